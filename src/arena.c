@@ -0,0 +1,246 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * arena.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* Everything handed out by an arena is aligned to this. */
+#define ARENA_ALIGNMENT                          8
+#define ARENA_ALIGN(size)                        (((size) + (ARENA_ALIGNMENT - 1)) & ~((size_t)ARENA_ALIGNMENT - 1))
+
+/* The smallest block an arena will allocate when it runs out of room. */
+#define ARENA_MIN_BLOCK_SIZE                     4096
+
+static arena_block *new_arena_block(size_t size);
+
+/******************************************************************************************************************************
+ * Creates an arena that messages can be parsed into with olm_get_message_at_in_arena(). Once it has grown to fit the largest
+ * message, parsing into a reused arena does not allocate any memory.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   initial_size   The number of bytes to reserve up front, or 0 for a small default.
+ *
+ * Returns:
+ *
+ *   The arena or NULL if there was not enough memory. It must be destroyed using olm_arena_destroy().
+ ******************************************************************************************************************************/
+olm_arena_t *olm_arena_create(size_t initial_size)
+{
+    olm_arena_t *arena = arena_create(initial_size);
+    
+    if (arena != NULL) arena->owned_by_message = false;
+    
+    return arena;
+}
+
+/******************************************************************************************************************************
+ * Releases every message held by the given arena so that its memory can be used again. Any messages parsed into the arena
+ * must not be used after this call.
+ ******************************************************************************************************************************/
+void olm_arena_reset(olm_arena_t *arena)
+{
+    if (arena == NULL) return;
+    
+    /* Keep all the blocks, they will be refilled in order. */
+    for (arena_block *block = arena->first; block != NULL; block = block->next) block->used = 0;
+    arena->current = arena->first;
+    arena->last_alloc = NULL;
+}
+
+/******************************************************************************************************************************
+ * Destroys the given arena along with any messages held by it.
+ ******************************************************************************************************************************/
+void olm_arena_destroy(olm_arena_t *arena)
+{
+    arena_destroy(arena);
+}
+
+/**************************************************************************************************
+ * Creates an arena whose first block (of the given size) is held in the same allocation as the
+ * arena itself, so that a message that fits in it costs a single call to malloc().
+ **************************************************************************************************/
+olm_arena_t *arena_create(size_t initial_size)
+{
+    olm_arena_t *arena = NULL;
+    
+    initial_size = ARENA_ALIGN((initial_size < ARENA_MIN_BLOCK_SIZE) ? ARENA_MIN_BLOCK_SIZE : initial_size);
+    arena = (olm_arena_t *)malloc(ARENA_ALIGN(sizeof(olm_arena_t)) + sizeof(arena_block) + initial_size);
+    if (arena == NULL) return NULL;
+    memset(arena, 0, sizeof(olm_arena_t));
+    
+    arena->first = (arena_block *)((unsigned char *)arena + ARENA_ALIGN(sizeof(olm_arena_t)));
+    arena->first->next = NULL;
+    arena->first->size = initial_size;
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->owned_by_message = true;
+    
+    return arena;
+}
+
+/**************************************************************************************************
+ * Frees the given arena and everything held by it.
+ **************************************************************************************************/
+void arena_destroy(olm_arena_t *arena)
+{
+    arena_block *block = NULL;
+    arena_block *next = NULL;
+    
+    if (arena == NULL) return;
+    
+    /* The first block is part of the arena allocation. */
+    for (block = arena->first->next; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    if (arena->reader != NULL) xmlFreeTextReader(arena->reader);
+    if (arena->io_buffer != NULL) free(arena->io_buffer);
+    
+    free(arena);
+}
+
+/**************************************************************************************************
+ * Allocates the given number of bytes from the arena. Returns NULL if there was not enough memory.
+ **************************************************************************************************/
+void *arena_alloc(olm_arena_t *arena, size_t size)
+{
+    arena_block *block = arena->current;
+    arena_block *spare = NULL;
+    void *ptr = NULL;
+    
+    size = ARENA_ALIGN((size == 0) ? 1 : size);
+    
+    /* Move on to the next block (left over from before a reset) until one has room. */
+    while ((block->size - block->used) < size)
+    {
+        if ((block->next != NULL) && (block->next->used == 0))
+        {
+            block = block->next;
+            continue;
+        }
+        
+        /* Add a new block after the current one. */
+        spare = new_arena_block((size > block->size) ? (size * 2) : block->size);
+        if (spare == NULL) return NULL;
+        spare->next = block->next;
+        block->next = spare;
+        block = spare;
+    }
+    
+    ptr = block->data + block->used;
+    block->used += size;
+    arena->current = block;
+    arena->last_alloc = ptr;
+    arena->last_size = size;
+    
+    return ptr;
+}
+
+/**************************************************************************************************
+ * Grows an allocation made from the arena to new_size bytes, keeping its contents. This is done in
+ * place if it was the most recent allocation and there is room, otherwise it is moved.
+ *
+ * Returns the (possibly moved) allocation or NULL if there was not enough memory.
+ **************************************************************************************************/
+void *arena_extend(olm_arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_block *block = arena->current;
+    size_t extra = 0;
+    void *moved = NULL;
+    
+    if (ptr == NULL) return arena_alloc(arena, new_size);
+    
+    new_size = ARENA_ALIGN(new_size);
+    if ((ptr == arena->last_alloc) && (new_size > arena->last_size))
+    {
+        extra = new_size - arena->last_size;
+        if ((block->size - block->used) >= extra)
+        {
+            block->used += extra;
+            arena->last_size = new_size;
+            return ptr;
+        }
+    }
+    else if (ptr == arena->last_alloc)
+    {
+        return ptr;
+    }
+    
+    moved = arena_alloc(arena, new_size);
+    if (moved == NULL) return NULL;
+    memcpy(moved, ptr, old_size);
+    
+    return moved;
+}
+
+/**************************************************************************************************
+ * Copies the given string into the arena. Returns NULL if there was not enough memory.
+ **************************************************************************************************/
+char *arena_strdup(olm_arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)arena_alloc(arena, len);
+    
+    if (copy != NULL) memcpy(copy, str, len);
+    
+    return copy;
+}
+
+/**************************************************************************************************
+ * Gives back everything allocated from the arena since the given block had the given number of
+ * bytes in use.
+ **************************************************************************************************/
+void arena_rewind(olm_arena_t *arena, arena_block *block, size_t used)
+{
+    /* Blocks are filled in order, so any after the given one were empty at that point. */
+    for (arena_block *later = block->next; (later != NULL) && (later->used != 0); later = later->next) later->used = 0;
+    block->used = used;
+    arena->current = block;
+    arena->last_alloc = NULL;
+}
+
+static arena_block *new_arena_block(size_t size)
+{
+    arena_block *block = NULL;
+    
+    size = ARENA_ALIGN((size < ARENA_MIN_BLOCK_SIZE) ? ARENA_MIN_BLOCK_SIZE : size);
+    block = (arena_block *)malloc(sizeof(arena_block) + size);
+    if (block == NULL) return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    
+    return block;
+}
@@ -0,0 +1,285 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * attachment.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/******************************************************************************************************************************
+ * Opens an attachment so that its data can be read straight out of the archive with olm_attachment_read(), without it being
+ * saved to a file first.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file that the message holding the attachment came from.
+ *   attachment     The attachment to open.
+ *   error_code     Receives the error code if the attachment cannot be opened. Can be NULL.
+ *
+ * Returns:
+ *
+ *   The open attachment or NULL if an error occurred. It must be closed using olm_attachment_close() before the file is.
+ ******************************************************************************************************************************/
+olm_attachment_reader_t *olm_attachment_open(olm_file_t *file, olm_attachment_t *attachment, int *error_code)
+{
+    olm_attachment_reader_t *reader = NULL;
+    internal_archive_entry_data *entry = NULL;
+    uint64_t data_offset = 0;
+    int result = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL)
+    {
+        result = OLM_ERROR_INVALID_FILE_HANDLE;
+        goto bail_and_die;
+    }
+    
+    result = locate_attachment_data(file, attachment, &entry, &data_offset);
+    if (result != OLM_ERROR_SUCCESS) goto bail_and_die;
+    
+    reader = (olm_attachment_reader_t *)malloc(sizeof(olm_attachment_reader_t));
+    if (reader == NULL)
+    {
+        result = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    reader->file = file;
+    reader->data_offset = data_offset;
+    reader->size = entry->entry_size;
+    reader->expected_crc = entry->crc32;
+    reader->crc = 0;
+    reader->crc_length = 0;
+    reader->verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    reader->error_code = OLM_ERROR_SUCCESS;
+    reader->stream = NULL;
+    
+    /* Deflated data can only be read in order, so it goes through a stream that is rewound when a read goes back. */
+    if (entry->compression_method == ZIP_CA_DEFLATE)
+    {
+        reader->stream = (entry_stream *)malloc(sizeof(entry_stream));
+        if (reader->stream == NULL)
+        {
+            result = OLM_ERROR_NO_MEMORY;
+        }
+        else if ((result = entry_stream_open(reader->stream, file, entry, data_offset, reader->verify, OLM_ERROR_ATTACHMENT_CORRUPTED)) != OLM_ERROR_SUCCESS)
+        {
+            entry_stream_close(reader->stream);
+            free(reader->stream);
+        }
+        if (result != OLM_ERROR_SUCCESS)
+        {
+            free(reader);
+            reader = NULL;
+        }
+    }
+    
+bail_and_die:
+    
+    if (error_code != NULL) *error_code = result;
+    
+    return reader;
+}
+
+/******************************************************************************************************************************
+ * Reads part of an open attachment. Reads may be made at any offset and in any order, but the CRC of the attachment is only
+ * checked as far as it has been read from the start without gaps, so reading it through in order checks all of it. A deflated
+ * attachment is quickest to read in order, as a read before the last one means inflating it again from the start.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   reader         The attachment to read from.
+ *   offset         The offset in the attachment to read from.
+ *   buffer         Receives the data.
+ *   length         The most bytes to read.
+ *   error_code     Receives the error code if the read fails. Can be NULL.
+ *
+ * Returns:
+ *
+ *   The number of bytes read, which is only less than length at the end of the attachment (0 past it), or -1 if an error
+ *   occurred. OLM_ERROR_ATTACHMENT_CORRUPTED is returned by the read that reaches the end of a bad attachment and by every
+ *   read after it.
+ ******************************************************************************************************************************/
+ssize_t olm_attachment_read(olm_attachment_reader_t *reader, uint64_t offset, void *buffer, size_t length, int *error_code)
+{
+    uint64_t end = 0;
+    int result = OLM_ERROR_SUCCESS;
+    
+    if ((reader == NULL) || ((buffer == NULL) && (length > 0)))
+    {
+        result = OLM_ERROR_INVALID_PARAMETER;
+        goto bail_and_die;
+    }
+    if (reader->error_code != OLM_ERROR_SUCCESS)
+    {
+        result = reader->error_code;
+        goto bail_and_die;
+    }
+    
+    /* Trim the read to the end of the attachment. */
+    if (offset >= reader->size)
+    {
+        length = 0;
+        goto bail_and_die;
+    }
+    if (length > (reader->size - offset)) length = (size_t)(reader->size - offset);
+    if (length > SSIZE_MAX) length = SSIZE_MAX;
+    end = offset + length;
+    
+    if (reader->stream != NULL)
+    {
+        result = entry_stream_seek(reader->stream, offset);
+        if ((result == OLM_ERROR_SUCCESS) && (entry_stream_read(reader->stream, buffer, length) != (ssize_t)length)) result = reader->stream->error_code;
+        if (result == OLM_ERROR_ATTACHMENT_CORRUPTED) reader->error_code = result;
+        goto bail_and_die;
+    }
+    
+    result = read_archive_data(reader->file, (reader->data_offset + offset), buffer, length);
+    if (result != OLM_ERROR_SUCCESS) goto bail_and_die;
+    
+    /* Carry the CRC on if this read continues (or overlaps) the part already checked. */
+    if ((reader->verify == true) && (offset <= reader->crc_length) && (end > reader->crc_length))
+    {
+        reader->crc = compute_crc32(reader->crc, ((const unsigned char *)buffer + (reader->crc_length - offset)), (end - reader->crc_length));
+        reader->crc_length = end;
+        if ((reader->crc_length == reader->size) && (reader->crc != reader->expected_crc))
+        {
+            reader->error_code = OLM_ERROR_ATTACHMENT_CORRUPTED;
+            result = reader->error_code;
+        }
+    }
+    
+bail_and_die:
+    
+    if (error_code != NULL) *error_code = result;
+    
+    return (result == OLM_ERROR_SUCCESS) ? (ssize_t)length : -1;
+}
+
+/**************************************************************************************************
+ * Returns the size of an open attachment.
+ **************************************************************************************************/
+uint64_t olm_attachment_size(olm_attachment_reader_t *reader)
+{
+    if (reader != NULL) return reader->size;
+    
+    return 0;
+}
+
+/**************************************************************************************************
+ * Closes an attachment opened with olm_attachment_open().
+ **************************************************************************************************/
+void olm_attachment_close(olm_attachment_reader_t *reader)
+{
+    if (reader == NULL) return;
+    
+    if (reader->stream != NULL)
+    {
+        entry_stream_close(reader->stream);
+        free(reader->stream);
+    }
+    free(reader);
+}
+
+/******************************************************************************************************************************
+ * Hands the data of an attachment to the given callback in order, a block at a time, straight from the archive. The blocks
+ * are no larger than a few megabytes and are only valid for the duration of the call.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file that the message holding the attachment came from.
+ *   attachment     The attachment to stream.
+ *   sink           Called with each block of data, return non zero to stop.
+ *   user_data      Passed to the callback.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_CANCELLED if the callback stopped early or another error code. As the CRC can only be
+ *   checked once all of the data has been seen, OLM_ERROR_ATTACHMENT_CORRUPTED is returned after the last block has been
+ *   passed on, in which case everything the callback was given should be thrown away.
+ ******************************************************************************************************************************/
+int olm_stream_attachment(olm_file_t *file, olm_attachment_t *attachment, olm_attachment_sink sink, void *user_data)
+{
+    internal_archive_entry_data *entry = NULL;
+    entry_stream stream;
+    const unsigned char *chunk_data = NULL;
+    uint64_t data_offset = 0;
+    size_t chunk_len = 0;
+    int verify = false;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if (sink == NULL) return OLM_ERROR_INVALID_PARAMETER;
+    
+    error_code = locate_attachment_data(file, attachment, &entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    
+    /* Mapped stored data is passed on where it lies, anything else goes through a window. */
+    error_code = entry_stream_open(&stream, file, entry, data_offset, verify, OLM_ERROR_ATTACHMENT_CORRUPTED);
+    while (error_code == OLM_ERROR_SUCCESS)
+    {
+        error_code = entry_stream_next(&stream, &chunk_data, &chunk_len);
+        if ((error_code != OLM_ERROR_SUCCESS) || (chunk_len == 0)) break;
+        if (sink(chunk_data, chunk_len, user_data) != 0) error_code = OLM_ERROR_CANCELLED;
+    }
+    entry_stream_close(&stream);
+    
+    return error_code;
+}
+
+/******************************************************************************************************************************
+ * Checks the CRC of an attachment without extracting it, even if the file was opened with OLM_OPT_SKIP_CRC. Opening a trusted
+ * archive with OLM_OPT_SKIP_CRC and calling this later (or never) puts off the cost of checking it.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file that the message holding the attachment came from.
+ *   attachment     The attachment to check.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_ATTACHMENT_CORRUPTED if the CRC is wrong or another error code.
+ ******************************************************************************************************************************/
+int olm_verify_attachment(olm_file_t *file, olm_attachment_t *attachment)
+{
+    internal_archive_entry_data *entry = NULL;
+    uint64_t data_offset = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    
+    error_code = locate_attachment_data(file, attachment, &entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    return verify_entry_crc(file, entry, data_offset, OLM_ERROR_ATTACHMENT_CORRUPTED);
+}
@@ -0,0 +1,570 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * batch.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* The most that is read in one go, and the largest gap between two messages that is read through
+   rather than skipped (in an archive the attachments of a message usually lie between it and the next). */
+#define BATCH_MAX_READ_SIZE                      (8 * 1024 * 1024)
+#define BATCH_MAX_GAP                            (64 * 1024)
+
+/* Room allowed for the extra field of a local header, which the central directory does not give. */
+#define BATCH_EXTRA_FIELD_SLACK                  256
+
+/* The number of reads kept in flight by the bulk extractors unless told otherwise, and the largest entry that is read into
+   memory by them (anything bigger is streamed from the archive the usual way). */
+#define BULK_DEFAULT_DEPTH                       64
+#define BULK_MAX_BUFFER_SIZE                     (16 * 1024 * 1024)
+
+/* A message to be read, in the order the messages lie in the archive. */
+typedef struct _batch_entry
+{
+    uint64_t file_offset;                                           /* Where the local header of the message is. */
+    uint64_t end_offset;                                            /* Where its data is expected to end (an estimate). */
+    uint64_t index;                                                 /* The index of the message. */
+} batch_entry;
+
+/* Called by run_bulk_reads() with each entry, and its data if that has been read. Returns OLM_ERROR_CANCELLED to stop. */
+typedef int (*bulk_handler)(olm_file_t *file, uint64_t position, internal_archive_entry_data *entry, const unsigned char *entry_data, void *context);
+
+/* A read kept in flight by run_bulk_reads(), with the buffer it reads into (which is kept for the next one). */
+typedef struct _bulk_slot
+{
+    io_request request;
+    size_t capacity;
+} bulk_slot;
+
+typedef struct _extract_messages_state
+{
+    uint64_t first;
+    olm_message_callback callback;
+    void *user_data;
+} extract_messages_state;
+
+typedef struct _extract_attachments_state
+{
+    olm_attachment_t **attachments;
+    const char **dest_paths;
+    int *errors;
+} extract_attachments_state;
+
+static int compare_batch_entries(const void *first, const void *second);
+static uint64_t estimate_entry_end(olm_file_t *file, internal_archive_entry_data *entry);
+static int run_bulk_reads(olm_file_t *file, internal_archive_entry_data **entries, uint64_t count, unsigned int depth, bulk_handler handler, void *context);
+static int deliver_extracted_message(olm_file_t *file, uint64_t position, internal_archive_entry_data *entry, const unsigned char *entry_data, void *context);
+static int save_extracted_attachment(olm_file_t *file, uint64_t position, internal_archive_entry_data *entry, const unsigned char *entry_data, void *context);
+static int write_entry_data(olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, const char *dest_path);
+static olm_mail_message_t *read_batched_message(olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, int *error_code);
+static const unsigned char *find_entry_data(internal_archive_entry_data *entry, const unsigned char *buffer, size_t buffer_size, uint64_t buffer_offset);
+
+/******************************************************************************************************************************
+ * Reads count messages starting at the given index. The messages are read in the order that they lie in the archive rather
+ * than by index, and messages that lie close together are read with a single read of the region that holds them all, so
+ * reading a range of messages from a disk takes a few large sequential reads rather than two small ones each.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the messages from.
+ *   first          The index of the first message.
+ *   count          The number of messages.
+ *   messages       Receives the messages, in order of index. Each one must be freed using olm_message_free(), one that
+ *                  could not be read is left as INVALID_OLM_MESSAGE.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS if every message was read, otherwise the error code for the first one (by index) that was not.
+ ******************************************************************************************************************************/
+int olm_get_messages(olm_file_t *file, uint64_t first, uint64_t count, olm_mail_message_t **messages)
+{
+    internal_archive_entry_data *entry = NULL;
+    batch_entry *order = NULL;
+    unsigned char *buffer = NULL;
+    const unsigned char *entry_data = NULL;
+    size_t buffer_capacity = 0;
+    size_t read_size = 0;
+    uint64_t group_end = 0;
+    uint64_t first_failed = UINT64_MAX;
+    int message_error = OLM_ERROR_SUCCESS;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((messages == NULL) || (first > file->message_entries.count) || (count > (file->message_entries.count - first))) return OLM_ERROR_INVALID_PARAMETER;
+    if (count == 0) return OLM_ERROR_SUCCESS;
+    
+    memset(messages, 0, (size_t)(sizeof(olm_mail_message_t *) * count));
+    order = (batch_entry *)malloc((size_t)(sizeof(batch_entry) * count));
+    if (order == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        entry = &file->message_entries.entries[first + idx];
+        order[idx].file_offset = entry->file_offset;
+        order[idx].end_offset = estimate_entry_end(file, entry);
+        order[idx].index = first + idx;
+    }
+    qsort(order, (size_t)count, sizeof(batch_entry), compare_batch_entries);
+    
+    for (uint64_t idx = 0, next = 0; idx < count; idx = next)
+    {
+        /* Take in the messages after this one for as long as they are close by and the read is not too big. A mapped
+           archive is already in memory, so it only benefits from the ordering. */
+        group_end = order[idx].end_offset;
+        for (next = idx + 1; (file->file_map == NULL) && (next < count); next++)
+        {
+            if ((order[next].file_offset > group_end) && ((order[next].file_offset - group_end) > BATCH_MAX_GAP)) break;
+            if ((((order[next].end_offset > group_end) ? order[next].end_offset : group_end) - order[idx].file_offset) > BATCH_MAX_READ_SIZE) break;
+            if (order[next].end_offset > group_end) group_end = order[next].end_offset;
+        }
+    
+        read_size = (group_end > order[idx].file_offset) ? (size_t)(group_end - order[idx].file_offset) : 0;
+        if ((file->file_map == NULL) && (read_size <= BATCH_MAX_READ_SIZE))
+        {
+            /* Without the memory for the read (or if it fails), the messages are still read one at a time. */
+            if (read_size > buffer_capacity)
+            {
+                free(buffer);
+                buffer = (unsigned char *)malloc(read_size);
+                buffer_capacity = (buffer == NULL) ? 0 : read_size;
+            }
+            if ((buffer == NULL) || (read_fully(file->file_seg, buffer, read_size, (off_t)order[idx].file_offset) == false)) read_size = 0;
+        }
+        else
+        {
+            read_size = 0;
+        }
+    
+        for (uint64_t member = idx; member < next; member++)
+        {
+            /* Anything that did not come in with the read (or was not what was expected) is read the usual way. */
+            entry = &file->message_entries.entries[order[member].index];
+            entry_data = (read_size > 0) ? find_entry_data(entry, buffer, read_size, order[idx].file_offset) : NULL;
+            messages[order[member].index - first] = read_batched_message(file, entry, entry_data, &message_error);
+            if ((messages[order[member].index - first] == INVALID_OLM_MESSAGE) && (order[member].index < first_failed))
+            {
+                first_failed = order[member].index;
+                error_code = message_error;
+            }
+        }
+    }
+    
+    if (buffer != NULL) free(buffer);
+    free(order);
+    
+    return error_code;
+}
+
+/******************************************************************************************************************************
+ * Reads count messages starting at the given index and passes each one to the given callback. The data of the messages is
+ * read from the archive in the order that it lies there, with many reads kept in flight at once (through io_uring if
+ * libolmec was configured with --enable-io-uring and the kernel allows it, otherwise through a pool of threads), and each
+ * message is parsed as soon as its data has come in. This keeps a disk or network file system busy while the messages are
+ * parsed, so it suits reading a whole archive from slow storage. A mapped archive gains nothing from it and is read in
+ * archive order.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the messages from.
+ *   first          The index of the first message.
+ *   count          The number of messages.
+ *   depth          The most reads to keep in flight, or 0 for the default.
+ *   callback       Called with each message, in the order they are read rather than by index. Calls are made from the
+ *                  calling thread. The callback owns the message and must release it with olm_message_free(). If the
+ *                  message could not be read the callback is passed NULL and the error code. Returning a non zero value
+ *                  stops the extraction.
+ *   user_data      Passed unchanged to the callback.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS once every message has been delivered, OLM_ERROR_CANCELLED if the callback stopped the extraction or
+ *   another error code if it could not be started.
+ ******************************************************************************************************************************/
+int olm_extract_messages(olm_file_t *file, uint64_t first, uint64_t count, unsigned int depth, olm_message_callback callback, void *user_data)
+{
+    internal_archive_entry_data **entries = NULL;
+    extract_messages_state state;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((callback == NULL) || (first > file->message_entries.count) || (count > (file->message_entries.count - first))) return OLM_ERROR_INVALID_PARAMETER;
+    if (count == 0) return OLM_ERROR_SUCCESS;
+    
+    entries = (internal_archive_entry_data **)malloc((size_t)(sizeof(internal_archive_entry_data *) * count));
+    if (entries == NULL) return OLM_ERROR_NO_MEMORY;
+    for (uint64_t idx = 0; idx < count; idx++) entries[idx] = &file->message_entries.entries[first + idx];
+    
+    state.first = first;
+    state.callback = callback;
+    state.user_data = user_data;
+    error_code = run_bulk_reads(file, entries, count, depth, deliver_extracted_message, &state);
+    free(entries);
+    
+    return error_code;
+}
+
+/******************************************************************************************************************************
+ * Extracts a number of attachments to disk at once, as olm_extract_and_save_attachment() would one at a time. The data of
+ * the attachments is read from the archive in the order that it lies there, with many reads kept in flight at once (see
+ * olm_extract_messages()), and each attachment is written out as soon as its data has come in. Attachments too large to
+ * be read into memory in one go are copied the usual way.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file that the messages holding the attachments came from.
+ *   attachments    The attachments to extract.
+ *   dest_paths     Where to save each attachment. A file that is already there is overwritten.
+ *   count          The number of attachments.
+ *   depth          The most reads to keep in flight, or 0 for the default.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS if every attachment was saved, otherwise the error code for the first one that was not. An attachment
+ *   that could not be saved is not left behind, but the others are still extracted.
+ ******************************************************************************************************************************/
+int olm_extract_attachments(olm_file_t *file, olm_attachment_t **attachments, const char **dest_paths, uint64_t count, unsigned int depth)
+{
+    internal_archive_entry_data **entries = NULL;
+    extract_attachments_state state;
+    uint64_t data_offset = 0;
+    int *errors = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((attachments == NULL) || (dest_paths == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    if (count == 0) return OLM_ERROR_SUCCESS;
+    
+    entries = (internal_archive_entry_data **)calloc((size_t)count, sizeof(internal_archive_entry_data *));
+    errors = (int *)calloc((size_t)count, sizeof(int));
+    if ((entries == NULL) || (errors == NULL))
+    {
+        error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    /* Anything that cannot be found is left out, the rest is read in archive order (and counts as failed until it is saved). */
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        if (dest_paths[idx] == NULL) errors[idx] = OLM_ERROR_INVALID_PARAMETER;
+        else if (file->file_map != NULL) errors[idx] = locate_attachment_data(file, attachments[idx], &entries[idx], &data_offset);
+        else if ((attachments[idx] == NULL) || (attachments[idx]->__private == NULL)) errors[idx] = OLM_ERROR_ATTACHMENT_NOT_FOUND;
+        else if ((entries[idx] = find_entry(&file->attachment_lookup, &file->attachment_entries, attachments[idx]->__private)) == NULL) errors[idx] = OLM_ERROR_ATTACHMENT_NOT_FOUND;
+        else if ((entries[idx]->compression_method != ZIP_CA_STORED) && (entries[idx]->compression_method != ZIP_CA_DEFLATE)) errors[idx] = OLM_ERROR_ATTACHMENT_CORRUPTED;
+        if (errors[idx] != OLM_ERROR_SUCCESS) entries[idx] = NULL;
+        else errors[idx] = OLM_ERROR_FILE_IO_ERROR;
+    }
+    
+    state.attachments = attachments;
+    state.dest_paths = dest_paths;
+    state.errors = errors;
+    run_bulk_reads(file, entries, count, depth, save_extracted_attachment, &state);
+    
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        if (errors[idx] == OLM_ERROR_SUCCESS) continue;
+        error_code = errors[idx];
+        break;
+    }
+    
+bail_and_die:
+    
+    if (errors != NULL) free(errors);
+    if (entries != NULL) free(entries);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Orders messages by where they lie in the archive, for qsort().
+ **************************************************************************************************/
+static int compare_batch_entries(const void *first, const void *second)
+{
+    const batch_entry *first_entry = (const batch_entry *)first;
+    const batch_entry *second_entry = (const batch_entry *)second;
+    
+    return (first_entry->file_offset > second_entry->file_offset) - (first_entry->file_offset < second_entry->file_offset);
+}
+
+/**************************************************************************************************
+ * Works out where the data of an entry ends in the archive from its central directory record,
+ * allowing for an extra field in its local header. The local headers all come before the central
+ * directory, so the estimate is not let run past it.
+ **************************************************************************************************/
+static uint64_t estimate_entry_end(olm_file_t *file, internal_archive_entry_data *entry)
+{
+    uint64_t end_offset = entry->file_offset + sizeof(local_file_header) + strlen(entry->raw_entry_path) + BATCH_EXTRA_FIELD_SLACK + entry->entry_compressed_size;
+    uint64_t central_dir_offset = (uint64_t)file->central_dir_offset;
+    
+    return (end_offset < central_dir_offset) ? end_offset : central_dir_offset;
+}
+
+/**************************************************************************************************
+ * Reads the given entries (leaving out any that are NULL) in the order that they lie in the
+ * archive, keeping up to depth reads in flight on an io_engine, and calls the handler with each
+ * one as its read completes. Entries too big to read into memory, or any that the read or the
+ * memory for it failed for, are passed to the handler without their data so that it can stream
+ * them; the same goes for every entry if the archive is mapped.
+ *
+ * Returns OLM_ERROR_SUCCESS, OLM_ERROR_CANCELLED if the handler stopped the reads or
+ * OLM_ERROR_FILE_IO_ERROR if the engine failed with reads still in flight.
+ **************************************************************************************************/
+static int run_bulk_reads(olm_file_t *file, internal_archive_entry_data **entries, uint64_t count, unsigned int depth, bulk_handler handler, void *context)
+{
+    batch_entry *order = NULL;
+    bulk_slot *slots = NULL;
+    bulk_slot **idle = NULL;
+    bulk_slot *slot = NULL;
+    io_engine *engine = NULL;
+    io_request *request = NULL;
+    internal_archive_entry_data *entry = NULL;
+    const unsigned char *entry_data = NULL;
+    unsigned char *grown = NULL;
+    unsigned int idle_count = 0;
+    uint64_t queued = 0;
+    uint64_t next = 0;
+    size_t read_size = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (depth == 0) depth = BULK_DEFAULT_DEPTH;
+    if (depth > count) depth = (unsigned int)count;
+    
+    order = (batch_entry *)malloc((size_t)(sizeof(batch_entry) * count));
+    if (order == NULL) goto read_in_place;
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        if (entries[idx] == NULL) continue;
+        order[queued].file_offset = entries[idx]->file_offset;
+        order[queued].end_offset = estimate_entry_end(file, entries[idx]);
+        order[queued].index = idx;
+        queued++;
+    }
+    qsort(order, (size_t)queued, sizeof(batch_entry), compare_batch_entries);
+    
+    if (file->file_map == NULL)
+    {
+        slots = (bulk_slot *)calloc(depth, sizeof(bulk_slot));
+        idle = (bulk_slot **)malloc(sizeof(bulk_slot *) * depth);
+        if ((slots != NULL) && (idle != NULL)) engine = io_engine_create(file->file_seg, depth);
+    }
+    if (engine != NULL)
+    {
+        for (idle_count = 0; idle_count < depth; idle_count++) idle[idle_count] = &slots[depth - idle_count - 1];
+    }
+    
+    while (((next < queued) && (error_code == OLM_ERROR_SUCCESS)) || ((engine != NULL) && (idle_count < depth)))
+    {
+        /* Keep the queue full. */
+        while ((next < queued) && (error_code == OLM_ERROR_SUCCESS) && ((engine == NULL) || (idle_count > 0)))
+        {
+            entry = entries[order[next].index];
+            read_size = (order[next].end_offset > order[next].file_offset) ? (size_t)(order[next].end_offset - order[next].file_offset) : 0;
+            if ((engine != NULL) && (read_size > 0) && (read_size <= BULK_MAX_BUFFER_SIZE))
+            {
+                slot = idle[idle_count - 1];
+                if (read_size > slot->capacity)
+                {
+                    grown = (unsigned char *)realloc(slot->request.buffer, read_size);
+                    if (grown != NULL)
+                    {
+                        slot->request.buffer = grown;
+                        slot->capacity = read_size;
+                    }
+                }
+                if (read_size <= slot->capacity)
+                {
+                    idle_count--;
+                    slot->request.offset = order[next].file_offset;
+                    slot->request.length = read_size;
+                    slot->request.tag = next;
+                    io_engine_submit(engine, &slot->request);
+                    next++;
+                    continue;
+                }
+            }
+            error_code = handler(file, order[next].index, entry, NULL, context);
+            next++;
+        }
+        if ((engine == NULL) || (idle_count == depth)) continue;
+    
+        /* Then hand on whatever comes in first. Once stopped, the reads still in flight are only waited for. */
+        request = io_engine_wait(engine);
+        if (request == NULL)
+        {
+            if (error_code == OLM_ERROR_SUCCESS) error_code = OLM_ERROR_FILE_IO_ERROR;
+            break;
+        }
+        slot = (bulk_slot *)request;
+        idle[idle_count++] = slot;
+        if (error_code != OLM_ERROR_SUCCESS) continue;
+        entry = entries[order[request->tag].index];
+        entry_data = (request->error_code == OLM_ERROR_SUCCESS) ? find_entry_data(entry, request->buffer, request->length, request->offset) : NULL;
+        error_code = handler(file, order[request->tag].index, entry, entry_data, context);
+    }
+    
+    io_engine_destroy(engine);
+    if (slots != NULL)
+    {
+        for (unsigned int idx = 0; idx < depth; idx++) free(slots[idx].request.buffer);
+        free(slots);
+    }
+    if (idle != NULL) free(idle);
+    free(order);
+    
+    return error_code;
+    
+read_in_place:
+    
+    /* Without the memory to put them in order, the entries are still read one at a time. */
+    for (uint64_t idx = 0; (idx < count) && (error_code == OLM_ERROR_SUCCESS); idx++)
+    {
+        if (entries[idx] != NULL) error_code = handler(file, idx, entries[idx], NULL, context);
+    }
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Parses a message read by run_bulk_reads() for olm_extract_messages() and passes it on.
+ *
+ * Returns OLM_ERROR_SUCCESS, or OLM_ERROR_CANCELLED if the callback asked to stop.
+ **************************************************************************************************/
+static int deliver_extracted_message(olm_file_t *file, uint64_t position, internal_archive_entry_data *entry, const unsigned char *entry_data, void *context)
+{
+    extract_messages_state *state = (extract_messages_state *)context;
+    olm_mail_message_t *message = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    message = read_batched_message(file, entry, entry_data, &error_code);
+    if (state->callback(file, (state->first + position), message, error_code, state->user_data) != 0) return OLM_ERROR_CANCELLED;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Writes out an attachment read by run_bulk_reads() for olm_extract_attachments(), or copies it
+ * from the archive if its data has not been read.
+ *
+ * Returns OLM_ERROR_SUCCESS, the outcome is left in the errors of the state.
+ **************************************************************************************************/
+static int save_extracted_attachment(olm_file_t *file, uint64_t position, internal_archive_entry_data *entry, const unsigned char *entry_data, void *context)
+{
+    extract_attachments_state *state = (extract_attachments_state *)context;
+    
+    if (entry_data == NULL) state->errors[position] = olm_extract_and_save_attachment(file, state->attachments[position], state->dest_paths[position]);
+    else state->errors[position] = write_entry_data(file, entry, entry_data, state->dest_paths[position]);
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Writes the data of an attachment, which has been read into memory, to the given file, inflating
+ * it on the way if need be. A bad or partial file is not left behind.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int write_entry_data(olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, const char *dest_path)
+{
+    entry_stream stream;
+    const unsigned char *chunk_data = NULL;
+    size_t chunk_len = 0;
+    int dest_fd = -1;
+    int verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    dest_fd = open(dest_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (dest_fd == -1) return OLM_ERROR_FILE_IO_ERROR;
+    
+    error_code = entry_stream_open(&stream, file, entry, 0, verify, OLM_ERROR_ATTACHMENT_CORRUPTED);
+    stream.source = entry_data;
+    while (error_code == OLM_ERROR_SUCCESS)
+    {
+        error_code = entry_stream_next(&stream, &chunk_data, &chunk_len);
+        if ((error_code != OLM_ERROR_SUCCESS) || (chunk_len == 0)) break;
+        if (write_fully(dest_fd, chunk_data, chunk_len) == false) error_code = OLM_ERROR_FILE_IO_ERROR;
+    }
+    entry_stream_close(&stream);
+    if ((close(dest_fd) != 0) && (error_code == OLM_ERROR_SUCCESS)) error_code = OLM_ERROR_FILE_IO_ERROR;
+    
+    if (error_code != OLM_ERROR_SUCCESS) unlink(dest_path);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Parses the given message into an arena of its own, as olm_get_message_at() does, taking its data
+ * from entry_data if it has already been read.
+ *
+ * Returns the message or INVALID_OLM_MESSAGE on error.
+ **************************************************************************************************/
+static olm_mail_message_t *read_batched_message(olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, int *error_code)
+{
+    olm_mail_message_t *message = NULL;
+    olm_arena_t *arena = arena_create(sizeof(olm_mail_message_t) + (size_t)entry->entry_size + MESSAGE_ARENA_SLACK);
+    
+    if (arena == NULL)
+    {
+        *error_code = OLM_ERROR_NO_MEMORY;
+        return INVALID_OLM_MESSAGE;
+    }
+    
+    message = get_message(file, entry, entry_data, arena, OLM_FIELD_ALL, NULL, error_code);
+    if (message == INVALID_OLM_MESSAGE) arena_destroy(arena);
+    
+    return message;
+}
+
+/**************************************************************************************************
+ * Finds the data of the given entry in a buffer read from the archive at buffer_offset, checking
+ * its local header on the way.
+ *
+ * Returns the data or NULL if the buffer does not hold all of it.
+ **************************************************************************************************/
+static const unsigned char *find_entry_data(internal_archive_entry_data *entry, const unsigned char *buffer, size_t buffer_size, uint64_t buffer_offset)
+{
+    local_file_header header;
+    uint64_t header_offset = entry->file_offset - buffer_offset;
+    uint64_t data_offset = 0;
+    
+    if ((entry->file_offset < buffer_offset) || (header_offset > buffer_size) || ((buffer_size - header_offset) < sizeof(local_file_header))) return NULL;
+    memcpy(&header, (buffer + header_offset), sizeof(local_file_header));
+    if (header.signature != SIG_LOCAL_FILE_HEADER) return NULL;
+    if ((entry->compression_method == ZIP_CA_STORED) && (entry->entry_size != entry->entry_compressed_size)) return NULL;
+    
+    data_offset = header_offset + sizeof(local_file_header) + header.filename_length + header.extra_field_length;
+    if ((data_offset > buffer_size) || ((buffer_size - data_offset) < entry->entry_compressed_size)) return NULL;
+    
+    return (buffer + data_offset);
+}
@@ -0,0 +1,433 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * category.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+static int ensure_categories_loaded(olm_file_t *file);
+static int load_categories(olm_file_t *file);
+static int add_category(olm_file_t *file, xmlTextReaderPtr reader, uint64_t *capacity);
+static int find_category_index(olm_file_t *file, const char *name, uint64_t *index);
+static int ensure_category_members(olm_file_t *file);
+static int index_category_members(olm_file_t *file);
+static int add_category_member(category_members *members, uint64_t message_index);
+
+/******************************************************************************************************************************
+ * Returns the number of categories in the category list of the given file. The list is read the first time that it is asked
+ * for and kept until the file is closed.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to count the categories of.
+ *
+ * Returns:
+ *
+ *   The number of categories, 0 if there are none or the list could not be read.
+ ******************************************************************************************************************************/
+uint64_t olm_category_count(olm_file_t *file)
+{
+    if (file == NULL) return 0;
+    if (ensure_categories_loaded(file) != OLM_ERROR_SUCCESS) return 0;
+    
+    return file->category_count;
+}
+
+/******************************************************************************************************************************
+ * Returns the category at the given index in the category list of the given file. The category belongs to the file and lasts
+ * until it is closed.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to get the category from.
+ *   index          The index of the category, from 0 to olm_category_count() - 1.
+ *
+ * Returns:
+ *
+ *   The category or NULL if there is no such category.
+ ******************************************************************************************************************************/
+const olm_category_t *olm_get_category_at(olm_file_t *file, uint64_t index)
+{
+    if (file == NULL) return NULL;
+    if (ensure_categories_loaded(file) != OLM_ERROR_SUCCESS) return NULL;
+    if (index >= file->category_count) return NULL;
+    
+    return &file->categories[index];
+}
+
+/******************************************************************************************************************************
+ * Looks up a category by its name, which is how messages refer to their categories (see the category_list of a message).
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to look in.
+ *   name           The name of the category.
+ *   index          Receives the index of the category if it is found.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS if the category list has the category, OLM_ERROR_CATEGORY_NOT_FOUND or another error code.
+ ******************************************************************************************************************************/
+int olm_find_category(olm_file_t *file, const char *name, uint64_t *index)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((name == NULL) || (index == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    error_code = ensure_categories_loaded(file);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    return (find_category_index(file, name, index) == true) ? OLM_ERROR_SUCCESS : OLM_ERROR_CATEGORY_NOT_FOUND;
+}
+
+/******************************************************************************************************************************
+ * Gets the indexes of the messages in the given category. The first time this is called every message is sorted into its
+ * categories, looking at nothing but the category list of each one. With OLM_OPT_INDEX the result is kept next to the
+ * archive (as <archive>.cat) and used by later opens until the archive changes, so that they do not have to look at the
+ * messages at all.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file               The olm file the category is in.
+ *   index              The index of the category.
+ *   message_indexes    Receives the indexes of the messages, in archive order. These belong to the file and last until it
+ *                      is closed.
+ *   count              Receives the number of messages.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS or an error code.
+ ******************************************************************************************************************************/
+int olm_get_category_messages(olm_file_t *file, uint64_t index, const uint64_t **message_indexes, uint64_t *count)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((message_indexes == NULL) || (count == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    error_code = ensure_category_members(file);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    if (index >= file->category_count) return OLM_ERROR_INVALID_PARAMETER;
+    
+    *message_indexes = file->category_members[index].messages;
+    *count = file->category_members[index].count;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Reads the category list of the given file if it has not been already. This is done once, by
+ * whichever thread gets to it first.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int ensure_categories_loaded(olm_file_t *file)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (__atomic_load_n(&file->categories_loaded, __ATOMIC_ACQUIRE) == true) return OLM_ERROR_SUCCESS;
+    
+    pthread_mutex_lock(&file->categories_lock);
+    if (file->categories_loaded == false)
+    {
+        error_code = load_categories(file);
+        if (error_code == OLM_ERROR_SUCCESS) __atomic_store_n(&file->categories_loaded, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&file->categories_lock);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Reads the category list (Categories.xml) into a table of names and colours, in a single forward
+ * pass without building a tree. A name that turns up more than once is only kept the first time.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int load_categories(olm_file_t *file)
+{
+    internal_archive_entry_data *entry = NULL;
+    entry_stream stream;
+    xmlTextReaderPtr reader = NULL;
+    const char *name = NULL;
+    uint64_t data_offset = 0;
+    uint64_t capacity = 0;
+    int verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    int parse_options = 0;
+    int ret = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file->category_entries.count == 0) return OLM_ERROR_SUCCESS;
+    entry = &file->category_entries.entries[0];
+    
+    error_code = get_entry_data_offset(file, entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    file->category_strings = arena_create(entry->entry_size);
+    if (file->category_strings == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    error_code = entry_stream_open(&stream, file, entry, data_offset, verify, OLM_ERROR_FILE_CORRUPTED);
+    if (error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
+    if ((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) parse_options = XML_PARSE_RECOVER | XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
+    reader = xmlReaderForIO(read_entry_stream, NULL, &stream, NULL, NULL, parse_options);
+    if (reader == NULL)
+    {
+        error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    ret = xmlTextReaderRead(reader);
+    while ((ret == 1) && (error_code == OLM_ERROR_SUCCESS))
+    {
+        if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT)
+        {
+            name = (const char *)xmlTextReaderConstLocalName(reader);
+            if ((name != NULL) && (element_tag(name) == ELEMENT_CATEGORY)) error_code = add_category(file, reader, &capacity);
+        }
+        if (error_code == OLM_ERROR_SUCCESS) ret = xmlTextReaderRead(reader);
+    }
+    if ((error_code == OLM_ERROR_SUCCESS) && (ret == -1)) error_code = OLM_ERROR_FILE_CORRUPTED;
+    /* If the data could not be inflated (or its CRC is wrong) that is what the parser tripped over. */
+    if (stream.error_code != OLM_ERROR_SUCCESS) error_code = stream.error_code;
+    
+bail_and_die:
+    
+    if (reader != NULL) xmlFreeTextReader(reader);
+    entry_stream_close(&stream);
+    if (error_code != OLM_ERROR_SUCCESS)
+    {
+        if (file->categories != NULL) free(file->categories);
+        arena_destroy(file->category_strings);
+        file->categories = NULL;
+        file->category_strings = NULL;
+        file->category_count = 0;
+    }
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Adds the category described by the attributes of the category element that the reader is
+ * positioned on to the category table of the given file, which has room for capacity categories.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int add_category(olm_file_t *file, xmlTextReaderPtr reader, uint64_t *capacity)
+{
+    olm_category_t *grown = NULL;
+    olm_category_t category;
+    const char *name = NULL;
+    const char *value = NULL;
+    uint64_t existing = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    memset(&category, 0, sizeof(olm_category_t));
+    while ((error_code == OLM_ERROR_SUCCESS) && (xmlTextReaderMoveToNextAttribute(reader) == 1))
+    {
+        name = (const char *)xmlTextReaderConstLocalName(reader);
+        value = (const char *)xmlTextReaderConstValue(reader);
+        if ((name == NULL) || (value == NULL)) continue;
+        
+        if ((strcmp(name, "OPFCategoryCopyName") == 0) && (category.name == NULL))
+        {
+            category.name = arena_strdup(file->category_strings, value);
+            if (category.name == NULL) error_code = OLM_ERROR_NO_MEMORY;
+        }
+        if ((strcmp(name, "OPFCategoryCopyBackgroundColor") == 0) && (category.colour == NULL))
+        {
+            category.colour = arena_strdup(file->category_strings, value);
+            if (category.colour == NULL) error_code = OLM_ERROR_NO_MEMORY;
+        }
+    }
+    xmlTextReaderMoveToElement(reader);
+    
+    if ((error_code != OLM_ERROR_SUCCESS) || (category.name == NULL)) return error_code;
+    if (find_category_index(file, category.name, &existing) == true) return OLM_ERROR_SUCCESS;
+    
+    if (file->category_count == *capacity)
+    {
+        grown = (olm_category_t *)realloc(file->categories, (size_t)(sizeof(olm_category_t) * ((*capacity == 0) ? 16 : (*capacity * 2))));
+        if (grown == NULL) return OLM_ERROR_NO_MEMORY;
+        file->categories = grown;
+        *capacity = (*capacity == 0) ? 16 : (*capacity * 2);
+    }
+    file->categories[file->category_count] = category;
+    file->category_count++;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Finds the category with the given name. There are only ever a handful of categories, so they are
+ * simply looked through in turn.
+ *
+ * Returns true if the category was found, false if not.
+ **************************************************************************************************/
+static int find_category_index(olm_file_t *file, const char *name, uint64_t *index)
+{
+    for (uint64_t idx = 0; idx < file->category_count; idx++)
+    {
+        if (strcmp(file->categories[idx].name, name) == 0)
+        {
+            *index = idx;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/**************************************************************************************************
+ * Sorts the messages of the given file into their categories if that has not been done already,
+ * taking them from the sidecar category index if there is a good one.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int ensure_category_members(olm_file_t *file)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    error_code = ensure_categories_loaded(file);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    if (__atomic_load_n(&file->members_indexed, __ATOMIC_ACQUIRE) == true) return OLM_ERROR_SUCCESS;
+    
+    pthread_mutex_lock(&file->categories_lock);
+    if (file->members_indexed == false)
+    {
+        if (((file->options & OLM_OPT_INDEX) == OLM_OPT_INDEX) && (load_category_index(file) == true))
+        {
+            error_code = OLM_ERROR_SUCCESS;
+        }
+        else
+        {
+            error_code = index_category_members(file);
+            if ((error_code == OLM_ERROR_SUCCESS) && ((file->options & OLM_OPT_INDEX) == OLM_OPT_INDEX)) save_category_index(file);
+        }
+        if (error_code == OLM_ERROR_SUCCESS) __atomic_store_n(&file->members_indexed, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&file->categories_lock);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Parses the category list of every message (and nothing else, so parsing stops at the end of the
+ * list) into a reused arena and adds the message to each of its categories. Categories that are not
+ * in the category list of the archive are passed over. A message that cannot be parsed fails the
+ * whole scan unless the file was opened with OLM_OPT_IGNORE_ERRORS.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int index_category_members(olm_file_t *file)
+{
+    category_members *members = NULL;
+    olm_mail_message_t *message = NULL;
+    olm_arena_t *arena = NULL;
+    uint64_t category_index = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    members = (category_members *)calloc(((file->category_count == 0) ? 1 : (size_t)file->category_count), sizeof(category_members));
+    arena = olm_arena_create(0);
+    if ((members == NULL) || (arena == NULL))
+    {
+        error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    for (uint64_t idx = 0; (idx < file->message_entries.count) && (file->category_count > 0); idx++)
+    {
+        olm_arena_reset(arena);
+        message = olm_get_message_fields_at(file, idx, OLM_FIELD_CATEGORIES, arena, &error_code);
+        if (message == INVALID_OLM_MESSAGE)
+        {
+            if (((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) && (error_code != OLM_ERROR_NO_MEMORY))
+            {
+                error_code = OLM_ERROR_SUCCESS;
+                continue;
+            }
+            goto bail_and_die;
+        }
+        
+        for (unsigned long category = 0; category < message->category_count; category++)
+        {
+            if (find_category_index(file, message->category_list[category], &category_index) == false) continue;
+            if (add_category_member(&members[category_index], idx) == false)
+            {
+                error_code = OLM_ERROR_NO_MEMORY;
+                goto bail_and_die;
+            }
+        }
+    }
+    
+    file->category_members = members;
+    members = NULL;
+    
+bail_and_die:
+    
+    if (members != NULL)
+    {
+        for (uint64_t idx = 0; idx < file->category_count; idx++) free(members[idx].messages);
+        free(members);
+    }
+    if (arena != NULL) olm_arena_destroy(arena);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Adds the given message to a category, unless it was the last one added (a message that names a
+ * category twice is only in it once).
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+static int add_category_member(category_members *members, uint64_t message_index)
+{
+    uint64_t *grown = NULL;
+    uint64_t capacity = 0;
+    
+    if ((members->count > 0) && (members->messages[members->count - 1] == message_index)) return true;
+    
+    if (members->count == members->capacity)
+    {
+        capacity = (members->capacity == 0) ? 64 : (members->capacity * 2);
+        grown = (uint64_t *)realloc(members->messages, (size_t)(sizeof(uint64_t) * capacity));
+        if (grown == NULL) return false;
+        members->messages = grown;
+        members->capacity = capacity;
+    }
+    members->messages[members->count] = message_index;
+    members->count++;
+    
+    return true;
+}
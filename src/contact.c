@@ -6,5 +6,678 @@
 //  Copyright (c) 2013 Chris Morrison. All rights reserved.
 //
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
-#include "contact.h"
\ No newline at end of file
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* The tags that the address book is split into contacts by. */
+#define CONTACT_START_TAG                        "<contact"
+#define CONTACT_END_TAG                          "</contact>"
+
+/* The most first and middle names a contact can have. */
+#define MAX_FIRST_NAMES                          2
+
+/* The contact field whose text the contact parser is currently collecting. */
+#define CONTACT_CAPTURE_NONE                     0
+#define CONTACT_CAPTURE_TITLE                    1
+#define CONTACT_CAPTURE_FIRST_NAME               2
+#define CONTACT_CAPTURE_MIDDLE_NAME              3
+#define CONTACT_CAPTURE_SURNAME                  4
+#define CONTACT_CAPTURE_DISPLAY_NAME             5
+#define CONTACT_CAPTURE_COMPANY                  6
+#define CONTACT_CAPTURE_JOB_TITLE                7
+#define CONTACT_CAPTURE_BIRTHDAY                 8
+#define CONTACT_CAPTURE_ANNIVERSARY              9
+#define CONTACT_CAPTURE_HOME_PHONE               10
+#define CONTACT_CAPTURE_WORK_PHONE               11
+#define CONTACT_CAPTURE_MOBILE_PHONE             12
+
+/* State kept while the address book is split into contacts, which may straddle the blocks it is read in. */
+typedef struct _contact_scan_state
+{
+    char tag[sizeof(CONTACT_END_TAG)];                              /* The start of the tag being matched. */
+    size_t tag_len;                                                 /* How much of it has been seen (0 if not in a tag). */
+    uint64_t tag_offset;                                            /* Where the tag being matched starts. */
+    uint64_t contact_offset;                                        /* Where the contact we are in starts. */
+    int in_contact;                                                 /* Set between the start and end tags of a contact. */
+    contact_span *spans;
+    uint64_t count;
+    uint64_t capacity;
+} contact_scan_state;
+
+/* Where the contacts are read from, kept open while a run of them is read. */
+typedef struct _contact_source
+{
+    olm_file_t *file;
+    internal_archive_entry_data *entry;                             /* The address book entry. */
+    uint64_t data_offset;                                           /* Where the data of the address book starts in the archive. */
+    int streaming;                                                  /* Set if the address book is deflated and read through stream. */
+    entry_stream stream;
+    unsigned char *buffer;                                          /* Holds a contact that cannot be parsed where it lies. */
+    size_t buffer_size;
+    xmlTextReaderPtr reader;                                        /* Reused for every contact. */
+    int parse_options;
+} contact_source;
+
+static int ensure_contact_index(olm_file_t *file);
+static int index_contacts(olm_file_t *file);
+static int scan_contacts(contact_scan_state *state, const unsigned char *data, size_t length, uint64_t offset);
+static int add_contact_span(contact_scan_state *state, uint64_t end_offset);
+static int open_contact_source(olm_file_t *file, contact_source *source);
+static int load_contact(contact_source *source, uint64_t index, olm_arena_t *arena, address_card_t **card);
+static void close_contact_source(contact_source *source);
+static int parse_contact_xml(xmlTextReaderPtr reader, address_card_t *card, olm_arena_t *arena);
+static int read_contact_email_address(xmlTextReaderPtr reader, address_card_t *card, olm_arena_t *arena);
+static int store_contact_text(int capture_field, char *text, address_card_t *card, olm_arena_t *arena);
+
+/******************************************************************************************************************************
+ * Returns the number of contacts in the address book of the given file. The address book is indexed the first time that its
+ * contacts are asked for, this reads it once from start to finish (checking its CRC unless the file was opened with
+ * OLM_OPT_SKIP_CRC) but does not parse it.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to count the contacts of.
+ *
+ * Returns:
+ *
+ *   The number of contacts, 0 if the file has no address book or it could not be read.
+ ******************************************************************************************************************************/
+uint64_t olm_contact_count(olm_file_t *file)
+{
+    if (file == NULL) return 0;
+    if (ensure_contact_index(file) != OLM_ERROR_SUCCESS) return 0;
+    
+    return file->contact_count;
+}
+
+/******************************************************************************************************************************
+ * Parses the contact at the given index in the address book. Only the contact itself is read and parsed, though getting at a
+ * contact in a deflated address book means inflating everything before it; olm_for_each_contact() is much quicker for reading
+ * all of them.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the contact from.
+ *   index          The index of the contact, from 0 to olm_contact_count() - 1.
+ *   error_code     Receives OLM_ERROR_SUCCESS or an error code.
+ *
+ * Returns:
+ *
+ *   The contact or NULL on error. It must be freed using olm_contact_free().
+ ******************************************************************************************************************************/
+address_card_t *olm_get_contact_at(olm_file_t *file, uint64_t index, int *error_code)
+{
+    contact_source source;
+    address_card_t *card = NULL;
+    olm_arena_t *arena = NULL;
+    
+    if (file == NULL)
+    {
+        *error_code = OLM_ERROR_INVALID_FILE_HANDLE;
+        return NULL;
+    }
+    
+    *error_code = ensure_contact_index(file);
+    if (*error_code != OLM_ERROR_SUCCESS) return NULL;
+    if (index >= file->contact_count)
+    {
+        *error_code = OLM_ERROR_INVALID_PARAMETER;
+        return NULL;
+    }
+    
+    /* Everything the contact needs comes from one arena, which is freed along with it. */
+    arena = arena_create(file->contacts[index].length + MESSAGE_ARENA_SLACK);
+    if (arena == NULL)
+    {
+        *error_code = OLM_ERROR_NO_MEMORY;
+        return NULL;
+    }
+    
+    *error_code = open_contact_source(file, &source);
+    if (*error_code == OLM_ERROR_SUCCESS) *error_code = load_contact(&source, index, arena, &card);
+    close_contact_source(&source);
+    if (*error_code != OLM_ERROR_SUCCESS)
+    {
+        arena_destroy(arena);
+        return NULL;
+    }
+    
+    return card;
+}
+
+/******************************************************************************************************************************
+ * Frees a contact returned by olm_get_contact_at().
+ ******************************************************************************************************************************/
+void olm_contact_free(address_card_t *card)
+{
+    if (card == NULL) return;
+    
+    arena_destroy((olm_arena_t *)card->__private);
+}
+
+/******************************************************************************************************************************
+ * Calls the given callback with each contact in the address book in turn, reading the address book from start to finish just
+ * once. All the contacts are parsed into the same memory, so a contact is only valid until the callback returns and must not
+ * be passed to olm_contact_free().
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the contacts from.
+ *   callback       Called with each contact, returns non zero to stop.
+ *   user_data      Passed on to the callback.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_CANCELLED if the callback asked to stop or another error code.
+ ******************************************************************************************************************************/
+int olm_for_each_contact(olm_file_t *file, olm_contact_callback callback, void *user_data)
+{
+    contact_source source;
+    address_card_t *card = NULL;
+    olm_arena_t *arena = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if (callback == NULL) return OLM_ERROR_INVALID_PARAMETER;
+    
+    error_code = ensure_contact_index(file);
+    if ((error_code != OLM_ERROR_SUCCESS) || (file->contact_count == 0)) return error_code;
+    
+    arena = arena_create(0);
+    if (arena == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    /* The contacts are in the order they appear in, so a deflated address book only ever moves forwards. */
+    error_code = open_contact_source(file, &source);
+    for (uint64_t idx = 0; (error_code == OLM_ERROR_SUCCESS) && (idx < file->contact_count); idx++)
+    {
+        olm_arena_reset(arena);
+        error_code = load_contact(&source, idx, arena, &card);
+        if ((error_code == OLM_ERROR_SUCCESS) && (callback(file, idx, card, user_data) != 0)) error_code = OLM_ERROR_CANCELLED;
+    }
+    close_contact_source(&source);
+    arena_destroy(arena);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Indexes the address book of the given file if it has not been already. This is done once, by
+ * whichever thread gets to it first.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int ensure_contact_index(olm_file_t *file)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (__atomic_load_n(&file->contacts_indexed, __ATOMIC_ACQUIRE) == true) return OLM_ERROR_SUCCESS;
+    
+    pthread_mutex_lock(&file->contacts_lock);
+    if (file->contacts_indexed == false)
+    {
+        error_code = index_contacts(file);
+        if (error_code == OLM_ERROR_SUCCESS) __atomic_store_n(&file->contacts_indexed, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&file->contacts_lock);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Finds where each contact is in the address book. The raw data is scanned for the start and end
+ * tags of the contact elements as it streams past, nothing is parsed or kept apart from the offsets.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int index_contacts(olm_file_t *file)
+{
+    contact_scan_state state;
+    entry_stream stream;
+    internal_archive_entry_data *entry = NULL;
+    const unsigned char *block_data = NULL;
+    uint64_t data_offset = 0;
+    uint64_t offset = 0;
+    size_t block_len = 0;
+    int verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    file->contacts = NULL;
+    file->contact_count = 0;
+    if (file->contact_entries.count == 0) return OLM_ERROR_SUCCESS;
+    entry = &file->contact_entries.entries[0];
+    
+    error_code = get_entry_data_offset(file, entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    memset(&state, 0, sizeof(contact_scan_state));
+    error_code = entry_stream_open(&stream, file, entry, data_offset, verify, OLM_ERROR_CONTACT_CORRUPTED);
+    while (error_code == OLM_ERROR_SUCCESS)
+    {
+        error_code = entry_stream_next(&stream, &block_data, &block_len);
+        if ((error_code != OLM_ERROR_SUCCESS) || (block_len == 0)) break;
+        error_code = scan_contacts(&state, block_data, block_len, offset);
+        offset += block_len;
+    }
+    entry_stream_close(&stream);
+    
+    if (error_code != OLM_ERROR_SUCCESS)
+    {
+        if (state.spans != NULL) free(state.spans);
+        return error_code;
+    }
+    
+    file->contacts = state.spans;
+    file->contact_count = state.count;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Looks for the start and end tags of contacts in the given block of the address book, which
+ * starts at the given offset. A start tag must be followed by white space or '>' so that
+ * contactEmailAddress and empty contact elements are passed over.
+ *
+ * Returns OLM_ERROR_SUCCESS or OLM_ERROR_NO_MEMORY.
+ **************************************************************************************************/
+static int scan_contacts(contact_scan_state *state, const unsigned char *data, size_t length, uint64_t offset)
+{
+    const unsigned char *curr = data;
+    const unsigned char *end = data + length;
+    const char *pattern = NULL;
+    size_t pattern_len = 0;
+    unsigned char ch = 0;
+    
+    while (curr < end)
+    {
+        /* Outside a tag only the next '<' matters. */
+        if (state->tag_len == 0)
+        {
+            curr = (const unsigned char *)memchr(curr, '<', (size_t)(end - curr));
+            if (curr == NULL) break;
+            state->tag[0] = '<';
+            state->tag_len = 1;
+            state->tag_offset = offset + (uint64_t)(curr - data);
+            curr++;
+            continue;
+        }
+    
+        ch = *curr;
+        if ((state->tag_len == 1) && (ch == '/'))
+        {
+            state->tag[state->tag_len++] = (char)ch;
+            curr++;
+            continue;
+        }
+    
+        pattern = ((state->tag_len > 1) && (state->tag[1] == '/')) ? CONTACT_END_TAG : CONTACT_START_TAG;
+        pattern_len = strlen(pattern);
+        if (state->tag_len == pattern_len)
+        {
+            /* The whole of a start tag name has been seen, the next character says whether that is all of it. */
+            if ((ch == '>') || (ch == ' ') || (ch == '\t') || (ch == '\r') || (ch == '\n'))
+            {
+                if (state->in_contact == false) state->contact_offset = state->tag_offset;
+                state->in_contact = true;
+            }
+            state->tag_len = 0;
+            continue;
+        }
+        if (ch != (unsigned char)pattern[state->tag_len])
+        {
+            /* Not one of ours, but the character may start the next tag so look at it again. */
+            state->tag_len = 0;
+            continue;
+        }
+        state->tag[state->tag_len++] = (char)ch;
+        curr++;
+    
+        if ((state->tag[1] == '/') && (state->tag_len == pattern_len))
+        {
+            state->tag_len = 0;
+            if ((state->in_contact == true) && (add_contact_span(state, (offset + (uint64_t)(curr - data))) == false)) return OLM_ERROR_NO_MEMORY;
+            state->in_contact = false;
+        }
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Adds the contact that has just ended at the given offset to the ones found so far.
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+static int add_contact_span(contact_scan_state *state, uint64_t end_offset)
+{
+    contact_span *grown = NULL;
+    uint64_t capacity = 0;
+    
+    if (state->count == state->capacity)
+    {
+        capacity = (state->capacity == 0) ? 256 : (state->capacity * 2);
+        grown = (contact_span *)realloc(state->spans, (size_t)(sizeof(contact_span) * capacity));
+        if (grown == NULL) return false;
+        state->spans = grown;
+        state->capacity = capacity;
+    }
+    
+    state->spans[state->count].offset = state->contact_offset;
+    state->spans[state->count].length = end_offset - state->contact_offset;
+    state->count++;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Gets ready to read contacts from the address book of the given file, which must have been
+ * indexed and have at least one contact. The source must be closed with close_contact_source()
+ * whether or not this succeeds.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int open_contact_source(olm_file_t *file, contact_source *source)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    memset(source, 0, sizeof(contact_source));
+    source->file = file;
+    source->entry = &file->contact_entries.entries[0];
+    if ((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) source->parse_options = XML_PARSE_RECOVER | XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
+    
+    error_code = get_entry_data_offset(file, source->entry, &source->data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    /* The whole of the address book was checked when it was indexed, so only part of it is read from here on. */
+    if (source->entry->compression_method == ZIP_CA_DEFLATE)
+    {
+        source->streaming = true;
+        error_code = entry_stream_open(&source->stream, file, source->entry, source->data_offset, false, OLM_ERROR_CONTACT_CORRUPTED);
+    }
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Parses the contact at the given index into the given arena. A contact in a stored address book
+ * is parsed where it lies if the archive is mapped, otherwise it is read into the buffer kept by
+ * the source first.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int load_contact(contact_source *source, uint64_t index, olm_arena_t *arena, address_card_t **card)
+{
+    contact_span *span = &source->file->contacts[index];
+    const char *data = NULL;
+    unsigned char *grown = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    *card = NULL;
+    if (span->length > INT32_MAX) return OLM_ERROR_CONTACT_CORRUPTED;
+    
+    if ((source->streaming == false) && (source->file->file_map != NULL))
+    {
+        data = (const char *)(source->file->file_map + source->data_offset + span->offset);
+    }
+    else
+    {
+        if (source->buffer_size < span->length)
+        {
+            grown = (unsigned char *)realloc(source->buffer, (size_t)span->length);
+            if (grown == NULL) return OLM_ERROR_NO_MEMORY;
+            source->buffer = grown;
+            source->buffer_size = (size_t)span->length;
+        }
+        if (source->streaming == true)
+        {
+            error_code = entry_stream_seek(&source->stream, span->offset);
+            if ((error_code == OLM_ERROR_SUCCESS) && (entry_stream_read(&source->stream, source->buffer, (size_t)span->length) != (ssize_t)span->length)) error_code = OLM_ERROR_CONTACT_CORRUPTED;
+        }
+        else
+        {
+            error_code = read_archive_data(source->file, (source->data_offset + span->offset), source->buffer, (size_t)span->length);
+        }
+        if (error_code != OLM_ERROR_SUCCESS) return error_code;
+        data = (const char *)source->buffer;
+    }
+    
+    if (source->reader == NULL)
+    {
+        source->reader = xmlReaderForMemory(data, (int)span->length, NULL, NULL, source->parse_options);
+    }
+    else if (xmlReaderNewMemory(source->reader, data, (int)span->length, NULL, NULL, source->parse_options) != 0)
+    {
+        xmlFreeTextReader(source->reader);
+        source->reader = NULL;
+    }
+    if (source->reader == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    *card = (address_card_t *)arena_alloc(arena, sizeof(address_card_t));
+    if (*card == NULL) return OLM_ERROR_NO_MEMORY;
+    memset(*card, 0, sizeof(address_card_t));
+    (*card)->__private = arena;
+    
+    error_code = parse_contact_xml(source->reader, *card, arena);
+    xmlTextReaderClose(source->reader);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Frees everything held by a contact source (but not the source itself).
+ **************************************************************************************************/
+static void close_contact_source(contact_source *source)
+{
+    if (source->streaming == true) entry_stream_close(&source->stream);
+    if (source->reader != NULL) xmlFreeTextReader(source->reader);
+    if (source->buffer != NULL) free(source->buffer);
+    source->streaming = false;
+    source->reader = NULL;
+    source->buffer = NULL;
+}
+
+/**************************************************************************************************
+ * Fills in the given contact from the XML of a single contact element, which is pulled from the
+ * given reader one node at a time in the same way as the message XML.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int parse_contact_xml(xmlTextReaderPtr reader, address_card_t *card, olm_arena_t *arena)
+{
+    const char *name = NULL;
+    const xmlChar *value = NULL;
+    char *text = NULL;
+    size_t text_len = 0;
+    size_t value_len = 0;
+    int capture_field = CONTACT_CAPTURE_NONE;
+    int capture_depth = -1;
+    int node_type = 0;
+    int depth = 0;
+    int ret = 0;
+    int seen_element = false;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    ret = xmlTextReaderRead(reader);
+    while ((ret == 1) && (error_code == OLM_ERROR_SUCCESS))
+    {
+        node_type = xmlTextReaderNodeType(reader);
+        depth = xmlTextReaderDepth(reader);
+    
+        switch (node_type)
+        {
+            case XML_READER_TYPE_ELEMENT:
+                seen_element = true;
+                name = (const char *)xmlTextReaderConstLocalName(reader);
+                if ((name == NULL) || (capture_field != CONTACT_CAPTURE_NONE)) break;
+    
+                switch (element_tag(name))
+                {
+                    case ELEMENT_CONTACT_EMAIL_ADDRESS:
+                        error_code = read_contact_email_address(reader, card, arena);
+                        break;
+                        
+                    case ELEMENT_NAME_PREFIX:           capture_field = CONTACT_CAPTURE_TITLE; break;
+                    case ELEMENT_FIRST_NAME:            capture_field = CONTACT_CAPTURE_FIRST_NAME; break;
+                    case ELEMENT_MIDDLE_NAME:           capture_field = CONTACT_CAPTURE_MIDDLE_NAME; break;
+                    case ELEMENT_LAST_NAME:             capture_field = CONTACT_CAPTURE_SURNAME; break;
+                    case ELEMENT_DISPLAY_NAME:          capture_field = CONTACT_CAPTURE_DISPLAY_NAME; break;
+                    case ELEMENT_BUSINESS_COMPANY:      capture_field = CONTACT_CAPTURE_COMPANY; break;
+                    case ELEMENT_BUSINESS_TITLE:        capture_field = CONTACT_CAPTURE_JOB_TITLE; break;
+                    case ELEMENT_BIRTHDAY:              capture_field = CONTACT_CAPTURE_BIRTHDAY; break;
+                    case ELEMENT_ANNIVERSARY:           capture_field = CONTACT_CAPTURE_ANNIVERSARY; break;
+                    case ELEMENT_HOME_PHONE:            capture_field = CONTACT_CAPTURE_HOME_PHONE; break;
+                    case ELEMENT_BUSINESS_PHONE:        capture_field = CONTACT_CAPTURE_WORK_PHONE; break;
+                    case ELEMENT_CELL_PHONE:            capture_field = CONTACT_CAPTURE_MOBILE_PHONE; break;
+                }
+                if (capture_field == CONTACT_CAPTURE_NONE) break;
+    
+                capture_depth = depth;
+                text = NULL;
+                text_len = 0;
+                /* An empty element has nothing to store. */
+                if (xmlTextReaderIsEmptyElement(reader) != 0)
+                {
+                    capture_field = CONTACT_CAPTURE_NONE;
+                    capture_depth = -1;
+                }
+                break;
+    
+            case XML_READER_TYPE_TEXT:
+            case XML_READER_TYPE_CDATA:
+            case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+                if (capture_field == CONTACT_CAPTURE_NONE) break;
+                value = xmlTextReaderConstValue(reader);
+                if (value == NULL) break;
+                value_len = strlen((const char *)value);
+                text = (char *)arena_extend(arena, text, text_len, (text_len + value_len + 1));
+                if (text == NULL)
+                {
+                    error_code = OLM_ERROR_NO_MEMORY;
+                    break;
+                }
+                memcpy((text + text_len), value, value_len);
+                text_len += value_len;
+                text[text_len] = '\0';
+                break;
+    
+            case XML_READER_TYPE_END_ELEMENT:
+                if ((capture_field != CONTACT_CAPTURE_NONE) && (depth == capture_depth))
+                {
+                    if (text != NULL) error_code = store_contact_text(capture_field, text, card, arena);
+                    capture_field = CONTACT_CAPTURE_NONE;
+                    capture_depth = -1;
+                    text = NULL;
+                }
+                break;
+        }
+    
+        if (error_code != OLM_ERROR_SUCCESS) break;
+        ret = xmlTextReaderRead(reader);
+    }
+    
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    if ((ret == -1) || (seen_element == false)) return OLM_ERROR_CONTACT_CORRUPTED;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Adds the address held by the contactEmailAddress element that the reader is positioned on to the
+ * addresses of the given contact. The first work and home addresses are kept separately as well.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int read_contact_email_address(xmlTextReaderPtr reader, address_card_t *card, olm_arena_t *arena)
+{
+    const char *name = NULL;
+    const char *value = NULL;
+    char *address = NULL;
+    char **dest = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    while ((error_code == OLM_ERROR_SUCCESS) && (xmlTextReaderMoveToNextAttribute(reader) == 1))
+    {
+        name = (const char *)xmlTextReaderConstLocalName(reader);
+        value = (const char *)xmlTextReaderConstValue(reader);
+        if ((name == NULL) || (value == NULL)) continue;
+    
+        if ((strcmp(name, "OPFContactEmailAddressAddress") == 0) && (address == NULL))
+        {
+            address = arena_strdup(arena, value);
+            if (address == NULL) error_code = OLM_ERROR_NO_MEMORY;
+        }
+        /* Outlook writes 0 for a work address and 1 for a home one, anything else is some other kind. */
+        if (strcmp(name, "OPFContactEmailAddressType") == 0)
+        {
+            if (strcmp(value, "0") == 0) dest = &card->work_email;
+            if (strcmp(value, "1") == 0) dest = &card->home_email;
+        }
+    }
+    xmlTextReaderMoveToElement(reader);
+    
+    if ((error_code != OLM_ERROR_SUCCESS) || (address == NULL)) return error_code;
+    if ((dest != NULL) && (*dest == NULL)) *dest = address;
+    if (append_address(arena, &card->email_addresses, address) == false) return OLM_ERROR_NO_MEMORY;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Stores the text collected for the contact field that has just ended in the given contact.
+ *
+ * Returns OLM_ERROR_SUCCESS or OLM_ERROR_NO_MEMORY.
+ **************************************************************************************************/
+static int store_contact_text(int capture_field, char *text, address_card_t *card, olm_arena_t *arena)
+{
+    size_t name_count = 0;
+    
+    switch (capture_field)
+    {
+        case CONTACT_CAPTURE_TITLE:         card->title = text; break;
+        case CONTACT_CAPTURE_SURNAME:       card->surname = text; break;
+        case CONTACT_CAPTURE_DISPLAY_NAME:  card->display_name = text; break;
+        case CONTACT_CAPTURE_COMPANY:       card->company = text; break;
+        case CONTACT_CAPTURE_JOB_TITLE:     card->job_title = text; break;
+        case CONTACT_CAPTURE_HOME_PHONE:    card->home_phone = text; break;
+        case CONTACT_CAPTURE_WORK_PHONE:    card->work_phone = text; break;
+        case CONTACT_CAPTURE_MOBILE_PHONE:  card->mobile_phone = text; break;
+        case CONTACT_CAPTURE_BIRTHDAY:      card->birthday = olm_parse_date_time(text); break;
+        case CONTACT_CAPTURE_ANNIVERSARY:   card->anniversary = olm_parse_date_time(text); break;
+    
+        case CONTACT_CAPTURE_FIRST_NAME:
+        case CONTACT_CAPTURE_MIDDLE_NAME:
+            /* The list has room for all the names and its terminator from the start. */
+            if (card->first_names == NULL)
+            {
+                card->first_names = (char **)arena_alloc(arena, (sizeof(char *) * (MAX_FIRST_NAMES + 1)));
+                if (card->first_names == NULL) return OLM_ERROR_NO_MEMORY;
+                memset(card->first_names, 0, (sizeof(char *) * (MAX_FIRST_NAMES + 1)));
+            }
+            while ((name_count < MAX_FIRST_NAMES) && (card->first_names[name_count] != NULL)) name_count++;
+            if (name_count == MAX_FIRST_NAMES) break;
+            /* The first name always comes first, even if it turns up after the middle name. */
+            if ((capture_field == CONTACT_CAPTURE_FIRST_NAME) && (name_count > 0))
+            {
+                card->first_names[1] = card->first_names[0];
+                card->first_names[0] = text;
+            }
+            else
+            {
+                card->first_names[name_count] = text;
+            }
+            break;
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
@@ -11,16 +11,24 @@
 
 #include <time.h>
 
+/* A contact from the address book. Strings that the contact does not have are NULL and dates 0. */
 typedef struct _address_card
 {
-    char title[8];
-    char **first_names;
+    char *title;                                                    /* Mr, Dr and so on. */
+    char **first_names;                                             /* The first name followed by the middle name (if any), NULL terminated. */
     char *surname;
-    char gender[8];
+    char *display_name;
+    char *company;
+    char *job_title;
     time_t birthday;
-    time_t aniversary;
+    time_t anniversary;
     char *home_email;
     char *work_email;
+    char *email_addresses;                                          /* Every e-mail address of the contact, comma separated. */
+    char *home_phone;
+    char *work_phone;
+    char *mobile_phone;
+    void *__private;
 } address_card_t;
 
 #endif
@@ -0,0 +1,442 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * crc.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+#if defined(HAVE_WMMINTRIN_H) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32_PCLMUL 1
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+/* A part of the data being checked by one of the threads. */
+typedef struct _crc_part
+{
+    const unsigned char *data;
+    uint64_t length;
+    uint32_t crc;                                                   /* The CRC of the part on its own. */
+} crc_part;
+
+/* A block that is being checked in parts, by the thread that asked for it along with any free workers of the pool. */
+typedef struct _crc_job
+{
+    crc_part parts[CRC_MAX_THREADS];
+    unsigned int part_count;
+    unsigned int next_part;                                         /* The next part to be claimed. */
+    unsigned int done_count;                                        /* The number of parts that have been checked. */
+    struct _crc_job *next;                                          /* The next job in the queue. */
+} crc_job;
+
+/* The pool of threads that help check large blocks. It is started the first time that it is needed and is shared by every
+   open file, so no matter how many blocks are being checked at once there are never more than CRC_MAX_THREADS - 1 of them.
+   The queue and the jobs on it are guarded by crc_pool_lock. */
+static pthread_once_t crc_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t crc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crc_pool_work = PTHREAD_COND_INITIALIZER;     /* Signalled when a job is queued. */
+static pthread_cond_t crc_pool_done = PTHREAD_COND_INITIALIZER;     /* Signalled when the last part of a job is checked. */
+static crc_job *crc_queue_head = NULL;
+static crc_job *crc_queue_tail = NULL;
+static unsigned int crc_pool_size = 0;
+
+/* Set on threads that belong to one of our pools, which are already one of many and so never split a block further. */
+static __thread int worker_thread = false;
+
+static void start_crc_pool(void);
+static void *crc_pool_worker(void *arg);
+static crc_part *claim_crc_part(crc_job *job);
+static void finish_crc_part(crc_job *job);
+#ifdef HAVE_CRC32_PCLMUL
+static int pclmul_supported(void);
+static uint32_t pclmul_crc32(uint32_t crc, const unsigned char *data, size_t length);
+#endif
+
+/**************************************************************************************************
+ * Updates a running CRC32 with the given data. Unlike crc32() from zlib the length is not limited
+ * to the range of an unsigned int, so it can be used over a whole mapped entry. Large blocks are
+ * split into parts that are checked by this thread and the CRC pool and then combined, unless this
+ * is a worker thread. Data that is being read a chunk at a time should use serial_crc32() instead.
+ **************************************************************************************************/
+uint32_t compute_crc32(uint32_t crc, const unsigned char *data, uint64_t length)
+{
+    crc_job job;
+    crc_part *part = NULL;
+    unsigned int part_count = 0;
+    uint64_t part_length = 0;
+    
+    if ((length < (2 * CRC_PARALLEL_PART_SIZE)) || (worker_thread == true)) return serial_crc32(crc, data, length);
+    
+    pthread_once(&crc_pool_once, start_crc_pool);
+    part_count = (unsigned int)(length / CRC_PARALLEL_PART_SIZE);
+    if (part_count > CRC_MAX_THREADS) part_count = CRC_MAX_THREADS;
+    if (part_count > (crc_pool_size + 1)) part_count = crc_pool_size + 1;
+    if (part_count < 2) return serial_crc32(crc, data, length);
+    
+    /* The last part picks up what is left over. */
+    memset(&job, 0, sizeof(crc_job));
+    job.part_count = part_count;
+    part_length = length / part_count;
+    for (unsigned int idx = 0; idx < part_count; idx++)
+    {
+        job.parts[idx].data = data + (idx * part_length);
+        job.parts[idx].length = (idx == (part_count - 1)) ? (length - (idx * part_length)) : part_length;
+    }
+    
+    pthread_mutex_lock(&crc_pool_lock);
+    if (crc_queue_tail != NULL) crc_queue_tail->next = &job;
+    else crc_queue_head = &job;
+    crc_queue_tail = &job;
+    pthread_cond_broadcast(&crc_pool_work);
+    
+    /* Check parts here until none are left unclaimed, then wait for the workers to finish theirs. The job cannot leave
+       this function while any worker still has a part of it. */
+    while ((part = claim_crc_part(&job)) != NULL)
+    {
+        pthread_mutex_unlock(&crc_pool_lock);
+        part->crc = serial_crc32(0, part->data, part->length);
+        pthread_mutex_lock(&crc_pool_lock);
+        finish_crc_part(&job);
+    }
+    while (job.done_count < job.part_count) pthread_cond_wait(&crc_pool_done, &crc_pool_lock);
+    pthread_mutex_unlock(&crc_pool_lock);
+    
+    for (unsigned int idx = 0; idx < part_count; idx++) crc = (uint32_t)crc32_combine(crc, job.parts[idx].crc, (z_off_t)job.parts[idx].length);
+    
+    return crc;
+}
+
+/**************************************************************************************************
+ * Marks the calling thread as a worker of one of the thread pools (or not), so that compute_crc32()
+ * does not split blocks across more threads when called from it.
+ *
+ * Returns whether the thread was marked as a worker before.
+ **************************************************************************************************/
+int set_worker_thread(int is_worker)
+{
+    int was_worker = worker_thread;
+    
+    worker_thread = is_worker;
+    
+    return was_worker;
+}
+
+/**************************************************************************************************
+ * Updates a running CRC32 with the given data on the calling thread, with the carry-less multiply
+ * instructions if the processor has them and zlib otherwise.
+ **************************************************************************************************/
+uint32_t serial_crc32(uint32_t crc, const unsigned char *data, uint64_t length)
+{
+    uInt block = 0;
+    
+#ifdef HAVE_CRC32_PCLMUL
+    size_t folded = 0;
+    
+    /* The kernel works on whole 16 byte blocks (at least four of them), zlib does the rest. */
+    if ((length >= CRC_PCLMUL_MIN_LENGTH) && (pclmul_supported() == true))
+    {
+        while (length >= CRC_PCLMUL_MIN_LENGTH)
+        {
+            folded = (length > 0x40000000) ? 0x40000000 : (size_t)(length & ~(uint64_t)15);
+            crc = ~pclmul_crc32(~crc, data, folded);
+            data += folded;
+            length -= folded;
+        }
+    }
+#endif
+    
+    while (length > 0)
+    {
+        block = (length > 0x40000000) ? 0x40000000 : (uInt)length;
+        crc = (uint32_t)crc32(crc, data, block);
+        data += block;
+        length -= block;
+    }
+    
+    return crc;
+}
+
+/**************************************************************************************************
+ * Checks the CRC of the given entry against the one in the central directory, regardless of the
+ * OLM_OPT_SKIP_CRC option. Deflated entries are inflated to do so.
+ *
+ * Returns OLM_ERROR_SUCCESS, corrupted_error if the CRC is wrong or another error code.
+ **************************************************************************************************/
+int verify_entry_crc(olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int corrupted_error)
+{
+    entry_stream stream;
+    unsigned char *buffer = NULL;
+    uint64_t done = 0;
+    size_t chunk_len = 0;
+    uint32_t crc = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (entry->compression_method == ZIP_CA_DEFLATE)
+    {
+        error_code = entry_stream_open(&stream, file, entry, data_offset, true, corrupted_error);
+        if (error_code == OLM_ERROR_SUCCESS) error_code = entry_stream_seek(&stream, entry->entry_size);
+        entry_stream_close(&stream);
+        return error_code;
+    }
+    if (entry->compression_method != ZIP_CA_STORED) return corrupted_error;
+    
+    /* Mapped data can be checked in one go, otherwise it is read a chunk at a time. */
+    if (file->file_map != NULL)
+    {
+        crc = compute_crc32(0, (file->file_map + data_offset), entry->entry_size);
+    }
+    else
+    {
+        buffer = (unsigned char *)malloc((entry->entry_size < COPY_CHUNK_SIZE) ? (size_t)entry->entry_size : COPY_CHUNK_SIZE);
+        if ((buffer == NULL) && (entry->entry_size > 0)) return OLM_ERROR_NO_MEMORY;
+        while (done < entry->entry_size)
+        {
+            chunk_len = ((entry->entry_size - done) < COPY_CHUNK_SIZE) ? (size_t)(entry->entry_size - done) : COPY_CHUNK_SIZE;
+            if (read_fully(file->file_seg, buffer, chunk_len, (off_t)(data_offset + done)) == false)
+            {
+                error_code = OLM_ERROR_FILE_IO_ERROR;
+                break;
+            }
+            crc = serial_crc32(crc, buffer, chunk_len);
+            done += chunk_len;
+        }
+        if (buffer != NULL) free(buffer);
+        if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    }
+    
+    return (crc == entry->crc32) ? OLM_ERROR_SUCCESS : corrupted_error;
+}
+
+/**************************************************************************************************
+ * Starts the threads of the CRC pool, one fewer than the number of online processors (up to
+ * CRC_MAX_THREADS) as the thread asking for a CRC always checks parts of it too. If no threads can
+ * be started blocks are simply checked on the thread that asks for them.
+ **************************************************************************************************/
+static void start_crc_pool(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int wanted = 0;
+    
+    if (online > CRC_MAX_THREADS) online = CRC_MAX_THREADS;
+    if (online > 1) wanted = (unsigned int)(online - 1);
+    if (pthread_attr_init(&attr) != 0) return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (crc_pool_size < wanted)
+    {
+        if (pthread_create(&thread, &attr, crc_pool_worker, NULL) != 0) break;
+        crc_pool_size++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**************************************************************************************************
+ * A thread of the CRC pool, which checks parts of the queued jobs for as long as the process runs.
+ **************************************************************************************************/
+static void *crc_pool_worker(void *arg)
+{
+    crc_job *job = NULL;
+    crc_part *part = NULL;
+    
+    (void)arg;
+    set_worker_thread(true);
+    
+    pthread_mutex_lock(&crc_pool_lock);
+    for (;;)
+    {
+        while (crc_queue_head == NULL) pthread_cond_wait(&crc_pool_work, &crc_pool_lock);
+        job = crc_queue_head;
+        part = claim_crc_part(job);
+        pthread_mutex_unlock(&crc_pool_lock);
+        part->crc = serial_crc32(0, part->data, part->length);
+        pthread_mutex_lock(&crc_pool_lock);
+        finish_crc_part(job);
+    }
+    
+    return NULL;
+}
+
+/**************************************************************************************************
+ * Claims the next part of the given job, taking the job off the queue once every part has been
+ * claimed. Must be called with crc_pool_lock held.
+ *
+ * Returns the part or NULL if they have all been claimed.
+ **************************************************************************************************/
+static crc_part *claim_crc_part(crc_job *job)
+{
+    crc_job *previous = NULL;
+    crc_part *part = NULL;
+    
+    if (job->next_part >= job->part_count) return NULL;
+    part = &job->parts[job->next_part++];
+    
+    if (job->next_part == job->part_count)
+    {
+        if (crc_queue_head != job)
+        {
+            for (previous = crc_queue_head; previous->next != job; previous = previous->next);
+            previous->next = job->next;
+        }
+        else
+        {
+            crc_queue_head = job->next;
+        }
+        if (crc_queue_tail == job) crc_queue_tail = previous;
+        job->next = NULL;
+    }
+    
+    return part;
+}
+
+/**************************************************************************************************
+ * Counts a part of the given job as checked. Must be called with crc_pool_lock held.
+ **************************************************************************************************/
+static void finish_crc_part(crc_job *job)
+{
+    job->done_count++;
+    if (job->done_count == job->part_count) pthread_cond_broadcast(&crc_pool_done);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/**************************************************************************************************
+ * Returns TRUE if the processor has the instructions that pclmul_crc32() needs.
+ **************************************************************************************************/
+static int pclmul_supported(void)
+{
+    static int supported = -1;
+    int result = __atomic_load_n(&supported, __ATOMIC_RELAXED);
+    
+    if (result == -1)
+    {
+        __builtin_cpu_init();
+        result = ((__builtin_cpu_supports("pclmul") != 0) && (__builtin_cpu_supports("sse4.1") != 0)) ? true : false;
+        __atomic_store_n(&supported, result, __ATOMIC_RELAXED);
+    }
+    
+    return result;
+}
+
+/**************************************************************************************************
+ * Works out the CRC32 of the given data by folding it 64 bytes at a time with carry-less multiplies
+ * and then reducing it with Barrett's method, as described in Intel's paper "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction". The CRC is passed in and out without the
+ * final inversion, the length must be a multiple of 16 and at least 64.
+ **************************************************************************************************/
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t pclmul_crc32(uint32_t crc, const unsigned char *data, size_t length)
+{
+    /* The folding constants and the polynomials for Barrett reduction, bit reflected. */
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+    
+    x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    data += 64;
+    length -= 64;
+    
+    /* Fold four blocks at a time. */
+    while (length >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        data += 64;
+        length -= 64;
+    }
+    
+    /* Fold the four blocks into one. */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    
+    /* Fold in any blocks that are left one at a time. */
+    while (length >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i *)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        length -= 16;
+    }
+    
+    /* Fold 128 bits down to 64. */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    /* Barrett reduce to 32 bits. */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
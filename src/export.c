@@ -0,0 +1,903 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * export.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* The size and number of the buffers that the formatted messages are handed to the writer in. Once they are all full the
+   formatter waits, which bounds the memory used however far the writer falls behind. */
+#define EXPORT_BUFFER_SIZE                       (1024 * 1024)
+#define EXPORT_BUFFER_COUNT                      4
+
+/* The longest encoded line (RFC 2045) and the most text put in one encoded word (RFC 2047), which keeps each word to
+   75 characters. Header text longer than EXPORT_MAX_RAW_HEADER is encoded so that it can be folded. */
+#define EXPORT_LINE_LENGTH                       76
+#define EXPORT_WORD_TEXT_LENGTH                  45
+#define EXPORT_MAX_RAW_HEADER                    900
+
+/* A buffer of formatted output and where it is to be written. */
+typedef struct _export_buffer
+{
+    unsigned char *data;
+    size_t length;
+    int fd;                                                         /* The file the data is for. */
+    int close_fd;                                                   /* Set if the file is to be closed once the data is written. */
+    struct _export_buffer *next;
+} export_buffer;
+
+typedef struct _export_state
+{
+    olm_file_t *file;
+    int mbox;                                                       /* Set for a single mbox file, clear for a directory of EML files. */
+    int out_fd;                                                     /* The file being written. */
+    const char *dest_dir;
+    char *path;                                                     /* Room for the path of each EML file. */
+    const char *eol;                                                /* LF for mbox files, CRLF for EML files. */
+    size_t eol_length;
+    export_buffer buffers[EXPORT_BUFFER_COUNT];
+    export_buffer *current;                                         /* The buffer being filled, owned by the formatter. */
+    export_buffer *free_list;
+    export_buffer *full_head;                                       /* Buffers waiting to be written, oldest first. */
+    export_buffer *full_tail;
+    pthread_mutex_t lock;                                           /* Guards the lists and error_code. */
+    pthread_cond_t buffer_free;
+    pthread_cond_t buffer_full;
+    int writer_running;
+    int finished;
+    int error_code;                                                 /* The first error, after which nothing more is written. */
+    size_t line_length;                                             /* How long the current encoded line is. */
+    unsigned char pending[3];                                       /* Attachment data waiting to be base64 encoded. */
+    size_t pending_count;
+} export_state;
+
+static const char *day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+static const char base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static int run_export(export_state *state, unsigned int nthreads);
+static int export_message(olm_file_t *file, uint64_t index, olm_mail_message_t *message, int error_code, void *user_data);
+static int format_message(export_state *state, uint64_t index, olm_mail_message_t *message);
+static int format_attachment(export_state *state, const char *boundary, olm_attachment_t *attachment);
+static void *export_writer(void *arg);
+static void write_export_buffer(export_state *state, export_buffer *buffer);
+static void hand_off(export_state *state, int close_fd);
+static unsigned char *reserve(export_state *state, size_t length);
+static void emit(export_state *state, const void *data, size_t length);
+static void emit_text(export_state *state, const char *text);
+static void emit_eol(export_state *state);
+static void emit_from_line(export_state *state, olm_mail_message_t *message);
+static void emit_date_header(export_state *state, time_t date);
+static int emit_address_header(export_state *state, const char *name, const char *addresses);
+static void emit_header_text(export_state *state, const char *text);
+static void emit_filename(export_state *state, const char *parameter, const char *filename);
+static void emit_quoted_printable(export_state *state, const char *text);
+static int encode_attachment_block(const void *data, size_t length, void *user_data);
+static void finish_base64(export_state *state);
+static int is_plain_text(const char *text, size_t limit);
+static time_t first_time(time_t first, time_t second, time_t third);
+
+/******************************************************************************************************************************
+ * Exports every message in the archive, with its attachments, to a single mbox file. The messages are parsed by a pool of
+ * threads, formatted as RFC 5322 messages in archive order as they come in and written out by a thread of their own, so
+ * parsing, formatting and writing all go on at once. The bodies are quoted-printable encoded (which also takes care of any
+ * lines starting "From ") and the attachments base64 encoded, so the file may be read as mboxo or mboxrd.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to export.
+ *   dest_path      Where to write the mbox file. A file that is already there is overwritten.
+ *   nthreads       The number of threads to parse the messages with, or 0 for one per online processor.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS or an error code, in which case the mbox file is not left behind. If the file was opened with
+ *   OLM_OPT_IGNORE_ERRORS, messages and attachments that cannot be read are left out rather than stopping the export.
+ ******************************************************************************************************************************/
+int olm_export_mbox(olm_file_t *file, const char *dest_path, unsigned int nthreads)
+{
+    export_state state;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if (dest_path == NULL) return OLM_ERROR_INVALID_PARAMETER;
+    
+    memset(&state, 0, sizeof(export_state));
+    state.file = file;
+    state.mbox = true;
+    state.eol = "\n";
+    state.eol_length = 1;
+    state.out_fd = open(dest_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (state.out_fd == -1) return OLM_ERROR_FILE_IO_ERROR;
+    
+    error_code = run_export(&state, nthreads);
+    if ((close(state.out_fd) != 0) && (error_code == OLM_ERROR_SUCCESS)) error_code = OLM_ERROR_FILE_IO_ERROR;
+    if (error_code != OLM_ERROR_SUCCESS) unlink(dest_path);
+    
+    return error_code;
+}
+
+/******************************************************************************************************************************
+ * Exports every message in the archive, with its attachments, to a file of its own in the given directory, in the same way
+ * as olm_export_mbox(). The files are named after the index of the message, 00000000.eml, 00000001.eml and so on, and have
+ * CRLF line endings.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to export.
+ *   dest_dir       The directory to write the files to, which is created if it is not there. Files that are already
+ *                  there are overwritten.
+ *   nthreads       The number of threads to parse the messages with, or 0 for one per online processor.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS or an error code, in which case some of the files may have been written. If the file was opened with
+ *   OLM_OPT_IGNORE_ERRORS, messages and attachments that cannot be read are left out rather than stopping the export.
+ ******************************************************************************************************************************/
+int olm_export_eml_dir(olm_file_t *file, const char *dest_dir, unsigned int nthreads)
+{
+    export_state state;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if (dest_dir == NULL) return OLM_ERROR_INVALID_PARAMETER;
+    if ((mkdir(dest_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) && (errno != EEXIST)) return OLM_ERROR_FILE_IO_ERROR;
+    
+    memset(&state, 0, sizeof(export_state));
+    state.file = file;
+    state.mbox = false;
+    state.out_fd = -1;
+    state.dest_dir = dest_dir;
+    state.eol = "\r\n";
+    state.eol_length = 2;
+    state.path = (char *)malloc(strlen(dest_dir) + 32);
+    if (state.path == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    error_code = run_export(&state, nthreads);
+    free(state.path);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Sets up the buffers and the writer thread, then parses and formats every message with
+ * olm_for_each_message() and waits for the last of the output to be written.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int run_export(export_state *state, unsigned int nthreads)
+{
+    pthread_t writer;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->buffer_free, NULL);
+    pthread_cond_init(&state->buffer_full, NULL);
+    
+    for (int idx = 0; idx < EXPORT_BUFFER_COUNT; idx++)
+    {
+        state->buffers[idx].data = (unsigned char *)malloc(EXPORT_BUFFER_SIZE);
+        if (state->buffers[idx].data == NULL)
+        {
+            error_code = OLM_ERROR_NO_MEMORY;
+            goto bail_and_die;
+        }
+        state->buffers[idx].next = state->free_list;
+        state->free_list = &state->buffers[idx];
+    }
+    state->current = state->free_list;
+    state->free_list = state->current->next;
+    state->current->length = 0;
+    state->current->fd = state->out_fd;
+    
+    /* Without a thread of its own the output is written as each buffer fills. */
+    state->writer_running = (pthread_create(&writer, NULL, export_writer, state) == 0);
+    
+    error_code = olm_for_each_message(state->file, nthreads, export_message, state, OLM_ITERATE_ARCHIVE_ORDER);
+    if (state->mbox == true) hand_off(state, false);
+    
+    pthread_mutex_lock(&state->lock);
+    state->finished = true;
+    pthread_cond_signal(&state->buffer_full);
+    pthread_mutex_unlock(&state->lock);
+    if (state->writer_running == true) pthread_join(writer, NULL);
+    
+    /* The callback stops the iteration when anything goes wrong, the error itself is kept in the state. */
+    if (state->error_code != OLM_ERROR_SUCCESS) error_code = state->error_code;
+
+bail_and_die:
+    
+    for (int idx = 0; idx < EXPORT_BUFFER_COUNT; idx++)
+    {
+        if (state->buffers[idx].data != NULL) free(state->buffers[idx].data);
+    }
+    pthread_cond_destroy(&state->buffer_full);
+    pthread_cond_destroy(&state->buffer_free);
+    pthread_mutex_destroy(&state->lock);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Called by olm_for_each_message() with each message in turn, formats it into the output.
+ *
+ * Returns 0 to carry on or 1 to stop if something went wrong.
+ **************************************************************************************************/
+static int export_message(olm_file_t *file, uint64_t index, olm_mail_message_t *message, int error_code, void *user_data)
+{
+    export_state *state = (export_state *)user_data;
+    int fd = -1;
+    
+    if (message == NULL)
+    {
+        if (((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) && (error_code != OLM_ERROR_NO_MEMORY)) return 0;
+        goto bail_and_die;
+    }
+    
+    /* Each EML file gets buffers of its own, the last of which closes it. */
+    if (state->mbox == false)
+    {
+        sprintf(state->path, "%s/%08" PRIu64 ".eml", state->dest_dir, index);
+        fd = open(state->path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+        if (fd == -1)
+        {
+            error_code = OLM_ERROR_FILE_IO_ERROR;
+            goto bail_and_die;
+        }
+        state->current->fd = fd;
+    }
+    
+    error_code = format_message(state, index, message);
+    if (state->mbox == false) hand_off(state, true);
+    if (error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
+    olm_message_free(message);
+    
+    pthread_mutex_lock(&state->lock);
+    error_code = state->error_code;
+    pthread_mutex_unlock(&state->lock);
+    
+    return (error_code != OLM_ERROR_SUCCESS);
+
+bail_and_die:
+    
+    if (message != NULL) olm_message_free(message);
+    pthread_mutex_lock(&state->lock);
+    if (state->error_code == OLM_ERROR_SUCCESS) state->error_code = error_code;
+    pthread_mutex_unlock(&state->lock);
+    
+    return 1;
+}
+
+/**************************************************************************************************
+ * Formats a message, and its attachments as MIME parts, into the output.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code from reading an attachment.
+ **************************************************************************************************/
+static int format_message(export_state *state, uint64_t index, olm_mail_message_t *message)
+{
+    char boundary[48];
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (state->mbox == true) emit_from_line(state, message);
+    
+    /* RFC 5322 wants every message to have a From and a Date, so those without are given the same stand ins as the mbox
+       "From " line. */
+    if (emit_address_header(state, "From: ", message->from) == false)
+    {
+        emit_text(state, "From: MAILER-DAEMON");
+        emit_eol(state);
+    }
+    emit_address_header(state, "To: ", message->to);
+    emit_address_header(state, "Reply-To: ", message->reply_to);
+    if ((message->subject != NULL) && (strcmp(message->subject, NO_SUBJECT) != 0))
+    {
+        emit_text(state, "Subject: ");
+        emit_header_text(state, message->subject);
+        emit_eol(state);
+    }
+    emit_date_header(state, first_time(message->sent_time, message->received_time, message->modified_time));
+    if ((message->message_id != NULL) && (strcmp(message->message_id, NO_MID) != 0) && (message->message_id[0] != '\0') && (is_plain_text(message->message_id, EXPORT_MAX_RAW_HEADER) == true))
+    {
+        emit_text(state, "Message-ID: ");
+        if (message->message_id[0] != '<') emit(state, "<", 1);
+        emit_text(state, message->message_id);
+        if (message->message_id[0] != '<') emit(state, ">", 1);
+        emit_eol(state);
+    }
+    if ((message->message_priority >= MESSAGE_PRIORITY_HIGHEST) && (message->message_priority <= MESSAGE_PRIORITY_LOWEST) && (message->message_priority != MESSAGE_PRIORITY_NORMAL))
+    {
+        emit_text(state, "X-Priority: ");
+        emit(state, &"012345"[message->message_priority], 1);
+        emit_eol(state);
+    }
+    for (unsigned long idx = 0; idx < message->category_count; idx++)
+    {
+        if (idx == 0) emit_text(state, "Keywords: ");
+        else
+        {
+            emit(state, ",", 1);
+            emit_eol(state);
+            emit(state, " ", 1);
+        }
+        emit_header_text(state, message->category_list[idx]);
+    }
+    if (message->category_count > 0) emit_eol(state);
+    emit_text(state, "MIME-Version: 1.0");
+    emit_eol(state);
+    
+    /* The boundary holds "=_", which can turn up in neither quoted-printable nor base64. */
+    if (message->attachment_count > 0)
+    {
+        sprintf(boundary, "=_olm_part_%" PRIu64, index);
+        emit_text(state, "Content-Type: multipart/mixed; boundary=\"");
+        emit_text(state, boundary);
+        emit(state, "\"", 1);
+        emit_eol(state);
+        emit_eol(state);
+        emit_text(state, "--");
+        emit_text(state, boundary);
+        emit_eol(state);
+    }
+    emit_text(state, ((message->has_html == true) ? "Content-Type: text/html; charset=UTF-8" : "Content-Type: text/plain; charset=UTF-8"));
+    emit_eol(state);
+    emit_text(state, "Content-Transfer-Encoding: quoted-printable");
+    emit_eol(state);
+    emit_eol(state);
+    if ((message->body != NULL) && (strcmp(message->body, NO_MESSAGE_BODY) != 0)) emit_quoted_printable(state, message->body);
+    emit_eol(state);
+    
+    if (message->attachment_count > 0)
+    {
+        for (unsigned long idx = 0; (idx < message->attachment_count) && (error_code == OLM_ERROR_SUCCESS); idx++)
+        {
+            error_code = format_attachment(state, boundary, message->attachment_list[idx]);
+        }
+        emit_text(state, "--");
+        emit_text(state, boundary);
+        emit_text(state, "--");
+        emit_eol(state);
+    }
+    
+    /* Messages in an mbox file are kept apart by a blank line. */
+    if (state->mbox == true) emit_eol(state);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Formats an attachment as a base64 encoded MIME part, taking its data straight from the archive.
+ * An attachment that is not in the archive is left out if errors are being ignored.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int format_attachment(export_state *state, const char *boundary, olm_attachment_t *attachment)
+{
+    const char *content_type = attachment->content_type;
+    int ignore_errors = ((state->file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS);
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if ((attachment->__private == NULL) || (find_entry(&state->file->attachment_lookup, &state->file->attachment_entries, attachment->__private) == NULL))
+    {
+        return (ignore_errors == true) ? OLM_ERROR_SUCCESS : OLM_ERROR_ATTACHMENT_NOT_FOUND;
+    }
+    
+    /* Only a content type made up of token characters is passed on. */
+    if ((content_type == NULL) || (content_type[0] == '\0') || (strspn(content_type, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#$&^_.+-/") != strlen(content_type)))
+    {
+        content_type = "application/octet-stream";
+    }
+    
+    emit_text(state, "--");
+    emit_text(state, boundary);
+    emit_eol(state);
+    emit_text(state, "Content-Type: ");
+    emit_text(state, content_type);
+    if (attachment->filename != NULL) emit_filename(state, "name", attachment->filename);
+    emit_eol(state);
+    emit_text(state, "Content-Disposition: attachment");
+    if (attachment->filename != NULL) emit_filename(state, "filename", attachment->filename);
+    emit_eol(state);
+    emit_text(state, "Content-Transfer-Encoding: base64");
+    emit_eol(state);
+    emit_eol(state);
+    
+    state->line_length = 0;
+    state->pending_count = 0;
+    error_code = olm_stream_attachment(state->file, attachment, encode_attachment_block, state);
+    finish_base64(state);
+    
+    return ((error_code == OLM_ERROR_SUCCESS) || (ignore_errors == true)) ? OLM_ERROR_SUCCESS : error_code;
+}
+
+/**************************************************************************************************
+ * The body of the writer thread, which writes out the full buffers in the order they were filled
+ * and hands them back.
+ **************************************************************************************************/
+static void *export_writer(void *arg)
+{
+    export_state *state = (export_state *)arg;
+    export_buffer *buffer = NULL;
+    
+    pthread_mutex_lock(&state->lock);
+    for (;;)
+    {
+        while ((state->full_head == NULL) && (state->finished == false)) pthread_cond_wait(&state->buffer_full, &state->lock);
+        if (state->full_head == NULL) break;
+        buffer = state->full_head;
+        state->full_head = buffer->next;
+        if (state->full_head == NULL) state->full_tail = NULL;
+        pthread_mutex_unlock(&state->lock);
+    
+        write_export_buffer(state, buffer);
+    
+        pthread_mutex_lock(&state->lock);
+        buffer->next = state->free_list;
+        state->free_list = buffer;
+        pthread_cond_signal(&state->buffer_free);
+    }
+    pthread_mutex_unlock(&state->lock);
+    
+    return NULL;
+}
+
+/**************************************************************************************************
+ * Writes out a buffer and closes its file if asked to. Once anything has failed, the data is
+ * thrown away rather than written.
+ **************************************************************************************************/
+static void write_export_buffer(export_state *state, export_buffer *buffer)
+{
+    int failed = false;
+    
+    pthread_mutex_lock(&state->lock);
+    failed = (state->error_code != OLM_ERROR_SUCCESS);
+    pthread_mutex_unlock(&state->lock);
+    
+    if ((failed == false) && (buffer->length > 0) && (write_fully(buffer->fd, buffer->data, buffer->length) == false)) failed = true;
+    if ((buffer->close_fd == true) && (close(buffer->fd) != 0)) failed = true;
+    
+    if (failed == true)
+    {
+        pthread_mutex_lock(&state->lock);
+        if (state->error_code == OLM_ERROR_SUCCESS) state->error_code = OLM_ERROR_FILE_IO_ERROR;
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/**************************************************************************************************
+ * Passes the current buffer on to the writer and takes a free one in its place, waiting for one
+ * if the writer has them all. If close_fd is set the file is closed after the buffer is written.
+ **************************************************************************************************/
+static void hand_off(export_state *state, int close_fd)
+{
+    export_buffer *buffer = state->current;
+    int fd = buffer->fd;
+    
+    buffer->close_fd = close_fd;
+    buffer->next = NULL;
+    if (state->writer_running == false)
+    {
+        write_export_buffer(state, buffer);
+    }
+    else
+    {
+        pthread_mutex_lock(&state->lock);
+        if (state->full_tail == NULL) state->full_head = buffer;
+        else state->full_tail->next = buffer;
+        state->full_tail = buffer;
+        pthread_cond_signal(&state->buffer_full);
+        while (state->free_list == NULL) pthread_cond_wait(&state->buffer_free, &state->lock);
+        buffer = state->free_list;
+        state->free_list = buffer->next;
+        pthread_mutex_unlock(&state->lock);
+    }
+    
+    buffer->length = 0;
+    buffer->close_fd = false;
+    buffer->fd = (close_fd == true) ? -1 : fd;
+    state->current = buffer;
+}
+
+/**************************************************************************************************
+ * Makes sure there is room for length bytes (which must be no more than EXPORT_BUFFER_SIZE) in the
+ * current buffer, handing it off if there is not.
+ *
+ * Returns where to put them, the caller adds length to the length of the buffer once it has.
+ **************************************************************************************************/
+static unsigned char *reserve(export_state *state, size_t length)
+{
+    if ((EXPORT_BUFFER_SIZE - state->current->length) < length) hand_off(state, false);
+    
+    return (state->current->data + state->current->length);
+}
+
+/**************************************************************************************************
+ * Appends data to the output.
+ **************************************************************************************************/
+static void emit(export_state *state, const void *data, size_t length)
+{
+    const unsigned char *src = (const unsigned char *)data;
+    size_t room = 0;
+    
+    while (length > 0)
+    {
+        if (state->current->length == EXPORT_BUFFER_SIZE) hand_off(state, false);
+        room = EXPORT_BUFFER_SIZE - state->current->length;
+        if (room > length) room = length;
+        memcpy((state->current->data + state->current->length), src, room);
+        state->current->length += room;
+        src += room;
+        length -= room;
+    }
+}
+
+/**************************************************************************************************
+ * Appends a string to the output.
+ **************************************************************************************************/
+static void emit_text(export_state *state, const char *text)
+{
+    emit(state, text, strlen(text));
+}
+
+/**************************************************************************************************
+ * Ends the current line of the output.
+ **************************************************************************************************/
+static void emit_eol(export_state *state)
+{
+    emit(state, state->eol, state->eol_length);
+}
+
+/**************************************************************************************************
+ * Writes the "From " line that starts each message in an mbox file, giving the first sender and
+ * the time the message was received (or else sent or last modified) in the form asctime() would
+ * (but always in UTC).
+ **************************************************************************************************/
+static void emit_from_line(export_state *state, olm_mail_message_t *message)
+{
+    char date[32];
+    struct tm parts;
+    time_t when = first_time(message->received_time, message->sent_time, message->modified_time);
+    size_t length = 0;
+    
+    emit_text(state, "From ");
+    if ((message->from != NULL) && (strcmp(message->from, NO_ADDRESS) != 0)) length = strcspn(message->from, ", \t\r\n");
+    if (length > 0) emit(state, message->from, length);
+    else emit_text(state, "MAILER-DAEMON");
+    
+    memset(&parts, 0, sizeof(parts));
+    gmtime_r(&when, &parts);
+    sprintf(date, " %s %s %2d %02d:%02d:%02d %d", day_names[parts.tm_wday % 7], month_names[parts.tm_mon % 12], parts.tm_mday, parts.tm_hour, parts.tm_min, parts.tm_sec, (parts.tm_year + 1900));
+    emit_text(state, date);
+    emit_eol(state);
+}
+
+/**************************************************************************************************
+ * Writes a Date header in the form RFC 5322 asks for, in UTC. A message without a date (or with
+ * one that cannot be shown) is given the start of the epoch, as in the mbox "From " line.
+ **************************************************************************************************/
+static void emit_date_header(export_state *state, time_t date)
+{
+    char text[48];
+    struct tm parts;
+    time_t epoch = 0;
+    
+    memset(&parts, 0, sizeof(parts));
+    if (gmtime_r(&date, &parts) == NULL) gmtime_r(&epoch, &parts);
+    sprintf(text, "Date: %s, %d %s %d %02d:%02d:%02d +0000", day_names[parts.tm_wday % 7], parts.tm_mday, month_names[parts.tm_mon % 12], (parts.tm_year + 1900), parts.tm_hour, parts.tm_min, parts.tm_sec);
+    emit_text(state, text);
+    emit_eol(state);
+}
+
+/**************************************************************************************************
+ * Writes a header holding a comma separated list of addresses, one to a line so that long lists
+ * are folded. Nothing is written if there are no addresses.
+ *
+ * Returns true if the header was written or false if there were no addresses.
+ **************************************************************************************************/
+static int emit_address_header(export_state *state, const char *name, const char *addresses)
+{
+    size_t length = 0;
+    int first = true;
+    
+    if ((addresses == NULL) || (strcmp(addresses, NO_ADDRESS) == 0)) return false;
+    
+    for (const char *curr = addresses; *curr != '\0'; curr += length)
+    {
+        /* Line breaks, which could end the header early, are taken as separators. */
+        if ((*curr == ',') || (*curr == '\r') || (*curr == '\n'))
+        {
+            length = 1;
+            continue;
+        }
+        length = strcspn(curr, ",\r\n");
+        if (first == true) emit_text(state, name);
+        else
+        {
+            emit(state, ",", 1);
+            emit_eol(state);
+            emit(state, " ", 1);
+        }
+        emit(state, curr, length);
+        first = false;
+    }
+    if (first == true) return false;
+    emit_eol(state);
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Writes header text, as it is if it is short printable ASCII, otherwise as RFC 2047 encoded words
+ * of UTF-8 on lines of their own.
+ **************************************************************************************************/
+static void emit_header_text(export_state *state, const char *text)
+{
+    const unsigned char *src = (const unsigned char *)text;
+    unsigned char *dest = NULL;
+    size_t remaining = strlen(text);
+    size_t length = 0;
+    uint32_t group = 0;
+    
+    if (is_plain_text(text, EXPORT_MAX_RAW_HEADER) == true)
+    {
+        emit(state, text, remaining);
+        return;
+    }
+    
+    while (remaining > 0)
+    {
+        /* Each word holds whole characters. */
+        length = (remaining < EXPORT_WORD_TEXT_LENGTH) ? remaining : EXPORT_WORD_TEXT_LENGTH;
+        while ((length < remaining) && (length > 1) && ((src[length] & 0xC0) == 0x80)) length--;
+    
+        if (src != (const unsigned char *)text)
+        {
+            emit_eol(state);
+            emit(state, " ", 1);
+        }
+        emit_text(state, "=?UTF-8?B?");
+        dest = reserve(state, ((length + 2) / 3) * 4);
+        for (size_t idx = 0; idx < length; idx += 3)
+        {
+            group = (uint32_t)src[idx] << 16;
+            if ((idx + 1) < length) group |= (uint32_t)src[idx + 1] << 8;
+            if ((idx + 2) < length) group |= (uint32_t)src[idx + 2];
+            *dest++ = base64_digits[(group >> 18) & 0x3F];
+            *dest++ = base64_digits[(group >> 12) & 0x3F];
+            *dest++ = ((idx + 1) < length) ? base64_digits[(group >> 6) & 0x3F] : '=';
+            *dest++ = ((idx + 2) < length) ? base64_digits[group & 0x3F] : '=';
+        }
+        state->current->length += ((length + 2) / 3) * 4;
+        emit_text(state, "?=");
+        src += length;
+        remaining -= length;
+    }
+}
+
+/**************************************************************************************************
+ * Writes the given filename as a parameter of a MIME header, quoted if it is printable ASCII and
+ * otherwise percent encoded as RFC 2231 asks.
+ **************************************************************************************************/
+static void emit_filename(export_state *state, const char *parameter, const char *filename)
+{
+    unsigned char *dest = NULL;
+    
+    emit_text(state, ";");
+    emit_eol(state);
+    emit_text(state, " ");
+    emit_text(state, parameter);
+    if ((is_plain_text(filename, EXPORT_MAX_RAW_HEADER) == true) && (strpbrk(filename, "\"\\") == NULL))
+    {
+        emit_text(state, "=\"");
+        emit_text(state, filename);
+        emit_text(state, "\"");
+        return;
+    }
+    
+    emit_text(state, "*=UTF-8''");
+    for (const unsigned char *curr = (const unsigned char *)filename; *curr != '\0'; curr++)
+    {
+        dest = reserve(state, 3);
+        if (((*curr >= 'a') && (*curr <= 'z')) || ((*curr >= 'A') && (*curr <= 'Z')) || ((*curr >= '0') && (*curr <= '9')) || (strchr("!#$&+-.^_`|~", *curr) != NULL))
+        {
+            *dest = *curr;
+            state->current->length++;
+            continue;
+        }
+        dest[0] = '%';
+        dest[1] = hex_digits[*curr >> 4];
+        dest[2] = hex_digits[*curr & 0x0F];
+        state->current->length += 3;
+    }
+}
+
+/**************************************************************************************************
+ * Writes the body of a message quoted-printable encoded (RFC 2045), with the line endings of the
+ * output. A line that starts "From " has its F encoded so that it cannot be taken for the start of
+ * the next message in an mbox file.
+ **************************************************************************************************/
+static void emit_quoted_printable(export_state *state, const char *text)
+{
+    const unsigned char *curr = (const unsigned char *)text;
+    unsigned char *dest = NULL;
+    size_t line_length = 0;
+    size_t needed = 0;
+    int encode = false;
+    
+    for (; *curr != '\0'; curr++)
+    {
+        if ((*curr == '\r') && (curr[1] == '\n')) continue;
+        if (*curr == '\n')
+        {
+            emit_eol(state);
+            line_length = 0;
+            continue;
+        }
+    
+        /* Spaces and tabs only need encoding at the end of a line. */
+        if ((*curr == ' ') || (*curr == '\t')) encode = ((curr[1] == '\0') || (curr[1] == '\n') || ((curr[1] == '\r') && (curr[2] == '\n')));
+        else encode = ((*curr < 33) || (*curr > 126) || (*curr == '='));
+    
+        /* Leave room for the = of a soft line break. */
+        if ((line_length + ((encode == true) ? 3 : 1)) > (EXPORT_LINE_LENGTH - 1))
+        {
+            emit(state, "=", 1);
+            emit_eol(state);
+            line_length = 0;
+        }
+        if ((line_length == 0) && (*curr == 'F') && (strncmp((const char *)curr, "From ", 5) == 0)) encode = true;
+        needed = (encode == true) ? 3 : 1;
+    
+        dest = reserve(state, needed);
+        if (encode == true)
+        {
+            dest[0] = '=';
+            dest[1] = hex_digits[*curr >> 4];
+            dest[2] = hex_digits[*curr & 0x0F];
+        }
+        else
+        {
+            dest[0] = *curr;
+        }
+        state->current->length += needed;
+        line_length += needed;
+    }
+}
+
+/**************************************************************************************************
+ * Called by olm_stream_attachment() with each block of an attachment, base64 encodes it into the
+ * output in lines of EXPORT_LINE_LENGTH characters. Up to two bytes are held over for the next
+ * block.
+ *
+ * Returns 0 to carry on.
+ **************************************************************************************************/
+static int encode_attachment_block(const void *data, size_t length, void *user_data)
+{
+    export_state *state = (export_state *)user_data;
+    const unsigned char *src = (const unsigned char *)data;
+    unsigned char *dest = NULL;
+    uint32_t group = 0;
+    
+    while (length > 0)
+    {
+        state->pending[state->pending_count++] = *src++;
+        length--;
+        if (state->pending_count < 3) continue;
+    
+        /* Whole groups are encoded straight from the block while there are enough of them. */
+        for (;;)
+        {
+            group = ((uint32_t)state->pending[0] << 16) | ((uint32_t)state->pending[1] << 8) | (uint32_t)state->pending[2];
+            dest = reserve(state, 4);
+            dest[0] = base64_digits[(group >> 18) & 0x3F];
+            dest[1] = base64_digits[(group >> 12) & 0x3F];
+            dest[2] = base64_digits[(group >> 6) & 0x3F];
+            dest[3] = base64_digits[group & 0x3F];
+            state->current->length += 4;
+            state->line_length += 4;
+            if (state->line_length >= EXPORT_LINE_LENGTH)
+            {
+                emit_eol(state);
+                state->line_length = 0;
+            }
+            if (length < 3) break;
+            memcpy(state->pending, src, 3);
+            src += 3;
+            length -= 3;
+        }
+        state->pending_count = 0;
+    }
+    
+    return 0;
+}
+
+/**************************************************************************************************
+ * Encodes whatever attachment data is held over, with padding, and ends the last line.
+ **************************************************************************************************/
+static void finish_base64(export_state *state)
+{
+    unsigned char *dest = NULL;
+    uint32_t group = 0;
+    
+    if (state->pending_count > 0)
+    {
+        group = (uint32_t)state->pending[0] << 16;
+        if (state->pending_count > 1) group |= (uint32_t)state->pending[1] << 8;
+        dest = reserve(state, 4);
+        dest[0] = base64_digits[(group >> 18) & 0x3F];
+        dest[1] = base64_digits[(group >> 12) & 0x3F];
+        dest[2] = (state->pending_count > 1) ? base64_digits[(group >> 6) & 0x3F] : '=';
+        dest[3] = '=';
+        state->current->length += 4;
+        state->line_length += 4;
+        state->pending_count = 0;
+    }
+    if (state->line_length > 0) emit_eol(state);
+    state->line_length = 0;
+}
+
+/**************************************************************************************************
+ * Returns true if the given text is printable ASCII and no longer than limit, so that it can go in
+ * a header as it is, false if not.
+ **************************************************************************************************/
+static int is_plain_text(const char *text, size_t limit)
+{
+    size_t length = 0;
+    
+    for (; text[length] != '\0'; length++)
+    {
+        if ((length >= limit) || ((unsigned char)text[length] < 32) || ((unsigned char)text[length] > 126)) return false;
+        if ((text[length] == '=') && (text[length + 1] == '?')) return false;
+    }
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Returns the first of the given times that the message has, or 0 if it has none of them. A time
+ * that could not be parsed ((time_t)-1) counts as missing.
+ **************************************************************************************************/
+static time_t first_time(time_t first, time_t second, time_t third)
+{
+    if ((first != 0) && (first != (time_t)-1)) return first;
+    if ((second != 0) && (second != (time_t)-1)) return second;
+    if ((third != 0) && (third != (time_t)-1)) return third;
+    
+    return 0;
+}
@@ -0,0 +1,490 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * index.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+static char *entry_index_path(const char *olm_filename, const char *suffix);
+static void fill_index_header(olm_file_t *file, const struct stat *archive_stat, entry_index_header *header);
+static size_t add_index_records(entry_table *table, unsigned char *buffer);
+static int load_index_records(olm_file_t *file, entry_table *table, uint64_t count, const unsigned char **records, const unsigned char *records_end);
+static const unsigned char *map_index_file(olm_file_t *file, const char *suffix, size_t *map_size);
+static int write_index_file(olm_file_t *file, const char *suffix, const unsigned char *buffer, size_t buffer_size);
+static int load_category_records(olm_file_t *file, category_members *members, const unsigned char *records, const unsigned char *records_end);
+
+/**************************************************************************************************
+ * Fills the message, attachment, address book and category list tables of the given file from its
+ * sidecar index, if there is one and it was written for the archive as it is now. Nothing is added
+ * to the tables unless the whole index is good.
+ *
+ * Returns true if the index was used, false if the central directory must be read instead.
+ **************************************************************************************************/
+int load_entry_index(olm_file_t *file, const struct stat *archive_stat)
+{
+    entry_index_header expected;
+    entry_index_header header;
+    const unsigned char *index_map = NULL;
+    const unsigned char *records = NULL;
+    const unsigned char *records_end = NULL;
+    arena_block *mark_block = file->entry_strings->current;
+    size_t mark_used = mark_block->used;
+    size_t map_size = 0;
+    int loaded = false;
+    
+    index_map = map_index_file(file, ENTRY_INDEX_SUFFIX, &map_size);
+    if (index_map == NULL) return false;
+    
+    /* Everything up to the counts must match the archive as it is now. */
+    memcpy(&header, index_map, sizeof(entry_index_header));
+    fill_index_header(file, archive_stat, &expected);
+    if (memcmp(&header, &expected, offsetof(entry_index_header, message_count)) != 0) goto bail_and_die;
+    if (header.records_size != (map_size - sizeof(entry_index_header))) goto bail_and_die;
+    records = index_map + sizeof(entry_index_header);
+    records_end = records + header.records_size;
+    if (compute_crc32(0, records, header.records_size) != header.records_crc32) goto bail_and_die;
+    
+    if (load_index_records(file, &file->message_entries, header.message_count, &records, records_end) == false) goto bail_and_die;
+    if (load_index_records(file, &file->attachment_entries, header.attachment_count, &records, records_end) == false) goto bail_and_die;
+    if (load_index_records(file, &file->contact_entries, header.contact_count, &records, records_end) == false) goto bail_and_die;
+    if (load_index_records(file, &file->category_entries, header.category_count, &records, records_end) == false) goto bail_and_die;
+    loaded = true;
+    
+bail_and_die:
+    
+    if (loaded == false)
+    {
+        file->message_entries.count = 0;
+        file->attachment_entries.count = 0;
+        file->contact_entries.count = 0;
+        file->category_entries.count = 0;
+        arena_rewind(file->entry_strings, mark_block, mark_used);
+    }
+    munmap((void *)index_map, map_size);
+    
+    return loaded;
+}
+
+/**************************************************************************************************
+ * Writes the message, attachment, address book and category list tables of the given file to its
+ * sidecar index. This is only an optimisation, so if it cannot be written (for example the archive
+ * is on read only media) it is quietly skipped.
+ **************************************************************************************************/
+void save_entry_index(olm_file_t *file, const struct stat *archive_stat)
+{
+    entry_index_header header;
+    entry_table *tables[4] = { &file->message_entries, &file->attachment_entries, &file->contact_entries, &file->category_entries };
+    unsigned char *buffer = NULL;
+    size_t buffer_size = sizeof(entry_index_header);
+    size_t records_size = 0;
+    
+    /* Work out how big the index will be. */
+    for (int i = 0; i < 4; i++)
+    {
+        for (uint64_t idx = 0; idx < tables[i]->count; idx++) buffer_size += sizeof(entry_index_record) + strlen(tables[i]->entries[idx].raw_entry_path);
+    }
+    
+    buffer = (unsigned char *)malloc(buffer_size);
+    if (buffer == NULL) return;
+    for (int i = 0; i < 4; i++) records_size += add_index_records(tables[i], (buffer + sizeof(entry_index_header) + records_size));
+    
+    fill_index_header(file, archive_stat, &header);
+    header.message_count = file->message_entries.count;
+    header.attachment_count = file->attachment_entries.count;
+    header.contact_count = file->contact_entries.count;
+    header.category_count = file->category_entries.count;
+    header.records_size = records_size;
+    header.records_crc32 = compute_crc32(0, (buffer + sizeof(entry_index_header)), records_size);
+    memcpy(buffer, &header, sizeof(entry_index_header));
+    
+    write_index_file(file, ENTRY_INDEX_SUFFIX, buffer, buffer_size);
+    free(buffer);
+}
+
+/**************************************************************************************************
+ * Fills in the messages of each category of the given file (whose category list has been read)
+ * from its sidecar category index, if there is one and it was written for the archive as it is now.
+ *
+ * Returns true if the index was used, false if the messages must be sorted into their categories.
+ **************************************************************************************************/
+int load_category_index(olm_file_t *file)
+{
+    entry_index_header expected;
+    entry_index_header header;
+    struct stat archive_stat;
+    category_members *members = NULL;
+    const unsigned char *index_map = NULL;
+    size_t map_size = 0;
+    int loaded = false;
+    
+    if (fstat(file->file_seg, &archive_stat) == -1) return false;
+    index_map = map_index_file(file, CATEGORY_INDEX_SUFFIX, &map_size);
+    if (index_map == NULL) return false;
+    
+    /* The messages and categories must be the ones the index was written for, as well as the archive. */
+    memcpy(&header, index_map, sizeof(entry_index_header));
+    fill_index_header(file, &archive_stat, &expected);
+    expected.signature = SIG_CATEGORY_INDEX;
+    if (memcmp(&header, &expected, offsetof(entry_index_header, message_count)) != 0) goto bail_and_die;
+    if ((header.message_count != file->message_entries.count) || (header.category_count != file->category_count)) goto bail_and_die;
+    if (header.records_size != (map_size - sizeof(entry_index_header))) goto bail_and_die;
+    if (compute_crc32(0, (index_map + sizeof(entry_index_header)), header.records_size) != header.records_crc32) goto bail_and_die;
+    
+    members = (category_members *)calloc(((file->category_count == 0) ? 1 : (size_t)file->category_count), sizeof(category_members));
+    if (members == NULL) goto bail_and_die;
+    loaded = load_category_records(file, members, (index_map + sizeof(entry_index_header)), (index_map + map_size));
+    
+bail_and_die:
+    
+    if ((loaded == false) && (members != NULL))
+    {
+        for (uint64_t idx = 0; idx < file->category_count; idx++) free(members[idx].messages);
+        free(members);
+    }
+    if (loaded == true) file->category_members = members;
+    munmap((void *)index_map, map_size);
+    
+    return loaded;
+}
+
+/**************************************************************************************************
+ * Writes the messages in each category of the given file to its sidecar category index. Like the
+ * entry index, it is quietly skipped if it cannot be written.
+ **************************************************************************************************/
+void save_category_index(olm_file_t *file)
+{
+    entry_index_header header;
+    struct stat archive_stat;
+    unsigned char *buffer = NULL;
+    size_t buffer_size = sizeof(entry_index_header);
+    size_t offset = sizeof(entry_index_header);
+    size_t length = 0;
+    
+    if (fstat(file->file_seg, &archive_stat) == -1) return;
+    for (uint64_t idx = 0; idx < file->category_count; idx++) buffer_size += sizeof(uint64_t) * (1 + file->category_members[idx].count);
+    
+    buffer = (unsigned char *)malloc(buffer_size);
+    if (buffer == NULL) return;
+    for (uint64_t idx = 0; idx < file->category_count; idx++)
+    {
+        memcpy((buffer + offset), &file->category_members[idx].count, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        length = sizeof(uint64_t) * file->category_members[idx].count;
+        if (length > 0) memcpy((buffer + offset), file->category_members[idx].messages, length);
+        offset += length;
+    }
+    
+    fill_index_header(file, &archive_stat, &header);
+    header.signature = SIG_CATEGORY_INDEX;
+    header.message_count = file->message_entries.count;
+    header.category_count = file->category_count;
+    header.records_size = buffer_size - sizeof(entry_index_header);
+    header.records_crc32 = compute_crc32(0, (buffer + sizeof(entry_index_header)), header.records_size);
+    memcpy(buffer, &header, sizeof(entry_index_header));
+    
+    write_index_file(file, CATEGORY_INDEX_SUFFIX, buffer, buffer_size);
+    free(buffer);
+}
+
+/**************************************************************************************************
+ * Maps the sidecar search index of the given file, if there is one and it was written for the
+ * archive and messages as they are now. Its CRC is checked unless the file was opened with
+ * OLM_OPT_SKIP_CRC, the layout of what follows the header is left to the caller.
+ *
+ * Returns the mapping (which must be unmapped by the caller) or NULL.
+ **************************************************************************************************/
+const unsigned char *load_search_index(olm_file_t *file, size_t *map_size)
+{
+    entry_index_header expected;
+    entry_index_header header;
+    struct stat archive_stat;
+    const unsigned char *index_map = NULL;
+    
+    if (fstat(file->file_seg, &archive_stat) == -1) return NULL;
+    index_map = map_index_file(file, SEARCH_INDEX_SUFFIX, map_size);
+    if (index_map == NULL) return NULL;
+    
+    memcpy(&header, index_map, sizeof(entry_index_header));
+    fill_index_header(file, &archive_stat, &expected);
+    expected.signature = SIG_SEARCH_INDEX;
+    if ((memcmp(&header, &expected, offsetof(entry_index_header, message_count)) != 0) || (header.message_count != file->message_entries.count) ||
+        (header.records_size != (*map_size - sizeof(entry_index_header))) ||
+        (((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC) && (compute_crc32(0, (index_map + sizeof(entry_index_header)), header.records_size) != header.records_crc32)))
+    {
+        munmap((void *)index_map, *map_size);
+        return NULL;
+    }
+    
+    return index_map;
+}
+
+/**************************************************************************************************
+ * Fills in the header at the start of the given search index, which must otherwise be complete.
+ *
+ * Returns true on success or false if the archive could not be looked at.
+ **************************************************************************************************/
+int fill_search_index_header(olm_file_t *file, unsigned char *buffer, size_t buffer_size)
+{
+    entry_index_header header;
+    struct stat archive_stat;
+    
+    if (fstat(file->file_seg, &archive_stat) == -1) return false;
+    
+    fill_index_header(file, &archive_stat, &header);
+    header.signature = SIG_SEARCH_INDEX;
+    header.message_count = file->message_entries.count;
+    header.records_size = buffer_size - sizeof(entry_index_header);
+    header.records_crc32 = compute_crc32(0, (buffer + sizeof(entry_index_header)), header.records_size);
+    memcpy(buffer, &header, sizeof(entry_index_header));
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Writes the given search index, header and all, next to the archive.
+ *
+ * Returns true if the index was written, false if not.
+ **************************************************************************************************/
+int save_search_index(olm_file_t *file, const unsigned char *buffer, size_t buffer_size)
+{
+    return write_index_file(file, SEARCH_INDEX_SUFFIX, buffer, buffer_size);
+}
+
+/**************************************************************************************************
+ * Maps the sidecar file with the given suffix, if it exists and is at least big enough to hold a
+ * header.
+ *
+ * Returns the mapping (which must be unmapped by the caller) or NULL.
+ **************************************************************************************************/
+static const unsigned char *map_index_file(olm_file_t *file, const char *suffix, size_t *map_size)
+{
+    struct stat index_stat;
+    char *index_path = NULL;
+    void *index_map = NULL;
+    int index_fd = -1;
+    
+    index_path = entry_index_path(file->filename, suffix);
+    if (index_path == NULL) return NULL;
+    index_fd = open(index_path, O_RDONLY);
+    free(index_path);
+    if (index_fd == -1) return NULL;
+    
+    if ((fstat(index_fd, &index_stat) == -1) || ((size_t)index_stat.st_size < sizeof(entry_index_header)))
+    {
+        close(index_fd);
+        return NULL;
+    }
+    index_map = mmap(NULL, (size_t)index_stat.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+    close(index_fd);
+    if (index_map == MAP_FAILED) return NULL;
+    *map_size = (size_t)index_stat.st_size;
+    
+    return (const unsigned char *)index_map;
+}
+
+/**************************************************************************************************
+ * Writes the given buffer to the sidecar file with the given suffix. It is written under a
+ * temporary name and renamed into place so that a reader never sees half of one.
+ *
+ * Returns true if the file was written, false if not.
+ **************************************************************************************************/
+static int write_index_file(olm_file_t *file, const char *suffix, const unsigned char *buffer, size_t buffer_size)
+{
+    char *index_path = NULL;
+    char *temp_path = NULL;
+    char temp_suffix[32];
+    int index_fd = -1;
+    int written = false;
+    
+    index_path = entry_index_path(file->filename, suffix);
+    snprintf(temp_suffix, sizeof(temp_suffix), "%s.%ld", suffix, (long)getpid());
+    temp_path = entry_index_path(file->filename, temp_suffix);
+    if ((index_path == NULL) || (temp_path == NULL)) goto bail_and_die;
+    
+    index_fd = open(temp_path, (O_WRONLY | O_CREAT | O_EXCL), 0644);
+    if (index_fd == -1) goto bail_and_die;
+    written = write_fully(index_fd, buffer, buffer_size);
+    if (close(index_fd) != 0) written = false;
+    if ((written == true) && (rename(temp_path, index_path) != 0)) written = false;
+    if (written == false) unlink(temp_path);
+    
+bail_and_die:
+    
+    if (temp_path != NULL) free(temp_path);
+    if (index_path != NULL) free(index_path);
+    
+    return written;
+}
+
+/**************************************************************************************************
+ * Returns the given filename with the given suffix added, which must be freed by the caller.
+ **************************************************************************************************/
+static char *entry_index_path(const char *olm_filename, const char *suffix)
+{
+    size_t name_len = strlen(olm_filename);
+    size_t suffix_len = strlen(suffix);
+    char *path = (char *)malloc(name_len + suffix_len + 1);
+    
+    if (path == NULL) return NULL;
+    memcpy(path, olm_filename, name_len);
+    memcpy((path + name_len), suffix, (suffix_len + 1));
+    
+    return path;
+}
+
+/**************************************************************************************************
+ * Fills in the part of an index header that identifies the archive as it is now.
+ **************************************************************************************************/
+static void fill_index_header(olm_file_t *file, const struct stat *archive_stat, entry_index_header *header)
+{
+    memset(header, 0, sizeof(entry_index_header));
+    header->signature = SIG_ENTRY_INDEX;
+    header->version = ENTRY_INDEX_VERSION;
+    header->archive_size = (uint64_t)archive_stat->st_size;
+    header->archive_mtime = (int64_t)archive_stat->st_mtime;
+    memcpy(&header->eocd_record, &file->eocd_rec32, sizeof(eocd_record32));
+    header->central_dir_offset = (uint64_t)file->central_dir_offset;
+    header->central_dir_size = file->central_dir_size;
+    header->total_entries = file->total_entries;
+}
+
+/**************************************************************************************************
+ * Writes a record for each entry in the given table to the given buffer, which must be big enough.
+ *
+ * Returns the number of bytes written.
+ **************************************************************************************************/
+static size_t add_index_records(entry_table *table, unsigned char *buffer)
+{
+    internal_archive_entry_data *entry = NULL;
+    entry_index_record record;
+    size_t offset = 0;
+    
+    for (uint64_t idx = 0; idx < table->count; idx++)
+    {
+        entry = &table->entries[idx];
+        memset(&record, 0, sizeof(entry_index_record));
+        record.entry_size = entry->entry_size;
+        record.entry_compressed_size = entry->entry_compressed_size;
+        record.file_offset = entry->file_offset;
+        record.crc32 = entry->crc32;
+        record.compression_method = (uint16_t)entry->compression_method;
+        record.flags = entry->flags;
+        record.attributes = entry->attributes;
+        record.path_length = (uint16_t)strlen(entry->raw_entry_path);
+        memcpy((buffer + offset), &record, sizeof(entry_index_record));
+        memcpy((buffer + offset + sizeof(entry_index_record)), entry->raw_entry_path, record.path_length);
+        offset += sizeof(entry_index_record) + record.path_length;
+    }
+    
+    return offset;
+}
+
+/**************************************************************************************************
+ * Reads the given number of records from the index into the given table, moving the records
+ * pointer on past them.
+ *
+ * Returns true on success or false if the records are truncated or there is not enough memory.
+ **************************************************************************************************/
+static int load_index_records(olm_file_t *file, entry_table *table, uint64_t count, const unsigned char **records, const unsigned char *records_end)
+{
+    internal_archive_entry_data entry;
+    entry_index_record record;
+    const unsigned char *curr = *records;
+    
+    /* Every record takes up at least its fixed part, so a bad count cannot make us reserve too much. */
+    if (count > ((uint64_t)(records_end - curr) / sizeof(entry_index_record))) return false;
+    if (entry_table_reserve(table, count) == false) return false;
+    
+    for (uint64_t idx = 0; idx < count; idx++)
+    {
+        if ((size_t)(records_end - curr) < sizeof(entry_index_record)) return false;
+        memcpy(&record, curr, sizeof(entry_index_record));
+        curr += sizeof(entry_index_record);
+        if ((record.path_length == 0) || ((size_t)(records_end - curr) < record.path_length)) return false;
+        
+        if (set_entry_path(file->entry_strings, &entry, (const char *)curr, record.path_length, record.attributes) == false) return false;
+        curr += record.path_length;
+        entry.entry_size = record.entry_size;
+        entry.entry_compressed_size = record.entry_compressed_size;
+        entry.file_offset = record.file_offset;
+        entry.crc32 = record.crc32;
+        entry.compression_method = record.compression_method;
+        entry.flags = record.flags;
+        if (entry_table_append(table, &entry) == false) return false;
+    }
+    
+    *records = curr;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Reads the messages of each category from the records of a category index into the given list
+ * (one per category).
+ *
+ * Returns true on success or false if the records are bad or there is not enough memory.
+ **************************************************************************************************/
+static int load_category_records(olm_file_t *file, category_members *members, const unsigned char *records, const unsigned char *records_end)
+{
+    const unsigned char *curr = records;
+    uint64_t count = 0;
+    
+    for (uint64_t idx = 0; idx < file->category_count; idx++)
+    {
+        if ((size_t)(records_end - curr) < sizeof(uint64_t)) return false;
+        memcpy(&count, curr, sizeof(uint64_t));
+        curr += sizeof(uint64_t);
+        if ((count > file->message_entries.count) || (count > ((uint64_t)(records_end - curr) / sizeof(uint64_t)))) return false;
+        if (count == 0) continue;
+        
+        members[idx].messages = (uint64_t *)malloc((size_t)(sizeof(uint64_t) * count));
+        if (members[idx].messages == NULL) return false;
+        memcpy(members[idx].messages, curr, (size_t)(sizeof(uint64_t) * count));
+        members[idx].count = count;
+        members[idx].capacity = count;
+        curr += sizeof(uint64_t) * count;
+        
+        /* Every message must be in the archive, in order. */
+        for (uint64_t member = 0; member < count; member++)
+        {
+            if (members[idx].messages[member] >= file->message_entries.count) return false;
+            if ((member > 0) && (members[idx].messages[member] <= members[idx].messages[member - 1])) return false;
+        }
+    }
+    
+    return (curr == records_end);
+}
@@ -0,0 +1,542 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * ioengine.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#endif
+#include "private.h"
+#include "libolmec.h"
+
+/* The deepest queue an engine will keep, and the most threads that are started to serve it when io_uring is not used. */
+#define IO_ENGINE_MAX_DEPTH                      4096
+#define IO_ENGINE_MAX_THREADS                    16
+
+/* The most that is asked for in one read, longer requests are finished off with more reads. */
+#define IO_ENGINE_MAX_READ_SIZE                  (1024 * 1024 * 1024)
+
+struct io_engine
+{
+    int fd;                                                         /* The archive. */
+    unsigned int outstanding;                                       /* Requests submitted and not yet handed back. */
+    io_request *pending_head;                                       /* Requests waiting to be issued, oldest first. */
+    io_request *pending_tail;
+    io_request *done_head;                                          /* Requests complete and waiting to be handed back. */
+    io_request *done_tail;
+#ifdef USE_IO_URING
+    int ring_fd;                                                    /* The io_uring instance, or -1 if the threads are used. */
+    int ring_failed;                                                /* Set if the ring stopped working, what is left is read here. */
+    unsigned int in_ring;                                           /* Requests issued to the ring and not yet complete. */
+    unsigned int unsubmitted;                                       /* Entries queued in the ring that the kernel has not seen. */
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+    pthread_mutex_t lock;                                           /* Guards the lists while the threads are running. */
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pthread_t *threads;
+    unsigned int thread_count;
+    int stopping;
+};
+
+static void *io_worker(void *arg);
+static void finish_read(io_engine *engine, io_request *request);
+static void push_request(io_request **head, io_request **tail, io_request *request);
+static io_request *pop_request(io_request **head, io_request **tail);
+#ifdef USE_IO_URING
+static int open_ring(io_engine *engine, unsigned int depth);
+static void close_ring(io_engine *engine);
+static void fill_ring(io_engine *engine);
+static void reclaim_ring(io_engine *engine);
+static void complete_ring_read(io_engine *engine, io_request *request, int result);
+static io_request *wait_ring(io_engine *engine);
+#endif
+
+/**************************************************************************************************
+ * Creates an engine that keeps up to depth reads from the given file in flight. If libolmec was
+ * configured with --enable-io-uring the reads go through an io_uring of that depth, unless the
+ * kernel does not allow one, in which case (or otherwise) they are shared out among a pool of
+ * threads. If not even one thread can be started the reads are made as they are submitted.
+ *
+ * Returns the engine or NULL if out of memory.
+ **************************************************************************************************/
+io_engine *io_engine_create(int fd, unsigned int depth)
+{
+    io_engine *engine = NULL;
+    unsigned int wanted = 0;
+    
+    if (depth == 0) depth = 1;
+    if (depth > IO_ENGINE_MAX_DEPTH) depth = IO_ENGINE_MAX_DEPTH;
+    
+    engine = (io_engine *)calloc(1, sizeof(io_engine));
+    if (engine == NULL) return NULL;
+    engine->fd = fd;
+    
+#ifdef USE_IO_URING
+    engine->ring_fd = -1;
+    if (open_ring(engine, depth) == true) return engine;
+#endif
+    
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->work_ready, NULL);
+    pthread_cond_init(&engine->work_done, NULL);
+    
+    wanted = (depth < IO_ENGINE_MAX_THREADS) ? depth : IO_ENGINE_MAX_THREADS;
+    engine->threads = (pthread_t *)malloc(sizeof(pthread_t) * wanted);
+    if (engine->threads == NULL) return engine;
+    for (; engine->thread_count < wanted; engine->thread_count++)
+    {
+        if (pthread_create(&engine->threads[engine->thread_count], NULL, io_worker, engine) != 0) break;
+    }
+    
+    return engine;
+}
+
+/**************************************************************************************************
+ * Queues a read of request->length bytes at request->offset into request->buffer. The request
+ * must be left alone until io_engine_wait() hands it back.
+ **************************************************************************************************/
+void io_engine_submit(io_engine *engine, io_request *request)
+{
+    request->done = 0;
+    request->error_code = OLM_ERROR_SUCCESS;
+    request->next = NULL;
+    engine->outstanding++;
+    
+#ifdef USE_IO_URING
+    if (engine->ring_fd != -1)
+    {
+        /* Reads are handed to the kernel in one go when the caller comes to wait for them. */
+        push_request(&engine->pending_head, &engine->pending_tail, request);
+        return;
+    }
+#endif
+    
+    if (engine->thread_count == 0)
+    {
+        finish_read(engine, request);
+        push_request(&engine->done_head, &engine->done_tail, request);
+        return;
+    }
+    
+    pthread_mutex_lock(&engine->lock);
+    push_request(&engine->pending_head, &engine->pending_tail, request);
+    pthread_cond_signal(&engine->work_ready);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**************************************************************************************************
+ * Waits for any one of the submitted reads to complete, in whatever order they do.
+ *
+ * Returns the request, with error_code set, or NULL if no reads are outstanding.
+ **************************************************************************************************/
+io_request *io_engine_wait(io_engine *engine)
+{
+    io_request *request = NULL;
+    
+    if (engine->outstanding == 0) return NULL;
+    
+#ifdef USE_IO_URING
+    if (engine->ring_fd != -1)
+    {
+        request = wait_ring(engine);
+        if (request != NULL) engine->outstanding--;
+        return request;
+    }
+#endif
+    
+    if (engine->thread_count == 0)
+    {
+        request = pop_request(&engine->done_head, &engine->done_tail);
+    }
+    else
+    {
+        pthread_mutex_lock(&engine->lock);
+        while (engine->done_head == NULL) pthread_cond_wait(&engine->work_done, &engine->lock);
+        request = pop_request(&engine->done_head, &engine->done_tail);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    engine->outstanding--;
+    
+    return request;
+}
+
+/**************************************************************************************************
+ * Destroys an engine. Any reads still outstanding are waited for first.
+ **************************************************************************************************/
+void io_engine_destroy(io_engine *engine)
+{
+    if (engine == NULL) return;
+    
+    while (io_engine_wait(engine) != NULL);
+    
+#ifdef USE_IO_URING
+    if (engine->ring_fd != -1)
+    {
+        close_ring(engine);
+        free(engine);
+        return;
+    }
+#endif
+    
+    pthread_mutex_lock(&engine->lock);
+    engine->stopping = true;
+    pthread_cond_broadcast(&engine->work_ready);
+    pthread_mutex_unlock(&engine->lock);
+    for (unsigned int idx = 0; idx < engine->thread_count; idx++) pthread_join(engine->threads[idx], NULL);
+    
+    if (engine->threads != NULL) free(engine->threads);
+    pthread_cond_destroy(&engine->work_done);
+    pthread_cond_destroy(&engine->work_ready);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine);
+}
+
+/**************************************************************************************************
+ * The body of each thread of the pool, which makes the reads on the pending list one at a time.
+ **************************************************************************************************/
+static void *io_worker(void *arg)
+{
+    io_engine *engine = (io_engine *)arg;
+    io_request *request = NULL;
+    
+    pthread_mutex_lock(&engine->lock);
+    for (;;)
+    {
+        while ((engine->pending_head == NULL) && (engine->stopping == false)) pthread_cond_wait(&engine->work_ready, &engine->lock);
+        if (engine->pending_head == NULL) break;
+        request = pop_request(&engine->pending_head, &engine->pending_tail);
+        pthread_mutex_unlock(&engine->lock);
+    
+        finish_read(engine, request);
+    
+        pthread_mutex_lock(&engine->lock);
+        push_request(&engine->done_head, &engine->done_tail, request);
+        pthread_cond_signal(&engine->work_done);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    
+    return NULL;
+}
+
+/**************************************************************************************************
+ * Reads whatever is left of the given request with blocking reads.
+ **************************************************************************************************/
+static void finish_read(io_engine *engine, io_request *request)
+{
+    if (read_fully(engine->fd, (request->buffer + request->done), (request->length - request->done), (off_t)(request->offset + request->done)) == false)
+    {
+        request->error_code = OLM_ERROR_FILE_IO_ERROR;
+        return;
+    }
+    request->done = request->length;
+}
+
+/**************************************************************************************************
+ * Adds a request to the end of a list.
+ **************************************************************************************************/
+static void push_request(io_request **head, io_request **tail, io_request *request)
+{
+    request->next = NULL;
+    if (*tail == NULL) *head = request;
+    else (*tail)->next = request;
+    *tail = request;
+}
+
+/**************************************************************************************************
+ * Takes the request from the front of a list.
+ *
+ * Returns the request or NULL if the list is empty.
+ **************************************************************************************************/
+static io_request *pop_request(io_request **head, io_request **tail)
+{
+    io_request *request = *head;
+    
+    if (request == NULL) return NULL;
+    *head = request->next;
+    if (*head == NULL) *tail = NULL;
+    request->next = NULL;
+    
+    return request;
+}
+
+#ifdef USE_IO_URING
+
+/**************************************************************************************************
+ * Sets up an io_uring of the given depth and maps its rings. This talks to the kernel directly
+ * rather than through liburing, which is only a thin wrapper for what is used here.
+ *
+ * Returns true on success or false if the kernel does not allow it (it may be too old or the
+ * system calls may be filtered out).
+ **************************************************************************************************/
+static int open_ring(io_engine *engine, unsigned int depth)
+{
+    struct io_uring_params params;
+    unsigned char *sq_ring = NULL;
+    unsigned char *cq_ring = NULL;
+    
+    memset(&params, 0, sizeof(params));
+    engine->ring_fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (engine->ring_fd == -1) return false;
+    
+    engine->sq_map_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+    engine->cq_map_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    /* Newer kernels let both rings be mapped at once. */
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {
+        if (engine->cq_map_size > engine->sq_map_size) engine->sq_map_size = engine->cq_map_size;
+        engine->cq_map_size = 0;
+    }
+    engine->sq_map = mmap(NULL, engine->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_map == MAP_FAILED)
+    {
+        engine->sq_map = NULL;
+        goto bail_and_die;
+    }
+    if (engine->cq_map_size > 0)
+    {
+        engine->cq_map = mmap(NULL, engine->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_CQ_RING);
+        if (engine->cq_map == MAP_FAILED)
+        {
+            engine->cq_map = NULL;
+            goto bail_and_die;
+        }
+    }
+    engine->sqes = (struct io_uring_sqe *)mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, engine->ring_fd, IORING_OFF_SQES);
+    if ((void *)engine->sqes == MAP_FAILED)
+    {
+        engine->sqes = NULL;
+        goto bail_and_die;
+    }
+    
+    sq_ring = (unsigned char *)engine->sq_map;
+    cq_ring = (engine->cq_map != NULL) ? (unsigned char *)engine->cq_map : sq_ring;
+    engine->sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+    engine->sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    engine->sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    engine->sq_entries = params.sq_entries;
+    engine->cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+    engine->cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    engine->cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    
+    return true;
+
+bail_and_die:
+    
+    close_ring(engine);
+    
+    return false;
+}
+
+/**************************************************************************************************
+ * Unmaps the rings and closes the io_uring, leaving the engine to use threads.
+ **************************************************************************************************/
+static void close_ring(io_engine *engine)
+{
+    if (engine->sqes != NULL) munmap(engine->sqes, engine->sqes_size);
+    if (engine->cq_map != NULL) munmap(engine->cq_map, engine->cq_map_size);
+    if (engine->sq_map != NULL) munmap(engine->sq_map, engine->sq_map_size);
+    engine->sqes = NULL;
+    engine->cq_map = NULL;
+    engine->sq_map = NULL;
+    if (engine->ring_fd != -1) close(engine->ring_fd);
+    engine->ring_fd = -1;
+}
+
+/**************************************************************************************************
+ * Moves as many pending requests into the submission ring as it has room for. Once the ring has
+ * failed they are read here instead.
+ **************************************************************************************************/
+static void fill_ring(io_engine *engine)
+{
+    struct io_uring_sqe *sqe = NULL;
+    io_request *request = NULL;
+    unsigned int tail = *engine->sq_tail;
+    size_t length = 0;
+    
+    while ((engine->pending_head != NULL) && ((engine->ring_failed == true) || (engine->in_ring < engine->sq_entries)))
+    {
+        request = pop_request(&engine->pending_head, &engine->pending_tail);
+        if (engine->ring_failed == true)
+        {
+            finish_read(engine, request);
+            push_request(&engine->done_head, &engine->done_tail, request);
+            continue;
+        }
+    
+        length = request->length - request->done;
+        if (length > IO_ENGINE_MAX_READ_SIZE) length = IO_ENGINE_MAX_READ_SIZE;
+        sqe = &engine->sqes[tail & *engine->sq_mask];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = engine->fd;
+        sqe->off = request->offset + request->done;
+        sqe->addr = (uint64_t)(uintptr_t)(request->buffer + request->done);
+        sqe->len = (uint32_t)length;
+        sqe->user_data = (uint64_t)(uintptr_t)request;
+        engine->sq_array[tail & *engine->sq_mask] = tail & *engine->sq_mask;
+        tail++;
+        engine->in_ring++;
+        engine->unsubmitted++;
+    }
+    __atomic_store_n(engine->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/**************************************************************************************************
+ * Takes back the entries in the submission ring that the kernel has not picked up, after it has
+ * refused them, and reads them here.
+ **************************************************************************************************/
+static void reclaim_ring(io_engine *engine)
+{
+    io_request *request = NULL;
+    unsigned int head = __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *engine->sq_tail;
+    
+    for (unsigned int pos = head; pos != tail; pos++)
+    {
+        request = (io_request *)(uintptr_t)engine->sqes[engine->sq_array[pos & *engine->sq_mask]].user_data;
+        finish_read(engine, request);
+        push_request(&engine->done_head, &engine->done_tail, request);
+        engine->in_ring--;
+    }
+    __atomic_store_n(engine->sq_tail, head, __ATOMIC_RELEASE);
+    engine->unsubmitted = 0;
+}
+
+/**************************************************************************************************
+ * Deals with the completion of a read issued to the ring. A short read is carried on with another,
+ * and a read that the kernel cannot do through the ring (it may be too old for IORING_OP_READ) is
+ * done here instead.
+ **************************************************************************************************/
+static void complete_ring_read(io_engine *engine, io_request *request, int result)
+{
+    if ((result == -EINTR) || (result == -EAGAIN))
+    {
+        push_request(&engine->pending_head, &engine->pending_tail, request);
+        return;
+    }
+    if ((result == -EINVAL) || (result == -EOPNOTSUPP))
+    {
+        finish_read(engine, request);
+        push_request(&engine->done_head, &engine->done_tail, request);
+        return;
+    }
+    
+    /* A read that comes back with nothing has run into the end of the file. */
+    if (result <= 0)
+    {
+        request->error_code = OLM_ERROR_FILE_IO_ERROR;
+        push_request(&engine->done_head, &engine->done_tail, request);
+        return;
+    }
+    
+    request->done += (size_t)result;
+    if (request->done < request->length) push_request(&engine->pending_head, &engine->pending_tail, request);
+    else push_request(&engine->done_head, &engine->done_tail, request);
+}
+
+/**************************************************************************************************
+ * Issues the pending requests to the ring and reaps completions until one of the requests is done.
+ *
+ * Returns the request, or NULL if there are none left in the ring.
+ **************************************************************************************************/
+static io_request *wait_ring(io_engine *engine)
+{
+    struct io_uring_cqe *cqe = NULL;
+    unsigned int head = 0;
+    int submitted = 0;
+    
+    for (;;)
+    {
+        if (engine->done_head != NULL) return pop_request(&engine->done_head, &engine->done_tail);
+        fill_ring(engine);
+        if (engine->done_head != NULL) continue;
+        if (engine->in_ring == 0) return NULL;
+    
+        head = *engine->cq_head;
+        if (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &engine->cqes[head & *engine->cq_mask];
+            engine->in_ring--;
+            complete_ring_read(engine, (io_request *)(uintptr_t)cqe->user_data, cqe->res);
+            __atomic_store_n(engine->cq_head, (head + 1), __ATOMIC_RELEASE);
+            continue;
+        }
+    
+        /* Hand over everything queued and wait for at least one read to complete, in a single call. */
+        submitted = (int)syscall(__NR_io_uring_enter, engine->ring_fd, engine->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted >= 0)
+        {
+            engine->unsubmitted -= ((unsigned int)submitted < engine->unsubmitted) ? (unsigned int)submitted : engine->unsubmitted;
+            continue;
+        }
+        if (errno == EINTR) continue;
+    
+        /* Whatever the kernel has not taken is read here from now on. */
+        if (engine->unsubmitted > 0)
+        {
+            engine->ring_failed = true;
+            reclaim_ring(engine);
+            continue;
+        }
+    
+        /* The reads the kernel has taken go on writing into the callers' buffers until they complete, so they are waited
+           for however the ring fails; handing them back early would let the buffers be freed (or the ring closed) under
+           them. */
+        sched_yield();
+    }
+}
+
+#endif
@@ -19,34 +19,60 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <zlib.h>
 #include <time.h>
+#include <pthread.h>
 #include <libxml/xmlreader.h>
-#include <simclist.h>
 #include "private.h"
 #include "libolmec.h"
 
-int get_eocd_record(olm_file_t *zipfile, eocd_record32 *eocd_record);
-int get_eocdr64_locator(olm_file_t *zipfile, eocdr_locator64 *eocdr_locator, size_t comment_length);
+/* The text that the fields missing from a message are pointed at. It is shared by every message, so it must not be written
+   to (or freed). */
+static const char no_address[] = NO_ADDRESS;
+static const char no_subject[] = NO_SUBJECT;
+static const char no_message_id[] = NO_MID;
+static const char no_message_body[] = NO_MESSAGE_BODY;
+
+unsigned char *read_tail_block(olm_file_t *zipfile, off_t file_size, size_t *block_len);
+int get_eocd_record(olm_file_t *zipfile, const unsigned char *tail, size_t tail_len, eocd_record32 *eocd_record, size_t *record_pos);
+int get_eocdr64_locator(const unsigned char *tail, size_t record_pos, eocdr_locator64 *eocdr_locator);
 int get_eocd64_record(olm_file_t *zipfile, eocd_record64 *eocd_record, off_t search_offset);
-internal_archive_entry_data *read_next_entry_from_central_dir(olm_file_t *file, int *error);
+int read_central_dir(olm_file_t *file);
+int read_next_entry_from_central_dir(olm_file_t *file, size_t *cdr_offset, internal_archive_entry_data *entry);
 int is_message(internal_archive_entry_data *entry);
 int is_attachment(internal_archive_entry_data *entry);
 int ends_with_attachment_suffix(const char *filename);
-void free_entry_from_central_dir(internal_archive_entry_data *entry);
-ssize_t read_out_extra_field(olm_file_t *zf, extra_field_header *buffer);
-int parse_element_names(xmlNode * a_node, olm_mail_message_t *message);
+ssize_t read_out_extra_field(const unsigned char *data, size_t data_len, extra_field_header *buffer);
+int parse_message_xml(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena, unsigned int fields, const olm_query_t *query);
+unsigned int capture_field_mask(int capture_field);
+unsigned int container_field_mask(int container);
+int read_email_address(xmlTextReaderPtr reader, olm_arena_t *arena, char **address_list);
+int read_attachment(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena);
+int read_category(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena);
+static int read_digits(const char *text, int count, int *value);
+static uint64_t hash_entry_path(const char *path);
+int store_captured_text(message_parse_state *state, olm_mail_message_t *message);
 ssize_t index_of_last(const char *str, char c);
-char *allocate_block_for_buffer(size_t buff_size, size_t *block_size, size_t *block_count);
+int copy_archive_range(olm_file_t *file, uint64_t offset, uint64_t length, int dest_fd, uint32_t *crc);
+ssize_t kernel_copy(int src_fd, off_t src_offset, int dest_fd, size_t length);
+int inflate_archive_entry(olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int dest_fd, int verify);
 
 /******************************************************************************************************************************
  * Opens an OLM file for reading.
@@ -68,8 +94,11 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
     struct stat stat_buff;
     uint32_t signature = 0;
     olm_file_t *file = NULL;
-    internal_archive_entry_data *entry_buff = NULL;
-    int magic_entries_found = 0;
+    unsigned char *tail_block = NULL;
+    size_t tail_len = 0;
+    size_t eocd_pos = 0;
+    uint64_t central_dir_limit = 0;
+    int index_loaded = false;
     
     // The most likley cause of failure.
     *error_code = OLM_ERROR_FILE_CORRUPTED;
@@ -95,6 +124,12 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
         return INVALID_OLM_FILE;
     }
     memset(file, 0, sizeof (olm_file_t));
+    pthread_mutex_init(&file->contacts_lock, NULL);
+    pthread_mutex_init(&file->categories_lock, NULL);
+    pthread_mutex_init(&file->search_lock, NULL);
+    
+    /* Make sure libxml2 has set up its global state before any threads use this file. */
+    xmlInitParser();
     
     /* Store the filename/char object. */
     file->filename = (char *) malloc(strlen(olm_filename) + 1);
@@ -114,8 +149,21 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
         goto bail_and_die;
     }
     
+    /* Map the whole file if we have been asked to. */
+    if ((opts & OLM_OPT_MMAP) == OLM_OPT_MMAP)
+    {
+        void *map = mmap(NULL, (size_t)file_size, PROT_READ, MAP_SHARED, file->file_seg, 0);
+        if (map == MAP_FAILED)
+        {
+            *error_code = OLM_ERROR_FILE_IO_ERROR;
+            goto bail_and_die;
+        }
+        file->file_map = (const unsigned char *)map;
+        file->map_size = (size_t)file_size;
+    }
+    
     /* Look for the magic number in the first four bytes of the file. */
-    if (read(file->file_seg, &signature, 4) != 4)
+    if (read_fully(file->file_seg, &signature, 4, 0) == false)
     {
         *error_code = OLM_ERROR_FILE_IO_ERROR;
         goto bail_and_die;
@@ -126,8 +174,16 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
         goto bail_and_die;
     }
     
+    /* The end of central directory record and the ZIP64 locator (if any) are both near the end of the file, so read it all in one go. */
+    tail_block = read_tail_block(file, file_size, &tail_len);
+    if (tail_block == NULL)
+    {
+        *error_code = (errno == ENOMEM) ? OLM_ERROR_NO_MEMORY : OLM_ERROR_FILE_IO_ERROR;
+        goto bail_and_die;
+    }
+    
     /* Now sniff for the end of central directory record that should be found 22 bytes from the end of the file (unless a comment is present). */
-    if (get_eocd_record(file, &file->eocd_rec32) == false)
+    if (get_eocd_record(file, tail_block, tail_len, &file->eocd_rec32, &eocd_pos) == false)
     {
         *error_code = OLM_ERROR_NOT_OLM_FILE;
         goto bail_and_die;
@@ -136,11 +192,12 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
     /* Get the data we need. */
     file->central_dir_size = file->eocd_rec32.central_dir_size;
     file->central_dir_offset = file->eocd_rec32.central_dir_offset;
+    central_dir_limit = (uint64_t)(file_size - (off_t)tail_len) + eocd_pos;
     
     /* Now look for a ZIP64 EOCDR locator record. */
     memset(&file->eocd_loc64, 0, sizeof (file->eocd_loc64));
     /* Check if we have a zip64 archive. */
-    if (get_eocdr64_locator(file, &file->eocd_loc64, file->eocd_rec32.comment_length) == true)
+    if (get_eocdr64_locator(tail_block, eocd_pos, &file->eocd_loc64) == true)
     {
         file->zip64 = true;
         file->total_segments = file->eocd_loc64.total_segments;
@@ -153,6 +210,8 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
         file->current_segment = file->eocd_rec32.this_segment + 1;
         file->total_entries = file->eocd_rec32.total_entries;
     }
+    free(tail_block);
+    tail_block = NULL;
     
     /* Ontain the ZIP64 end of central directory if present. */
     if (file->zip64)
@@ -163,6 +222,7 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
             file->total_entries = file->eocd_rec64.total_entries;
             file->central_dir_size = file->eocd_rec64.central_directory_size;
             file->central_dir_offset = (off_t)file->eocd_rec64.central_directory_offset;
+            if (file->eocd_loc64.zip64_EOCDR_offset < central_dir_limit) central_dir_limit = file->eocd_loc64.zip64_EOCDR_offset;
         }
         else
         {
@@ -172,79 +232,129 @@ olm_file_t *olm_open_file(const char *olm_filename, int opts, int *error_code)
         }
     }
 
-    /* Now we must seek to, read out and parse the central directory. */
-    if (lseek(file->file_seg, file->central_dir_offset, SEEK_SET) == -1)
+    /* Make sure there is a central directory to read. */
+    if ((file->total_entries == 0) || (file->central_dir_size == 0))
     {
-        *error_code = OLM_ERROR_FILE_IO_ERROR;
+        *error_code = OLM_ERROR_NOT_OLM_FILE;
+        goto bail_and_die;
+    }
+    
+    /* The central directory must lie before the record that ends it and have room for all of its entries, otherwise a
+       damaged archive could have us try to allocate far more memory than the file could ever need. */
+    if ((file->central_dir_offset < 0) ||
+        (file->central_dir_size > central_dir_limit) ||
+        ((uint64_t)file->central_dir_offset > (central_dir_limit - file->central_dir_size)) ||
+        (file->total_entries > (file->central_dir_size / sizeof(central_dir_entry_header))))
+    {
+        *error_code = OLM_ERROR_FILE_CORRUPTED;
+        goto bail_and_die;
+    }
+    
+    /* The entry paths take up roughly as much room as the central directory does. */
+    file->entry_strings = arena_create((size_t)file->central_dir_size);
+    if (file->entry_strings == NULL)
+    {
+        *error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    /* A sidecar index saves walking the central directory again if the archive has not changed since it was written. */
+    if ((opts & OLM_OPT_INDEX) == OLM_OPT_INDEX) index_loaded = load_entry_index(file, &stat_buff);
+    if (index_loaded == false)
+    {
+        *error_code = read_central_dir(file);
+        if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
+        if ((opts & OLM_OPT_INDEX) == OLM_OPT_INDEX) save_entry_index(file, &stat_buff);
+    }
+    
+    /* Attachments are looked up by the path that their messages give for them. */
+    if (build_entry_lookup(&file->attachment_lookup, &file->attachment_entries) == false)
+    {
+        *error_code = OLM_ERROR_NO_MEMORY;
         goto bail_and_die;
     }
     
-    /* Initialise the vectors. */
-    list_init(&file->message_entries);
-    list_init(&file->attachment_entries);
-    list_init(&file->contact_entries);
+    /* Store the options. */
+    file->options = opts;
+        
+    *error_code = OLM_ERROR_SUCCESS;
+    return file;
+    
+bail_and_die:
+    
+    if (tail_block != NULL) free(tail_block);
+    olm_close_file(file);
+        
+    return INVALID_OLM_FILE;
+}
+
+/**************************************************************************************************
+ * Reads the central directory in one go and walks it from memory, sorting the entries we want into
+ * the message and attachment tables. The cdr_buffer is released again once it has been walked.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int read_central_dir(olm_file_t *file)
+{
+    internal_archive_entry_data entry;
+    entry_table *dest = NULL;
+    arena_block *mark_block = NULL;
+    size_t mark_used = 0;
+    int magic_entries_found = 0;
+    size_t cdr_offset = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    file->cdr_buffer = (unsigned char *)malloc(file->central_dir_size);
+    if (file->cdr_buffer == NULL) return OLM_ERROR_NO_MEMORY;
+    if (read_fully(file->file_seg, file->cdr_buffer, file->central_dir_size, file->central_dir_offset) == false) return OLM_ERROR_FILE_IO_ERROR;
     
     for (uint64_t idx = 0; idx < file->total_entries; idx++)
     {
-        entry_buff = read_next_entry_from_central_dir(file, error_code);
-        if (entry_buff == NULL) goto bail_and_die;
+        /* Remember where the strings of this entry will start, so they can be given back if it is not kept. */
+        mark_block = file->entry_strings->current;
+        mark_used = mark_block->used;
+        error_code = read_next_entry_from_central_dir(file, &cdr_offset, &entry);
+        if (error_code != OLM_ERROR_SUCCESS) return error_code;
         
-        if (strcmp(entry_buff->raw_entry_path, "Categories.xml") == 0)
+        dest = NULL;
+        if (strcmp(entry.raw_entry_path, "Categories.xml") == 0)
         {
+            /* The category list is only read when it is first asked for. */
             magic_entries_found |= 4;
-            free_entry_from_central_dir(entry_buff);
-            continue;
+            if (file->category_entries.count == 0) dest = &file->category_entries;
         }
-        
-        if (strcmp(entry_buff->raw_entry_path, "Local/Address Book/Contacts.xml") == 0)
+        else if (strcmp(entry.raw_entry_path, "Local/Address Book/Contacts.xml") == 0)
         {
-            /* TODO: Process contacts. */
-            free_entry_from_central_dir(entry_buff);
-            continue;
+            /* The contacts in it are only found when they are first asked for. */
+            if (file->contact_entries.count == 0) dest = &file->contact_entries;
         }
-        
-        /* Discard directories and invalid files.*/
-        if (entry_buff->is_directory == true)
+        else if (entry.is_directory == true)
         {
-            if (strncmp(entry_buff->raw_entry_path, "Accounts", 8) == 0) magic_entries_found |= 1;
-            if (strncmp(entry_buff->raw_entry_path, "Local", 5) == 0) magic_entries_found |= 2;
-            free_entry_from_central_dir(entry_buff);
-            continue;
+            /* Discard directories, but note the ones that every olm file has. */
+            if (strncmp(entry.raw_entry_path, "Accounts", 8) == 0) magic_entries_found |= 1;
+            if (strncmp(entry.raw_entry_path, "Local", 5) == 0) magic_entries_found |= 2;
         }
-        
-        /* Look for and store messages. */
-        if (is_message(entry_buff) == true)
+        else if (is_message(&entry) == true)
         {
-            list_append(&file->message_entries, entry_buff);
-            continue;
+            dest = &file->message_entries;
         }
-        if (is_attachment(entry_buff) == true)
+        else if (is_attachment(&entry) == true)
         {
-            list_append(&file->attachment_entries, entry_buff);
-            continue;
+            dest = &file->attachment_entries;
         }
         
-        /* Make sure anything we missed gets freed. */
-        free_entry_from_central_dir(entry_buff);
-    }
-    
-    if (magic_entries_found != 7)
-    {
-        *error_code = OLM_ERROR_NOT_OLM_FILE;
-        goto bail_and_die;
+        /* Store the messages and attachments, anything else gives its strings back. */
+        if (dest == NULL) arena_rewind(file->entry_strings, mark_block, mark_used);
+        else if (entry_table_append(dest, &entry) == false) return OLM_ERROR_NO_MEMORY;
     }
     
-    /* Store the options. */
-    file->options = opts;
-        
-    *error_code = OLM_ERROR_SUCCESS;
-    return file;
+    /* Everything we need has been copied out of the central directory. */
+    free(file->cdr_buffer);
+    file->cdr_buffer = NULL;
     
-bail_and_die:
+    if (magic_entries_found != 7) return OLM_ERROR_NOT_OLM_FILE;
     
-    olm_close_file(file);
-        
-    return INVALID_OLM_FILE;
+    return OLM_ERROR_SUCCESS;
 }
 
 int is_message(internal_archive_entry_data *entry)
@@ -312,611 +422,950 @@ int ends_with_attachment_suffix(const char *filename)
 
 olm_mail_message_t *olm_get_message_at(olm_file_t *file, uint64_t index, int *error_code)
 {
+    return olm_get_message_fields_at(file, index, OLM_FIELD_ALL, NULL, error_code);
+}
+
+/******************************************************************************************************************************
+ * Parses the message at the given index into the given arena. Nothing needs to be freed for the message, it lasts until the
+ * arena is reset or destroyed. An arena that is reused for each message avoids the allocations that olm_get_message_at()
+ * makes for them. An arena must not be used by more than one thread at a time.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the message from.
+ *   index          The index of the message.
+ *   arena          The arena to hold the message, as returned by olm_arena_create().
+ *   error_code     Receives OLM_ERROR_SUCCESS or an error code.
+ *
+ * Returns:
+ *
+ *   The message or INVALID_OLM_MESSAGE on error.
+ ******************************************************************************************************************************/
+olm_mail_message_t *olm_get_message_at_in_arena(olm_file_t *file, uint64_t index, olm_arena_t *arena, int *error_code)
+{
+    if (arena == NULL)
+    {
+        *error_code = OLM_ERROR_INVALID_PARAMETER;
+        return INVALID_OLM_MESSAGE;
+    }
+    
+    return olm_get_message_fields_at(file, index, OLM_FIELD_ALL, arena, error_code);
+}
+
+/******************************************************************************************************************************
+ * Parses only the given fields of the message at the given index. The elements holding any other fields are skipped without
+ * their text being collected, and parsing stops as soon as every wanted field has been seen, so asking for just the headers
+ * avoids most of the work of parsing a message.
+ *
+ * String fields that were not asked for are left NULL and other fields are left 0. As the whole message is not necessarily
+ * read, its CRC is only checked when the body is asked for.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to read the message from.
+ *   index          The index of the message.
+ *   fields         The fields wanted, any of the OLM_FIELD_* values or'ed together.
+ *   arena          The arena to hold the message (see olm_get_message_at_in_arena()), or NULL for the message to be freed
+ *                  with olm_message_free() as usual.
+ *   error_code     Receives OLM_ERROR_SUCCESS or an error code.
+ *
+ * Returns:
+ *
+ *   The message or INVALID_OLM_MESSAGE on error.
+ ******************************************************************************************************************************/
+olm_mail_message_t *olm_get_message_fields_at(olm_file_t *file, uint64_t index, unsigned int fields, olm_arena_t *arena, int *error_code)
+{
+    internal_archive_entry_data *entry = NULL;
     olm_mail_message_t *message = NULL;
-    char *message_data = NULL;
-    uint32_t local_header_sig = 0;
-    uint16_t filename_len = 0;
-    uint16_t extra_len = 0;
-    char *data_buffer = NULL;
-    xmlDoc *doc = NULL;
-    xmlNode *root_node = NULL;
-    size_t data_len = 0;
-    
-    message = (olm_mail_message_t *)malloc(sizeof(olm_mail_message_t));
-    if (message == NULL)
+    
+    if (file == NULL)
+    {
+        *error_code = OLM_ERROR_INVALID_PARAMETER;
+        return INVALID_OLM_MESSAGE;
+    }
+    
+    if (index >= file->message_entries.count)
+    {
+        *error_code = OLM_ERROR_INVALID_PARAMETER;
+        return INVALID_OLM_MESSAGE;
+    }
+    entry = &file->message_entries.entries[index];
+    
+    if (arena != NULL) return get_message(file, entry, NULL, arena, (fields & OLM_FIELD_ALL), NULL, error_code);
+    
+    /* The message gets an arena of its own, the text in it is never bigger than the XML it came from so
+       this is usually the only block it needs. */
+    arena = arena_create(sizeof(olm_mail_message_t) + (size_t)entry->entry_size + MESSAGE_ARENA_SLACK);
+    if (arena == NULL)
     {
         *error_code = OLM_ERROR_NO_MEMORY;
         return INVALID_OLM_MESSAGE;
     }
     
-    /* Set up the message block with plain vanilla values. */
-    memset(message, 0, sizeof(olm_mail_message_t));
+    message = get_message(file, entry, NULL, arena, (fields & OLM_FIELD_ALL), NULL, error_code);
+    if (message == INVALID_OLM_MESSAGE) arena_destroy(arena);
+    
+    return message;
+}
+
+/******************************************************************************************************************************
+ * Checks the CRC of the message at the given index, even if the file was opened with OLM_OPT_SKIP_CRC. Opening a trusted
+ * archive with OLM_OPT_SKIP_CRC and calling this later (or never) puts off the cost of checking it.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file that holds the message.
+ *   index          The index of the message.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_MESSAGE_CORRUPTED if the CRC is wrong or another error code.
+ ******************************************************************************************************************************/
+int olm_verify_message_at(olm_file_t *file, uint64_t index)
+{
+    internal_archive_entry_data *entry = NULL;
+    uint64_t data_offset = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if ((file == NULL) || (index >= file->message_entries.count)) return OLM_ERROR_INVALID_PARAMETER;
+    entry = &file->message_entries.entries[index];
+    
+    error_code = get_entry_data_offset(file, entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
     
-    /* Get the entry and process it. */
-    internal_archive_entry_data *entry = (internal_archive_entry_data *)list_get_at(&file->message_entries, index);
-    if (entry == NULL)
+    return verify_entry_crc(file, entry, data_offset, OLM_ERROR_MESSAGE_CORRUPTED);
+}
+
+/**************************************************************************************************
+ * Reads and parses the given fields (OLM_FIELD_*) of the given message entry, everything for the
+ * message is allocated from the given arena. If the (compressed) data of the entry has already been
+ * read it is taken from entry_data, which must hold all of it, rather than the archive. If a query is given, the fields it looks at must be
+ * among those asked for and a message that does not match it fails with MESSAGE_FILTERED_OUT. On
+ * error anything taken from the arena is given back to it.
+ **************************************************************************************************/
+olm_mail_message_t *get_message(olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, olm_arena_t *arena, unsigned int fields, const olm_query_t *query, int *error_code)
+{
+    olm_mail_message_t *message = NULL;
+    arena_block *mark_block = arena->current;
+    size_t mark_used = arena->current->used;
+    uint64_t data_offset = 0;
+    const char *data_buffer = NULL;
+    xmlTextReaderPtr reader = NULL;
+    entry_stream stream;
+    int streaming = false;
+    int verify = (((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC) && ((fields & OLM_FIELD_BODY) != 0));
+    int parse_options = 0;
+    
+    message = (olm_mail_message_t *)arena_alloc(arena, sizeof(olm_mail_message_t));
+    if (message == NULL)
     {
         *error_code = OLM_ERROR_NO_MEMORY;
         goto bail_and_die;
     }
-    printf("+ Getting data from file %s\n", entry->raw_entry_path);
-    if (entry->compression_method != ZIP_CA_STORED)
+    
+    /* Set up the message block with plain vanilla values. */
+    memset(message, 0, sizeof(olm_mail_message_t));
+    message->__private = arena;
+    
+    if ((entry->compression_method != ZIP_CA_STORED) && (entry->compression_method != ZIP_CA_DEFLATE))
     {
         *error_code = OLM_ERROR_MESSAGE_CORRUPTED;
-        goto bail_and_die; /* OLM files should not use compression for messages. */
+        goto bail_and_die; /* OLM files only use compression for messages if they have been zipped up again. */
     }
-    /* Allocate a buffer for the message data. */
-    message_data = (char *)malloc(entry->entry_size);
-    if (message_data == NULL)
+    /* We must now skip the (redundant) local header, unless the caller has already done so. */
+    if (entry_data == NULL)
     {
-        *error_code = OLM_ERROR_NO_MEMORY;
-        goto bail_and_die;
+        *error_code = get_entry_data_offset(file, entry, &data_offset);
+        if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
     }
-    /* Now read it from the olm file. */
-    if (lseek(file->file_seg, (off_t)entry->file_offset, SEEK_SET) == -1)
+    /* Now get the actual data out. Deflated data is inflated straight into the parser a window at a time, stored data
+       comes straight from the mapping if there is one. */
+    if (entry->compression_method == ZIP_CA_DEFLATE)
     {
-        *error_code = OLM_ERROR_FILE_IO_ERROR;
-        goto bail_and_die;
+        streaming = true;
+        *error_code = entry_stream_open(&stream, file, entry, data_offset, verify, OLM_ERROR_MESSAGE_CORRUPTED);
+        if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
+        stream.source = entry_data;
     }
-    /* We must now skip the (redundant) local header. */
-    /* all the following error (bar two) will due to an IO error. */
-    *error_code = OLM_ERROR_FILE_IO_ERROR;
-    if (read(file->file_seg, &local_header_sig, 4) != 4) goto bail_and_die;
-    if (local_header_sig != SIG_LOCAL_FILE_HEADER)  /* Just to make sure. */
+    else if (entry_data != NULL)
     {
-        *error_code = OLM_ERROR_FILE_CORRUPTED;
-        goto bail_and_die;
+        data_buffer = (const char *)entry_data;
     }
-    if (lseek(file->file_seg, 22, SEEK_CUR) == -1) goto bail_and_die;
-    if ((read(file->file_seg, &filename_len, 2) != 2) || (read(file->file_seg, &extra_len, 2) != 2)) goto bail_and_die;
-    if (lseek(file->file_seg, (filename_len + extra_len), SEEK_CUR) == -1) goto bail_and_die;
-    /* Now get the actual data out. */
-    data_buffer = (char *)malloc(entry->entry_size);
-    if (data_buffer == NULL)
+    else if (file->file_map != NULL)
     {
-        *error_code = OLM_ERROR_NO_MEMORY;
-        goto bail_and_die;
+        data_buffer = (const char *)(file->file_map + data_offset);
     }
-    if (read(file->file_seg, data_buffer, entry->entry_size) != entry->entry_size) goto  bail_and_die;
-    /* Check the data. */
-    if (crc32(0, data_buffer, entry->entry_size) != entry->crc32)
+    else
     {
-        *error_code = OLM_ERROR_MESSAGE_CORRUPTED;
-        goto bail_and_die;
+        /* The read buffer is kept with the arena and only replaced when a bigger message comes along. */
+        if (arena->io_buffer_size < entry->entry_size)
+        {
+            if (arena->io_buffer != NULL) free(arena->io_buffer);
+            arena->io_buffer_size = 0;
+            arena->io_buffer = (unsigned char *)malloc(entry->entry_size);
+            if (arena->io_buffer == NULL)
+            {
+                *error_code = OLM_ERROR_NO_MEMORY;
+                goto bail_and_die;
+            }
+            arena->io_buffer_size = entry->entry_size;
+        }
+        *error_code = OLM_ERROR_FILE_IO_ERROR;
+        if (read_fully(file->file_seg, arena->io_buffer, entry->entry_size, (off_t)data_offset) == false) goto  bail_and_die;
+        data_buffer = (const char *)arena->io_buffer;
     }
-    /* Now read the XML. */
-    if ((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS)
+    /* Check the data, unless we have been told not to or will only be looking at part of it (the stream checks deflated data). */
+    if ((streaming == false) && (verify == true) && (compute_crc32(0, (const unsigned char *)data_buffer, entry->entry_size) != entry->crc32))
     {
-        doc = xmlReadMemory(data_buffer, entry->entry_size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+        *error_code = OLM_ERROR_MESSAGE_CORRUPTED;
+        goto bail_and_die;
     }
-    else
+    /* Now read the XML, in a single forward pass without building a tree. The reader is reused if the arena has one. */
+    if ((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) parse_options = XML_PARSE_RECOVER | XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
+    if (streaming == true)
     {
-        doc = xmlParseMemory(data_buffer, entry->entry_size);
+        if (arena->reader == NULL)
+        {
+            arena->reader = xmlReaderForIO(read_entry_stream, NULL, &stream, NULL, NULL, parse_options);
+        }
+        else if (xmlReaderNewIO(arena->reader, read_entry_stream, NULL, &stream, NULL, NULL, parse_options) != 0)
+        {
+            xmlFreeTextReader(arena->reader);
+            arena->reader = NULL;
+        }
     }
-    *error_code = OLM_ERROR_MESSAGE_CORRUPTED;
-    if (doc == NULL) goto bail_and_die;
-    root_node = xmlDocGetRootElement(doc);
-    if (root_node == NULL) goto bail_and_die;
-    *error_code = parse_element_names(root_node, message);
-    if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
-    /*free the document */
-    xmlFreeDoc(doc);
-    xmlCleanupParser();
-    
-    /* Make sure all the fields are allocated. */
-    *error_code = OLM_ERROR_NO_MEMORY;
-    if (message->to == NULL)
+    else if (arena->reader == NULL)
     {
-        data_len = strlen(NO_ADDRESS) + 2;
-        message->to = (char *)malloc(data_len);
-        if (message->to == NULL) goto bail_and_die;
-        memset(message->to, 0, data_len);
-        strncpy(message->to, NO_ADDRESS, data_len);
+        arena->reader = xmlReaderForMemory(data_buffer, (int)entry->entry_size, NULL, NULL, parse_options);
     }
-    if (message->from == NULL)
+    else if (xmlReaderNewMemory(arena->reader, data_buffer, (int)entry->entry_size, NULL, NULL, parse_options) != 0)
     {
-        data_len = strlen(NO_ADDRESS) + 2;
-        message->from = (char *)malloc(data_len);
-        if (message->from == NULL) goto bail_and_die;
-        memset(message->from, 0, data_len);
-        strncpy(message->from, NO_ADDRESS, data_len);
+        xmlFreeTextReader(arena->reader);
+        arena->reader = NULL;
     }
-    if (message->reply_to == NULL)
+    reader = arena->reader;
+    if (reader == NULL)
     {
-        data_len = strlen(NO_ADDRESS) + 2;
-        message->reply_to = (char *)malloc(data_len);
-        if (message->reply_to == NULL) goto bail_and_die;
-        memset(message->reply_to, 0, data_len);
-        strncpy(message->reply_to, NO_ADDRESS, data_len);
+        *error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
     }
-    if (message->subject == NULL)
+    *error_code = parse_message_xml(reader, message, arena, fields, query);
+    /* If the data could not be inflated that is what the parser tripped over. */
+    if ((streaming == true) && (stream.error_code != OLM_ERROR_SUCCESS)) *error_code = stream.error_code;
+    if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
+    /* The parser may stop before the end of the data, the rest of a deflated message is inflated to check its CRC. */
+    if ((streaming == true) && (verify == true))
     {
-        data_len = strlen(NO_SUBJECT) + 2;
-        message->subject = (char *)malloc(data_len);
-        if (message->subject == NULL) goto bail_and_die;
-        memset(message->subject, 0, data_len);
-        strncpy(message->subject, NO_SUBJECT, data_len);
+        *error_code = entry_stream_seek(&stream, entry->entry_size);
+        if (*error_code != OLM_ERROR_SUCCESS) goto bail_and_die;
     }
-    if (message->message_id == NULL)
+    /* Let go of the message data, a reader that stays with the arena must not refer to it. */
+    xmlTextReaderClose(reader);
+    if (arena->owned_by_message == true)
     {
-        data_len = strlen(NO_MID) + 2;
-        message->message_id = (char *)malloc(data_len);
-        if (message->message_id == NULL) goto bail_and_die;
-        memset(message->message_id, 0, data_len);
-        strncpy(message->message_id, NO_MID, data_len);
+        xmlFreeTextReader(reader);
+        arena->reader = NULL;
     }
-    if (message->body == NULL)
+    if (streaming == true)
     {
-        data_len = strlen(NO_MESSAGE_BODY) + 2;
-        message->body = (char *)malloc(data_len);
-        if (message->body == NULL) goto bail_and_die;
-        memset(message->body, 0, data_len);
-        strncpy(message->body, NO_MESSAGE_BODY, data_len);
+        entry_stream_close(&stream);
+        streaming = false;
     }
     
-    free(data_buffer);
-    free(message_data);
+    /* Point the wanted fields that were missing at the placeholders. */
+    if (((fields & OLM_FIELD_TO) != 0) && (message->to == NULL)) message->to = (char *)no_address;
+    if (((fields & OLM_FIELD_FROM) != 0) && (message->from == NULL)) message->from = (char *)no_address;
+    if (((fields & OLM_FIELD_REPLY_TO) != 0) && (message->reply_to == NULL)) message->reply_to = (char *)no_address;
+    if (((fields & OLM_FIELD_SUBJECT) != 0) && (message->subject == NULL)) message->subject = (char *)no_subject;
+    if (((fields & OLM_FIELD_MESSAGE_ID) != 0) && (message->message_id == NULL)) message->message_id = (char *)no_message_id;
+    if (((fields & OLM_FIELD_BODY) != 0) && (message->body == NULL)) message->body = (char *)no_message_body;
+    
     *error_code = OLM_ERROR_SUCCESS;
     return message;
     
 bail_and_die:
     
-    if (message_data != NULL) free(message_data);
-    if (data_buffer != NULL) free(data_buffer);
-    if (doc != NULL)
+    if (arena->reader != NULL)
     {
-        xmlFreeDoc(doc);
-        xmlCleanupParser();
+        xmlTextReaderClose(arena->reader);
+        if (arena->owned_by_message == true)
+        {
+            xmlFreeTextReader(arena->reader);
+            arena->reader = NULL;
+        }
     }
-    
-    olm_message_free(message);
+    if (streaming == true) entry_stream_close(&stream);
+    arena_rewind(arena, mark_block, mark_used);
     
     return INVALID_OLM_MESSAGE;
 }
 
-int parse_element_names(xmlNode * a_node, olm_mail_message_t *message)
+/**************************************************************************************************
+ * Fills in the given message from the message XML, which is pulled from the given reader one node
+ * at a time. No document tree is built, the text of the elements we are interested in is collected
+ * as it goes past, straight into the arena that holds the message. Only the fields in the given
+ * OLM_FIELD_* mask are filled in, the elements holding the others are skipped over and parsing stops
+ * as soon as all the wanted ones have been seen. Elements are told apart by the tag element_tag()
+ * finds for their names, and nesting is only followed through the depth the reader gives, so a
+ * deeply nested body takes no more stack than a flat one. If a query is given, each field it looks
+ * at is checked as soon as it has been read and parsing stops at the first one that fails.
+ *
+ * Returns OLM_ERROR_SUCCESS, MESSAGE_FILTERED_OUT or an error code.
+ **************************************************************************************************/
+int parse_message_xml(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena, unsigned int fields, const olm_query_t *query)
 {
-    xmlNode *cur_node = NULL;
-    xmlAttr *attribute = NULL;
-    int found = false;
-    xmlChar *char_data = NULL;
-    unsigned long child_count = 0;
-    int found_to = false;
-    int found_reply_to = false;
-    olm_attachment_t *curr_att = NULL;
-    size_t data_len = 0;
-    struct tm time_str;
-    
-    for (cur_node = a_node; cur_node; cur_node = cur_node->next)
+    message_parse_state state;
+    const char *name = NULL;
+    const xmlChar *value = NULL;
+    size_t value_len = 0;
+    unsigned int field = 0;
+    unsigned int unchecked = 0;
+    int node_type = 0;
+    int depth = 0;
+    int ret = 0;
+    int list = ADDRESS_LIST_NONE;
+    int capture = CAPTURE_NONE;
+    int skip = false;
+    int seen_element = false;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    memset(&state, 0, sizeof(message_parse_state));
+    state.capture_depth = -1;
+    state.container_depth = -1;
+    state.arena = arena;
+    state.remaining = fields;
+    if (query != NULL) unchecked = query_field_mask(query) & fields;
+    
+    ret = xmlTextReaderRead(reader);
+    while ((ret == 1) && (error_code == OLM_ERROR_SUCCESS))
     {
-        if (cur_node->type == XML_ELEMENT_NODE)
+        node_type = xmlTextReaderNodeType(reader);
+        depth = xmlTextReaderDepth(reader);
+        skip = false;
+        
+        switch (node_type)
         {
-            /* e-mail addresses. */
-            if (strcmp((const char *)cur_node->name, "emailAddress") == 0) /* email address node */
-            {
-                /* To */
-                if (strcmp((const char *)cur_node->parent->name, "OPFMessageCopyToAddresses") == 0)
+            case XML_READER_TYPE_ELEMENT:
+                seen_element = true;
+                name = (const char *)xmlTextReaderConstLocalName(reader);
+                if (name == NULL) break;
+                
+                list = ADDRESS_LIST_NONE;
+                capture = CAPTURE_NONE;
+                switch (element_tag(name))
                 {
-                    attribute = cur_node->properties;
-                    found = false;
-                    while ((attribute != NULL) && (found == false))
-                    {
-                        if (strcmp((const char *)attribute->name, "OPFContactEmailAddressAddress") == 0)
+                    /* e-mail addresses, the element they are in says what they are. */
+                    case ELEMENT_EMAIL_ADDRESS:
+                        if (state.container == ADDRESS_LIST_TO) error_code = read_email_address(reader, arena, &message->to);
+                        if (state.container == ADDRESS_LIST_REPLY_TO) error_code = read_email_address(reader, arena, &message->reply_to);
+                        if (state.container == ADDRESS_LIST_FROM)
                         {
-                            char_data = xmlNodeGetContent(attribute->children);
-                            if (char_data != NULL)
-                            {
-                                data_len = strlen((const char *)char_data) + 2;
-                                message->to = (char *)malloc(data_len);
-                                if (message->to == NULL) return OLM_ERROR_NO_MEMORY;
-                                memset(message->to, 0, data_len);
-                                if (found_to == false)
-                                {
-                                    strncpy(message->to, (const char *)char_data, data_len);
-                                }
-                                else
-                                {
-                                    strncat(message->to, ",", data_len);
-                                    strncat(message->to, (const char *)char_data, data_len);
-                                }
-                                xmlFree(char_data);
-                                found_to = true;
-                            }
-
-                            found = true;
+                            /* There is only one sender. */
+                            message->from = NULL;
+                            error_code = read_email_address(reader, arena, &message->from);
                         }
-                        attribute = attribute->next;
-                    }
+                        break;
+                    case ELEMENT_MESSAGE_ATTACHMENT:
+                        if ((fields & OLM_FIELD_ATTACHMENTS) != 0) error_code = read_attachment(reader, message, arena);
+                        break;
+                    case ELEMENT_CATEGORY:
+                        if (state.container == CATEGORY_LIST) error_code = read_category(reader, message, arena);
+                        break;
+                        
+                    case ELEMENT_TO_ADDRESSES:          list = ADDRESS_LIST_TO; break;
+                    case ELEMENT_REPLY_TO_ADDRESSES:    list = ADDRESS_LIST_REPLY_TO; break;
+                    case ELEMENT_SENDER_ADDRESS:        list = ADDRESS_LIST_FROM; break;
+                    case ELEMENT_ATTACHMENT_LIST:       list = ATTACHMENT_LIST; break;
+                    case ELEMENT_CATEGORY_LIST:         list = CATEGORY_LIST; break;
+                        
+                    case ELEMENT_SUBJECT:               capture = CAPTURE_SUBJECT; break;
+                    case ELEMENT_BODY:                  capture = CAPTURE_BODY; break;
+                    case ELEMENT_SENT_TIME:             capture = CAPTURE_SENT_TIME; break;
+                    case ELEMENT_RECEIVED_TIME:         capture = CAPTURE_RECEIVED_TIME; break;
+                    case ELEMENT_MOD_DATE:              capture = CAPTURE_MODIFIED_TIME; break;
+                    case ELEMENT_MESSAGE_ID:            capture = CAPTURE_MESSAGE_ID; break;
+                    case ELEMENT_HAS_HTML:              capture = CAPTURE_HAS_HTML; break;
+                    case ELEMENT_HAS_RICH_TEXT:         capture = CAPTURE_HAS_RICH_TEXT; break;
+                    case ELEMENT_PRIORITY:              capture = CAPTURE_PRIORITY; break;
                 }
-                /* Reply to */
-                if (strcmp((const char *)cur_node->parent->name, "OPFMessageCopyReplyToAddresses") == 0)
+                
+                /* Elements that contain the lists, skipped over entirely if the list is not wanted. */
+                if ((list != ADDRESS_LIST_NONE) && (state.container == ADDRESS_LIST_NONE))
                 {
-                    attribute = cur_node->properties;
-                    found = false;
-                    while ((attribute != NULL) && (found == false))
+                    field = container_field_mask(list);
+                    if ((fields & field) == 0)
                     {
-                        if (strcmp((const char *)attribute->name, "OPFContactEmailAddressAddress") == 0)
-                        {
-                            char_data = xmlNodeGetContent(attribute->children);
-                            if (char_data != NULL)
-                            {
-                                data_len = strlen((const char *)char_data) + 2;
-                                message->reply_to = (char *)malloc(data_len);
-                                if (message->reply_to == NULL) return OLM_ERROR_NO_MEMORY;
-                                memset(message->reply_to, 0, data_len);
-                                if (found_reply_to == false)
-                                {
-                                    strncpy(message->reply_to, (const char *)char_data, data_len);
-                                }
-                                else
-                                {
-                                    strncat(message->reply_to, ",", data_len);
-                                    strncat(message->reply_to, (const char *)char_data, data_len);
-                                }
-                                xmlFree(char_data);
-                                found_reply_to = true;
-                            }
-                            
-                            found = true;
-                        }
-                        attribute = attribute->next;
+                        skip = true;
                     }
-                }
-                /* From */
-                if (strcmp((const char *)cur_node->parent->name, "OPFMessageCopySenderAddress") == 0)
-                {
-                    attribute = cur_node->properties;
-                    found = false;
-                    while ((attribute != NULL) && (found == false))
+                    else if (xmlTextReaderIsEmptyElement(reader) == 0)
                     {
-                        if (strcmp((const char *)attribute->name, "OPFContactEmailAddressAddress") == 0)
-                        {
-                            char_data = xmlNodeGetContent(attribute->children);
-                            if (char_data != NULL)
-                            {
-                                data_len = strlen((const char *)char_data) + 2;
-                                message->from = (char *)malloc(data_len);
-                                if (message->from == NULL) return OLM_ERROR_NO_MEMORY;
-                                memset(message->from, 0, data_len);
-                                strncpy(message->from, (const char *)char_data, data_len);
-                                xmlFree(char_data);
-                            }
-                            
-                            found = true;
-                        }
-                        attribute = attribute->next;
+                        state.container = list;
+                        state.container_depth = depth;
+                    }
+                    else
+                    {
+                        state.remaining &= ~field;
                     }
+                    break;
                 }
-            }
-        }
-        /* Subject. */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopySubject") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                data_len = strlen((const char *)char_data) + 2;
-                message->subject = (char *)malloc(data_len);
-                if (message->subject == NULL) return OLM_ERROR_NO_MEMORY;
-                memset(message->subject, 0, data_len);
-                strncpy(message->subject, (const char *)char_data, data_len);
-                xmlFree(char_data);
-            }
-        }
-        /* Message body. */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopyBody") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                message->body = (char *)malloc(strlen((char *)char_data) + 1);
-                if (message->body != NULL)
+                
+                /* Elements whose text we want (only one is collected at a time). */
+                if ((capture == CAPTURE_NONE) || (state.capture_field != CAPTURE_NONE)) break;
+                state.capture_field = capture;
+                field = capture_field_mask(state.capture_field);
+                if ((fields & field) == 0)
                 {
-                    memset(message->body, 0, strlen((char *)char_data) + 1);
-                    strncpy(message->body, (const char *)char_data, strlen((char *)char_data) + 1);
-                    xmlFree(char_data);
+                    /* Not wanted, so do not even look at its text. */
+                    state.capture_field = CAPTURE_NONE;
+                    skip = true;
+                    break;
                 }
-                else
+                
+                state.capture_depth = depth;
+                state.text_len = 0;
+                /* An empty element has no end element node, so it is complete already. */
+                if (xmlTextReaderIsEmptyElement(reader) != 0)
                 {
-                    xmlFree(char_data);
-                    return OLM_ERROR_NO_MEMORY;
+                    error_code = store_captured_text(&state, message);
+                    state.remaining &= ~field;
                 }
-            }
-        }
-        /* Sent time/date */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopySentTime") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                sscanf ((const char *)char_data, "%d%*c%d%*c%d%*c%d%*c%d%*c%d", &time_str.tm_year, &time_str.tm_mon, &time_str.tm_mday, &time_str.tm_hour, &time_str.tm_min, &time_str.tm_sec);
-                time_str.tm_year -= 1900;
-                time_str.tm_mon -= 1;
-                time_str.tm_isdst = -1;
-                message->sent_time = mktime(&time_str);
-            }
-        }
-        /* Received time/date */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopyReceivedTime") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                sscanf ((const char *)char_data, "%d%*c%d%*c%d%*c%d%*c%d%*c%d", &time_str.tm_year, &time_str.tm_mon, &time_str.tm_mday, &time_str.tm_hour, &time_str.tm_min, &time_str.tm_sec);
-                time_str.tm_year -= 1900;
-                time_str.tm_mon -= 1;
-                time_str.tm_isdst = -1;
-                message->received_time = mktime(&time_str);
-            }
-        }
-        /* Modified time/date */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopyModDate") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                sscanf ((const char *)char_data, "%d%*c%d%*c%d%*c%d%*c%d%*c%d", &time_str.tm_year, &time_str.tm_mon, &time_str.tm_mday, &time_str.tm_hour, &time_str.tm_min, &time_str.tm_sec);
-                time_str.tm_year -= 1900;
-                time_str.tm_mon -= 1;
-                time_str.tm_isdst = -1;
-                message->modified_time = mktime(&time_str);
-            }
-        }
-        /* Message ID. */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopyMessageID") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                data_len = strlen((const char *)char_data) + 2;
-                message->message_id = (char *)malloc(data_len);
-                if (message->message_id == NULL) return OLM_ERROR_NO_MEMORY;
-                memset(message->message_id, 0, data_len);
-                strncpy(message->message_id, (const char *)char_data, data_len);
-            }
-        }
-        /* HTML status */
-        if (strcmp((const char *)cur_node->name, "OPFMessageGetHasHTML") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                if (char_data[0] == '0')
-                    message->has_html = 0;
-                else
-                    message->has_html = 1;
-            }
-        }
-        /* Rich text status */
-        if (strcmp((const char *)cur_node->name, "OPFMessageGetHasRichText") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                if (char_data[0] == '0')
-                    message->has_rich_text = 0;
-                else
-                    message->has_rich_text = 1;
-            }
-        }
-        /* Message priority */
-        if (strcmp((const char *)cur_node->name, "OPFMessageGetPriority") == 0)
-        {
-            char_data = xmlNodeGetContent(cur_node);
-            if (char_data != NULL)
-            {
-                message->message_priority = (int)char_data[0];
-                message->message_priority -=30;
-                if ((message->message_priority < MESSAGE_PRIORITY_LOWEST) || (message->message_priority > MESSAGE_PRIORITY_HIGHEST)) message->message_priority = MESSAGE_PRIORITY_NORMAL;
-            }
-        }
-        
-        /* Attachments. */
-        if (strcmp((const char *)cur_node->name, "OPFMessageCopyAttachmentList") == 0)
-        {
-            message->attachment_list = NULL;
-            message->attachment_count = 0;
-            child_count = xmlChildElementCount(cur_node);
-            if (child_count > 0)
-            {
-                /* Allocate some memory. */
-                message->attachment_list = (olm_attachment_t **)malloc(sizeof(olm_attachment_t *) * child_count);
-                if (message->attachment_list == NULL) return OLM_ERROR_NO_MEMORY;
-                memset(message->attachment_list, 0, (sizeof(olm_attachment_t *) * child_count));
-            }
-        }
-        if (strcmp((const char *)cur_node->name, "messageAttachment") == 0)
-        {
-            curr_att = malloc(sizeof(olm_attachment_t));
-            if (curr_att == NULL) return OLM_ERROR_NO_MEMORY;
-            memset(curr_att, 0, sizeof(olm_attachment_t));
-            attribute = cur_node->properties;
-            while (attribute != NULL)
-            {
-                if (strcmp((const char *)attribute->name, "OPFAttachmentContentExtension") == 0)
+                break;
+                
+            case XML_READER_TYPE_TEXT:
+            case XML_READER_TYPE_CDATA:
+            case XML_READER_TYPE_WHITESPACE:
+            case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+                if (state.capture_field == CAPTURE_NONE) break;
+                value = xmlTextReaderConstValue(reader);
+                if (value == NULL) break;
+                value_len = strlen((const char *)value);
+                /* Grow the text (leaving room for a terminator), this is done in place unless something else was allocated since. */
+                state.text = (char *)arena_extend(arena, state.text, state.text_len, (state.text_len + value_len + 1));
+                if (state.text == NULL)
                 {
-                    char_data = xmlNodeGetContent(attribute->children);
-                    if (char_data != NULL)
-                    {
-                        data_len = strlen((const char *)char_data) + 2;
-                        curr_att->extension = (char *)malloc(data_len);
-                        if (curr_att->extension == NULL) return OLM_ERROR_NO_MEMORY;
-                        memset(curr_att->extension, 0, data_len);
-                        strncpy(curr_att->extension, (const char *)char_data, data_len);
-                        xmlFree(char_data);
-                    }
+                    error_code = OLM_ERROR_NO_MEMORY;
+                    break;
                 }
-                if (strcmp((const char *)attribute->name, "OPFAttachmentContentType") == 0)
+                memcpy((state.text + state.text_len), value, value_len);
+                state.text_len += value_len;
+                break;
+                
+            case XML_READER_TYPE_END_ELEMENT:
+                if ((state.capture_field != CAPTURE_NONE) && (depth == state.capture_depth))
                 {
-                    char_data = xmlNodeGetContent(attribute->children);
-                    if (char_data != NULL)
-                    {
-                        data_len = strlen((const char *)char_data) + 2;
-                        curr_att->content_type = (char *)malloc(data_len);
-                        if (curr_att->content_type == NULL) return OLM_ERROR_NO_MEMORY;
-                        memset(curr_att->content_type, 0, data_len);
-                        strncpy(curr_att->content_type, (const char *)char_data, data_len);
-                        xmlFree(char_data);
-                    }
+                    state.remaining &= ~capture_field_mask(state.capture_field);
+                    error_code = store_captured_text(&state, message);
                 }
-                if (strcmp((const char *)attribute->name, "OPFAttachmentName") == 0)
+                if ((state.container != ADDRESS_LIST_NONE) && (depth == state.container_depth))
                 {
-                    char_data = xmlNodeGetContent(attribute->children);
-                    if (char_data != NULL)
-                    {
-                        data_len = strlen((const char *)char_data) + 2;
-                        curr_att->filename = (char *)malloc(data_len);
-                        if (curr_att->filename == NULL) return OLM_ERROR_NO_MEMORY;
-                        memset(curr_att->filename, 0, data_len);
-                        strncpy(curr_att->filename, (const char *)char_data, data_len);
-                        xmlFree(char_data);
-                    }
+                    state.remaining &= ~container_field_mask(state.container);
+                    state.container = ADDRESS_LIST_NONE;
+                    state.container_depth = -1;
                 }
-                if (strcmp((const char *)attribute->name, "OPFAttachmentContentFileSize") == 0)
-                {
-                    char_data = xmlNodeGetContent(attribute->children);
-                    if (char_data != NULL)
-                    {
-                        curr_att->file_size = atoll((const char *)char_data);
-                        xmlFree(char_data);
-                    }
-                    else
-                    {
-                        curr_att->file_size = 0;
-                    }
-                }
-                if (strcmp((const char *)attribute->name, "OPFAttachmentURL") == 0)
-                {
-                    char_data = xmlNodeGetContent(attribute->children);
-                    if (char_data != NULL)
-                    {
-                        data_len = strlen((const char *)char_data) + 2;
-                        curr_att->__private = (char *)malloc(data_len);
-                        if (curr_att->__private == NULL) return OLM_ERROR_NO_MEMORY;
-                        memset(curr_att->__private, 0, data_len);
-                        strncpy(curr_att->__private, (const char *)char_data, data_len);
-                        xmlFree(char_data);
-                    }
-                }
-                
-                attribute = attribute->next;
-            }
-            message->attachment_list[message->attachment_count] = curr_att;
-            message->attachment_count++;
+                break;
         }
-        parse_element_names(cur_node->children, message);
+        
+        /* Drop the message as soon as a field that the query looks at has been read and fails it. */
+        if ((unchecked & ~state.remaining) != 0)
+        {
+            if ((error_code == OLM_ERROR_SUCCESS) && (message_matches_query(message, query, (unchecked & ~state.remaining)) == false)) error_code = MESSAGE_FILTERED_OUT;
+            unchecked &= state.remaining;
+        }
+        
+        /* Stop as soon as everything that was asked for has been found. */
+        if ((error_code != OLM_ERROR_SUCCESS) || (state.remaining == 0)) break;
+        ret = (skip == true) ? xmlTextReaderNext(reader) : xmlTextReaderRead(reader);
     }
     
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    if ((ret == -1) || (seen_element == false)) return OLM_ERROR_MESSAGE_CORRUPTED;
+    /* Anything the query looks at that was not in the message is checked as missing. */
+    if ((unchecked != 0) && (message_matches_query(message, query, unchecked) == false)) return MESSAGE_FILTERED_OUT;
+    
     return OLM_ERROR_SUCCESS;
 }
 
-void olm_message_free(olm_mail_message_t *message)
+/**************************************************************************************************
+ * Returns the OLM_FIELD_* bit for the given CAPTURE_* value.
+ **************************************************************************************************/
+unsigned int capture_field_mask(int capture_field)
 {
-    if (message == NULL) return;
-    if (message->to != NULL) free(message->to);
-    if (message->from != NULL) free(message->from);
-    if (message->reply_to != NULL) free(message->reply_to);
-    if (message->subject != NULL) free(message->subject);
-    if (message->message_id != NULL) free(message->message_id);
-    if (message->body != NULL) free(message->body);
-    if (message->attachment_list != NULL)
-    {
-        for (uint64_t i = 0; i < message->attachment_count; i++)
+    switch (capture_field)
+    {
+        case CAPTURE_SUBJECT:           return OLM_FIELD_SUBJECT;
+        case CAPTURE_BODY:              return OLM_FIELD_BODY;
+        case CAPTURE_SENT_TIME:         return OLM_FIELD_SENT_TIME;
+        case CAPTURE_RECEIVED_TIME:     return OLM_FIELD_RECEIVED_TIME;
+        case CAPTURE_MODIFIED_TIME:     return OLM_FIELD_MODIFIED_TIME;
+        case CAPTURE_MESSAGE_ID:        return OLM_FIELD_MESSAGE_ID;
+        case CAPTURE_HAS_HTML:          return OLM_FIELD_HAS_HTML;
+        case CAPTURE_HAS_RICH_TEXT:     return OLM_FIELD_HAS_RICH_TEXT;
+        case CAPTURE_PRIORITY:          return OLM_FIELD_PRIORITY;
+    }
+    
+    return 0;
+}
+
+/**************************************************************************************************
+ * Returns the OLM_FIELD_* bit for the given list container (ADDRESS_LIST_*, ATTACHMENT_LIST or
+ * CATEGORY_LIST).
+ **************************************************************************************************/
+unsigned int container_field_mask(int container)
+{
+    switch (container)
+    {
+        case ADDRESS_LIST_TO:           return OLM_FIELD_TO;
+        case ADDRESS_LIST_REPLY_TO:     return OLM_FIELD_REPLY_TO;
+        case ADDRESS_LIST_FROM:         return OLM_FIELD_FROM;
+        case ATTACHMENT_LIST:           return OLM_FIELD_ATTACHMENTS;
+        case CATEGORY_LIST:             return OLM_FIELD_CATEGORIES;
+    }
+    
+    return 0;
+}
+
+/* The names of the elements that element_tag() knows. */
+static const struct
+{
+    const char *name;
+    int tag;
+} known_elements[] =
+{
+    { "emailAddress",                       ELEMENT_EMAIL_ADDRESS },
+    { "messageAttachment",                  ELEMENT_MESSAGE_ATTACHMENT },
+    { "category",                           ELEMENT_CATEGORY },
+    { "OPFMessageCopyToAddresses",          ELEMENT_TO_ADDRESSES },
+    { "OPFMessageCopyReplyToAddresses",     ELEMENT_REPLY_TO_ADDRESSES },
+    { "OPFMessageCopySenderAddress",        ELEMENT_SENDER_ADDRESS },
+    { "OPFMessageCopyAttachmentList",       ELEMENT_ATTACHMENT_LIST },
+    { "OPFMessageCopyCategoryList",         ELEMENT_CATEGORY_LIST },
+    { "OPFMessageCopySubject",              ELEMENT_SUBJECT },
+    { "OPFMessageCopyBody",                 ELEMENT_BODY },
+    { "OPFMessageCopySentTime",             ELEMENT_SENT_TIME },
+    { "OPFMessageCopyReceivedTime",         ELEMENT_RECEIVED_TIME },
+    { "OPFMessageCopyModDate",              ELEMENT_MOD_DATE },
+    { "OPFMessageCopyMessageID",            ELEMENT_MESSAGE_ID },
+    { "OPFMessageGetHasHTML",               ELEMENT_HAS_HTML },
+    { "OPFMessageGetHasRichText",           ELEMENT_HAS_RICH_TEXT },
+    { "OPFMessageGetPriority",              ELEMENT_PRIORITY },
+    { "contactEmailAddress",                ELEMENT_CONTACT_EMAIL_ADDRESS },
+    { "OPFContactCopyNamePrefix",           ELEMENT_NAME_PREFIX },
+    { "OPFContactCopyFirstName",            ELEMENT_FIRST_NAME },
+    { "OPFContactCopyMiddleName",           ELEMENT_MIDDLE_NAME },
+    { "OPFContactCopyLastName",             ELEMENT_LAST_NAME },
+    { "OPFContactCopyDisplayName",          ELEMENT_DISPLAY_NAME },
+    { "OPFContactCopyBusinessCompany",      ELEMENT_BUSINESS_COMPANY },
+    { "OPFContactCopyBusinessTitle",        ELEMENT_BUSINESS_TITLE },
+    { "OPFContactCopyBirthday",             ELEMENT_BIRTHDAY },
+    { "OPFContactCopyAnniversary",          ELEMENT_ANNIVERSARY },
+    { "OPFContactCopyHomePhone",            ELEMENT_HOME_PHONE },
+    { "OPFContactCopyBusinessPhone",        ELEMENT_BUSINESS_PHONE },
+    { "OPFContactCopyCellPhone",            ELEMENT_CELL_PHONE }
+};
+
+/* Open addressed hash table over the above, each slot holds the index of an element plus one (0 for an empty slot). */
+static unsigned char element_slots[ELEMENT_LOOKUP_SIZE];
+static pthread_once_t element_slots_once = PTHREAD_ONCE_INIT;
+
+/**************************************************************************************************
+ * Fills in the element lookup table, this is only done once.
+ **************************************************************************************************/
+static void build_element_slots(void)
+{
+    uint64_t slot = 0;
+    
+    for (size_t idx = 0; idx < (sizeof(known_elements) / sizeof(known_elements[0])); idx++)
+    {
+        slot = hash_entry_path(known_elements[idx].name) & (ELEMENT_LOOKUP_SIZE - 1);
+        while (element_slots[slot] != 0) slot = (slot + 1) & (ELEMENT_LOOKUP_SIZE - 1);
+        element_slots[slot] = (unsigned char)(idx + 1);
+    }
+}
+
+/**************************************************************************************************
+ * Returns the ELEMENT_* tag for the element with the given name, or ELEMENT_UNKNOWN if it is not
+ * one that the parsers act on. Most elements are not, and those nearly always land on an empty
+ * slot without a single string compare.
+ **************************************************************************************************/
+int element_tag(const char *name)
+{
+    uint64_t slot = 0;
+    
+    pthread_once(&element_slots_once, build_element_slots);
+    
+    for (slot = hash_entry_path(name) & (ELEMENT_LOOKUP_SIZE - 1); element_slots[slot] != 0; slot = (slot + 1) & (ELEMENT_LOOKUP_SIZE - 1))
+    {
+        if (strcmp(known_elements[element_slots[slot] - 1].name, name) == 0) return known_elements[element_slots[slot] - 1].tag;
+    }
+    
+    return ELEMENT_UNKNOWN;
+}
+
+/**************************************************************************************************
+ * Stores the text collected for the element that has just ended in the appropriate field of the
+ * message and resets the capture state. String fields take the collected text as it is, any other
+ * field leaves it to be reused for the next element.
+ **************************************************************************************************/
+int store_captured_text(message_parse_state *state, olm_mail_message_t *message)
+{
+    char **dest = NULL;
+    char *text = NULL;
+    int field = state->capture_field;
+    
+    state->capture_field = CAPTURE_NONE;
+    state->capture_depth = -1;
+    
+    /* Make sure we have a (terminated) string, even if the element was empty. */
+    if (state->text == NULL)
+    {
+        state->text = (char *)arena_alloc(state->arena, 1);
+        if (state->text == NULL) return OLM_ERROR_NO_MEMORY;
+    }
+    state->text[state->text_len] = '\0';
+    text = state->text;
+    
+    switch (field)
+    {
+        case CAPTURE_SUBJECT:
+            dest = &message->subject;
+            break;
+        case CAPTURE_BODY:
+            dest = &message->body;
+            break;
+        case CAPTURE_MESSAGE_ID:
+            dest = &message->message_id;
+            break;
+        case CAPTURE_SENT_TIME:
+            message->sent_time = olm_parse_date_time(text);
+            break;
+        case CAPTURE_RECEIVED_TIME:
+            message->received_time = olm_parse_date_time(text);
+            break;
+        case CAPTURE_MODIFIED_TIME:
+            message->modified_time = olm_parse_date_time(text);
+            break;
+        case CAPTURE_HAS_HTML:
+            message->has_html = (text[0] == '0') ? 0 : 1;
+            break;
+        case CAPTURE_HAS_RICH_TEXT:
+            message->has_rich_text = (text[0] == '0') ? 0 : 1;
+            break;
+        case CAPTURE_PRIORITY:
+            message->message_priority = text[0] - '0';
+            if ((message->message_priority < MESSAGE_PRIORITY_HIGHEST) || (message->message_priority > MESSAGE_PRIORITY_LOWEST)) message->message_priority = MESSAGE_PRIORITY_NORMAL;
+            break;
+    }
+    
+    if (dest != NULL)
+    {
+        *dest = text;
+        state->text = NULL;
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Appends the address held by the emailAddress element that the reader is positioned on to the
+ * given comma separated list of addresses (which is allocated from the arena if it is NULL).
+ **************************************************************************************************/
+int read_email_address(xmlTextReaderPtr reader, olm_arena_t *arena, char **address_list)
+{
+    const char *address = NULL;
+    
+    while (xmlTextReaderMoveToNextAttribute(reader) == 1)
+    {
+        if (strcmp((const char *)xmlTextReaderConstLocalName(reader), "OPFContactEmailAddressAddress") == 0)
         {
-            if (message->attachment_list[i]->__private != NULL) free(message->attachment_list[i]->__private);
-            if (message->attachment_list[i]->content_type != NULL) free(message->attachment_list[i]->content_type);
-            if (message->attachment_list[i]->extension != NULL) free(message->attachment_list[i]->extension);
-            if (message->attachment_list[i]->filename != NULL) free(message->attachment_list[i]->filename);
-            free(message->attachment_list[i]);
+            address = (const char *)xmlTextReaderConstValue(reader);
+            break;
         }
-        free(message->attachment_list);
     }
-    free(message);
+    
+    if ((address != NULL) && (append_address(arena, address_list, address) == false))
+    {
+        xmlTextReaderMoveToElement(reader);
+        return OLM_ERROR_NO_MEMORY;
+    }
+    
+    xmlTextReaderMoveToElement(reader);
+    
+    return OLM_ERROR_SUCCESS;
 }
 
-int olm_extract_and_save_attachment(olm_file_t *file, olm_attachment_t* attachment, const char *dest_path)
+/**************************************************************************************************
+ * Appends the given address to the given comma separated list of addresses (which is allocated
+ * from the arena if it is NULL).
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+int append_address(olm_arena_t *arena, char **address_list, const char *address)
 {
-    internal_archive_entry_data *attachment_entry = NULL;
-    int dest_fd = -1;
-    char *copy_buff = NULL;
-    size_t block_size = 0;
-    size_t block_count = 0;
-    uint32_t local_header_sig = 0;
-    uint16_t filename_len = 0;
-    uint16_t extra_len = 0;
-    ssize_t bytes_xfer = 0;
-    uint32_t crc = 0;
+    char *grown = NULL;
+    size_t list_len = (*address_list != NULL) ? strlen(*address_list) : 0;
+    size_t address_len = strlen(address);
+    
+    grown = (char *)arena_extend(arena, *address_list, ((list_len > 0) ? (list_len + 1) : 0), (list_len + address_len + 2));
+    if (grown == NULL) return false;
+    if (list_len > 0) grown[list_len++] = ',';
+    memcpy((grown + list_len), address, (address_len + 1));
+    *address_list = grown;
     
-    /* Look for the attachment in the list of archive entries. */
-    list_iterator_start(&file->attachment_entries);
-    while (list_iterator_hasnext(&file->attachment_entries) != 0)
+    return true;
+}
+
+/**************************************************************************************************
+ * Adds the attachment described by the attributes of the messageAttachment element that the reader
+ * is positioned on to the attachment list of the given message.
+ **************************************************************************************************/
+int read_attachment(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena)
+{
+    olm_attachment_t *curr_att = NULL;
+    olm_attachment_t **grown = NULL;
+    const char *name = NULL;
+    const char *value = NULL;
+    char **dest = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    /* Make room in the list, which grows in powers of two. */
+    if ((message->attachment_count & (message->attachment_count - 1)) == 0)
     {
-        attachment_entry = (internal_archive_entry_data *)list_iterator_next(&file->attachment_entries);
-        if (strcmp(attachment_entry->raw_entry_path, attachment->__private) == 0) break;
+        grown = (olm_attachment_t **)arena_extend(arena, message->attachment_list, (sizeof(olm_attachment_t *) * message->attachment_count), (sizeof(olm_attachment_t *) * ((message->attachment_count == 0) ? 1 : (message->attachment_count * 2))));
+        if (grown == NULL) return OLM_ERROR_NO_MEMORY;
+        message->attachment_list = grown;
     }
-    list_iterator_stop(&file->attachment_entries);
     
-    /* Make sure we have an attachment. */
-    if (attachment_entry == NULL) return OLM_ERROR_ATTACHMENT_NOT_FOUND;
-    
-    /* Seek to the appropriate place in the source archive. */
-    if (lseek(file->file_seg, attachment_entry->file_offset, SEEK_SET) == -1) return OLM_ERROR_FILE_IO_ERROR;
-    /* Skip the (redundant) local header. */
-    if (read(file->file_seg, &local_header_sig, 4) != 4) return OLM_ERROR_FILE_IO_ERROR;
-    if (local_header_sig != SIG_LOCAL_FILE_HEADER)  return OLM_ERROR_FILE_CORRUPTED; /* Just to make sure. */
-    if (lseek(file->file_seg, 22, SEEK_CUR) == -1) return OLM_ERROR_FILE_IO_ERROR;
-    if ((read(file->file_seg, &filename_len, 2) != 2) || (read(file->file_seg, &extra_len, 2) != 2)) return OLM_ERROR_FILE_IO_ERROR;
-    if (lseek(file->file_seg, (filename_len + extra_len), SEEK_CUR) == -1) return OLM_ERROR_FILE_CORRUPTED;
+    curr_att = (olm_attachment_t *)arena_alloc(arena, sizeof(olm_attachment_t));
+    if (curr_att == NULL) return OLM_ERROR_NO_MEMORY;
+    memset(curr_att, 0, sizeof(olm_attachment_t));
+    message->attachment_list[message->attachment_count] = curr_att;
+    message->attachment_count++;
     
-    /* Check if the attachment is compressed (it shouldn't be). */
-    if (attachment_entry->compression_method != ZIP_CA_STORED)
+    while ((error_code == OLM_ERROR_SUCCESS) && (xmlTextReaderMoveToNextAttribute(reader) == 1))
     {
-        return OLM_ERROR_ATTACHMENT_CORRUPTED;
+        name = (const char *)xmlTextReaderConstLocalName(reader);
+        value = (const char *)xmlTextReaderConstValue(reader);
+        if ((name == NULL) || (value == NULL)) continue;
+        
+        dest = NULL;
+        if (strcmp(name, "OPFAttachmentContentExtension") == 0) dest = &curr_att->extension;
+        if (strcmp(name, "OPFAttachmentContentType") == 0) dest = &curr_att->content_type;
+        if (strcmp(name, "OPFAttachmentName") == 0) dest = &curr_att->filename;
+        if (strcmp(name, "OPFAttachmentURL") == 0) dest = &curr_att->__private;
+        if (strcmp(name, "OPFAttachmentContentFileSize") == 0) curr_att->file_size = atoll(value);
+        
+        if ((dest != NULL) && (*dest == NULL))
+        {
+            *dest = arena_strdup(arena, value);
+            if (*dest == NULL)
+            {
+                error_code = OLM_ERROR_NO_MEMORY;
+                break;
+            }
+        }
     }
     
-    /* Allocate the copy buffer. */
-    copy_buff = allocate_block_for_buffer(attachment_entry->entry_size, &block_size, &block_count);
-    if (copy_buff == NULL) return OLM_ERROR_NO_MEMORY;
+    xmlTextReaderMoveToElement(reader);
     
-    /* Now try to create the destination file. This will be overwritten if it already exists. */
-    dest_fd = open(dest_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
-    if (dest_fd == -1)
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Adds the name held by the category element that the reader is positioned on to the category list
+ * of the given message.
+ **************************************************************************************************/
+int read_category(xmlTextReaderPtr reader, olm_mail_message_t *message, olm_arena_t *arena)
+{
+    char **grown = NULL;
+    char *category_name = NULL;
+    const char *value = NULL;
+    
+    while (xmlTextReaderMoveToNextAttribute(reader) == 1)
     {
-        free(copy_buff);
-        return OLM_ERROR_FILE_IO_ERROR;
+        if (strcmp((const char *)xmlTextReaderConstLocalName(reader), "OPFCategoryCopyName") == 0)
+        {
+            value = (const char *)xmlTextReaderConstValue(reader);
+            if (value != NULL) category_name = arena_strdup(arena, value);
+            break;
+        }
     }
+    xmlTextReaderMoveToElement(reader);
+    if (value == NULL) return OLM_ERROR_SUCCESS;
+    if (category_name == NULL) return OLM_ERROR_NO_MEMORY;
     
-    /* Now copy the data from the archive to the dest files. */
-    for (size_t block = 0; block < block_count; block++)
+    /* Make room in the list, which grows in powers of two. */
+    if ((message->category_count & (message->category_count - 1)) == 0)
+    {
+        grown = (char **)arena_extend(arena, message->category_list, (sizeof(char *) * message->category_count), (sizeof(char *) * ((message->category_count == 0) ? 1 : (message->category_count * 2))));
+        if (grown == NULL) return OLM_ERROR_NO_MEMORY;
+        message->category_list = grown;
+    }
+    message->category_list[message->category_count] = category_name;
+    message->category_count++;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/******************************************************************************************************************************
+ * Converts an ISO 8601 date/time as found in the message and contact XML (for example 2012-06-11T09:27:23 or
+ * 2012-06-11T09:27:23.000Z) to a time_t. A time without a zone is taken to be UTC, the time and seconds may be left out and
+ * any fraction of a second is ignored. This does plain arithmetic, without looking at the locale or the time zone database,
+ * so it is safe to call from any number of threads at once.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   text           The date/time to convert.
+ *
+ * Returns:
+ *
+ *   The date/time or (time_t)-1 if it is not one.
+ ******************************************************************************************************************************/
+time_t olm_parse_date_time(const char *text)
+{
+    const char *curr = text;
+    int year = 0;
+    int month = 0;
+    int day = 0;
+    int hour = 0;
+    int minute = 0;
+    int second = 0;
+    int zone_hours = 0;
+    int zone_minutes = 0;
+    int zone_sign = 0;
+    int64_t days = 0;
+    
+    if (text == NULL) return (time_t)-1;
+    
+    /* The date must be there, the parts are always the same length so no scanning is needed. */
+    if ((read_digits(curr, 4, &year) == false) || (curr[4] == '\0') || (read_digits((curr + 5), 2, &month) == false) || (curr[7] == '\0') || (read_digits((curr + 8), 2, &day) == false)) return (time_t)-1;
+    curr += 10;
+    
+    /* Then the time, if there is one. */
+    if ((*curr != '\0') && (curr[1] >= '0') && (curr[1] <= '9'))
     {
-        bytes_xfer = read(file->file_seg, copy_buff, block_size);
-        if (bytes_xfer != block_size)
+        if ((read_digits((curr + 1), 2, &hour) == false) || (curr[3] == '\0') || (read_digits((curr + 4), 2, &minute) == false)) return (time_t)-1;
+        curr += 6;
+        if ((*curr == ':') && (read_digits((curr + 1), 2, &second) == true)) curr += 3;
+        if ((*curr == '.') || (*curr == ','))
         {
-            free(copy_buff);
-            close(dest_fd);
-            return OLM_ERROR_FILE_IO_ERROR;
+            for (curr++; (*curr >= '0') && (*curr <= '9'); curr++);
         }
-        crc = crc32(crc, copy_buff, block_size);
-        bytes_xfer = write(dest_fd, copy_buff, block_size);
-        if (bytes_xfer != block_size)
+        
+        /* And the zone. */
+        if ((*curr == '+') || (*curr == '-'))
         {
-            free(copy_buff);
-            close(dest_fd);
-            return OLM_ERROR_FILE_IO_ERROR;
+            zone_sign = (*curr == '-') ? -1 : 1;
+            if (read_digits((curr + 1), 2, &zone_hours) == false) return (time_t)-1;
+            curr += 3;
+            if (*curr == ':') curr++;
+            if (read_digits(curr, 2, &zone_minutes) == true) curr += 2;
         }
     }
     
-    free(copy_buff);
-    close(dest_fd);
+    if ((month < 1) || (month > 12) || (day < 1) || (day > 31) || (hour > 23) || (minute > 59) || (second > 60) || (zone_hours > 23) || (zone_minutes > 59)) return (time_t)-1;
     
-    /* Check the extracted file. */
-    if (crc != attachment_entry->crc32)
+    /* Count the days since 1970-01-01 in the proleptic Gregorian calendar, with the year starting in March so that the leap
+       day comes last. */
+    if (month <= 2) year--;
+    days = (int64_t)(year / 400) * 146097;
+    year %= 400;
+    if (year < 0)
     {
-        return  OLM_ERROR_ATTACHMENT_CORRUPTED;
-        unlink(dest_path);
+        year += 400;
+        days -= 146097;
     }
+    days += (int64_t)year * 365 + (year / 4) - (year / 100);
+    days += ((153 * ((month > 2) ? (month - 3) : (month + 9))) + 2) / 5 + (day - 1);
+    days -= 719468;
+    
+    return (time_t)((days * 86400) + (hour * 3600) + (minute * 60) + second - (zone_sign * ((zone_hours * 3600) + (zone_minutes * 60))));
+}
 
-    return OLM_ERROR_SUCCESS;
+/**************************************************************************************************
+ * Reads the given number of decimal digits from the text into value.
+ *
+ * Returns true on success or false if there are not that many digits.
+ **************************************************************************************************/
+static int read_digits(const char *text, int count, int *value)
+{
+    *value = 0;
+    for (int idx = 0; idx < count; idx++)
+    {
+        if ((text[idx] < '0') || (text[idx] > '9')) return false;
+        *value = (*value * 10) + (text[idx] - '0');
+    }
+    
+    return true;
+}
+
+void olm_message_free(olm_mail_message_t *message)
+{
+    olm_arena_t *arena = NULL;
+    
+    if (message == NULL) return;
+    
+    /* Everything belonging to the message is in its arena. Messages in an arena given to
+       olm_get_message_at_in_arena() last until that is reset or destroyed. */
+    arena = (olm_arena_t *)message->__private;
+    if ((arena != NULL) && (arena->owned_by_message == true)) arena_destroy(arena);
+}
+
+int olm_extract_and_save_attachment(olm_file_t *file, olm_attachment_t* attachment, const char *dest_path)
+{
+    internal_archive_entry_data *attachment_entry = NULL;
+    int dest_fd = -1;
+    uint64_t data_offset = 0;
+    uint32_t crc = 0;
+    int verify = ((file->options & OLM_OPT_SKIP_CRC) != OLM_OPT_SKIP_CRC);
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    error_code = locate_attachment_data(file, attachment, &attachment_entry, &data_offset);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    
+    /* Now try to create the destination file. This will be overwritten if it already exists. */
+    dest_fd = open(dest_path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (dest_fd == -1) return OLM_ERROR_FILE_IO_ERROR;
+    
+    /* Now copy the data from the archive to the dest file, inflating it on the way if need be. */
+    if (attachment_entry->compression_method == ZIP_CA_DEFLATE)
+    {
+        error_code = inflate_archive_entry(file, attachment_entry, data_offset, dest_fd, verify);
+    }
+    else
+    {
+        error_code = copy_archive_range(file, data_offset, attachment_entry->entry_size, dest_fd, ((verify == true) ? &crc : NULL));
+        if ((error_code == OLM_ERROR_SUCCESS) && (verify == true) && (crc != attachment_entry->crc32)) error_code = OLM_ERROR_ATTACHMENT_CORRUPTED;
+    }
+    if ((close(dest_fd) != 0) && (error_code == OLM_ERROR_SUCCESS)) error_code = OLM_ERROR_FILE_IO_ERROR;
+    
+    /* A bad or partial file is not left behind. */
+    if (error_code != OLM_ERROR_SUCCESS) unlink(dest_path);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Finds the archive entry for the given attachment and works out where its data starts, skipping
+ * the (redundant) local header.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int locate_attachment_data(olm_file_t *file, olm_attachment_t *attachment, internal_archive_entry_data **entry, uint64_t *data_offset)
+{
+    /* Look for the attachment in the table of archive entries. */
+    if ((attachment == NULL) || (attachment->__private == NULL)) return OLM_ERROR_ATTACHMENT_NOT_FOUND;
+    *entry = find_entry(&file->attachment_lookup, &file->attachment_entries, attachment->__private);
+    
+    /* Make sure we have an attachment. */
+    if (*entry == NULL) return OLM_ERROR_ATTACHMENT_NOT_FOUND;
+    
+    /* Attachments are normally stored, but are deflated if the archive has been zipped up again. */
+    if (((*entry)->compression_method != ZIP_CA_STORED) && ((*entry)->compression_method != ZIP_CA_DEFLATE))
+    {
+        return OLM_ERROR_ATTACHMENT_CORRUPTED;
+    }
+    
+    return get_entry_data_offset(file, *entry, data_offset);
 }
 
 void olm_close_file(olm_file_t *file)
@@ -924,22 +1373,32 @@ void olm_close_file(olm_file_t *file)
     if (file != NULL)
     {
         /* Free the entries */
-        list_iterator_start(&file->message_entries);
-        while (list_iterator_hasnext(&file->message_entries) != 0)
+        entry_table_free(&file->message_entries);
+        entry_table_free(&file->attachment_entries);
+        entry_table_free(&file->contact_entries);
+        entry_lookup_free(&file->attachment_lookup);
+        if (file->contacts != NULL) free(file->contacts);
+        pthread_mutex_destroy(&file->contacts_lock);
+        entry_table_free(&file->category_entries);
+        if (file->categories != NULL) free(file->categories);
+        if (file->category_strings != NULL) arena_destroy(file->category_strings);
+        if (file->category_members != NULL)
         {
-            free_entry_from_central_dir((internal_archive_entry_data *)list_iterator_next(&file->message_entries));
+            for (uint64_t idx = 0; idx < file->category_count; idx++) free(file->category_members[idx].messages);
+            free(file->category_members);
         }
-        list_iterator_stop(&file->message_entries);
-        list_destroy(&file->message_entries);
-        
-        list_iterator_start(&file->attachment_entries);
-        while (list_iterator_hasnext(&file->attachment_entries) != 0)
+        pthread_mutex_destroy(&file->categories_lock);
+        if (file->search_index != NULL)
         {
-            free_entry_from_central_dir((internal_archive_entry_data *)list_iterator_next(&file->attachment_entries));
+            if (file->search_index_mapped == true) munmap((void *)file->search_index, file->search_index_size);
+            else free((void *)file->search_index);
         }
-        list_iterator_stop(&file->attachment_entries);
-        list_destroy(&file->attachment_entries);
+        pthread_mutex_destroy(&file->search_lock);
+        if (file->entry_strings != NULL) arena_destroy(file->entry_strings);
         
+        if (file->cdr_buffer != NULL) free(file->cdr_buffer);
+        if (file->file_map != NULL) munmap((void *)file->file_map, file->map_size);
+        if (file->comment != NULL) free(file->comment);
         free(file->filename);
         close(file->file_seg);
         
@@ -947,12 +1406,39 @@ void olm_close_file(olm_file_t *file)
     }
 }
 
+/******************************************************************************************************************************
+ * Looks up an attachment in the archive by its path, which is the value of the OPFAttachmentURL attribute in the message
+ * that refers to it (for example Local/com.microsoft.__Messages/com.microsoft.__Attachments/...).
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to look in.
+ *   entry_path     The path of the attachment in the archive.
+ *   entry_size     Receives the (uncompressed) size of the attachment if it is found. Can be NULL.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS if the archive holds the attachment, otherwise OLM_ERROR_ATTACHMENT_NOT_FOUND.
+ ******************************************************************************************************************************/
+int olm_find_attachment_entry(olm_file_t *file, const char *entry_path, uint64_t *entry_size)
+{
+    internal_archive_entry_data *entry = NULL;
+    
+    if ((file == NULL) || (entry_path == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    entry = find_entry(&file->attachment_lookup, &file->attachment_entries, entry_path);
+    if (entry == NULL) return OLM_ERROR_ATTACHMENT_NOT_FOUND;
+    if (entry_size != NULL) *entry_size = entry->entry_size;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
 /**************************************************************************************************
  * Returns the number of messages contained in this olm archive.
  **************************************************************************************************/
 uint64_t olm_mail_message_count(olm_file_t *file)
 {    
-    if (file != NULL) return (uint64_t)list_size(&file->message_entries);
+    if (file != NULL) return file->message_entries.count;
     
     return 0;
 }
@@ -962,100 +1448,118 @@ uint64_t olm_mail_message_count(olm_file_t *file)
  ***************************************************************************************************************************************************/
 
 /**************************************************************************************************
- * This function will attempt to fetch the end of central directory record from the end of the
- * ZIP file, or the current segment. All ZIP files have this record at the end.
+ * Reads the block at the end of the file that may hold the end of central directory record, which
+ * is the size of the record plus the maximum size of the ZIP file comment (64k). Room is also made
+ * for the ZIP64 locator that would immediately precede the record.
+ *
+ * Returns a newly allocated buffer holding the block (its length is stored in block_len) or NULL if
+ * an error occurred, in which case errno should hold a value that indicates what went wrong.
+ **************************************************************************************************/
+unsigned char *read_tail_block(olm_file_t *file, off_t file_size, size_t *block_len)
+{
+    unsigned char *block = NULL;
+    size_t len = sizeof(eocdr_locator64) + sizeof(eocd_record32) + 0xFFFF;
+    
+    if ((off_t)len > file_size) len = (size_t)file_size;
+    
+    block = (unsigned char *)malloc(len);
+    if (block == NULL) return NULL;
+    
+    if (read_fully(file->file_seg, block, len, (file_size - (off_t)len)) == false)
+    {
+        free(block);
+        return NULL;
+    }
+    
+    *block_len = len;
+    return block;
+}
+
+/**************************************************************************************************
+ * This function will attempt to find the end of central directory record in the block read from
+ * the end of the ZIP file, or the current segment, by read_tail_block(). All ZIP files have this
+ * record at the end.
  *
  * If the ZIP file has a comment on the end, the location of this record will be further back in
- * the file. The function will search back until a record is found or an error occurs. The function
- * will not search back more then 64k + the size of the record, as this is the maximum size of the
- * comment, and the function could block for a long time if searching a big ZIP file.
+ * the file. The function searches the block backwards for the record signature, which will not be
+ * more then 64k + the size of the record from the end, as this is the maximum size of the comment.
  *
- * If the record is found the function will return TRUE. If the record is not found; FALSE will
- * be returned. If an I/O error occurs errno should hold a value that indicates what went wrong.
+ * If the record is found the function will return TRUE and store its position within the block in
+ * record_pos. If the record is not found; FALSE will be returned.
  **************************************************************************************************/
-int get_eocd_record(olm_file_t *file, eocd_record32 *eocd_record)
+int get_eocd_record(olm_file_t *file, const unsigned char *tail, size_t tail_len, eocd_record32 *eocd_record, size_t *record_pos)
 {
-    off_t seek_offset = -22;
-    int rec_found = false;
-    int give_up = false;
-    ssize_t bytes_read = 0;
-    ssize_t record_size = sizeof(eocd_record32);
+    static const unsigned char signature[4] = { 0x50, 0x4b, 0x05, 0x06 };
+    const unsigned char *candidate = NULL;
+    size_t search_len = 0;
+    
+    if (tail_len < sizeof(eocd_record32)) return false;
     
     /* Look for the end of central directory record.
      * If there is no ZIP file comment, the record will be 22 bytes from the end of the file,
      * if there is a comment we will have to search back.
      */
-    
-    rec_found = false;
-    give_up = false;
-    while ((rec_found == false) && (give_up == false))
+    search_len = tail_len - sizeof(eocd_record32) + 1;
+    while (search_len > 0)
     {
-        /* Position the stream. */
-        if (lseek(file->file_seg, seek_offset, SEEK_END) == -1) return false;
-        
-        /* Look for the end of central directory record signature. */
-        bytes_read = read(file->file_seg, eocd_record, (size_t)record_size);
-        if (bytes_read != record_size) return false;
-        
-        /* Check that we have in fact read out a valid end of central directory record from the specified location. */
-        if (eocd_record->signature == SIG_END_OF_CENTRAL_DIR)
-        {
-            rec_found = true;
-        }
-        else
+        /* Find the previous occurrence of the first byte of the signature. */
+#ifdef HAVE_MEMRCHR
+        candidate = (const unsigned char *)memrchr(tail, signature[0], search_len);
+#else
+        candidate = NULL;
+        for (size_t idx = search_len; idx > 0; idx--)
         {
-            if (seek_offset <= -65558)
+            if (tail[idx - 1] == signature[0])
             {
-                give_up = true;
-                rec_found = false;
+                candidate = tail + (idx - 1);
+                break;
             }
-            --seek_offset;
         }
-    }
-    
-    /* Get the comment if there is one. */
-    if ((rec_found) && (eocd_record->comment_length > 0))
-    {
-        /* Allocate some memory and make room for a zero terminator byte. */
-        file->comment = (char *) malloc(eocd_record->comment_length + 1);
-        /* Make sure the memory was allocated. */
-        if (file->comment != NULL)
+#endif
+        if (candidate == NULL) return false;
+        search_len = (size_t)(candidate - tail);
+        
+        /* Check that we have in fact found a valid end of central directory record, the comment must fit in what follows it. */
+        if (memcmp(candidate, signature, sizeof(signature)) != 0) continue;
+        memcpy(eocd_record, candidate, sizeof(eocd_record32));
+        if ((search_len + sizeof(eocd_record32) + eocd_record->comment_length) > tail_len) continue;
+        
+        *record_pos = search_len;
+        
+        /* Get the comment if there is one. */
+        if ((eocd_record->comment_length > 0) && (file->comment == NULL))
         {
-            memset(file->comment, 0, eocd_record->comment_length);
-            bytes_read = read(file->file_seg, file->comment, eocd_record->comment_length);
-            if (bytes_read != eocd_record->comment_length) return false;
-            /* make sure the string is NULL terminated. */
-            file->comment[eocd_record->comment_length] = '\0';
+            /* Allocate some memory and make room for a zero terminator byte. */
+            file->comment = (char *) malloc(eocd_record->comment_length + 1);
+            /* Make sure the memory was allocated. */
+            if (file->comment != NULL)
+            {
+                memcpy(file->comment, (candidate + sizeof(eocd_record32)), eocd_record->comment_length);
+                /* make sure the string is NULL terminated. */
+                file->comment[eocd_record->comment_length] = '\0';
+            }
         }
+        
+        return true;
     }
     
-    return rec_found;
+    return false;
 }
 
 /**************************************************************************************************
  * This function will fetch the ZIP64 end of central directory locator if it is present.
  *
- * The function will return TRUE if the record was found and FALSE in any other case.
+ * The zip64 locator record will (if present) be located immediately before the end of central
+ * directory record, so it is taken from the same block at the end of the file.
  *
- * If the record was not found due to an error, errno should hold a value that indicates what went wrong.
+ * The function will return TRUE if the record was found and FALSE in any other case.
  **************************************************************************************************/
-int get_eocdr64_locator(olm_file_t *file, eocdr_locator64 *eocdr_locator, size_t comment_length)
+int get_eocdr64_locator(const unsigned char *tail, size_t record_pos, eocdr_locator64 *eocdr_locator)
 {
-    off_t seek_offset = -42;
-    ssize_t bytes_read = 0;
-    ssize_t record_size = sizeof(eocdr_locator64);
-    
-    seek_offset -= comment_length; /* subtract then length of the comment from the seek offset. */
+    if (record_pos < sizeof(eocdr_locator64)) return false;
     
-    /* The zip64 locator record will (if present) be located immediatley before the end of central directory record. */
-    /* It will therefore be 42 bytes + the length of the comment from the end of the file. */
-    
-    /* Position the file pointer. */
-    if (lseek(file->file_seg, seek_offset, SEEK_END) == -1) return false;
-    
-    /* Read out the the record. */
-    bytes_read = read(file->file_seg, eocdr_locator, (size_t)record_size);
-    if (bytes_read != record_size) return false;
+    /* Copy out the the record. */
+    memcpy(eocdr_locator, (tail + record_pos - sizeof(eocdr_locator64)), sizeof(eocdr_locator64));
     
     if (eocdr_locator->signature != SIG_ZIP64_EOCDR_LOCATOR) return false;
     
@@ -1074,11 +1578,8 @@ int get_eocd64_record(olm_file_t *file, eocd_record64 *eocd_record, off_t search
     ssize_t record_size = sizeof(eocd_record64);
     ssize_t bytes_read = 0;
     
-    /* Position the file pointer. */
-    if (lseek(file->file_seg, search_offset, SEEK_SET) == -1) return false;
-    
     /* Read out the record. */
-    bytes_read = read(file->file_seg, eocd_record, (size_t)record_size);
+    bytes_read = pread(file->file_seg, eocd_record, (size_t)record_size, search_offset);
     if (bytes_read != record_size) return false;
     
     /* check the magic number. */
@@ -1088,154 +1589,254 @@ int get_eocd64_record(olm_file_t *file, eocd_record64 *eocd_record, off_t search
 }
 
 /**************************************************************************************************
- * This function read the next entry from the central directory and populate the given internal
- * archive entry data structure.
+ * This function parses the next entry from the in-memory copy of the central directory (held in
+ * cdr_buffer) into the given internal archive entry data structure.
+ *
+ * On entry cdr_offset holds the offset of the entry within the buffer, on exit it will hold the
+ * offset of the entry that follows it.
  *
- * The function will return the number of bytes read from the underlying stream. or -1 if there was
- * an error.
+ * The strings of the entry are allocated from the entry_strings arena of the file.
  *
- * If the record was not found due to an error, errno should hold a value that indicates what went
- * wrong.
+ * Returns OLM_ERROR_SUCCESS or an error code that indicates what went wrong.
  **************************************************************************************************/
-internal_archive_entry_data *read_next_entry_from_central_dir(olm_file_t *file, int *error_code)
+int read_next_entry_from_central_dir(olm_file_t *file, size_t *cdr_offset, internal_archive_entry_data *entry)
 {
-    central_dir_entry_header header_buff = { 0, 0, 0, 0, 0, {0}, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    char *last_slash = NULL;
-    internal_archive_entry_data *entry = (internal_archive_entry_data *)malloc(sizeof(internal_archive_entry_data));
-    if (entry == NULL) return NULL;
-    memset(entry, 0, sizeof(internal_archive_entry_data));
-    ssize_t bytes_read = 0;
-    ssize_t total_bytes_read = 0;
+    central_dir_entry_header header_buff;
+    const unsigned char *record = NULL;
+    const unsigned char *extra_data = NULL;
+    size_t remaining = 0;
+    size_t record_len = 0;
+    size_t path_len = 0;
+    ssize_t field_len = 0;
     extra_field_header efh = { 0, 0, NULL };
-    size_t str_len = 0;
     
-    /* Read out the header. */
-    if (read(file->file_seg, &header_buff, sizeof(central_dir_entry_header)) == -1)
-    {
-        *error_code = OLM_ERROR_FILE_IO_ERROR;
-        goto bail_and_die;
-    }
+    /* Make sure the fixed part of the header is in the buffer. */
+    if ((*cdr_offset > file->central_dir_size) || ((file->central_dir_size - *cdr_offset) < sizeof(central_dir_entry_header))) return OLM_ERROR_FILE_CORRUPTED;
+    record = file->cdr_buffer + *cdr_offset;
+    memcpy(&header_buff, record, sizeof(central_dir_entry_header));
+    if (header_buff.signature != SIG_CENTRAL_FILE_HEADER) return OLM_ERROR_FILE_CORRUPTED;
     
-    /*******************************************************************
-     * Now we must read out the variable data that follows the header. *
-     *******************************************************************/
+    /* The filename, extra fields and comment follow the header in that order; make sure they are all there. */
+    record_len = sizeof(central_dir_entry_header) + header_buff.filename_length + header_buff.extra_field_length + header_buff.file_comment_length;
+    if ((header_buff.filename_length == 0) || ((file->central_dir_size - *cdr_offset) < record_len)) return OLM_ERROR_FILE_CORRUPTED;
     
-    /* Get the filename. */
-    if (header_buff.filename_length == 0)
-    {
-        *error_code = OLM_ERROR_FILE_CORRUPTED;
-        goto bail_and_die;
-    }
-    
-    entry->raw_entry_path = (char *)malloc(header_buff.filename_length + 1);
-    if (entry->raw_entry_path == NULL)
-    {
-        *error_code = OLM_ERROR_NO_MEMORY;
-        goto bail_and_die;
-    }
-    memset(entry->raw_entry_path, 0, (header_buff.filename_length + 1));
-    if (read(file->file_seg, entry->raw_entry_path, header_buff.filename_length) == -1)
-    {
-        *error_code = OLM_ERROR_FILE_IO_ERROR;
-        goto bail_and_die;
-    }
+    path_len = header_buff.filename_length;
+    if (set_entry_path(file->entry_strings, entry, (const char *)(record + sizeof(central_dir_entry_header)), path_len, header_buff.internal_file_attributes) == false) return OLM_ERROR_NO_MEMORY;
     
     /* First get the values we need from the header. */
     entry->entry_size = header_buff.uncompressed_size;
     entry->entry_compressed_size = header_buff.compressed_size;
-    entry->attributes = header_buff.internal_file_attributes;
     entry->compression_method = header_buff.compression_method;
     entry->crc32 = header_buff.crc32;
     entry->flags = header_buff.bit_flag;
     entry->file_offset = header_buff.local_header_offset;
     
-    /* Get (skip) the file comment. */
-    if (header_buff.file_comment_length != 0)
+    /* Process the extra fields. */
+    extra_data = record + sizeof(central_dir_entry_header) + path_len;
+    remaining = header_buff.extra_field_length;
+    while (remaining > 0)
     {
-        /* We are not interested in the file comment (for now ?) */
-        if (lseek(file->file_seg, header_buff.file_comment_length, SEEK_CUR) == -1) goto bail_and_die;
-    }
-    
-    /* Get (skip) the extra fields. */
-    if (header_buff.extra_field_length != 0)
-    {
-        total_bytes_read = 0;
-        while (total_bytes_read < header_buff.extra_field_length)
+        field_len = read_out_extra_field(extra_data, remaining, &efh);
+        if (field_len == -1) return OLM_ERROR_FILE_CORRUPTED;
+        switch (efh.header_id)
         {
-            bytes_read = read_out_extra_field(file, &efh);
-            if (bytes_read == -1) goto bail_and_die;
-            switch (efh.header_id)
+            case 0x0001: /* ZIP64 extra field, only the values that overflowed the header are present (in this order). */
             {
-                case 0x0001: /* ZIP64 extra field. */
-                    if (header_buff.uncompressed_size == 0xFFFFFFFF) memcpy(&entry->entry_size, efh.data, 8);
-                    if (header_buff.compressed_size == 0xFFFFFFFF) memcpy(&entry->entry_compressed_size, (efh.data + 8), 8);
-                    if (header_buff.local_header_offset == 0xFFFFFFFF) memcpy(&entry->file_offset, (efh.data + 16), 8);
-                    break;
+                uint16_t zip64_offset = 0;
+                if ((header_buff.uncompressed_size == 0xFFFFFFFF) && ((zip64_offset + 8) <= efh.data_size))
+                {
+                    memcpy(&entry->entry_size, (efh.data + zip64_offset), 8);
+                    zip64_offset += 8;
+                }
+                if ((header_buff.compressed_size == 0xFFFFFFFF) && ((zip64_offset + 8) <= efh.data_size))
+                {
+                    memcpy(&entry->entry_compressed_size, (efh.data + zip64_offset), 8);
+                    zip64_offset += 8;
+                }
+                if ((header_buff.local_header_offset == 0xFFFFFFFF) && ((zip64_offset + 8) <= efh.data_size))
+                {
+                    memcpy(&entry->file_offset, (efh.data + zip64_offset), 8);
+                }
+                break;
             }
-            if (efh.data != NULL) free(efh.data);
-            total_bytes_read += bytes_read;
         }
+        extra_data += field_len;
+        remaining -= (size_t)field_len;
     }
     
+    /* We are not interested in the file comment (for now ?) so just step over the whole record. */
+    *cdr_offset += record_len;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Sets the path of the given entry from the given path (which need not be terminated), splitting
+ * it into its directory and filename. Everything else in the entry is zeroed. The path and the
+ * directory are copied into the given arena, the filename points into the path.
+ *
+ * Returns true or false if there was not enough memory.
+ **************************************************************************************************/
+int set_entry_path(olm_arena_t *strings, internal_archive_entry_data *entry, const char *path, size_t path_len, uint16_t attributes)
+{
+    char *last_slash = NULL;
+    
+    memset(entry, 0, sizeof(internal_archive_entry_data));
+    entry->raw_entry_path = (char *)arena_alloc(strings, ((path_len + 1) * 2));
+    if (entry->raw_entry_path == NULL) return false;
+    memset(entry->raw_entry_path, 0, ((path_len + 1) * 2));
+    memcpy(entry->raw_entry_path, path, path_len);
+    entry->attributes = attributes;
+    
     /* Check if this is a directory. */
-    if ((entry->raw_entry_path[header_buff.filename_length - 1] == '/') || ((entry->attributes & FAT_ATTRIB_DIR) == FAT_ATTRIB_DIR))
+    if ((entry->raw_entry_path[path_len - 1] == '/') || ((entry->attributes & FAT_ATTRIB_DIR) == FAT_ATTRIB_DIR))
     {
-        if (entry->raw_entry_path[header_buff.filename_length - 1] == '/') entry->raw_entry_path[header_buff.filename_length - 1] = '\0';
+        if (entry->raw_entry_path[path_len - 1] == '/') entry->raw_entry_path[path_len - 1] = '\0';
         entry->is_directory = true;
-        str_len = strlen(entry->raw_entry_path) + 1;
-        entry->directory = (char *)malloc(str_len);
-        if (entry->directory == NULL)
-        {
-            *error_code = OLM_ERROR_NO_MEMORY;
-            goto bail_and_die;
-        }
-        memset(entry->directory, 0, str_len);
-        strncpy(entry->directory, entry->raw_entry_path, str_len);
+        entry->directory = entry->raw_entry_path + (path_len + 1);
+        memcpy(entry->directory, entry->raw_entry_path, strlen(entry->raw_entry_path));
         entry->filename = NULL;
     }
     else
     {
         entry->is_directory = false;
-        if (strchr(entry->raw_entry_path, '/') == NULL)
+        last_slash = strrchr(entry->raw_entry_path, '/');
+        if (last_slash == NULL)
         {
-            str_len = strlen(entry->raw_entry_path) + 1;
-            entry->filename = (char *)malloc(str_len);
-            if (entry->filename == NULL)
-            {
-                *error_code = OLM_ERROR_NO_MEMORY;
-                goto bail_and_die;
-            }
-            memset(entry->filename, 0, str_len);
-            strncpy(entry->filename, entry->raw_entry_path, str_len);
+            entry->filename = entry->raw_entry_path;
             entry->directory = NULL;
         }
         else
         {
-            str_len = strlen(entry->raw_entry_path) + 1;
-            entry->filename = (char *)malloc(str_len);
-            entry->directory = (char *)malloc(str_len);
-            if ((entry->filename == NULL) || (entry->directory == NULL))
-            {
-                *error_code= OLM_ERROR_NO_MEMORY;
-                goto bail_and_die;
-            }
-            memset(entry->filename, 0, str_len);
-            memset(entry->directory, 0, str_len);
-            last_slash = strrchr(entry->raw_entry_path, '/');
-            strncpy(entry->filename, (last_slash + 1), str_len);
-            strncpy(entry->directory, entry->raw_entry_path, index_of_last(entry->raw_entry_path, '/'));
+            entry->filename = last_slash + 1;
+            entry->directory = entry->raw_entry_path + (path_len + 1);
+            memcpy(entry->directory, entry->raw_entry_path, (size_t)(last_slash - entry->raw_entry_path));
         }
     }
     
-    return entry;
+    return true;
+}
+
+/**************************************************************************************************
+ * Makes room in the given entry table for at least the given number of entries.
+ *
+ * Returns true or false if there was not enough memory.
+ **************************************************************************************************/
+int entry_table_reserve(entry_table *table, uint64_t capacity)
+{
+    internal_archive_entry_data *grown = NULL;
+    
+    if (capacity <= table->capacity) return true;
+    if (capacity > (SIZE_MAX / sizeof(internal_archive_entry_data))) return false;
+    grown = (internal_archive_entry_data *)realloc(table->entries, (size_t)capacity * sizeof(internal_archive_entry_data));
+    if (grown == NULL) return false;
+    table->entries = grown;
+    table->capacity = capacity;
     
-bail_and_die:
+    return true;
+}
+
+/**************************************************************************************************
+ * Adds a copy of the given entry to the end of the given entry table, which grows in powers of two.
+ *
+ * Returns true or false if there was not enough memory.
+ **************************************************************************************************/
+int entry_table_append(entry_table *table, const internal_archive_entry_data *entry)
+{
+    if ((table->count == table->capacity) && (entry_table_reserve(table, ((table->capacity == 0) ? 64 : (table->capacity * 2))) == false)) return false;
+    memcpy(&table->entries[table->count], entry, sizeof(internal_archive_entry_data));
+    table->count++;
     
-    free_entry_from_central_dir(entry);
+    return true;
+}
+
+/**************************************************************************************************
+ * Frees the given entry table (but not the strings of its entries, which belong to an arena).
+ **************************************************************************************************/
+void entry_table_free(entry_table *table)
+{
+    if (table->entries != NULL) free(table->entries);
+    memset(table, 0, sizeof(entry_table));
+}
+
+/**************************************************************************************************
+ * Returns the (64 bit FNV-1a) hash of the given entry path.
+ **************************************************************************************************/
+static uint64_t hash_entry_path(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+    
+    return hash;
+}
+
+/**************************************************************************************************
+ * Builds a lookup by path for the entries in the given table. The lookup is kept at most half full
+ * so that probe sequences stay short.
+ *
+ * Returns true or false if there was not enough memory.
+ **************************************************************************************************/
+int build_entry_lookup(entry_lookup *lookup, const entry_table *table)
+{
+    uint64_t slot_count = 16;
+    uint64_t hash = 0;
+    uint64_t slot = 0;
+    
+    while (slot_count < (table->count * 2)) slot_count *= 2;
+    if (slot_count > (SIZE_MAX / sizeof(entry_lookup_slot))) return false;
+    lookup->slots = (entry_lookup_slot *)malloc((size_t)slot_count * sizeof(entry_lookup_slot));
+    if (lookup->slots == NULL) return false;
+    memset(lookup->slots, 0xFF, ((size_t)slot_count * sizeof(entry_lookup_slot)));
+    lookup->mask = slot_count - 1;
+    
+    for (uint64_t idx = 0; idx < table->count; idx++)
+    {
+        hash = hash_entry_path(table->entries[idx].raw_entry_path);
+        slot = hash & lookup->mask;
+        while (lookup->slots[slot].index != ENTRY_LOOKUP_EMPTY) slot = (slot + 1) & lookup->mask;
+        lookup->slots[slot].hash = hash;
+        lookup->slots[slot].index = idx;
+    }
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Returns the entry in the given table with the given path or NULL if there is not one.
+ **************************************************************************************************/
+internal_archive_entry_data *find_entry(const entry_lookup *lookup, const entry_table *table, const char *path)
+{
+    internal_archive_entry_data *entry = NULL;
+    uint64_t hash = 0;
+    uint64_t slot = 0;
+    
+    if (lookup->slots == NULL) return NULL;
+    
+    hash = hash_entry_path(path);
+    for (slot = hash & lookup->mask; lookup->slots[slot].index != ENTRY_LOOKUP_EMPTY; slot = (slot + 1) & lookup->mask)
+    {
+        if (lookup->slots[slot].hash != hash) continue;
+        entry = &table->entries[lookup->slots[slot].index];
+        if (strcmp(entry->raw_entry_path, path) == 0) return entry;
+    }
     
     return NULL;
 }
 
+/**************************************************************************************************
+ * Frees the given entry lookup.
+ **************************************************************************************************/
+void entry_lookup_free(entry_lookup *lookup)
+{
+    if (lookup->slots != NULL) free(lookup->slots);
+    memset(lookup, 0, sizeof(entry_lookup));
+}
+
 ssize_t index_of_last(const char *str, char c)
 {
     char ch = 1;
@@ -1253,72 +1854,251 @@ ssize_t index_of_last(const char *str, char c)
     return idx;
 }
 
-void free_entry_from_central_dir(internal_archive_entry_data *entry)
+/**************************************************************************************************
+ * Parses the extra field at the start of the given data, which must hold at least data_len bytes.
+ * The data member of the extra field header will point into the given data, it is not copied.
+ *
+ * Returns the total length of the extra field (including its header) or -1 if it is truncated.
+ **************************************************************************************************/
+ssize_t read_out_extra_field(const unsigned char *data, size_t data_len, extra_field_header *buffer)
+{
+    if (data_len < 4) return -1;
+    memcpy(&buffer->header_id, data, 2);
+    memcpy(&buffer->data_size, (data + 2), 2);
+    if ((size_t)(buffer->data_size + 4) > data_len) return -1;
+    
+    buffer->data = (buffer->data_size > 0) ? (data + 4) : NULL;
+    
+    return (buffer->data_size + 4);
+}
+
+/**************************************************************************************************
+ * Reads exactly length bytes from the given offset of the given file descriptor, retrying after
+ * short reads and interruptions. The file offset of the descriptor is not used or changed, so any
+ * number of threads may read from the same descriptor at once.
+ *
+ * Returns TRUE if all the data was read or FALSE if an error occurred or the end of the file was
+ * reached first.
+ **************************************************************************************************/
+int read_fully(int fd, void *buffer, size_t length, off_t offset)
 {
-    if (entry != NULL)
+    unsigned char *dest = (unsigned char *)buffer;
+    ssize_t bytes_read = 0;
+    
+    while (length > 0)
     {
-        if (entry->filename != NULL)
+        bytes_read = pread(fd, dest, length, offset);
+        if (bytes_read == -1)
         {
-            free(entry->filename);
-            entry->filename = NULL;
+            if (errno == EINTR) continue;
+            return false;
         }
-        if (entry->directory != NULL)
-        {
-            free(entry->directory);
-            entry->directory = NULL;
-        }
-        if (entry->raw_entry_path == NULL)
+        if (bytes_read == 0) return false;
+        dest += bytes_read;
+        offset += bytes_read;
+        length -= (size_t)bytes_read;
+    }
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Writes exactly length bytes to the given file descriptor, retrying after short writes and
+ * interruptions.
+ *
+ * Returns TRUE if all the data was written or FALSE if an error occurred.
+ **************************************************************************************************/
+int write_fully(int fd, const void *buffer, size_t length)
+{
+    const unsigned char *src = (const unsigned char *)buffer;
+    ssize_t bytes_written = 0;
+    
+    while (length > 0)
+    {
+        bytes_written = write(fd, src, length);
+        if (bytes_written == -1)
         {
-            free(entry->raw_entry_path);
-            entry->raw_entry_path = NULL;
+            if (errno == EINTR) continue;
+            return false;
         }
-        
-        free(entry);
+        src += bytes_written;
+        length -= (size_t)bytes_written;
     }
+    
+    return true;
 }
 
-ssize_t read_out_extra_field(olm_file_t *file, extra_field_header *buffer)
+/**************************************************************************************************
+ * Copies length bytes from the given offset of the archive to the current position of dest_fd, in
+ * chunks of no more than COPY_CHUNK_SIZE. The kernel does the copying where it can, otherwise the
+ * data is written from the mapping (if there is one) or goes through a single chunk sized buffer.
+ *
+ * If crc is not NULL the CRC of the data is worked out as well. Mapped data has it worked out in one
+ * go (on several threads if it is big enough) and is still copied by the kernel, otherwise it is
+ * worked out over the chunks as they pass through the buffer.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int copy_archive_range(olm_file_t *file, uint64_t offset, uint64_t length, int dest_fd, uint32_t *crc)
 {
-    if (read(file->file_seg, buffer, 4) == -1) return -1;
+    unsigned char *buffer = NULL;
+    const unsigned char *chunk_data = NULL;
+    uint64_t done = 0;
+    size_t chunk_len = 0;
+    ssize_t copied = 0;
+    int use_kernel = false;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if ((crc != NULL) && (file->file_map != NULL))
+    {
+        *crc = compute_crc32(*crc, (file->file_map + offset), length);
+        crc = NULL;
+    }
+    use_kernel = (crc == NULL);
     
-    /* Get some memory. */
-    if (buffer->data_size > 0)
+    while ((done < length) && (error_code == OLM_ERROR_SUCCESS))
     {
-        buffer->data = (unsigned char *)malloc(buffer->data_size);
-        if (buffer->data == NULL) return -1;
+        chunk_len = ((length - done) < COPY_CHUNK_SIZE) ? (size_t)(length - done) : COPY_CHUNK_SIZE;
         
-        if (read(file->file_seg, buffer->data, buffer->data_size) == -1)
+        if (use_kernel == true)
         {
-            free(buffer->data);
-            return -1;
+            copied = kernel_copy(file->file_seg, (off_t)(offset + done), dest_fd, chunk_len);
+            if (copied > 0)
+            {
+                done += (uint64_t)copied;
+                continue;
+            }
+            /* The archive is shorter than it claims. */
+            if (copied == 0)
+            {
+                error_code = OLM_ERROR_FILE_IO_ERROR;
+                break;
+            }
+            /* The kernel cannot copy between these files, so do it ourselves from now on. */
+            use_kernel = false;
         }
+        
+        if (file->file_map != NULL)
+        {
+            chunk_data = file->file_map + offset + done;
+        }
+        else
+        {
+            if (buffer == NULL) buffer = (unsigned char *)malloc(COPY_CHUNK_SIZE);
+            if (buffer == NULL)
+            {
+                error_code = OLM_ERROR_NO_MEMORY;
+                break;
+            }
+            if (read_fully(file->file_seg, buffer, chunk_len, (off_t)(offset + done)) == false)
+            {
+                error_code = OLM_ERROR_FILE_IO_ERROR;
+                break;
+            }
+            chunk_data = buffer;
+        }
+        if (crc != NULL) *crc = serial_crc32(*crc, chunk_data, chunk_len);
+        if (write_fully(dest_fd, chunk_data, chunk_len) == false) error_code = OLM_ERROR_FILE_IO_ERROR;
+        done += chunk_len;
     }
-    else
+    
+    if (buffer != NULL) free(buffer);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Inflates the given deflated entry into dest_fd, a window at a time, checking its CRC as it goes
+ * if verify is set.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int inflate_archive_entry(olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int dest_fd, int verify)
+{
+    entry_stream stream;
+    const unsigned char *chunk_data = NULL;
+    size_t chunk_len = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    error_code = entry_stream_open(&stream, file, entry, data_offset, verify, OLM_ERROR_ATTACHMENT_CORRUPTED);
+    while (error_code == OLM_ERROR_SUCCESS)
     {
-        buffer->data = NULL;
+        error_code = entry_stream_next(&stream, &chunk_data, &chunk_len);
+        if ((error_code != OLM_ERROR_SUCCESS) || (chunk_len == 0)) break;
+        if (write_fully(dest_fd, chunk_data, chunk_len) == false) error_code = OLM_ERROR_FILE_IO_ERROR;
     }
+    entry_stream_close(&stream);
     
-    return (buffer->data_size + 4);
+    return error_code;
 }
 
-char *allocate_block_for_buffer(size_t buff_size, size_t *block_size, size_t *block_count)
+/**************************************************************************************************
+ * Has the kernel copy up to length bytes from the given offset of src_fd to the current position of
+ * dest_fd, without the data passing through user space. copy_file_range() is tried first and then
+ * sendfile().
+ *
+ * Returns the number of bytes copied, 0 at the end of src_fd or -1 if neither call can be used for
+ * these descriptors (or failed).
+ **************************************************************************************************/
+ssize_t kernel_copy(int src_fd, off_t src_offset, int dest_fd, size_t length)
 {
-    char *buff = NULL;
-    size_t bs = 0;
+    ssize_t copied = -1;
+    
+#ifdef HAVE_COPY_FILE_RANGE
+    loff_t range_offset = (loff_t)src_offset;
+    
+    do
+    {
+        copied = copy_file_range(src_fd, &range_offset, dest_fd, NULL, length, 0);
+    } while ((copied == -1) && (errno == EINTR));
+    if (copied != -1) return copied;
+    /* Only fall through to sendfile() if copy_file_range() is not supported here. */
+    if ((errno != ENOSYS) && (errno != EXDEV) && (errno != EINVAL) && (errno != EOPNOTSUPP)) return -1;
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    off_t file_offset = src_offset;
+    
+    do
+    {
+        copied = sendfile(dest_fd, src_fd, &file_offset, length);
+    } while ((copied == -1) && (errno == EINTR));
+#endif
     
-    if ((buff_size == 0) || (block_size == NULL) || (block_count == NULL)) return NULL;
+    return copied;
+}
 
-    for (size_t bc = 1; bc <= buff_size; bc++)
+/**************************************************************************************************
+ * Works out where the data of the given entry starts. The local file header that precedes it has
+ * to be read as the lengths of its variable fields may differ from those in the central directory.
+ * Every reader of entry data comes through here, so it also checks that the sizes of the entry fit
+ * the data.
+ *
+ * Returns OLM_ERROR_SUCCESS and stores the offset of the data in data_offset, or an error code.
+ **************************************************************************************************/
+int get_entry_data_offset(olm_file_t *file, internal_archive_entry_data *entry, uint64_t *data_offset)
+{
+    local_file_header header;
+    
+    /* A stored entry is read as entry_size bytes of data, so a central directory that gives it a different size from the
+       data it holds would have the readers run past the data (and the end of any mapping). */
+    if ((entry->compression_method == ZIP_CA_STORED) && (entry->entry_size != entry->entry_compressed_size)) return OLM_ERROR_FILE_CORRUPTED;
+    
+    if (file->file_map != NULL)
     {
-        if ((buff_size % bc) != 0) continue;
-        bs = buff_size / bc;
-        buff = (char *)malloc(bs);
-        if (buff == NULL) continue;
-        *block_count = bc;
-        *block_size = bs;
-        break;
+        if ((entry->file_offset > file->map_size) || ((file->map_size - entry->file_offset) < sizeof(local_file_header))) return OLM_ERROR_FILE_CORRUPTED;
+        memcpy(&header, (file->file_map + entry->file_offset), sizeof(local_file_header));
     }
+    else
+    {
+        if (read_fully(file->file_seg, &header, sizeof(local_file_header), (off_t)entry->file_offset) == false) return OLM_ERROR_FILE_IO_ERROR;
+    }
+    if (header.signature != SIG_LOCAL_FILE_HEADER) return OLM_ERROR_FILE_CORRUPTED; /* Just to make sure. */
     
-    return buff;
+    *data_offset = entry->file_offset + sizeof(local_file_header) + header.filename_length + header.extra_field_length;
+    
+    /* Make sure the whole of the data is inside the mapping. */
+    if ((file->file_map != NULL) && ((*data_offset > file->map_size) || ((file->map_size - *data_offset) < entry->entry_compressed_size))) return OLM_ERROR_FILE_CORRUPTED;
+    
+    return OLM_ERROR_SUCCESS;
 }
 
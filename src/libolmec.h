@@ -25,6 +25,8 @@
 #define _FILE_OFFSET_BITS 64
 #define _DARWIN_USE_64_BIT_INODE
 
+#include "contact.h"
+
 #define INVALID_OLM_FILE                         NULL
 #define INVALID_OLM_MESSAGE                      0
 
@@ -39,6 +41,9 @@
 #define OLM_ERROR_MESSAGE_CORRUPTED              0x07
 #define OLM_ERROR_ATTACHMENT_CORRUPTED           0X08
 #define OLM_ERROR_ATTACHMENT_NOT_FOUND           0x09
+#define OLM_ERROR_CANCELLED                      0x0A
+#define OLM_ERROR_CONTACT_CORRUPTED              0x0B
+#define OLM_ERROR_CATEGORY_NOT_FOUND             0x0C
 
 #define MESSAGE_PRIORITY_HIGHEST                 1
 #define MESSAGE_PRIORITY_HIGH                    2
@@ -47,6 +52,44 @@
 #define MESSAGE_PRIORITY_LOWEST                  5
 
 #define OLM_OPT_IGNORE_ERRORS                    0x01
+#define OLM_OPT_MMAP                             0x02
+#define OLM_OPT_INDEX                            0x04
+#define OLM_OPT_SKIP_CRC                         0x08
+
+/* Predicates for olm_query(), saying which of the members of olm_query_t are to be used. */
+#define OLM_QUERY_SENT_SINCE                     0x0001
+#define OLM_QUERY_SENT_BEFORE                    0x0002
+#define OLM_QUERY_RECEIVED_SINCE                 0x0004
+#define OLM_QUERY_RECEIVED_BEFORE                0x0008
+#define OLM_QUERY_SENDER                         0x0010
+#define OLM_QUERY_RECIPIENT                      0x0020
+#define OLM_QUERY_HAS_ATTACHMENTS                0x0040
+#define OLM_QUERY_PRIORITY                       0x0080
+
+/* Flags for olm_for_each_message(). */
+#define OLM_ITERATE_ARCHIVE_ORDER                0x01
+
+/* Formats for olm_export_metadata(). */
+#define OLM_EXPORT_JSONL                         1
+#define OLM_EXPORT_CSV                           2
+
+/* Message fields for olm_get_message_fields_at(). */
+#define OLM_FIELD_TO                             0x0001
+#define OLM_FIELD_FROM                           0x0002
+#define OLM_FIELD_REPLY_TO                       0x0004
+#define OLM_FIELD_SUBJECT                        0x0008
+#define OLM_FIELD_MESSAGE_ID                     0x0010
+#define OLM_FIELD_BODY                           0x0020
+#define OLM_FIELD_SENT_TIME                      0x0040
+#define OLM_FIELD_RECEIVED_TIME                  0x0080
+#define OLM_FIELD_MODIFIED_TIME                  0x0100
+#define OLM_FIELD_HAS_HTML                       0x0200
+#define OLM_FIELD_HAS_RICH_TEXT                  0x0400
+#define OLM_FIELD_PRIORITY                       0x0800
+#define OLM_FIELD_ATTACHMENTS                    0x1000
+#define OLM_FIELD_CATEGORIES                     0x2000
+#define OLM_FIELD_HEADERS                        0x2FDF             /* Everything but the body and the attachments. */
+#define OLM_FIELD_ALL                            0x3FFF
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +98,12 @@ extern "C" {
 /* Opaque type for the olm file descriptor. */
 typedef struct olm_file_t olm_file_t;
 
+/* Opaque type for a reusable block of memory that messages can be parsed into. */
+typedef struct olm_arena_t olm_arena_t;
+
+/* Opaque type for an attachment opened for reading. */
+typedef struct olm_attachment_reader_t olm_attachment_reader_t;
+
 typedef struct _attch
 {
     char *__private;
@@ -64,6 +113,8 @@ typedef struct _attch
     uint64_t file_size;
 } olm_attachment_t;
 
+/* A parsed message. The text of a field that was wanted but missing from the message (such as a message without a subject)
+   is shared by every message and must not be written to. */
 typedef struct _mail_message
 {
     char *to;
@@ -80,14 +131,85 @@ typedef struct _mail_message
     int message_priority;
     unsigned long attachment_count;
     olm_attachment_t **attachment_list;
+    unsigned long category_count;
+    char **category_list;                                           /* The names of the categories the message is in. */
+    void *__private;
 } olm_mail_message_t;
 
+/* A category from the category list of the archive (Categories.xml). */
+typedef struct _category
+{
+    char *name;
+    char *colour;                                                   /* The background colour (for example #E7A1A2) or NULL. */
+} olm_category_t;
+
+/* The messages that olm_query() is to pass on, a message must meet every predicate that is set. */
+typedef struct _query
+{
+    unsigned int predicates;                                        /* Any of the OLM_QUERY_* values or'ed together. */
+    time_t sent_since;                                              /* Sent at or after this time. */
+    time_t sent_before;                                             /* Sent before this time. */
+    time_t received_since;                                          /* Received at or after this time. */
+    time_t received_before;                                         /* Received before this time. */
+    const char *sender;                                             /* Text found in the sender address (case does not matter). */
+    const char *recipient;                                          /* Text found in any of the recipient addresses (case does not matter). */
+    int has_attachments;                                            /* Non zero for messages with attachments, 0 for those without. */
+    int highest_priority;                                           /* The priorities (MESSAGE_PRIORITY_*) from this one... */
+    int lowest_priority;                                            /* ...to this one. */
+} olm_query_t;
+
+/* Called by olm_for_each_message() for each message, return non zero to stop. */
+typedef int (*olm_message_callback)(olm_file_t *file, uint64_t index, olm_mail_message_t *message, int error_code, void *user_data);
+
+/* Called by olm_stream_attachment() with each block of the attachment in turn, return non zero to stop. */
+typedef int (*olm_attachment_sink)(const void *data, size_t length, void *user_data);
+
+/* Called by olm_for_each_contact() for each contact, return non zero to stop. */
+typedef int (*olm_contact_callback)(olm_file_t *file, uint64_t index, address_card_t *card, void *user_data);
+
+/* Called by olm_search() with the index of each message that matches, return non zero to stop. */
+typedef int (*olm_search_callback)(olm_file_t *file, uint64_t index, void *user_data);
+
+/* Once a file has been opened, olm_get_message_at() and olm_extract_and_save_attachment() may be called
+ * from any number of threads at once on the same olm_file_t. Opening and closing must not overlap them. */
 olm_file_t          *olm_open_file(const char *olm_filename, int opts, int *error_code);
 olm_mail_message_t  *olm_get_message_at(olm_file_t *file, uint64_t index, int *error_code);
 uint64_t             olm_mail_message_count(olm_file_t *file);
 int                  olm_extract_and_save_attachment(olm_file_t *file, olm_attachment_t* attachment, const char *dest_path);
+int                  olm_find_attachment_entry(olm_file_t *file, const char *entry_path, uint64_t *entry_size);
 void                 olm_message_free(olm_mail_message_t *message);
+olm_arena_t         *olm_arena_create(size_t initial_size);
+olm_mail_message_t  *olm_get_message_at_in_arena(olm_file_t *file, uint64_t index, olm_arena_t *arena, int *error_code);
+olm_mail_message_t  *olm_get_message_fields_at(olm_file_t *file, uint64_t index, unsigned int fields, olm_arena_t *arena, int *error_code);
+int                  olm_get_messages(olm_file_t *file, uint64_t first, uint64_t count, olm_mail_message_t **messages);
+int                  olm_extract_messages(olm_file_t *file, uint64_t first, uint64_t count, unsigned int depth, olm_message_callback callback, void *user_data);
+int                  olm_extract_attachments(olm_file_t *file, olm_attachment_t **attachments, const char **dest_paths, uint64_t count, unsigned int depth);
+void                 olm_arena_reset(olm_arena_t *arena);
+void                 olm_arena_destroy(olm_arena_t *arena);
 void                 olm_close_file(olm_file_t *file);
+int                  olm_for_each_message(olm_file_t *file, unsigned int nthreads, olm_message_callback callback, void *user_data, int flags);
+olm_attachment_reader_t *olm_attachment_open(olm_file_t *file, olm_attachment_t *attachment, int *error_code);
+ssize_t              olm_attachment_read(olm_attachment_reader_t *reader, uint64_t offset, void *buffer, size_t length, int *error_code);
+uint64_t             olm_attachment_size(olm_attachment_reader_t *reader);
+void                 olm_attachment_close(olm_attachment_reader_t *reader);
+int                  olm_stream_attachment(olm_file_t *file, olm_attachment_t *attachment, olm_attachment_sink sink, void *user_data);
+int                  olm_verify_message_at(olm_file_t *file, uint64_t index);
+int                  olm_verify_attachment(olm_file_t *file, olm_attachment_t *attachment);
+uint64_t             olm_contact_count(olm_file_t *file);
+address_card_t      *olm_get_contact_at(olm_file_t *file, uint64_t index, int *error_code);
+void                 olm_contact_free(address_card_t *card);
+int                  olm_for_each_contact(olm_file_t *file, olm_contact_callback callback, void *user_data);
+uint64_t             olm_category_count(olm_file_t *file);
+const olm_category_t *olm_get_category_at(olm_file_t *file, uint64_t index);
+int                  olm_find_category(olm_file_t *file, const char *name, uint64_t *index);
+int                  olm_get_category_messages(olm_file_t *file, uint64_t index, const uint64_t **message_indexes, uint64_t *count);
+time_t               olm_parse_date_time(const char *text);
+int                  olm_build_search_index(olm_file_t *file);
+int                  olm_search(olm_file_t *file, const char *query, olm_search_callback callback, void *user_data);
+int                  olm_query(olm_file_t *file, const olm_query_t *query, unsigned int fields, olm_message_callback callback, void *user_data);
+int                  olm_export_mbox(olm_file_t *file, const char *dest_path, unsigned int nthreads);
+int                  olm_export_eml_dir(olm_file_t *file, const char *dest_dir, unsigned int nthreads);
+int                  olm_export_metadata(olm_file_t *file, int format, int fd, unsigned int fields);
     
 #ifdef __cplusplus
 }
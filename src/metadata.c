@@ -0,0 +1,530 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * metadata.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* The size of the buffer the records are written into, and the most that is put into it in one go (an escaped character
+   or a number), so that only whole strings need checking for room. */
+#define METADATA_BUFFER_SIZE                     (1024 * 1024)
+#define METADATA_MAX_ITEM_SIZE                   32
+
+/* The fields that can be exported, which is everything but the body. */
+#define METADATA_FIELDS                          (OLM_FIELD_ALL & ~OLM_FIELD_BODY)
+
+/* The buffer the records are built in, which is written out whenever it fills up. */
+typedef struct _metadata_output
+{
+    int fd;
+    int format;                                                     /* OLM_EXPORT_JSONL or OLM_EXPORT_CSV. */
+    unsigned char *data;
+    size_t length;
+    int first_field;                                                /* Set until the first field of a record has been written. */
+    int error_code;
+} metadata_output;
+
+static void write_record(metadata_output *output, uint64_t index, olm_mail_message_t *message, unsigned int fields);
+static void write_header_row(metadata_output *output, unsigned int fields);
+static void begin_field(metadata_output *output, const char *name);
+static void write_string(metadata_output *output, const char *text, size_t length);
+static void write_escaped(metadata_output *output, const char *text, size_t length);
+static void write_address_list(metadata_output *output, const char *list);
+static void open_list(metadata_output *output);
+static void separate_list(metadata_output *output);
+static void close_list(metadata_output *output);
+static void write_list_text(metadata_output *output, const char *text, size_t length);
+static void write_number(metadata_output *output, uint64_t value);
+static void write_time(metadata_output *output, time_t when);
+static void write_null(metadata_output *output);
+static void write_raw(metadata_output *output, const char *text, size_t length);
+static unsigned char *make_room(metadata_output *output, size_t length);
+static void flush_output(metadata_output *output);
+static int is_placeholder(const char *text, const char *placeholder);
+
+/******************************************************************************************************************************
+ * Writes a record of metadata for each message in the archive to the given file descriptor, one record to a line, as JSON
+ * Lines or CSV. Only the fields asked for are parsed, into an arena that is reused from one message to the next, and the
+ * records are escaped from there into a large buffer that is written out as it fills. The bodies are never read, and the
+ * only allocations made for each message are those of the XML reader.
+ *
+ * In JSON Lines each record is an object holding "index" and the fields asked for. Times are ISO 8601 strings in UTC,
+ * addresses, attachment sizes and categories are arrays and missing values are null. In CSV the first line names the
+ * columns, lists are separated by semicolons and lines end in CRLF (RFC 4180).
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to export the metadata of.
+ *   format         OLM_EXPORT_JSONL or OLM_EXPORT_CSV.
+ *   fd             Where to write the records, which is left open.
+ *   fields         The fields wanted, any of the OLM_FIELD_* values but OLM_FIELD_BODY or'ed together. OLM_FIELD_ATTACHMENTS
+ *                  gives the number of attachments and their sizes.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS or an error code. If the file was opened with OLM_OPT_IGNORE_ERRORS, messages that cannot be read are
+ *   left out rather than stopping the export.
+ ******************************************************************************************************************************/
+int olm_export_metadata(olm_file_t *file, int format, int fd, unsigned int fields)
+{
+    metadata_output output;
+    internal_archive_entry_data *entry = NULL;
+    olm_mail_message_t *message = NULL;
+    olm_arena_t *arena = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if (((format != OLM_EXPORT_JSONL) && (format != OLM_EXPORT_CSV)) || (fd < 0)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    memset(&output, 0, sizeof(metadata_output));
+    output.fd = fd;
+    output.format = format;
+    output.data = (unsigned char *)malloc(METADATA_BUFFER_SIZE);
+    arena = olm_arena_create(0);
+    if ((output.data == NULL) || (arena == NULL))
+    {
+        output.error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    fields &= METADATA_FIELDS;
+    if (format == OLM_EXPORT_CSV) write_header_row(&output, fields);
+    
+    for (uint64_t idx = 0; (idx < file->message_entries.count) && (output.error_code == OLM_ERROR_SUCCESS); idx++)
+    {
+        entry = &file->message_entries.entries[idx];
+        olm_arena_reset(arena);
+        message = get_message(file, entry, NULL, arena, fields, NULL, &error_code);
+        if (message == INVALID_OLM_MESSAGE)
+        {
+            if (((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) && (error_code != OLM_ERROR_NO_MEMORY)) continue;
+            output.error_code = error_code;
+            break;
+        }
+        write_record(&output, idx, message, fields);
+    }
+    flush_output(&output);
+
+bail_and_die:
+    
+    if (arena != NULL) olm_arena_destroy(arena);
+    if (output.data != NULL) free(output.data);
+    
+    return output.error_code;
+}
+
+/**************************************************************************************************
+ * Writes the record for one message, with the fields in the same order as write_header_row().
+ **************************************************************************************************/
+static void write_record(metadata_output *output, uint64_t index, olm_mail_message_t *message, unsigned int fields)
+{
+    output->first_field = true;
+    if (output->format == OLM_EXPORT_JSONL) write_raw(output, "{", 1);
+    
+    begin_field(output, "index");
+    write_number(output, index);
+    if ((fields & OLM_FIELD_SENT_TIME) != 0)
+    {
+        begin_field(output, "sent_time");
+        write_time(output, message->sent_time);
+    }
+    if ((fields & OLM_FIELD_RECEIVED_TIME) != 0)
+    {
+        begin_field(output, "received_time");
+        write_time(output, message->received_time);
+    }
+    if ((fields & OLM_FIELD_MODIFIED_TIME) != 0)
+    {
+        begin_field(output, "modified_time");
+        write_time(output, message->modified_time);
+    }
+    if ((fields & OLM_FIELD_FROM) != 0)
+    {
+        begin_field(output, "from");
+        write_address_list(output, (is_placeholder(message->from, NO_ADDRESS) ? NULL : message->from));
+    }
+    if ((fields & OLM_FIELD_TO) != 0)
+    {
+        begin_field(output, "to");
+        write_address_list(output, (is_placeholder(message->to, NO_ADDRESS) ? NULL : message->to));
+    }
+    if ((fields & OLM_FIELD_REPLY_TO) != 0)
+    {
+        begin_field(output, "reply_to");
+        write_address_list(output, (is_placeholder(message->reply_to, NO_ADDRESS) ? NULL : message->reply_to));
+    }
+    if ((fields & OLM_FIELD_SUBJECT) != 0)
+    {
+        begin_field(output, "subject");
+        if (is_placeholder(message->subject, NO_SUBJECT)) write_null(output);
+        else write_string(output, message->subject, strlen(message->subject));
+    }
+    if ((fields & OLM_FIELD_MESSAGE_ID) != 0)
+    {
+        begin_field(output, "message_id");
+        if (is_placeholder(message->message_id, NO_MID)) write_null(output);
+        else write_string(output, message->message_id, strlen(message->message_id));
+    }
+    if ((fields & OLM_FIELD_PRIORITY) != 0)
+    {
+        begin_field(output, "priority");
+        if (message->message_priority == 0) write_null(output);
+        else write_number(output, (uint64_t)message->message_priority);
+    }
+    if ((fields & OLM_FIELD_HAS_HTML) != 0)
+    {
+        begin_field(output, "has_html");
+        write_number(output, (message->has_html != 0));
+    }
+    if ((fields & OLM_FIELD_HAS_RICH_TEXT) != 0)
+    {
+        begin_field(output, "has_rich_text");
+        write_number(output, (message->has_rich_text != 0));
+    }
+    if ((fields & OLM_FIELD_ATTACHMENTS) != 0)
+    {
+        begin_field(output, "attachment_count");
+        write_number(output, message->attachment_count);
+        begin_field(output, "attachment_sizes");
+        open_list(output);
+        for (unsigned long idx = 0; idx < message->attachment_count; idx++)
+        {
+            if (idx > 0) separate_list(output);
+            write_number(output, message->attachment_list[idx]->file_size);
+        }
+        close_list(output);
+    }
+    if ((fields & OLM_FIELD_CATEGORIES) != 0)
+    {
+        begin_field(output, "categories");
+        open_list(output);
+        for (unsigned long idx = 0; idx < message->category_count; idx++)
+        {
+            if (idx > 0) separate_list(output);
+            write_list_text(output, message->category_list[idx], strlen(message->category_list[idx]));
+        }
+        close_list(output);
+    }
+    
+    if (output->format == OLM_EXPORT_JSONL) write_raw(output, "}\n", 2);
+    else write_raw(output, "\r\n", 2);
+}
+
+/**************************************************************************************************
+ * Writes the line of column names that starts a CSV file.
+ **************************************************************************************************/
+static void write_header_row(metadata_output *output, unsigned int fields)
+{
+    write_raw(output, "index", 5);
+    if ((fields & OLM_FIELD_SENT_TIME) != 0) write_raw(output, ",sent_time", 10);
+    if ((fields & OLM_FIELD_RECEIVED_TIME) != 0) write_raw(output, ",received_time", 14);
+    if ((fields & OLM_FIELD_MODIFIED_TIME) != 0) write_raw(output, ",modified_time", 14);
+    if ((fields & OLM_FIELD_FROM) != 0) write_raw(output, ",from", 5);
+    if ((fields & OLM_FIELD_TO) != 0) write_raw(output, ",to", 3);
+    if ((fields & OLM_FIELD_REPLY_TO) != 0) write_raw(output, ",reply_to", 9);
+    if ((fields & OLM_FIELD_SUBJECT) != 0) write_raw(output, ",subject", 8);
+    if ((fields & OLM_FIELD_MESSAGE_ID) != 0) write_raw(output, ",message_id", 11);
+    if ((fields & OLM_FIELD_PRIORITY) != 0) write_raw(output, ",priority", 9);
+    if ((fields & OLM_FIELD_HAS_HTML) != 0) write_raw(output, ",has_html", 9);
+    if ((fields & OLM_FIELD_HAS_RICH_TEXT) != 0) write_raw(output, ",has_rich_text", 14);
+    if ((fields & OLM_FIELD_ATTACHMENTS) != 0) write_raw(output, ",attachment_count,attachment_sizes", 34);
+    if ((fields & OLM_FIELD_CATEGORIES) != 0) write_raw(output, ",categories", 11);
+    write_raw(output, "\r\n", 2);
+}
+
+/**************************************************************************************************
+ * Starts a field of a record, with its name in JSON and a comma between fields in either format.
+ **************************************************************************************************/
+static void begin_field(metadata_output *output, const char *name)
+{
+    if (output->first_field == false) write_raw(output, ",", 1);
+    output->first_field = false;
+    if (output->format == OLM_EXPORT_JSONL)
+    {
+        write_raw(output, "\"", 1);
+        write_raw(output, name, strlen(name));
+        write_raw(output, "\":", 2);
+    }
+}
+
+/**************************************************************************************************
+ * Writes a string value, quoted and escaped for the format.
+ **************************************************************************************************/
+static void write_string(metadata_output *output, const char *text, size_t length)
+{
+    write_raw(output, "\"", 1);
+    write_escaped(output, text, length);
+    write_raw(output, "\"", 1);
+}
+
+/**************************************************************************************************
+ * Copies text into the buffer escaping it on the way for the inside of a quoted value, with JSON
+ * escapes or (in CSV) doubled quotes. Runs of text that need no escaping are copied in one go.
+ **************************************************************************************************/
+static void write_escaped(metadata_output *output, const char *text, size_t length)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const unsigned char *curr = (const unsigned char *)text;
+    const unsigned char *end = curr + length;
+    const unsigned char *limit = NULL;
+    unsigned char *dest = NULL;
+    
+    while (curr < end)
+    {
+        dest = make_room(output, METADATA_MAX_ITEM_SIZE);
+        if (dest == NULL) return;
+        
+        limit = ((size_t)(end - curr) < (METADATA_BUFFER_SIZE - output->length)) ? end : (curr + (METADATA_BUFFER_SIZE - output->length));
+        for (; curr < limit; curr++)
+        {
+            if ((*curr == '"') || ((output->format == OLM_EXPORT_JSONL) && ((*curr < 0x20) || (*curr == '\\')))) break;
+            *dest++ = *curr;
+        }
+        output->length = (size_t)(dest - output->data);
+        
+        /* Either everything has been copied, the buffer needs writing out or a character needs escaping. */
+        if ((curr == end) || ((METADATA_BUFFER_SIZE - output->length) < METADATA_MAX_ITEM_SIZE)) continue;
+        *dest++ = (output->format == OLM_EXPORT_CSV) ? '"' : '\\';
+        switch (*curr)
+        {
+            case '"': *dest++ = '"'; break;
+            case '\\': *dest++ = '\\'; break;
+            case '\n': *dest++ = 'n'; break;
+            case '\r': *dest++ = 'r'; break;
+            case '\t': *dest++ = 't'; break;
+            case '\b': *dest++ = 'b'; break;
+            case '\f': *dest++ = 'f'; break;
+            default:
+                memcpy(dest, "u00", 3);
+                dest[3] = (unsigned char)hex_digits[*curr >> 4];
+                dest[4] = (unsigned char)hex_digits[*curr & 0x0F];
+                dest += 5;
+                break;
+        }
+        output->length = (size_t)(dest - output->data);
+        curr++;
+    }
+}
+
+/**************************************************************************************************
+ * Writes a comma separated list of addresses (as the parser leaves them) as a list, or as a
+ * missing value if there are none.
+ **************************************************************************************************/
+static void write_address_list(metadata_output *output, const char *list)
+{
+    const char *item_end = NULL;
+    int item = 0;
+    
+    if (list == NULL)
+    {
+        write_null(output);
+        return;
+    }
+    
+    open_list(output);
+    for (const char *curr = list; *curr != '\0'; curr = item_end)
+    {
+        item_end = strchr(curr, ',');
+        if (item_end == NULL) item_end = curr + strlen(curr);
+        if (item_end > curr)
+        {
+            if (item++ > 0) separate_list(output);
+            write_list_text(output, curr, (size_t)(item_end - curr));
+        }
+        if (*item_end != '\0') item_end++;
+    }
+    close_list(output);
+}
+
+/**************************************************************************************************
+ * Starts a list, a JSON array or in CSV a single quoted field with the items separated by
+ * semicolons.
+ **************************************************************************************************/
+static void open_list(metadata_output *output)
+{
+    write_raw(output, ((output->format == OLM_EXPORT_JSONL) ? "[" : "\""), 1);
+}
+
+/**************************************************************************************************
+ * Goes between two items of a list.
+ **************************************************************************************************/
+static void separate_list(metadata_output *output)
+{
+    write_raw(output, ((output->format == OLM_EXPORT_JSONL) ? "," : ";"), 1);
+}
+
+/**************************************************************************************************
+ * Ends a list.
+ **************************************************************************************************/
+static void close_list(metadata_output *output)
+{
+    write_raw(output, ((output->format == OLM_EXPORT_JSONL) ? "]" : "\""), 1);
+}
+
+/**************************************************************************************************
+ * Writes a string item of a list, which is quoted in JSON and inside the quotes of the list in
+ * CSV.
+ **************************************************************************************************/
+static void write_list_text(metadata_output *output, const char *text, size_t length)
+{
+    if (output->format == OLM_EXPORT_JSONL) write_string(output, text, length);
+    else write_escaped(output, text, length);
+}
+
+/**************************************************************************************************
+ * Writes a number in decimal.
+ **************************************************************************************************/
+static void write_number(metadata_output *output, uint64_t value)
+{
+    char digits[24];
+    size_t count = 0;
+    unsigned char *dest = make_room(output, sizeof(digits));
+    
+    if (dest == NULL) return;
+    do
+    {
+        digits[count++] = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value > 0);
+    while (count > 0) *dest++ = (unsigned char)digits[--count];
+    output->length = (size_t)(dest - output->data);
+}
+
+/**************************************************************************************************
+ * Writes a time as an ISO 8601 string in UTC (2012-06-11T09:27:23Z), or null if there is none or
+ * it could not be parsed ((time_t)-1).
+ **************************************************************************************************/
+static void write_time(metadata_output *output, time_t when)
+{
+    struct tm parts;
+    unsigned char *dest = NULL;
+    int quoted = (output->format == OLM_EXPORT_JSONL);
+    
+    memset(&parts, 0, sizeof(parts));
+    if ((when == 0) || (when == (time_t)-1) || (gmtime_r(&when, &parts) == NULL) || (parts.tm_year < -1900) || (parts.tm_year > 8099))
+    {
+        write_null(output);
+        return;
+    }
+    
+    dest = make_room(output, 22);
+    if (dest == NULL) return;
+    if (quoted) *dest++ = '"';
+    dest[0] = (unsigned char)('0' + ((parts.tm_year + 1900) / 1000));
+    dest[1] = (unsigned char)('0' + (((parts.tm_year + 1900) / 100) % 10));
+    dest[2] = (unsigned char)('0' + (((parts.tm_year + 1900) / 10) % 10));
+    dest[3] = (unsigned char)('0' + ((parts.tm_year + 1900) % 10));
+    dest[4] = '-';
+    dest[5] = (unsigned char)('0' + ((parts.tm_mon + 1) / 10));
+    dest[6] = (unsigned char)('0' + ((parts.tm_mon + 1) % 10));
+    dest[7] = '-';
+    dest[8] = (unsigned char)('0' + (parts.tm_mday / 10));
+    dest[9] = (unsigned char)('0' + (parts.tm_mday % 10));
+    dest[10] = 'T';
+    dest[11] = (unsigned char)('0' + (parts.tm_hour / 10));
+    dest[12] = (unsigned char)('0' + (parts.tm_hour % 10));
+    dest[13] = ':';
+    dest[14] = (unsigned char)('0' + (parts.tm_min / 10));
+    dest[15] = (unsigned char)('0' + (parts.tm_min % 10));
+    dest[16] = ':';
+    dest[17] = (unsigned char)('0' + (parts.tm_sec / 10));
+    dest[18] = (unsigned char)('0' + (parts.tm_sec % 10));
+    dest[19] = 'Z';
+    dest += 20;
+    if (quoted) *dest++ = '"';
+    output->length = (size_t)(dest - output->data);
+}
+
+/**************************************************************************************************
+ * Writes a missing value, null in JSON and an empty field in CSV.
+ **************************************************************************************************/
+static void write_null(metadata_output *output)
+{
+    if (output->format == OLM_EXPORT_JSONL) write_raw(output, "null", 4);
+}
+
+/**************************************************************************************************
+ * Appends the given bytes to the buffer as they are.
+ **************************************************************************************************/
+static void write_raw(metadata_output *output, const char *text, size_t length)
+{
+    size_t room = 0;
+    
+    while (length > 0)
+    {
+        if (make_room(output, 1) == NULL) return;
+        room = METADATA_BUFFER_SIZE - output->length;
+        if (room > length) room = length;
+        memcpy((output->data + output->length), text, room);
+        output->length += room;
+        text += room;
+        length -= room;
+    }
+}
+
+/**************************************************************************************************
+ * Makes sure there are at least length bytes (no more than METADATA_MAX_ITEM_SIZE) free in the
+ * buffer, writing it out if there are not.
+ *
+ * Returns where the free space starts or NULL if the buffer could not be written.
+ **************************************************************************************************/
+static unsigned char *make_room(metadata_output *output, size_t length)
+{
+    if ((METADATA_BUFFER_SIZE - output->length) < length) flush_output(output);
+    if (output->error_code != OLM_ERROR_SUCCESS) return NULL;
+    
+    return (output->data + output->length);
+}
+
+/**************************************************************************************************
+ * Writes out the buffer and empties it. Once a write has failed nothing more is written.
+ **************************************************************************************************/
+static void flush_output(metadata_output *output)
+{
+    if ((output->error_code == OLM_ERROR_SUCCESS) && (output->length > 0) && (write_fully(output->fd, output->data, output->length) == false))
+    {
+        output->error_code = OLM_ERROR_FILE_IO_ERROR;
+    }
+    output->length = 0;
+}
+
+/**************************************************************************************************
+ * Returns true if the given field is missing or holds the placeholder the parser puts in for a
+ * missing value.
+ **************************************************************************************************/
+static int is_placeholder(const char *text, const char *placeholder)
+{
+    return ((text == NULL) || (strcmp(text, placeholder) == 0));
+}
@@ -0,0 +1,371 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * parallel.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+/* The number of messages that may be parsed ahead of the next one to be delivered in archive order (per worker). */
+#define REORDER_WINDOW_PER_WORKER                8
+
+#define IS_CANCELLED(state)                      __atomic_load_n(&(state)->cancelled, __ATOMIC_ACQUIRE)
+#define SET_CANCELLED(state)                     __atomic_store_n(&(state)->cancelled, true, __ATOMIC_RELEASE)
+
+/* A range of message indexes owned by a worker, other workers steal from the end of it. */
+typedef struct _work_range
+{
+    pthread_mutex_t lock;
+    uint64_t next;                                                  /* The next index to be parsed. */
+    uint64_t end;                                                   /* One past the last index in the range. */
+} work_range;
+
+/* A parsed message waiting to be delivered in archive order. */
+typedef struct _pending_message
+{
+    int ready;
+    int error_code;
+    olm_mail_message_t *message;
+} pending_message;
+
+typedef struct _for_each_state
+{
+    olm_file_t *file;
+    olm_message_callback callback;
+    void *user_data;
+    int flags;
+    uint64_t message_count;
+    unsigned int worker_count;
+    int cancelled;                                                  /* Set once the callback has asked us to stop (accessed atomically). */
+    pthread_mutex_t deliver_lock;                                   /* Serialises the calls to the callback. */
+    pthread_cond_t deliver_cond;
+    work_range *ranges;                                             /* One per worker (completion order only). */
+    uint64_t next_to_claim;                                         /* The next index to be parsed (archive order only). */
+    uint64_t next_to_deliver;                                       /* The next index to be delivered (archive order only). */
+    uint64_t window_size;
+    pending_message *window;                                        /* Ring buffer of parsed messages (archive order only). */
+} for_each_state;
+
+typedef struct _worker_args
+{
+    for_each_state *state;
+    unsigned int worker_id;
+} worker_args;
+
+static void *ordered_worker(void *arg);
+static void *unordered_worker(void *arg);
+static int claim_from_range(work_range *range, uint64_t *index);
+static int steal_range(for_each_state *state, unsigned int thief);
+
+/******************************************************************************************************************************
+ * Parses every message in the archive using a pool of worker threads and passes each one to the given callback.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The OLM file to iterate over. Cannot be NULL.
+ *   nthreads       The number of worker threads to use, or 0 to use one per online processor.
+ *   callback       The function to call for each message. Calls are never made concurrently. The callback owns the message
+ *                  and must release it with olm_message_free(). If the message could not be parsed the callback is passed
+ *                  NULL and the error code. Returning a non zero value stops the iteration.
+ *   user_data      Passed unchanged to the callback.
+ *   flags          OLM_ITERATE_ARCHIVE_ORDER to deliver the messages in archive order, otherwise they are delivered in the
+ *                  order that they finish parsing.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS once every message has been delivered, OLM_ERROR_CANCELLED if the callback stopped the iteration or
+ *   another error code if the iteration could not be started.
+ ******************************************************************************************************************************/
+int olm_for_each_message(olm_file_t *file, unsigned int nthreads, olm_message_callback callback, void *user_data, int flags)
+{
+    for_each_state state;
+    worker_args *args = NULL;
+    pthread_t *threads = NULL;
+    unsigned int started = 0;
+    int was_worker = false;
+    void *(*worker_main)(void *) = NULL;
+    int error_code = OLM_ERROR_NO_MEMORY;
+    
+    if ((file == NULL) || (callback == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    memset(&state, 0, sizeof(for_each_state));
+    state.file = file;
+    state.callback = callback;
+    state.user_data = user_data;
+    state.flags = flags;
+    state.message_count = olm_mail_message_count(file);
+    if (state.message_count == 0) return OLM_ERROR_SUCCESS;
+    
+    /* Work out how many workers we need. */
+    if (nthreads == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (online > 0) ? (unsigned int)online : 1;
+    }
+    if (nthreads > state.message_count) nthreads = (unsigned int)state.message_count;
+    state.worker_count = nthreads;
+    
+    pthread_mutex_init(&state.deliver_lock, NULL);
+    pthread_cond_init(&state.deliver_cond, NULL);
+    
+    args = (worker_args *)malloc(sizeof(worker_args) * nthreads);
+    threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+    if ((args == NULL) || (threads == NULL)) goto bail_and_die;
+    
+    if ((flags & OLM_ITERATE_ARCHIVE_ORDER) == OLM_ITERATE_ARCHIVE_ORDER)
+    {
+        /* The workers claim one message at a time so that they stay close to the next one to be delivered. */
+        state.window_size = (uint64_t)nthreads * REORDER_WINDOW_PER_WORKER;
+        state.window = (pending_message *)malloc(sizeof(pending_message) * state.window_size);
+        if (state.window == NULL) goto bail_and_die;
+        memset(state.window, 0, sizeof(pending_message) * state.window_size);
+        worker_main = ordered_worker;
+    }
+    else
+    {
+        /* Each worker starts with an equal share of the messages and steals from the others when it runs out. */
+        state.ranges = (work_range *)malloc(sizeof(work_range) * nthreads);
+        if (state.ranges == NULL) goto bail_and_die;
+        for (unsigned int idx = 0; idx < nthreads; idx++)
+        {
+            pthread_mutex_init(&state.ranges[idx].lock, NULL);
+            state.ranges[idx].next = (state.message_count * idx) / nthreads;
+            state.ranges[idx].end = (state.message_count * (idx + 1)) / nthreads;
+        }
+        worker_main = unordered_worker;
+    }
+    
+    /* The calling thread is worker 0, any workers that cannot be started simply have their share stolen. */
+    for (unsigned int idx = 0; idx < nthreads; idx++)
+    {
+        args[idx].state = &state;
+        args[idx].worker_id = idx;
+    }
+    for (unsigned int idx = 1; idx < nthreads; idx++)
+    {
+        if (pthread_create(&threads[started], NULL, worker_main, &args[idx]) != 0) break;
+        ++started;
+    }
+    was_worker = set_worker_thread(true);
+    worker_main(&args[0]);
+    set_worker_thread(was_worker);
+    for (unsigned int idx = 0; idx < started; idx++) pthread_join(threads[idx], NULL);
+    
+    error_code = (IS_CANCELLED(&state)) ? OLM_ERROR_CANCELLED : OLM_ERROR_SUCCESS;
+    
+bail_and_die:
+    
+    /* Anything parsed but not delivered (because we were cancelled) must be freed. */
+    if (state.window != NULL)
+    {
+        for (uint64_t idx = 0; idx < state.window_size; idx++)
+        {
+            if (state.window[idx].message != NULL) olm_message_free(state.window[idx].message);
+        }
+        free(state.window);
+    }
+    if (state.ranges != NULL)
+    {
+        for (unsigned int idx = 0; idx < nthreads; idx++) pthread_mutex_destroy(&state.ranges[idx].lock);
+        free(state.ranges);
+    }
+    pthread_cond_destroy(&state.deliver_cond);
+    pthread_mutex_destroy(&state.deliver_lock);
+    if (threads != NULL) free(threads);
+    if (args != NULL) free(args);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Worker for archive order iteration. Messages are claimed one at a time from a shared cursor and
+ * parked in the reorder window until all the messages before them have been delivered. A worker
+ * that gets too far ahead waits, which bounds the number of parsed messages held in memory.
+ **************************************************************************************************/
+static void *ordered_worker(void *arg)
+{
+    for_each_state *state = ((worker_args *)arg)->state;
+    olm_mail_message_t *message = NULL;
+    pending_message *slot = NULL;
+    uint64_t index = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    set_worker_thread(true);
+    
+    while (IS_CANCELLED(state) == false)
+    {
+        index = __sync_fetch_and_add(&state->next_to_claim, 1);
+        if (index >= state->message_count) break;
+        
+        /* Wait for room in the window, the worker holding the next message to be delivered never waits. */
+        pthread_mutex_lock(&state->deliver_lock);
+        while ((IS_CANCELLED(state) == false) && (index >= (state->next_to_deliver + state->window_size))) pthread_cond_wait(&state->deliver_cond, &state->deliver_lock);
+        pthread_mutex_unlock(&state->deliver_lock);
+        if (IS_CANCELLED(state)) break;
+        
+        message = olm_get_message_at(state->file, index, &error_code);
+        
+        pthread_mutex_lock(&state->deliver_lock);
+        slot = &state->window[index % state->window_size];
+        slot->message = message;
+        slot->error_code = error_code;
+        slot->ready = true;
+        
+        /* Deliver everything that is now in sequence. */
+        slot = &state->window[state->next_to_deliver % state->window_size];
+        while ((IS_CANCELLED(state) == false) && (slot->ready))
+        {
+            message = slot->message;
+            error_code = slot->error_code;
+            memset(slot, 0, sizeof(pending_message));
+            if (state->callback(state->file, state->next_to_deliver, message, error_code, state->user_data) != 0) SET_CANCELLED(state);
+            state->next_to_deliver++;
+            slot = &state->window[state->next_to_deliver % state->window_size];
+        }
+        pthread_cond_broadcast(&state->deliver_cond);
+        pthread_mutex_unlock(&state->deliver_lock);
+    }
+    
+    return NULL;
+}
+
+/**************************************************************************************************
+ * Worker for completion order iteration. The worker parses the messages in its own range and then
+ * steals half of the largest remaining range from the other workers until there is nothing left.
+ **************************************************************************************************/
+static void *unordered_worker(void *arg)
+{
+    for_each_state *state = ((worker_args *)arg)->state;
+    unsigned int worker_id = ((worker_args *)arg)->worker_id;
+    olm_mail_message_t *message = NULL;
+    uint64_t index = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    set_worker_thread(true);
+    
+    while (IS_CANCELLED(state) == false)
+    {
+        if (claim_from_range(&state->ranges[worker_id], &index) == false)
+        {
+            if (steal_range(state, worker_id) == false) break;
+            continue;
+        }
+        
+        message = olm_get_message_at(state->file, index, &error_code);
+        
+        pthread_mutex_lock(&state->deliver_lock);
+        if (IS_CANCELLED(state) == false)
+        {
+            if (state->callback(state->file, index, message, error_code, state->user_data) != 0) SET_CANCELLED(state);
+        }
+        else if (message != NULL)
+        {
+            olm_message_free(message);
+        }
+        pthread_mutex_unlock(&state->deliver_lock);
+    }
+    
+    return NULL;
+}
+
+/**************************************************************************************************
+ * Takes the next index from the front of the given range. Returns FALSE if the range is empty.
+ **************************************************************************************************/
+static int claim_from_range(work_range *range, uint64_t *index)
+{
+    int claimed = false;
+    
+    pthread_mutex_lock(&range->lock);
+    if (range->next < range->end)
+    {
+        *index = range->next;
+        __atomic_store_n(&range->next, (range->next + 1), __ATOMIC_RELAXED);
+        claimed = true;
+    }
+    pthread_mutex_unlock(&range->lock);
+    
+    return claimed;
+}
+
+/**************************************************************************************************
+ * Moves the back half of the largest range belonging to another worker into the (empty) range of
+ * the given worker. Only one lock is ever held at a time. Returns FALSE if there was nothing left
+ * to steal.
+ **************************************************************************************************/
+static int steal_range(for_each_state *state, unsigned int thief)
+{
+    work_range *victim = NULL;
+    uint64_t remaining = 0;
+    uint64_t largest = 0;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint64_t next = 0;
+    
+    while (true)
+    {
+        /* Find the worker with the most left to do (without locking, this is only a hint). */
+        victim = NULL;
+        largest = 0;
+        for (unsigned int idx = 0; idx < state->worker_count; idx++)
+        {
+            if (idx == thief) continue;
+            next = __atomic_load_n(&state->ranges[idx].next, __ATOMIC_RELAXED);
+            end = __atomic_load_n(&state->ranges[idx].end, __ATOMIC_RELAXED);
+            remaining = (next < end) ? (end - next) : 0;
+            if (remaining > largest)
+            {
+                largest = remaining;
+                victim = &state->ranges[idx];
+            }
+        }
+        if (victim == NULL) return false;
+        
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end)
+        {
+            remaining = victim->end - victim->next;
+            end = victim->end;
+            start = end - ((remaining + 1) / 2);
+            __atomic_store_n(&victim->end, start, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&victim->lock);
+            
+            pthread_mutex_lock(&state->ranges[thief].lock);
+            __atomic_store_n(&state->ranges[thief].next, start, __ATOMIC_RELAXED);
+            __atomic_store_n(&state->ranges[thief].end, end, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&state->ranges[thief].lock);
+            
+            return true;
+        }
+        /* Somebody else got there first, look again. */
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
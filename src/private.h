@@ -112,6 +112,21 @@ typedef struct eocd_record64
     uint16_t hash_data_length;                                      /* Length of hash data. */
 } __attribute__((__packed__)) eocd_record64;
 
+/* ZIP file local file header structure (the fixed part that precedes the file name). */
+typedef struct _local_file_header
+{
+    uint32_t signature;                                             /* Local file header signature 4 bytes (0x04034b50). */
+    uint16_t extract_version;                                       /* Version needed to extract 2 bytes. */
+    uint16_t bit_flag;                                              /* General purpose bit flag 2 bytes. */
+    uint16_t compression_method;                                    /* Compression method 2 bytes. */
+    uint32_t file_date_time;                                        /* Last mod file time and date 4 bytes. */
+    uint32_t crc32;                                                 /* CRC-32 4 bytes. */
+    uint32_t compressed_size;                                       /* Compressed size 4 bytes. */
+    uint32_t uncompressed_size;                                     /* Uncompressed size 4 bytes. */
+    uint16_t filename_length;                                       /* File name length 2 bytes. */
+    uint16_t extra_field_length;                                    /* Extra field length 2 bytes. */
+} __attribute__((__packed__)) local_file_header;
+
 typedef struct _central_dir_entry_header
 {
     uint32_t signature;
@@ -137,23 +152,61 @@ typedef struct _central_dir_entry_header
     uint32_t local_header_offset;
 } __attribute__((__packed__)) central_dir_entry_header;
 
-/* Internal archive entry decriptor. */
+/* Internal archive entry decriptor (the values needed to read an entry come first, the strings are kept in an arena). */
 typedef struct _internal_archive_entry_data
 {
-    char *raw_entry_path;
-    char *filename;
-    char *directory;
-    char *comment;
-    int is_directory;
+    uint64_t file_offset;                                           /* The offset of the start of the local file header for this entry. */
     uint64_t entry_size;
     uint64_t entry_compressed_size;
-    uint16_t attributes;
-    int compression_method;                                         /* Indicates the method of compression if any used to compress this entry. */
     uint32_t crc32;
+    uint16_t compression_method;                                    /* Indicates the method of compression if any used to compress this entry. */
     uint16_t  flags;                                                /* The general purpose flags. */
-    uint64_t file_offset;                                           /* The offset of the start of the local file header for this entry. */
+    uint16_t attributes;
+    uint16_t is_directory;
+    char *raw_entry_path;
+    char *filename;                                                 /* Points into raw_entry_path. */
+    char *directory;
 } internal_archive_entry_data;
 
+/* A table of archive entries, held in one contiguous block so they can be got at by index. */
+typedef struct _entry_table
+{
+    internal_archive_entry_data *entries;
+    uint64_t count;                                                 /* The number of entries in the table. */
+    uint64_t capacity;                                              /* The number of entries there is room for. */
+} entry_table;
+
+/* A slot in an entry lookup, empty slots have an index of ENTRY_LOOKUP_EMPTY. */
+typedef struct _entry_lookup_slot
+{
+    uint64_t hash;                                                  /* The hash of the entry path. */
+    uint64_t index;                                                 /* The index of the entry in its table. */
+} entry_lookup_slot;
+
+/* An open addressed hash table from entry path to the index of the entry in an entry table. */
+typedef struct _entry_lookup
+{
+    entry_lookup_slot *slots;
+    uint64_t mask;                                                  /* The number of slots (a power of two) less one. */
+} entry_lookup;
+
+#define ENTRY_LOOKUP_EMPTY                       UINT64_MAX
+
+/* Where a contact element is in the address book (Contacts.xml), from its start tag to the end of its end tag. */
+typedef struct _contact_span
+{
+    uint64_t offset;
+    uint64_t length;
+} contact_span;
+
+/* The messages in a category, in archive order. */
+typedef struct _category_members
+{
+    uint64_t *messages;                                             /* The indexes of the messages. */
+    uint64_t count;
+    uint64_t capacity;
+} category_members;
+
 /* Internal ZIP file descriptor. */
 struct olm_file_t
 {
@@ -165,6 +218,8 @@ struct olm_file_t
     uint64_t total_entries;                                         /* The total number of entries (files and directories) in this ZIP file. */
     int zip64;                                                      /* Set to TRUE if this ZIP file uses ZIP64 extensions (i.e. it is larger that 2GB and/or it has a compressed/encrypted central directory. */
     char *comment;                                                  /* Points to the comment of the ZIP file (if present). */
+    const unsigned char *file_map;                                  /* The read only mapping of the whole file (OLM_OPT_MMAP only). */
+    size_t map_size;                                                /* The size of the above mapping. */
     unsigned char *cdr_buffer;                                      /* The buffer in which the central directory will be read. */
     unsigned char *cdr_sig_data;                                    /* Holds the digital signature data for the central directory. */
     int cdr_compressed;                                             /* Set to TRUE if the central directory is compressed. */
@@ -177,16 +232,333 @@ struct olm_file_t
     eocd_record64 eocd_rec64;
     uint64_t central_dir_size;
     off_t central_dir_offset;
-    list_t message_entries;
-    list_t attachment_entries;
-    list_t contact_entries;
+    entry_table message_entries;                                    /* The messages, in archive order. */
+    entry_table attachment_entries;                                 /* The attachments, in archive order. */
+    entry_lookup attachment_lookup;                                 /* Finds the attachments by their path. */
+    entry_table contact_entries;                                    /* The address book, if there is one (there is never more than one). */
+    contact_span *contacts;                                         /* Where each contact is in the address book, once contacts_indexed is set. */
+    uint64_t contact_count;                                         /* The number of contacts in the above. */
+    int contacts_indexed;                                           /* Set once the address book has been indexed (accessed atomically). */
+    pthread_mutex_t contacts_lock;                                  /* Held while the address book is being indexed. */
+    entry_table category_entries;                                   /* The category list (there is always exactly one). */
+    struct _category *categories;                                   /* The categories, once categories_loaded is set. */
+    uint64_t category_count;                                        /* The number of categories in the above. */
+    struct olm_arena_t *category_strings;                           /* Holds the names and colours of the categories. */
+    category_members *category_members;                             /* The messages in each category, once members_indexed is set. */
+    int categories_loaded;                                          /* Set once the category list has been read (accessed atomically). */
+    int members_indexed;                                            /* Set once every message has been sorted into its categories (accessed atomically). */
+    pthread_mutex_t categories_lock;                                /* Held while either of the above is being done. */
+    const unsigned char *search_index;                              /* The search index, once search_ready is set (mapped or in memory). */
+    size_t search_index_size;                                       /* The size of the above. */
+    int search_index_mapped;                                        /* Set if the search index is mapped rather than allocated. */
+    int search_ready;                                               /* Set once the search index has been loaded or built (accessed atomically). */
+    pthread_mutex_t search_lock;                                    /* Held while the search index is being loaded or built. */
+    struct olm_arena_t *entry_strings;                              /* Holds the paths of the entries in the tables above. */
 };
 
+/* The most that is copied in one go when extracting an entry. */
+#define COPY_CHUNK_SIZE                          (4 * 1024 * 1024)
+
+/* The sidecar entry index that OLM_OPT_INDEX keeps next to the archive (as <archive>.idx). */
+#define SIG_ENTRY_INDEX                          0x494d4c4f         /* "OLMI" */
+#define ENTRY_INDEX_VERSION                      3                  /* Bump whenever the layout or the classification of entries changes. */
+#define ENTRY_INDEX_SUFFIX                       ".idx"
+
+/* The header at the start of the index, the archive must still match the first part of it for the index to be used. */
+typedef struct _entry_index_header
+{
+    uint32_t signature;                                             /* SIG_ENTRY_INDEX. */
+    uint32_t version;                                               /* ENTRY_INDEX_VERSION. */
+    uint64_t archive_size;                                          /* The size of the archive when the index was written. */
+    int64_t archive_mtime;                                          /* The modification time of the archive when the index was written. */
+    eocd_record32 eocd_record;                                      /* The end of central directory record of the archive. */
+    uint64_t central_dir_offset;                                    /* Where the central directory was (from the ZIP64 record if there is one). */
+    uint64_t central_dir_size;                                      /* The size of the central directory. */
+    uint64_t total_entries;                                         /* The number of entries in the central directory. */
+    uint64_t message_count;                                         /* The number of message records that follow. */
+    uint64_t attachment_count;                                      /* The number of attachment records that follow the messages. */
+    uint64_t contact_count;                                         /* The number of address book records that follow the attachments (0 or 1). */
+    uint64_t category_count;                                        /* The number of category list records that follow the address book (0 or 1). */
+    uint64_t records_size;                                          /* The total size of the records (and their paths). */
+    uint32_t records_crc32;                                         /* The CRC of the records (and their paths). */
+} __attribute__((__packed__)) entry_index_header;
+
+/* A record in the index for each message and attachment entry, the entry path follows it (unterminated). */
+typedef struct _entry_index_record
+{
+    uint64_t entry_size;
+    uint64_t entry_compressed_size;
+    uint64_t file_offset;
+    uint32_t crc32;
+    uint16_t compression_method;
+    uint16_t flags;
+    uint16_t attributes;
+    uint16_t path_length;
+} __attribute__((__packed__)) entry_index_record;
+
+struct stat;
+int load_entry_index(struct olm_file_t *file, const struct stat *archive_stat);
+void save_entry_index(struct olm_file_t *file, const struct stat *archive_stat);
+
+/* The sidecar category index that OLM_OPT_INDEX keeps next to the archive (as <archive>.cat). It has the same header as the
+   entry index, with category_count giving the number of categories. For each category there follows a uint64_t count and
+   then the indexes of the messages in it. */
+#define SIG_CATEGORY_INDEX                       0x434d4c4f         /* "OLMC" */
+#define CATEGORY_INDEX_SUFFIX                    ".cat"
+int load_category_index(struct olm_file_t *file);
+void save_category_index(struct olm_file_t *file);
+
+/* The sidecar search index that olm_build_search_index() keeps next to the archive (as <archive>.fts). It has the same header
+   as the entry index, with message_count giving the number of messages indexed. Then comes a search_index_header, a record
+   for each term (sorted by the text of the terms), the text of the terms and the postings of the terms. The postings of a
+   term are, for each message it is in (in order), the distance from the previous message as a variable length integer
+   (7 bits a byte, low bits first) and a byte saying which fields (SEARCH_FIELD_*) it is in. */
+#define SIG_SEARCH_INDEX                         0x534d4c4f         /* "OLMS" */
+#define SEARCH_INDEX_SUFFIX                      ".fts"
+
+typedef struct _search_index_header
+{
+    uint64_t term_count;                                            /* The number of term records. */
+    uint64_t text_size;                                             /* The size of the text of the terms. */
+    uint64_t postings_size;                                         /* The size of the postings. */
+} __attribute__((__packed__)) search_index_header;
+
+typedef struct _search_term_record
+{
+    uint64_t text_offset;                                           /* Where the text of the term is, from the start of the text. */
+    uint64_t postings_offset;                                       /* Where the postings of the term are, from the start of the postings. */
+    uint64_t postings_size;                                         /* The size of the postings of the term. */
+    uint32_t text_length;                                           /* The length of the text of the term (it is not terminated). */
+    uint32_t message_count;                                         /* The number of messages the term is in. */
+} __attribute__((__packed__)) search_term_record;
+
+/* The fields of a message that are indexed. */
+#define SEARCH_FIELD_SUBJECT                     0x01
+#define SEARCH_FIELD_FROM                        0x02
+#define SEARCH_FIELD_TO                          0x04
+#define SEARCH_FIELD_BODY                        0x08
+
+/* Terms longer than this are cut short, both when they are indexed and when they are searched for. */
+#define SEARCH_MAX_TERM_LENGTH                   64
+
+const unsigned char *load_search_index(struct olm_file_t *file, size_t *map_size);
+int fill_search_index_header(struct olm_file_t *file, unsigned char *buffer, size_t buffer_size);
+int save_search_index(struct olm_file_t *file, const unsigned char *buffer, size_t buffer_size);
+
+/* Helpers shared between the source files. */
+int set_entry_path(struct olm_arena_t *strings, internal_archive_entry_data *entry, const char *path, size_t path_len, uint16_t attributes);
+int entry_table_reserve(entry_table *table, uint64_t capacity);
+int entry_table_append(entry_table *table, const internal_archive_entry_data *entry);
+void entry_table_free(entry_table *table);
+int build_entry_lookup(entry_lookup *lookup, const entry_table *table);
+internal_archive_entry_data *find_entry(const entry_lookup *lookup, const entry_table *table, const char *path);
+void entry_lookup_free(entry_lookup *lookup);
+int read_fully(int fd, void *buffer, size_t length, off_t offset);
+int append_address(struct olm_arena_t *arena, char **address_list, const char *address);
+int write_fully(int fd, const void *buffer, size_t length);
+uint32_t compute_crc32(uint32_t crc, const unsigned char *data, uint64_t length);
+uint32_t serial_crc32(uint32_t crc, const unsigned char *data, uint64_t length);
+int set_worker_thread(int is_worker);
+int verify_entry_crc(struct olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int corrupted_error);
+
+/* Blocks of at least twice this size have their CRC worked out on several threads, a part of at least this size each. The
+   threads come from a pool shared by the whole process, which has at most CRC_MAX_THREADS - 1 of them. */
+#define CRC_PARALLEL_PART_SIZE                   (1024 * 1024)
+#define CRC_MAX_THREADS                          16
+
+/* The shortest block that is worth handing to the carry-less multiply CRC kernel. */
+#define CRC_PCLMUL_MIN_LENGTH                    64
+int get_entry_data_offset(struct olm_file_t *file, internal_archive_entry_data *entry, uint64_t *data_offset);
+struct _attch;
+int locate_attachment_data(struct olm_file_t *file, struct _attch *attachment, internal_archive_entry_data **entry, uint64_t *data_offset);
+
+int read_archive_data(struct olm_file_t *file, uint64_t offset, void *buffer, size_t length);
+
+/* The size of the windows that an entry stream reads compressed data into and hands out blocks from. */
+#define STREAM_WINDOW_SIZE                       (256 * 1024)
+
+/* Reads the data of an entry from start to finish, inflating it if it is deflated. */
+typedef struct _entry_stream
+{
+    struct olm_file_t *file;                                        /* The archive the entry is in. */
+    uint64_t data_offset;                                           /* Where the (compressed) data of the entry starts in the archive. */
+    uint64_t compressed_size;                                       /* The size of the data in the archive. */
+    uint64_t size;                                                  /* The size of the entry once inflated. */
+    uint64_t consumed;                                              /* How much of the data in the archive has been given to inflate. */
+    uint64_t produced;                                              /* How much of the entry has been read. */
+    uint32_t expected_crc;                                          /* The CRC from the central directory. */
+    uint32_t crc;                                                   /* The CRC of what has been read. */
+    int compression_method;                                         /* ZIP_CA_STORED or ZIP_CA_DEFLATE. */
+    int verify;                                                     /* Clear if the CRC is not being checked. */
+    int corrupted_error;                                            /* What bad data is reported as. */
+    int error_code;                                                 /* Set once the stream has failed, every read after that fails too. */
+    int inflating;                                                  /* Set once zstream has been initialised. */
+    z_stream zstream;
+    const unsigned char *source;                                    /* The data of the entry if it is already in memory (set after opening), or NULL. */
+    unsigned char *in_window;                                       /* Holds compressed data read from an unmapped archive. */
+    unsigned char *out_window;                                      /* Holds the blocks handed out by entry_stream_next(). */
+} entry_stream;
+
+int entry_stream_open(entry_stream *stream, struct olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int verify, int corrupted_error);
+ssize_t entry_stream_read(entry_stream *stream, void *buffer, size_t length);
+int entry_stream_next(entry_stream *stream, const unsigned char **data, size_t *length);
+int entry_stream_seek(entry_stream *stream, uint64_t offset);
+void entry_stream_close(entry_stream *stream);
+int read_entry_stream(void *context, char *buffer, int length);
+
+/* A read from the archive queued on an io_engine. */
+typedef struct _io_request
+{
+    uint64_t offset;                                                /* Where to read from in the archive. */
+    unsigned char *buffer;                                          /* Where to read to. */
+    size_t length;                                                  /* How much to read. */
+    size_t done;                                                    /* How much has been read so far. */
+    int error_code;                                                 /* OLM_ERROR_SUCCESS or an error code, once the read is complete. */
+    uint64_t tag;                                                   /* Left for the caller to tell its reads apart. */
+    struct _io_request *next;                                       /* Used by the engine while it holds the request. */
+} io_request;
+
+/* Keeps a number of reads from the archive in flight at once, through io_uring if it was configured in and the kernel allows
+   it, otherwise through a pool of threads. Only one thread may use an engine. */
+typedef struct io_engine io_engine;
+
+io_engine *io_engine_create(int fd, unsigned int depth);
+void io_engine_submit(io_engine *engine, io_request *request);
+io_request *io_engine_wait(io_engine *engine);
+void io_engine_destroy(io_engine *engine);
+
+/* An attachment opened with olm_attachment_open(). */
+struct olm_attachment_reader_t
+{
+    struct olm_file_t *file;                                        /* The archive the attachment is in. */
+    uint64_t data_offset;                                           /* Where the data of the attachment starts in the archive. */
+    uint64_t size;                                                  /* The size of the attachment. */
+    uint32_t expected_crc;                                          /* The CRC from the central directory. */
+    uint32_t crc;                                                   /* The CRC of the first crc_length bytes read. */
+    uint64_t crc_length;                                            /* How much of the attachment (from the start) the CRC covers. */
+    int verify;                                                     /* Clear if the CRC is not being checked. */
+    int error_code;                                                 /* Set once the attachment has been found to be corrupted. */
+    entry_stream *stream;                                           /* Inflates the attachment if it is deflated (the CRC is then checked by it). */
+};
+
+/* A block of memory belonging to an arena, the memory handed out follows the header. */
+typedef struct _arena_block
+{
+    struct _arena_block *next;                                      /* The next block in the arena. */
+    size_t size;                                                    /* The number of bytes that follow the header. */
+    size_t used;                                                    /* The number of those bytes that have been handed out. */
+    unsigned char data[] __attribute__((aligned(8)));
+} arena_block;
+
+/* An arena that all the memory for a message is carved from, so it can be freed in one go. */
+struct olm_arena_t
+{
+    arena_block *first;                                             /* The first block (part of the same allocation as the arena). */
+    arena_block *current;                                           /* The block that allocations are being made from. */
+    void *last_alloc;                                               /* The most recent allocation (which can be grown in place). */
+    size_t last_size;                                               /* The size of the most recent allocation. */
+    int owned_by_message;                                           /* Set if the arena is freed along with the message it holds. */
+    xmlTextReaderPtr reader;                                        /* A reader kept for reuse between messages. */
+    unsigned char *io_buffer;                                       /* A buffer kept for reading message data into. */
+    size_t io_buffer_size;                                          /* The size of the above buffer. */
+};
+
+/* Room left in a message arena beyond the size of the message XML (for the message and attachment structures). */
+#define MESSAGE_ARENA_SLACK                      1024
+
+struct olm_arena_t *arena_create(size_t initial_size);
+void arena_destroy(struct olm_arena_t *arena);
+void *arena_alloc(struct olm_arena_t *arena, size_t size);
+void *arena_extend(struct olm_arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+char *arena_strdup(struct olm_arena_t *arena, const char *str);
+void arena_rewind(struct olm_arena_t *arena, arena_block *block, size_t used);
+
+/* The list that the message parser is currently inside. */
+#define ADDRESS_LIST_NONE                        0
+#define ADDRESS_LIST_TO                          1
+#define ADDRESS_LIST_REPLY_TO                    2
+#define ADDRESS_LIST_FROM                        3
+#define ATTACHMENT_LIST                          4
+#define CATEGORY_LIST                            5
+
+/* Returned by get_message() (but never passed on by the library) for a message that does not match the query it was given. */
+#define MESSAGE_FILTERED_OUT                     0x100
+
+struct _mail_message;
+struct _query;
+
+struct _mail_message *get_message(struct olm_file_t *file, internal_archive_entry_data *entry, const unsigned char *entry_data, struct olm_arena_t *arena, unsigned int fields, const struct _query *query, int *error_code);
+unsigned int query_field_mask(const struct _query *query);
+int message_matches_query(const struct _mail_message *message, const struct _query *query, unsigned int fields);
+
+/* The message field whose text the message parser is currently collecting. */
+#define CAPTURE_NONE                             0
+#define CAPTURE_SUBJECT                          1
+#define CAPTURE_BODY                             2
+#define CAPTURE_SENT_TIME                        3
+#define CAPTURE_RECEIVED_TIME                    4
+#define CAPTURE_MODIFIED_TIME                    5
+#define CAPTURE_MESSAGE_ID                       6
+#define CAPTURE_HAS_HTML                         7
+#define CAPTURE_HAS_RICH_TEXT                    8
+#define CAPTURE_PRIORITY                         9
+
+/* The elements that the message and contact parsers act on, found from their names by element_tag(). */
+#define ELEMENT_UNKNOWN                          0
+#define ELEMENT_EMAIL_ADDRESS                    1
+#define ELEMENT_MESSAGE_ATTACHMENT               2
+#define ELEMENT_CATEGORY                         3
+#define ELEMENT_TO_ADDRESSES                     4
+#define ELEMENT_REPLY_TO_ADDRESSES               5
+#define ELEMENT_SENDER_ADDRESS                   6
+#define ELEMENT_ATTACHMENT_LIST                  7
+#define ELEMENT_CATEGORY_LIST                    8
+#define ELEMENT_SUBJECT                          9
+#define ELEMENT_BODY                             10
+#define ELEMENT_SENT_TIME                        11
+#define ELEMENT_RECEIVED_TIME                    12
+#define ELEMENT_MOD_DATE                         13
+#define ELEMENT_MESSAGE_ID                       14
+#define ELEMENT_HAS_HTML                         15
+#define ELEMENT_HAS_RICH_TEXT                    16
+#define ELEMENT_PRIORITY                         17
+#define ELEMENT_CONTACT_EMAIL_ADDRESS            18
+#define ELEMENT_NAME_PREFIX                      19
+#define ELEMENT_FIRST_NAME                       20
+#define ELEMENT_MIDDLE_NAME                      21
+#define ELEMENT_LAST_NAME                        22
+#define ELEMENT_DISPLAY_NAME                     23
+#define ELEMENT_BUSINESS_COMPANY                 24
+#define ELEMENT_BUSINESS_TITLE                   25
+#define ELEMENT_BIRTHDAY                         26
+#define ELEMENT_ANNIVERSARY                      27
+#define ELEMENT_HOME_PHONE                       28
+#define ELEMENT_BUSINESS_PHONE                   29
+#define ELEMENT_CELL_PHONE                       30
+
+/* The number of slots in the table that element_tag() looks names up in (a power of two, at least twice the number of names). */
+#define ELEMENT_LOOKUP_SIZE                      128
+
+int element_tag(const char *name);
+
+/* State kept by the (streaming) message parser. */
+typedef struct _message_parse_state
+{
+    int container;                                                  /* The list we are in (ADDRESS_LIST_*, ATTACHMENT_LIST or CATEGORY_LIST). */
+    int container_depth;                                            /* The depth of the element holding the list. */
+    int capture_field;                                              /* The field whose text is being collected (CAPTURE_*). */
+    int capture_depth;                                              /* The depth of the element holding that text. */
+    char *text;                                                     /* The text collected so far (in the arena). */
+    size_t text_len;                                                /* The length of the text collected so far. */
+    struct olm_arena_t *arena;                                      /* The arena holding the message. */
+    unsigned int remaining;                                         /* The wanted fields (OLM_FIELD_*) that have not been seen yet. */
+} message_parse_state;
+
 typedef struct _extra_field_header
 {
     uint16_t header_id;
     uint16_t data_size;
-    unsigned char *data; /* Free when done. */
+    const unsigned char *data;                                      /* Points into the in-memory central directory. */
 } __attribute__((__packed__)) extra_field_header;
 
 #endif
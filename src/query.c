@@ -0,0 +1,191 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * query.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+static int contains_text(const char *text, const char *pattern);
+
+/******************************************************************************************************************************
+ * Calls the given callback with each message that matches the given query, in order. The predicates of the query are checked
+ * by the parser as each field they look at is read, so a message that fails one is dropped there and then without the rest of
+ * it being parsed. When the body is asked for, each message is first parsed for just the fields the query looks at and only
+ * parsed again in full if it matches, so the body of a message that is dropped is never copied. All the messages are parsed
+ * into the same memory, so a message is only valid until the callback returns and must not be passed to olm_message_free().
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to query.
+ *   query          The predicates the messages must meet.
+ *   fields         The fields wanted, any of the OLM_FIELD_* values or'ed together. The fields the query looks at may also
+ *                  be filled in.
+ *   callback       Called with each message that matches, returns non zero to stop. If a message could not be parsed the
+ *                  callback is passed NULL and the error code, unless the file was opened with OLM_OPT_IGNORE_ERRORS in which
+ *                  case the message is passed over.
+ *   user_data      Passed on to the callback.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_CANCELLED if the callback asked to stop or another error code.
+ ******************************************************************************************************************************/
+int olm_query(olm_file_t *file, const olm_query_t *query, unsigned int fields, olm_message_callback callback, void *user_data)
+{
+    internal_archive_entry_data *entry = NULL;
+    olm_mail_message_t *message = NULL;
+    olm_arena_t *arena = NULL;
+    unsigned int query_fields = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    int ret = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((query == NULL) || (callback == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    arena = olm_arena_create(0);
+    if (arena == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    fields &= OLM_FIELD_ALL;
+    query_fields = query_field_mask(query);
+    for (uint64_t idx = 0; idx < file->message_entries.count; idx++)
+    {
+        entry = &file->message_entries.entries[idx];
+        olm_arena_reset(arena);
+        if (((fields & OLM_FIELD_BODY) != 0) && (query_fields != 0))
+        {
+            message = get_message(file, entry, NULL, arena, query_fields, query, &error_code);
+            if (message != INVALID_OLM_MESSAGE)
+            {
+                olm_arena_reset(arena);
+                message = get_message(file, entry, NULL, arena, fields, NULL, &error_code);
+            }
+        }
+        else
+        {
+            message = get_message(file, entry, NULL, arena, (fields | query_fields), query, &error_code);
+        }
+    
+        if (message == INVALID_OLM_MESSAGE)
+        {
+            if (error_code == MESSAGE_FILTERED_OUT) continue;
+            if (((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) && (error_code != OLM_ERROR_NO_MEMORY)) continue;
+        }
+        if (callback(file, idx, message, error_code, user_data) != 0)
+        {
+            ret = OLM_ERROR_CANCELLED;
+            break;
+        }
+    }
+    olm_arena_destroy(arena);
+    
+    return ret;
+}
+
+/**************************************************************************************************
+ * Returns the OLM_FIELD_* bits for the fields that the predicates of the given query look at.
+ **************************************************************************************************/
+unsigned int query_field_mask(const olm_query_t *query)
+{
+    unsigned int fields = 0;
+    
+    if ((query->predicates & (OLM_QUERY_SENT_SINCE | OLM_QUERY_SENT_BEFORE)) != 0) fields |= OLM_FIELD_SENT_TIME;
+    if ((query->predicates & (OLM_QUERY_RECEIVED_SINCE | OLM_QUERY_RECEIVED_BEFORE)) != 0) fields |= OLM_FIELD_RECEIVED_TIME;
+    if ((query->predicates & OLM_QUERY_SENDER) != 0) fields |= OLM_FIELD_FROM;
+    if ((query->predicates & OLM_QUERY_RECIPIENT) != 0) fields |= OLM_FIELD_TO;
+    if ((query->predicates & OLM_QUERY_HAS_ATTACHMENTS) != 0) fields |= OLM_FIELD_ATTACHMENTS;
+    if ((query->predicates & OLM_QUERY_PRIORITY) != 0) fields |= OLM_FIELD_PRIORITY;
+    
+    return fields;
+}
+
+/**************************************************************************************************
+ * Checks the predicates of the given query that look at the given fields (OLM_FIELD_*) of the
+ * given message, which must have been read. A message without a priority is taken to be of normal
+ * priority.
+ *
+ * Returns true if the message meets all of them, false if not.
+ **************************************************************************************************/
+int message_matches_query(const olm_mail_message_t *message, const olm_query_t *query, unsigned int fields)
+{
+    unsigned int predicates = query->predicates;
+    int priority = 0;
+    
+    if ((fields & OLM_FIELD_SENT_TIME) != 0)
+    {
+        if (((predicates & OLM_QUERY_SENT_SINCE) != 0) && (message->sent_time < query->sent_since)) return false;
+        if (((predicates & OLM_QUERY_SENT_BEFORE) != 0) && (message->sent_time >= query->sent_before)) return false;
+    }
+    if ((fields & OLM_FIELD_RECEIVED_TIME) != 0)
+    {
+        if (((predicates & OLM_QUERY_RECEIVED_SINCE) != 0) && (message->received_time < query->received_since)) return false;
+        if (((predicates & OLM_QUERY_RECEIVED_BEFORE) != 0) && (message->received_time >= query->received_before)) return false;
+    }
+    if (((fields & OLM_FIELD_FROM) != 0) && ((predicates & OLM_QUERY_SENDER) != 0) && (contains_text(message->from, query->sender) == false)) return false;
+    if (((fields & OLM_FIELD_TO) != 0) && ((predicates & OLM_QUERY_RECIPIENT) != 0) && (contains_text(message->to, query->recipient) == false)) return false;
+    if (((fields & OLM_FIELD_ATTACHMENTS) != 0) && ((predicates & OLM_QUERY_HAS_ATTACHMENTS) != 0) &&
+        ((message->attachment_count > 0) != (query->has_attachments != 0))) return false;
+    if (((fields & OLM_FIELD_PRIORITY) != 0) && ((predicates & OLM_QUERY_PRIORITY) != 0))
+    {
+        priority = (message->message_priority == 0) ? MESSAGE_PRIORITY_NORMAL : message->message_priority;
+        if ((priority < query->highest_priority) || (priority > query->lowest_priority)) return false;
+    }
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Returns true if the given pattern is found in the given text, ignoring the case of ASCII letters
+ * (which is all that matters for addresses), false if not or if there is no text.
+ **************************************************************************************************/
+static int contains_text(const char *text, const char *pattern)
+{
+    size_t idx = 0;
+    unsigned char text_ch = 0;
+    unsigned char pattern_ch = 0;
+    
+    if ((text == NULL) || (pattern == NULL)) return false;
+    
+    for (; *text != '\0'; text++)
+    {
+        for (idx = 0; pattern[idx] != '\0'; idx++)
+        {
+            text_ch = (unsigned char)text[idx];
+            pattern_ch = (unsigned char)pattern[idx];
+            if ((text_ch >= 'A') && (text_ch <= 'Z')) text_ch += ('a' - 'A');
+            if ((pattern_ch >= 'A') && (pattern_ch <= 'Z')) pattern_ch += ('a' - 'A');
+            if (text_ch != pattern_ch) break;
+        }
+        if (pattern[idx] == '\0') return true;
+    }
+    
+    return (pattern[0] == '\0');
+}
@@ -0,0 +1,745 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * search.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+#define SEARCH_FIELD_ALL                         (SEARCH_FIELD_SUBJECT | SEARCH_FIELD_FROM | SEARCH_FIELD_TO | SEARCH_FIELD_BODY)
+
+/* The smallest term table and the smallest postings buffer that are allocated while building. */
+#define SEARCH_MIN_TERM_SLOTS                    4096
+#define SEARCH_MIN_POSTINGS_SIZE                 16
+
+/* A term while the index is being built. */
+typedef struct _search_term
+{
+    char *text;                                                     /* The text of the term (in the string arena, not terminated). */
+    uint32_t length;                                                /* The length of the above. */
+    uint32_t message_count;                                         /* The number of messages the term is in so far. */
+    uint64_t hash;                                                  /* The hash of the text. */
+    uint64_t last_message;                                          /* The last message the term was found in. */
+    unsigned char *postings;                                        /* The postings so far, in the on disk format. */
+    size_t postings_size;                                           /* The number of bytes used in the above. */
+    size_t postings_capacity;                                       /* The number of bytes allocated for the above. */
+} search_term;
+
+/* Everything needed while the index is being built. */
+typedef struct _search_builder
+{
+    search_term *terms;                                             /* The terms in the order they were first found. */
+    uint64_t term_count;                                            /* The number of terms in the above. */
+    uint64_t term_capacity;                                         /* The number of terms allocated for the above. */
+    uint64_t *slots;                                                /* Open addressed table of (term index + 1), 0 if empty. */
+    uint64_t slot_count;                                            /* The number of slots, always a power of two. */
+    olm_arena_t *strings;                                           /* Holds the text of the terms. */
+    uint64_t text_size;                                             /* The total length of the text of the terms. */
+} search_builder;
+
+/* The parts of a loaded index. */
+typedef struct _search_view
+{
+    const search_term_record *records;
+    uint64_t term_count;
+    const unsigned char *text;
+    uint64_t text_size;
+    const unsigned char *postings;
+    uint64_t postings_size;
+} search_view;
+
+/* Steps through the postings of one term of a query. */
+typedef struct _posting_cursor
+{
+    const unsigned char *next;                                      /* The next posting. */
+    const unsigned char *end;                                       /* The end of the postings of the term. */
+    uint64_t count;                                                 /* The number of messages the term is in. */
+    uint64_t message;                                               /* The message of the current posting. */
+    unsigned char fields;                                           /* The fields of the current posting. */
+    unsigned char wanted;                                           /* The fields the query asks for the term to be in. */
+    int started;                                                    /* Set once the first posting has been read. */
+} posting_cursor;
+
+static int ensure_search_index(olm_file_t *file, int save);
+static int open_search_index(olm_file_t *file, int save);
+static int build_search_index(olm_file_t *file, unsigned char **buffer, size_t *buffer_size);
+static int index_message_field(search_builder *builder, const char *text, const char *placeholder, uint64_t message_index, unsigned char field);
+static search_term *find_or_add_term(search_builder *builder, const char *text, uint32_t length);
+static int grow_term_slots(search_builder *builder);
+static int add_posting(search_term *term, uint64_t message_index, unsigned char field);
+static int compare_terms(const void *first, const void *second);
+static unsigned char *write_search_index(search_builder *builder, size_t *buffer_size);
+static void free_search_builder(search_builder *builder);
+static int open_search_view(const unsigned char *index, size_t index_size, search_view *view);
+static int find_term_record(const search_view *view, const char *text, uint32_t length, posting_cursor *cursor);
+static int next_posting(posting_cursor *cursor);
+static int compare_cursors(const void *first, const void *second);
+static uint32_t next_term(const char **text, const char *end, char *term);
+static uint64_t hash_term(const char *text, uint32_t length);
+
+/******************************************************************************************************************************
+ * Builds the full-text search index of the given file, over the subject, sender, recipients and body of every message, and
+ * writes it next to the archive (as <archive>.fts) so that it can be mapped rather than built when the archive is next opened.
+ * It is kept in memory until the file is closed. The index is only built if there is not already a good one.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to index.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_FILE_IO_ERROR if the index was built but could not be written or another error code.
+ ******************************************************************************************************************************/
+int olm_build_search_index(olm_file_t *file)
+{
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    
+    return ensure_search_index(file, true);
+}
+
+/******************************************************************************************************************************
+ * Finds the messages that contain every term of the given query and calls the given callback with the index of each one, in
+ * order. A term is a run of letters and digits (and any non ASCII characters) and case does not matter. A term may be limited
+ * to one field by putting subject:, from:, to: or body: in front of it. If the file has no search index, it is taken from the
+ * sidecar file that olm_build_search_index() writes or, failing that, built in memory (and also written if the file was
+ * opened with OLM_OPT_INDEX).
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *   file           The olm file to search.
+ *   query          The terms to search for, separated by white space.
+ *   callback       Called with the index of each message that matches, returns non zero to stop.
+ *   user_data      Passed on to the callback.
+ *
+ * Returns:
+ *
+ *   OLM_ERROR_SUCCESS, OLM_ERROR_CANCELLED if the callback asked to stop or another error code. A query with no terms in it is
+ *   an OLM_ERROR_INVALID_PARAMETER.
+ ******************************************************************************************************************************/
+int olm_search(olm_file_t *file, const char *query, olm_search_callback callback, void *user_data)
+{
+    search_view view;
+    posting_cursor *cursors = NULL;
+    const char *word = NULL;
+    const char *word_end = NULL;
+    const char *separator = NULL;
+    char term[SEARCH_MAX_TERM_LENGTH];
+    unsigned char wanted = 0;
+    uint64_t cursor_count = 0;
+    uint32_t term_length = 0;
+    size_t query_len = 0;
+    int matched = false;
+    int ret = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if (file == NULL) return OLM_ERROR_INVALID_FILE_HANDLE;
+    if ((query == NULL) || (callback == NULL)) return OLM_ERROR_INVALID_PARAMETER;
+    
+    error_code = ensure_search_index(file, false);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    if (open_search_view(file->search_index, file->search_index_size, &view) == false) return OLM_ERROR_FILE_CORRUPTED;
+    
+    /* Every term takes at least one character and a separator. */
+    query_len = strlen(query);
+    cursors = (posting_cursor *)malloc(sizeof(posting_cursor) * ((query_len / 2) + 1));
+    if (cursors == NULL) return OLM_ERROR_NO_MEMORY;
+    
+    for (word = query; *word != '\0'; word = word_end)
+    {
+        while ((*word == ' ') || (*word == '\t') || (*word == '\r') || (*word == '\n')) word++;
+        for (word_end = word; (*word_end != '\0') && (*word_end != ' ') && (*word_end != '\t') && (*word_end != '\r') && (*word_end != '\n'); word_end++);
+    
+        wanted = SEARCH_FIELD_ALL;
+        separator = memchr(word, ':', (size_t)(word_end - word));
+        if (separator != NULL)
+        {
+            if (((separator - word) == 7) && (strncmp(word, "subject", 7) == 0)) wanted = SEARCH_FIELD_SUBJECT;
+            else if (((separator - word) == 4) && (strncmp(word, "from", 4) == 0)) wanted = SEARCH_FIELD_FROM;
+            else if (((separator - word) == 2) && (strncmp(word, "to", 2) == 0)) wanted = SEARCH_FIELD_TO;
+            else if (((separator - word) == 4) && (strncmp(word, "body", 4) == 0)) wanted = SEARCH_FIELD_BODY;
+            if (wanted != SEARCH_FIELD_ALL) word = separator + 1;
+        }
+    
+        while ((term_length = next_term(&word, word_end, term)) > 0)
+        {
+            /* A term that is not in the index at all means that nothing matches. */
+            if (find_term_record(&view, term, term_length, &cursors[cursor_count]) == false) goto bail_and_die;
+            cursors[cursor_count].wanted = wanted;
+            cursor_count++;
+        }
+    }
+    if (cursor_count == 0)
+    {
+        error_code = OLM_ERROR_INVALID_PARAMETER;
+        goto bail_and_die;
+    }
+    
+    /* Step through the rarest term and look for each of its messages in the postings of the others. */
+    qsort(cursors, (size_t)cursor_count, sizeof(posting_cursor), compare_cursors);
+    while ((ret = next_posting(&cursors[0])) > 0)
+    {
+        if ((cursors[0].fields & cursors[0].wanted) == 0) continue;
+    
+        matched = true;
+        for (uint64_t idx = 1; (idx < cursor_count) && (matched == true); idx++)
+        {
+            while ((ret > 0) && ((cursors[idx].started == false) || (cursors[idx].message < cursors[0].message))) ret = next_posting(&cursors[idx]);
+            if (ret <= 0) break;
+            if ((cursors[idx].message != cursors[0].message) || ((cursors[idx].fields & cursors[idx].wanted) == 0)) matched = false;
+        }
+        if (ret <= 0) break;
+    
+        if ((matched == true) && (cursors[0].message < file->message_entries.count) && (callback(file, cursors[0].message, user_data) != 0))
+        {
+            error_code = OLM_ERROR_CANCELLED;
+            break;
+        }
+    }
+    if (ret < 0) error_code = OLM_ERROR_FILE_CORRUPTED;
+
+bail_and_die:
+    
+    free(cursors);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Loads or builds the search index of the given file if it has not been already. This is done
+ * once, by whichever thread gets to it first. If asked to save it, it is also made sure that the
+ * index has been written next to the archive.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int ensure_search_index(olm_file_t *file, int save)
+{
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    if ((__atomic_load_n(&file->search_ready, __ATOMIC_ACQUIRE) == true) && ((save == false) || (file->search_index_mapped == true))) return OLM_ERROR_SUCCESS;
+    
+    pthread_mutex_lock(&file->search_lock);
+    if (file->search_ready == false)
+    {
+        error_code = open_search_index(file, save);
+        if (file->search_index != NULL) __atomic_store_n(&file->search_ready, true, __ATOMIC_RELEASE);
+    }
+    else if ((save == true) && (file->search_index_mapped == false))
+    {
+        /* Built by an earlier search, it only needs writing. It is left where it is as it may be in use. */
+        if (save_search_index(file, file->search_index, file->search_index_size) == false) error_code = OLM_ERROR_FILE_IO_ERROR;
+    }
+    pthread_mutex_unlock(&file->search_lock);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Maps the sidecar search index of the given file if there is a good one, otherwise builds the
+ * index in memory. A built index is written next to the archive if asked to or if the file was
+ * opened with OLM_OPT_INDEX, and then swapped for the written file so that its pages can be shared
+ * and dropped. Failing to write it is only an error if it was asked for, the index is kept anyway.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int open_search_index(olm_file_t *file, int save)
+{
+    search_view view;
+    const unsigned char *index_map = NULL;
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    size_t map_size = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    index_map = load_search_index(file, &map_size);
+    if (index_map != NULL)
+    {
+        if (open_search_view(index_map, map_size, &view) == true)
+        {
+            file->search_index = index_map;
+            file->search_index_size = map_size;
+            file->search_index_mapped = true;
+            return OLM_ERROR_SUCCESS;
+        }
+        munmap((void *)index_map, map_size);
+    }
+    
+    error_code = build_search_index(file, &buffer, &buffer_size);
+    if (error_code != OLM_ERROR_SUCCESS) return error_code;
+    file->search_index = buffer;
+    file->search_index_size = buffer_size;
+    
+    if ((save == true) || ((file->options & OLM_OPT_INDEX) == OLM_OPT_INDEX))
+    {
+        if (save_search_index(file, buffer, buffer_size) == false) return (save == true) ? OLM_ERROR_FILE_IO_ERROR : OLM_ERROR_SUCCESS;
+        
+        index_map = load_search_index(file, &map_size);
+        if ((index_map != NULL) && (map_size == buffer_size) && (memcmp(index_map, buffer, buffer_size) == 0))
+        {
+            free(buffer);
+            file->search_index = index_map;
+            file->search_index_mapped = true;
+        }
+        else if (index_map != NULL) munmap((void *)index_map, map_size);
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Parses the subject, sender, recipients and body of every message into a reused arena and adds
+ * each of their terms to a hash table, then writes the table out in the format of the search
+ * index. A message that cannot be parsed fails the whole build unless the file was opened with
+ * OLM_OPT_IGNORE_ERRORS.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int build_search_index(olm_file_t *file, unsigned char **buffer, size_t *buffer_size)
+{
+    search_builder builder;
+    olm_mail_message_t *message = NULL;
+    olm_arena_t *arena = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    memset(&builder, 0, sizeof(search_builder));
+    builder.strings = arena_create(0);
+    arena = olm_arena_create(0);
+    if ((builder.strings == NULL) || (arena == NULL) || (grow_term_slots(&builder) == false))
+    {
+        error_code = OLM_ERROR_NO_MEMORY;
+        goto bail_and_die;
+    }
+    
+    for (uint64_t idx = 0; idx < file->message_entries.count; idx++)
+    {
+        olm_arena_reset(arena);
+        message = olm_get_message_fields_at(file, idx, (OLM_FIELD_SUBJECT | OLM_FIELD_FROM | OLM_FIELD_TO | OLM_FIELD_BODY), arena, &error_code);
+        if (message == INVALID_OLM_MESSAGE)
+        {
+            if (((file->options & OLM_OPT_IGNORE_ERRORS) == OLM_OPT_IGNORE_ERRORS) && (error_code != OLM_ERROR_NO_MEMORY))
+            {
+                error_code = OLM_ERROR_SUCCESS;
+                continue;
+            }
+            goto bail_and_die;
+        }
+    
+        if ((index_message_field(&builder, message->subject, NO_SUBJECT, idx, SEARCH_FIELD_SUBJECT) == false) ||
+            (index_message_field(&builder, message->from, NO_ADDRESS, idx, SEARCH_FIELD_FROM) == false) ||
+            (index_message_field(&builder, message->to, NO_ADDRESS, idx, SEARCH_FIELD_TO) == false) ||
+            (index_message_field(&builder, message->body, NO_MESSAGE_BODY, idx, SEARCH_FIELD_BODY) == false))
+        {
+            error_code = OLM_ERROR_NO_MEMORY;
+            goto bail_and_die;
+        }
+    }
+    
+    *buffer = write_search_index(&builder, buffer_size);
+    if (*buffer == NULL) error_code = OLM_ERROR_NO_MEMORY;
+    else if (fill_search_index_header(file, *buffer, *buffer_size) == false) error_code = OLM_ERROR_FILE_IO_ERROR;
+    if ((error_code != OLM_ERROR_SUCCESS) && (*buffer != NULL))
+    {
+        free(*buffer);
+        *buffer = NULL;
+    }
+
+bail_and_die:
+    
+    free_search_builder(&builder);
+    if (arena != NULL) olm_arena_destroy(arena);
+    
+    return error_code;
+}
+
+/**************************************************************************************************
+ * Adds each term of the given field of a message to the index being built. A field that only holds
+ * the placeholder that is put in when the message does not have it is passed over.
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+static int index_message_field(search_builder *builder, const char *text, const char *placeholder, uint64_t message_index, unsigned char field)
+{
+    search_term *found = NULL;
+    const char *end = NULL;
+    char term[SEARCH_MAX_TERM_LENGTH];
+    uint32_t term_length = 0;
+    
+    if ((text == NULL) || (strcmp(text, placeholder) == 0)) return true;
+    
+    end = text + strlen(text);
+    while ((term_length = next_term(&text, end, term)) > 0)
+    {
+        found = find_or_add_term(builder, term, term_length);
+        if ((found == NULL) || (add_posting(found, message_index, field) == false)) return false;
+    }
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Finds the given term in the table of the index being built, adding it if it is not there.
+ *
+ * Returns the term or NULL if there is not enough memory.
+ **************************************************************************************************/
+static search_term *find_or_add_term(search_builder *builder, const char *text, uint32_t length)
+{
+    search_term *grown = NULL;
+    search_term *term = NULL;
+    uint64_t hash = hash_term(text, length);
+    uint64_t slot = 0;
+    
+    for (slot = hash & (builder->slot_count - 1); builder->slots[slot] != 0; slot = (slot + 1) & (builder->slot_count - 1))
+    {
+        term = &builder->terms[builder->slots[slot] - 1];
+        if ((term->hash == hash) && (term->length == length) && (memcmp(term->text, text, length) == 0)) return term;
+    }
+    
+    if (builder->term_count == builder->term_capacity)
+    {
+        grown = (search_term *)realloc(builder->terms, (size_t)(sizeof(search_term) * ((builder->term_capacity == 0) ? 1024 : (builder->term_capacity * 2))));
+        if (grown == NULL) return NULL;
+        builder->terms = grown;
+        builder->term_capacity = (builder->term_capacity == 0) ? 1024 : (builder->term_capacity * 2);
+    }
+    
+    term = &builder->terms[builder->term_count];
+    memset(term, 0, sizeof(search_term));
+    term->text = (char *)arena_alloc(builder->strings, length);
+    if (term->text == NULL) return NULL;
+    memcpy(term->text, text, length);
+    term->length = length;
+    term->hash = hash;
+    builder->slots[slot] = ++builder->term_count;
+    builder->text_size += length;
+    
+    /* Keep the table no more than three quarters full. */
+    if (((builder->term_count * 4) > (builder->slot_count * 3)) && (grow_term_slots(builder) == false)) return NULL;
+    
+    return &builder->terms[builder->term_count - 1];
+}
+
+/**************************************************************************************************
+ * Doubles the size of the term table of the index being built (or creates it) and puts the terms
+ * back into it.
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+static int grow_term_slots(search_builder *builder)
+{
+    uint64_t slot_count = (builder->slot_count == 0) ? SEARCH_MIN_TERM_SLOTS : (builder->slot_count * 2);
+    uint64_t *slots = (uint64_t *)calloc((size_t)slot_count, sizeof(uint64_t));
+    uint64_t slot = 0;
+    
+    if (slots == NULL) return false;
+    
+    for (uint64_t idx = 0; idx < builder->term_count; idx++)
+    {
+        for (slot = builder->terms[idx].hash & (slot_count - 1); slots[slot] != 0; slot = (slot + 1) & (slot_count - 1));
+        slots[slot] = idx + 1;
+    }
+    
+    free(builder->slots);
+    builder->slots = slots;
+    builder->slot_count = slot_count;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Records that the given term is in the given field of the given message. Messages are added in
+ * order, so a term found again in the same message only needs the field adding to its last posting.
+ *
+ * Returns true on success or false if there is not enough memory.
+ **************************************************************************************************/
+static int add_posting(search_term *term, uint64_t message_index, unsigned char field)
+{
+    unsigned char *grown = NULL;
+    uint64_t delta = 0;
+    
+    if ((term->message_count > 0) && (term->last_message == message_index))
+    {
+        term->postings[term->postings_size - 1] |= field;
+        return true;
+    }
+    
+    /* The most a posting can take is ten bytes of distance and the byte of fields. */
+    if ((term->postings_size + 11) > term->postings_capacity)
+    {
+        grown = (unsigned char *)realloc(term->postings, ((term->postings_capacity == 0) ? SEARCH_MIN_POSTINGS_SIZE : (term->postings_capacity * 2)));
+        if (grown == NULL) return false;
+        term->postings = grown;
+        term->postings_capacity = (term->postings_capacity == 0) ? SEARCH_MIN_POSTINGS_SIZE : (term->postings_capacity * 2);
+    }
+    
+    delta = (term->message_count == 0) ? message_index : (message_index - term->last_message);
+    while (delta >= 0x80)
+    {
+        term->postings[term->postings_size++] = (unsigned char)(delta | 0x80);
+        delta >>= 7;
+    }
+    term->postings[term->postings_size++] = (unsigned char)delta;
+    term->postings[term->postings_size++] = field;
+    term->last_message = message_index;
+    term->message_count++;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Orders the terms of the index being built by their text, for qsort().
+ **************************************************************************************************/
+static int compare_terms(const void *first, const void *second)
+{
+    const search_term *first_term = (const search_term *)first;
+    const search_term *second_term = (const search_term *)second;
+    int ret = memcmp(first_term->text, second_term->text, ((first_term->length < second_term->length) ? first_term->length : second_term->length));
+    
+    if (ret != 0) return ret;
+    
+    return (first_term->length > second_term->length) - (first_term->length < second_term->length);
+}
+
+/**************************************************************************************************
+ * Sorts the terms of the index being built and writes them to a new buffer in the format of the
+ * search index, leaving room for the header at the start.
+ *
+ * Returns the buffer (which must be freed by the caller) or NULL if there is not enough memory.
+ **************************************************************************************************/
+static unsigned char *write_search_index(search_builder *builder, size_t *buffer_size)
+{
+    search_index_header header;
+    search_term_record record;
+    unsigned char *buffer = NULL;
+    unsigned char *records = NULL;
+    unsigned char *text = NULL;
+    unsigned char *postings = NULL;
+    uint64_t text_offset = 0;
+    uint64_t postings_offset = 0;
+    uint64_t postings_size = 0;
+    
+    for (uint64_t idx = 0; idx < builder->term_count; idx++) postings_size += builder->terms[idx].postings_size;
+    
+    *buffer_size = sizeof(entry_index_header) + sizeof(search_index_header) + (size_t)(builder->term_count * sizeof(search_term_record)) +
+                   (size_t)builder->text_size + (size_t)postings_size;
+    buffer = (unsigned char *)malloc(*buffer_size);
+    if (buffer == NULL) return NULL;
+    
+    if (builder->term_count > 0) qsort(builder->terms, (size_t)builder->term_count, sizeof(search_term), compare_terms);
+    
+    memset(buffer, 0, sizeof(entry_index_header));
+    header.term_count = builder->term_count;
+    header.text_size = builder->text_size;
+    header.postings_size = postings_size;
+    memcpy((buffer + sizeof(entry_index_header)), &header, sizeof(search_index_header));
+    
+    records = buffer + sizeof(entry_index_header) + sizeof(search_index_header);
+    text = records + (builder->term_count * sizeof(search_term_record));
+    postings = text + builder->text_size;
+    for (uint64_t idx = 0; idx < builder->term_count; idx++)
+    {
+        record.text_offset = text_offset;
+        record.postings_offset = postings_offset;
+        record.postings_size = builder->terms[idx].postings_size;
+        record.text_length = builder->terms[idx].length;
+        record.message_count = builder->terms[idx].message_count;
+        memcpy((records + (idx * sizeof(search_term_record))), &record, sizeof(search_term_record));
+    
+        memcpy((text + text_offset), builder->terms[idx].text, builder->terms[idx].length);
+        memcpy((postings + postings_offset), builder->terms[idx].postings, builder->terms[idx].postings_size);
+        text_offset += builder->terms[idx].length;
+        postings_offset += builder->terms[idx].postings_size;
+    }
+    
+    return buffer;
+}
+
+/**************************************************************************************************
+ * Frees everything held by the given index builder.
+ **************************************************************************************************/
+static void free_search_builder(search_builder *builder)
+{
+    for (uint64_t idx = 0; idx < builder->term_count; idx++) free(builder->terms[idx].postings);
+    if (builder->terms != NULL) free(builder->terms);
+    if (builder->slots != NULL) free(builder->slots);
+    if (builder->strings != NULL) arena_destroy(builder->strings);
+}
+
+/**************************************************************************************************
+ * Finds the parts of the given search index and checks that they fit in it. The terms themselves
+ * are checked as they are looked up.
+ *
+ * Returns true on success or false if the index is not laid out correctly.
+ **************************************************************************************************/
+static int open_search_view(const unsigned char *index, size_t index_size, search_view *view)
+{
+    search_index_header header;
+    uint64_t remaining = 0;
+    
+    if (index_size < (sizeof(entry_index_header) + sizeof(search_index_header))) return false;
+    memcpy(&header, (index + sizeof(entry_index_header)), sizeof(search_index_header));
+    remaining = index_size - (sizeof(entry_index_header) + sizeof(search_index_header));
+    
+    if (header.term_count > (remaining / sizeof(search_term_record))) return false;
+    remaining -= header.term_count * sizeof(search_term_record);
+    if ((header.text_size > remaining) || (header.postings_size != (remaining - header.text_size))) return false;
+    
+    view->records = (const search_term_record *)(index + sizeof(entry_index_header) + sizeof(search_index_header));
+    view->term_count = header.term_count;
+    view->text = (const unsigned char *)(view->records + header.term_count);
+    view->text_size = header.text_size;
+    view->postings = view->text + header.text_size;
+    view->postings_size = header.postings_size;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Looks for the given term in the given search index and sets up a cursor over its postings.
+ *
+ * Returns true if the term was found, false if not.
+ **************************************************************************************************/
+static int find_term_record(const search_view *view, const char *text, uint32_t length, posting_cursor *cursor)
+{
+    const search_term_record *record = NULL;
+    uint64_t low = 0;
+    uint64_t high = view->term_count;
+    uint64_t middle = 0;
+    int ret = 0;
+    
+    while (low < high)
+    {
+        middle = low + ((high - low) / 2);
+        record = &view->records[middle];
+        if ((record->text_offset > view->text_size) || (record->text_length > (view->text_size - record->text_offset))) return false;
+    
+        ret = memcmp((view->text + record->text_offset), text, ((record->text_length < length) ? record->text_length : length));
+        if (ret == 0) ret = (record->text_length > length) - (record->text_length < length);
+        if (ret == 0) break;
+        if (ret < 0) low = middle + 1;
+        else high = middle;
+    }
+    if ((low >= high) || (record->postings_offset > view->postings_size) || (record->postings_size > (view->postings_size - record->postings_offset))) return false;
+    
+    memset(cursor, 0, sizeof(posting_cursor));
+    cursor->next = view->postings + record->postings_offset;
+    cursor->end = cursor->next + record->postings_size;
+    cursor->count = record->message_count;
+    
+    return true;
+}
+
+/**************************************************************************************************
+ * Moves the given cursor on to the next posting of its term.
+ *
+ * Returns 1 if there was one, 0 at the end of the postings or -1 if they are corrupted.
+ **************************************************************************************************/
+static int next_posting(posting_cursor *cursor)
+{
+    uint64_t delta = 0;
+    unsigned int shift = 0;
+    
+    if (cursor->next == cursor->end) return 0;
+    
+    do
+    {
+        if ((cursor->next == cursor->end) || (shift > 63)) return -1;
+        delta |= (uint64_t)(*cursor->next & 0x7F) << shift;
+        shift += 7;
+    } while ((*cursor->next++ & 0x80) != 0);
+    if (cursor->next == cursor->end) return -1;
+    
+    if ((cursor->started == true) && ((delta == 0) || (delta > (UINT64_MAX - cursor->message)))) return -1;
+    cursor->message = (cursor->started == true) ? (cursor->message + delta) : delta;
+    cursor->fields = *cursor->next++;
+    cursor->started = true;
+    
+    return 1;
+}
+
+/**************************************************************************************************
+ * Orders the terms of a query by the number of messages they are in, for qsort().
+ **************************************************************************************************/
+static int compare_cursors(const void *first, const void *second)
+{
+    const posting_cursor *first_cursor = (const posting_cursor *)first;
+    const posting_cursor *second_cursor = (const posting_cursor *)second;
+    
+    return (first_cursor->count > second_cursor->count) - (first_cursor->count < second_cursor->count);
+}
+
+/**************************************************************************************************
+ * Reads the next term from the given text, which is moved past it, into the given buffer. A term
+ * is a run of ASCII letters and digits and bytes of non ASCII characters. ASCII letters are made
+ * lower case and anything beyond SEARCH_MAX_TERM_LENGTH bytes is dropped. The same rules are used
+ * for messages and for queries, so the two always agree.
+ *
+ * Returns the length of the term, 0 if there are no more.
+ **************************************************************************************************/
+static uint32_t next_term(const char **text, const char *end, char *term)
+{
+    const unsigned char *next = (const unsigned char *)*text;
+    uint32_t length = 0;
+    unsigned char ch = 0;
+    
+    for (; next < (const unsigned char *)end; next++)
+    {
+        ch = *next;
+        if ((ch >= 'A') && (ch <= 'Z')) ch += ('a' - 'A');
+        if (((ch < '0') || (ch > '9')) && ((ch < 'a') || (ch > 'z')) && (ch < 0x80))
+        {
+            if (length > 0) break;
+            continue;
+        }
+        
+    
+        if (length < SEARCH_MAX_TERM_LENGTH) term[length++] = (char)ch;
+    }
+    *text = (const char *)next;
+    
+    return length;
+}
+
+/**************************************************************************************************
+ * Returns the FNV-1a hash of the given term.
+ **************************************************************************************************/
+static uint64_t hash_term(const char *text, uint32_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    
+    for (uint32_t idx = 0; idx < length; idx++)
+    {
+        hash ^= (unsigned char)text[idx];
+        hash *= 0x100000001b3ULL;
+    }
+    
+    return hash;
+}
@@ -0,0 +1,352 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * stream.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <libxml/xmlreader.h>
+#include "private.h"
+#include "libolmec.h"
+
+static int fill_stream_input(entry_stream *stream);
+static int inflate_into(entry_stream *stream, unsigned char *buffer, size_t length, size_t *produced);
+static unsigned char *get_out_window(entry_stream *stream);
+static const unsigned char *stream_source(entry_stream *stream);
+
+/**************************************************************************************************
+ * Gets the given entry ready to be read from start to finish with entry_stream_read() or
+ * entry_stream_next(). Stored entries are read as they are and deflated ones are inflated a window
+ * at a time, so the memory used does not depend on the size of the entry. If verify is set the CRC
+ * is checked once the last byte has been read, and corrupted_error is what bad data is reported as.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code. The stream must be closed with entry_stream_close()
+ * either way.
+ **************************************************************************************************/
+int entry_stream_open(entry_stream *stream, olm_file_t *file, internal_archive_entry_data *entry, uint64_t data_offset, int verify, int corrupted_error)
+{
+    memset(stream, 0, sizeof(entry_stream));
+    stream->file = file;
+    stream->data_offset = data_offset;
+    stream->compressed_size = entry->entry_compressed_size;
+    stream->size = entry->entry_size;
+    stream->expected_crc = entry->crc32;
+    stream->compression_method = entry->compression_method;
+    stream->verify = verify;
+    stream->corrupted_error = corrupted_error;
+    
+    if (stream->compression_method == ZIP_CA_STORED) return OLM_ERROR_SUCCESS;
+    if (stream->compression_method != ZIP_CA_DEFLATE)
+    {
+        stream->error_code = corrupted_error;
+        return stream->error_code;
+    }
+    
+    /* ZIP entries hold raw deflate data, without the zlib header and trailer. */
+    if (inflateInit2(&stream->zstream, -MAX_WBITS) != Z_OK)
+    {
+        stream->error_code = OLM_ERROR_NO_MEMORY;
+        return stream->error_code;
+    }
+    stream->inflating = true;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Reads the next length bytes of the entry into the given buffer.
+ *
+ * Returns the number of bytes read, which is only less than length at the end of the entry, or -1
+ * if an error occurred (the error code is left in the stream). The read that reaches the end of an
+ * entry whose CRC is wrong fails, as does every read after it.
+ **************************************************************************************************/
+ssize_t entry_stream_read(entry_stream *stream, void *buffer, size_t length)
+{
+    size_t done = 0;
+    
+    if (stream->error_code != OLM_ERROR_SUCCESS) return -1;
+    
+    if (length > (stream->size - stream->produced)) length = (size_t)(stream->size - stream->produced);
+    if (length > SSIZE_MAX) length = SSIZE_MAX;
+    
+    if ((stream->compression_method == ZIP_CA_STORED) && (stream->source != NULL))
+    {
+        memcpy(buffer, (stream->source + stream->produced), length);
+        done = length;
+    }
+    else if (stream->compression_method == ZIP_CA_STORED)
+    {
+        stream->error_code = read_archive_data(stream->file, (stream->data_offset + stream->produced), buffer, length);
+        if (stream->error_code != OLM_ERROR_SUCCESS) return -1;
+        done = length;
+    }
+    else
+    {
+        stream->error_code = inflate_into(stream, (unsigned char *)buffer, length, &done);
+        if (stream->error_code != OLM_ERROR_SUCCESS) return -1;
+    }
+    
+    if (stream->verify == true) stream->crc = serial_crc32(stream->crc, (const unsigned char *)buffer, done);
+    stream->produced += done;
+    
+    if ((stream->produced == stream->size) && (stream->verify == true) && (stream->crc != stream->expected_crc))
+    {
+        stream->error_code = stream->corrupted_error;
+        return -1;
+    }
+    
+    return (ssize_t)done;
+}
+
+/**************************************************************************************************
+ * Hands out the next block of the entry without it having to be copied. Stored entries in a mapped
+ * archive are passed on where they lie, everything else is read into a window kept by the stream.
+ * The block is only valid until the stream is next used.
+ *
+ * Returns OLM_ERROR_SUCCESS with the block in data and length (a length of 0 at the end of the
+ * entry), or an error code.
+ **************************************************************************************************/
+int entry_stream_next(entry_stream *stream, const unsigned char **data, size_t *length)
+{
+    const unsigned char *source = NULL;
+    ssize_t read = 0;
+    size_t block = 0;
+    
+    *data = NULL;
+    *length = 0;
+    if (stream->error_code != OLM_ERROR_SUCCESS) return stream->error_code;
+    if (stream->produced == stream->size) return OLM_ERROR_SUCCESS;
+    
+    if ((stream->compression_method == ZIP_CA_STORED) && ((source = stream_source(stream)) != NULL))
+    {
+        block = ((stream->size - stream->produced) < COPY_CHUNK_SIZE) ? (size_t)(stream->size - stream->produced) : COPY_CHUNK_SIZE;
+        *data = source + stream->produced;
+        if (stream->verify == true) stream->crc = serial_crc32(stream->crc, *data, block);
+        stream->produced += block;
+        if ((stream->produced == stream->size) && (stream->verify == true) && (stream->crc != stream->expected_crc))
+        {
+            stream->error_code = stream->corrupted_error;
+            return stream->error_code;
+        }
+        *length = block;
+        return OLM_ERROR_SUCCESS;
+    }
+    
+    if (get_out_window(stream) == NULL) return stream->error_code;
+    read = entry_stream_read(stream, stream->out_window, STREAM_WINDOW_SIZE);
+    if (read < 0) return stream->error_code;
+    *data = stream->out_window;
+    *length = (size_t)read;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Moves the stream to the given offset in the entry. Deflated data can only be read from the start,
+ * so going forwards means inflating (and throwing away) everything up to the offset and going back
+ * means starting again.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int entry_stream_seek(entry_stream *stream, uint64_t offset)
+{
+    size_t length = 0;
+    
+    if (stream->error_code != OLM_ERROR_SUCCESS) return stream->error_code;
+    if (offset > stream->size) offset = stream->size;
+    
+    if (offset < stream->produced)
+    {
+        if ((stream->inflating == true) && (inflateReset(&stream->zstream) != Z_OK))
+        {
+            stream->error_code = stream->corrupted_error;
+            return stream->error_code;
+        }
+        stream->zstream.next_in = NULL;
+        stream->zstream.avail_in = 0;
+        stream->consumed = 0;
+        stream->produced = 0;
+        stream->crc = 0;
+    }
+    
+    while (stream->produced < offset)
+    {
+        if (get_out_window(stream) == NULL) return stream->error_code;
+        length = ((offset - stream->produced) < STREAM_WINDOW_SIZE) ? (size_t)(offset - stream->produced) : STREAM_WINDOW_SIZE;
+        if (entry_stream_read(stream, stream->out_window, length) < 0) return stream->error_code;
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Frees everything held by an entry stream (but not the stream itself).
+ **************************************************************************************************/
+void entry_stream_close(entry_stream *stream)
+{
+    if (stream->inflating == true) inflateEnd(&stream->zstream);
+    if (stream->in_window != NULL) free(stream->in_window);
+    if (stream->out_window != NULL) free(stream->out_window);
+    stream->inflating = false;
+    stream->in_window = NULL;
+    stream->out_window = NULL;
+}
+
+/**************************************************************************************************
+ * Feeds an XML reader the data of an entry, from the entry stream given as its context.
+ *
+ * Returns the number of bytes read, 0 at the end of the entry or -1 on error.
+ **************************************************************************************************/
+int read_entry_stream(void *context, char *buffer, int length)
+{
+    ssize_t read = entry_stream_read((entry_stream *)context, buffer, (size_t)length);
+    
+    return (read < 0) ? -1 : (int)read;
+}
+
+/**************************************************************************************************
+ * Copies length bytes from the given offset of the archive into the buffer, from the mapping if
+ * there is one (get_entry_data_offset() has already checked that the data lies inside it).
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+int read_archive_data(olm_file_t *file, uint64_t offset, void *buffer, size_t length)
+{
+    if (file->file_map != NULL)
+    {
+        memcpy(buffer, (file->file_map + offset), length);
+        return OLM_ERROR_SUCCESS;
+    }
+    
+    if (read_fully(file->file_seg, buffer, length, (off_t)offset) == false) return OLM_ERROR_FILE_IO_ERROR;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Gives inflate the next part of the compressed data. Data that is in memory (or mapped) is handed
+ * over where it lies, otherwise it is read into a window kept by the stream.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int fill_stream_input(entry_stream *stream)
+{
+    const unsigned char *source = stream_source(stream);
+    uint64_t remaining = stream->compressed_size - stream->consumed;
+    size_t block = 0;
+    
+    /* The compressed data ran out before the entry did. */
+    if (remaining == 0) return stream->corrupted_error;
+    
+    if (source != NULL)
+    {
+        block = (remaining > 0x40000000) ? 0x40000000 : (size_t)remaining;
+        stream->zstream.next_in = (Bytef *)(source + stream->consumed);
+    }
+    else
+    {
+        if (stream->in_window == NULL)
+        {
+            stream->in_window = (unsigned char *)malloc(STREAM_WINDOW_SIZE);
+            if (stream->in_window == NULL) return OLM_ERROR_NO_MEMORY;
+        }
+        block = (remaining > STREAM_WINDOW_SIZE) ? STREAM_WINDOW_SIZE : (size_t)remaining;
+        if (read_fully(stream->file->file_seg, stream->in_window, block, (off_t)(stream->data_offset + stream->consumed)) == false) return OLM_ERROR_FILE_IO_ERROR;
+        stream->zstream.next_in = stream->in_window;
+    }
+    stream->zstream.avail_in = (uInt)block;
+    stream->consumed += block;
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Inflates exactly length bytes into the buffer (the caller has already made sure that the entry
+ * is at least that much longer), feeding inflate more compressed data as it needs it.
+ *
+ * Returns OLM_ERROR_SUCCESS or an error code.
+ **************************************************************************************************/
+static int inflate_into(entry_stream *stream, unsigned char *buffer, size_t length, size_t *produced)
+{
+    size_t block = 0;
+    int result = Z_OK;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    *produced = 0;
+    while (*produced < length)
+    {
+        if (stream->zstream.avail_in == 0)
+        {
+            error_code = fill_stream_input(stream);
+            if (error_code != OLM_ERROR_SUCCESS) return error_code;
+        }
+        
+        block = ((length - *produced) > UINT_MAX) ? UINT_MAX : (length - *produced);
+        stream->zstream.next_out = buffer + *produced;
+        stream->zstream.avail_out = (uInt)block;
+        result = inflate(&stream->zstream, Z_NO_FLUSH);
+        *produced += block - stream->zstream.avail_out;
+        
+        /* Running out of input is fine (there is more to come), anything else is bad data. The stream ending
+           early means the sizes in the central directory are wrong. */
+        if ((result == Z_STREAM_END) && (*produced < length)) return stream->corrupted_error;
+        if (result == Z_MEM_ERROR) return OLM_ERROR_NO_MEMORY;
+        if ((result != Z_OK) && (result != Z_STREAM_END) && (result != Z_BUF_ERROR)) return stream->corrupted_error;
+    }
+    
+    return OLM_ERROR_SUCCESS;
+}
+
+/**************************************************************************************************
+ * Returns the window that the stream reads blocks into for entry_stream_next(), allocating it the
+ * first time, or NULL (with the error code left in the stream) if there is no memory for it.
+ **************************************************************************************************/
+static unsigned char *get_out_window(entry_stream *stream)
+{
+    if (stream->out_window == NULL)
+    {
+        stream->out_window = (unsigned char *)malloc(STREAM_WINDOW_SIZE);
+        if (stream->out_window == NULL) stream->error_code = OLM_ERROR_NO_MEMORY;
+    }
+    
+    return stream->out_window;
+}
+
+/**************************************************************************************************
+ * Returns where the data of the entry lies in memory, if it has been read already or the archive
+ * is mapped, or NULL if it has to be read from the archive.
+ **************************************************************************************************/
+static const unsigned char *stream_source(entry_stream *stream)
+{
+    if (stream->source != NULL) return stream->source;
+    if (stream->file->file_map != NULL) return (stream->file->file_map + stream->data_offset);
+    
+    return NULL;
+}
@@ -0,0 +1,301 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * archive.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+#include "archive.h"
+
+#define SIG_LOCAL_FILE_HEADER                    0x04034b50
+#define SIG_CENTRAL_FILE_HEADER                  0x02014b50
+#define SIG_END_OF_CENTRAL_DIR                   0x06054b50
+#define LOCAL_HEADER_SIZE                        30
+#define CENTRAL_HEADER_SIZE                      46
+#define END_OF_CENTRAL_DIR_SIZE                  22
+#define ZIP_VERSION                              20
+
+#define MESSAGE_DIR                              "Local/com.microsoft.__Messages/Inbox"
+#define ATTACHMENT_DIR                           MESSAGE_DIR "/com.microsoft.__Attachments"
+
+struct test_archive
+{
+    FILE *stream;
+    unsigned char *central_dir;
+    size_t central_dir_size;
+    size_t central_dir_capacity;
+    uint32_t offset;
+    uint16_t entry_count;
+};
+
+static void put16(unsigned char *dest, uint16_t value)
+{
+    dest[0] = (unsigned char)value;
+    dest[1] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned char *dest, uint32_t value)
+{
+    put16(dest, (uint16_t)value);
+    put16((dest + 2), (uint16_t)(value >> 16));
+}
+
+/******************************************************************************************************************************
+ * Creates a new archive with the directories and the category list that every OLM file has.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      path        The file to write the archive to, it is overwritten if it already exists.
+ *
+ * Returns:
+ *
+ *      The archive, or NULL if the file could not be created.
+ ******************************************************************************************************************************/
+test_archive *test_archive_create(const char *path)
+{
+    static const char categories[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<categories/>\n";
+    test_archive *archive = NULL;
+    
+    archive = (test_archive *)calloc(1, sizeof(test_archive));
+    if (archive == NULL) return NULL;
+    archive->stream = fopen(path, "wb");
+    if (archive->stream == NULL)
+    {
+        free(archive);
+        return NULL;
+    }
+    
+    if ((test_archive_add(archive, "Accounts/", "", 0, 0) == false) ||
+        (test_archive_add(archive, "Local/", "", 0, 0) == false) ||
+        (test_archive_add(archive, "Categories.xml", categories, (sizeof(categories) - 1), (sizeof(categories) - 1)) == false))
+    {
+        test_archive_close(archive);
+        return NULL;
+    }
+    
+    return archive;
+}
+
+/******************************************************************************************************************************
+ * Adds a stored entry to an archive.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      archive         The archive to add the entry to.
+ *      entry_path      The path of the entry, ending in a slash for a directory.
+ *      data            The data of the entry.
+ *      length          The number of bytes of data.
+ *      stated_size     The uncompressed size that the headers give, which is normally the same as length. A different
+ *                      size makes a damaged entry.
+ *
+ * Returns:
+ *
+ *      true or false if the entry could not be written.
+ ******************************************************************************************************************************/
+int test_archive_add(test_archive *archive, const char *entry_path, const void *data, uint32_t length, uint32_t stated_size)
+{
+    unsigned char header[CENTRAL_HEADER_SIZE];
+    unsigned char *central_dir = NULL;
+    size_t path_length = strlen(entry_path);
+    size_t capacity = 0;
+    uint32_t crc = (uint32_t)crc32(0, (const Bytef *)data, length);
+    
+    /* The local header. */
+    memset(header, 0, sizeof(header));
+    put32(header, SIG_LOCAL_FILE_HEADER);
+    put16((header + 4), ZIP_VERSION);
+    put32((header + 14), crc);
+    put32((header + 18), length);
+    put32((header + 22), stated_size);
+    put16((header + 26), (uint16_t)path_length);
+    if ((fwrite(header, 1, LOCAL_HEADER_SIZE, archive->stream) != LOCAL_HEADER_SIZE) ||
+        (fwrite(entry_path, 1, path_length, archive->stream) != path_length) ||
+        (fwrite(data, 1, length, archive->stream) != length)) return false;
+    
+    /* The central directory record, which is written out when the archive is closed. */
+    capacity = archive->central_dir_size + CENTRAL_HEADER_SIZE + path_length;
+    if (capacity > archive->central_dir_capacity)
+    {
+        capacity *= 2;
+        central_dir = (unsigned char *)realloc(archive->central_dir, capacity);
+        if (central_dir == NULL) return false;
+        archive->central_dir = central_dir;
+        archive->central_dir_capacity = capacity;
+    }
+    memset(header, 0, sizeof(header));
+    put32(header, SIG_CENTRAL_FILE_HEADER);
+    put16((header + 4), ZIP_VERSION);
+    put16((header + 6), ZIP_VERSION);
+    put32((header + 16), crc);
+    put32((header + 20), length);
+    put32((header + 24), stated_size);
+    put16((header + 28), (uint16_t)path_length);
+    put32((header + 42), archive->offset);
+    memcpy((archive->central_dir + archive->central_dir_size), header, CENTRAL_HEADER_SIZE);
+    memcpy((archive->central_dir + archive->central_dir_size + CENTRAL_HEADER_SIZE), entry_path, path_length);
+    archive->central_dir_size += CENTRAL_HEADER_SIZE + path_length;
+    
+    archive->offset += (uint32_t)(LOCAL_HEADER_SIZE + path_length + length);
+    archive->entry_count++;
+    
+    return true;
+}
+
+/******************************************************************************************************************************
+ * Adds a message with the subject "Message <index>" to an archive, along with an attachment if one is given.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      archive         The archive to add the message to.
+ *      index           The number of the message, which names it and its attachment.
+ *      attachment      The data of the attachment or NULL for none.
+ *      length          The number of bytes of attachment data.
+ *      stated_size     The size of the attachment that its headers give (see test_archive_add()).
+ *
+ * Returns:
+ *
+ *      true or false if the message could not be written.
+ ******************************************************************************************************************************/
+int test_archive_add_message(test_archive *archive, unsigned int index, const void *attachment, uint32_t length, uint32_t stated_size)
+{
+    char attachment_path[256];
+    char message_path[256];
+    char xml[1024];
+    int xml_length = 0;
+    
+    snprintf(attachment_path, sizeof(attachment_path), ATTACHMENT_DIR "/attachment_%u_1", index);
+    snprintf(message_path, sizeof(message_path), MESSAGE_DIR "/message_%05u__message_attachment__.xml", index);
+    
+    xml_length = snprintf(xml, sizeof(xml),
+                          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<emails><email>\n"
+                          "<OPFMessageCopySubject>Message %u</OPFMessageCopySubject>\n"
+                          "<OPFMessageCopySenderAddress><emailAddress OPFContactEmailAddressAddress=\"sender%u@example.com\"/></OPFMessageCopySenderAddress>\n"
+                          "<OPFMessageCopyBody>Body of message %u</OPFMessageCopyBody>\n",
+                          index, index, index);
+    if (attachment != NULL)
+    {
+        xml_length += snprintf((xml + xml_length), (sizeof(xml) - (size_t)xml_length),
+                               "<OPFMessageCopyAttachmentList><messageAttachment OPFAttachmentName=\"attachment_%u.bin\" "
+                               "OPFAttachmentURL=\"%s\" OPFAttachmentContentFileSize=\"%u\"/></OPFMessageCopyAttachmentList>\n",
+                               index, attachment_path, length);
+    }
+    xml_length += snprintf((xml + xml_length), (sizeof(xml) - (size_t)xml_length), "</email></emails>\n");
+    
+    if (test_archive_add(archive, message_path, xml, (uint32_t)xml_length, (uint32_t)xml_length) == false) return false;
+    if ((attachment != NULL) && (test_archive_add(archive, attachment_path, attachment, length, stated_size) == false)) return false;
+    
+    return true;
+}
+
+/******************************************************************************************************************************
+ * Adds a message made of the given elements to an archive, for tests that need more than test_archive_add_message() gives.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      archive         The archive to add the message to.
+ *      index           The number of the message, which names it.
+ *      elements        The XML that goes inside the <email> element of the message.
+ *
+ * Returns:
+ *
+ *      true or false if the message could not be written.
+ ******************************************************************************************************************************/
+int test_archive_add_email(test_archive *archive, unsigned int index, const char *elements)
+{
+    static const char xml_head[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<emails><email>\n";
+    static const char xml_tail[] = "</email></emails>\n";
+    char message_path[256];
+    char *xml = NULL;
+    size_t xml_length = 0;
+    int result = false;
+    
+    snprintf(message_path, sizeof(message_path), MESSAGE_DIR "/message_%05u__message_attachment__.xml", index);
+    
+    xml_length = (sizeof(xml_head) - 1) + strlen(elements) + (sizeof(xml_tail) - 1);
+    xml = (char *)malloc(xml_length + 1);
+    if (xml == NULL) return false;
+    snprintf(xml, (xml_length + 1), "%s%s%s", xml_head, elements, xml_tail);
+    
+    result = test_archive_add(archive, message_path, xml, (uint32_t)xml_length, (uint32_t)xml_length);
+    free(xml);
+    
+    return result;
+}
+
+/******************************************************************************************************************************
+ * Writes out the central directory of an archive and closes it. The archive is freed even if this fails.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      archive     The archive to close.
+ *
+ * Returns:
+ *
+ *      true or false if the archive could not be written.
+ ******************************************************************************************************************************/
+int test_archive_close(test_archive *archive)
+{
+    unsigned char record[END_OF_CENTRAL_DIR_SIZE];
+    int result = true;
+    
+    memset(record, 0, sizeof(record));
+    put32(record, SIG_END_OF_CENTRAL_DIR);
+    put16((record + 8), archive->entry_count);
+    put16((record + 10), archive->entry_count);
+    put32((record + 12), (uint32_t)archive->central_dir_size);
+    put32((record + 16), archive->offset);
+    
+    if ((fwrite(archive->central_dir, 1, archive->central_dir_size, archive->stream) != archive->central_dir_size) ||
+        (fwrite(record, 1, sizeof(record), archive->stream) != sizeof(record))) result = false;
+    if (fclose(archive->stream) != 0) result = false;
+    
+    free(archive->central_dir);
+    free(archive);
+    
+    return result;
+}
+
+/******************************************************************************************************************************
+ * Fills a buffer with the contents of an attachment, which differ for each attachment so that a mix up shows.
+ *-----------------------------------------------------------------------------------------------------------------------------
+ * Parameters:
+ *
+ *      index       The number of the message that the attachment belongs to.
+ *      data        The buffer to fill.
+ *      length      The size of the buffer.
+ ******************************************************************************************************************************/
+void test_attachment_data(unsigned int index, unsigned char *data, uint32_t length)
+{
+    uint32_t state = (index + 1) * 2654435761u;
+    
+    for (uint32_t idx = 0; idx < length; idx++)
+    {
+        state = (state * 1103515245u) + 12345u;
+        data[idx] = (unsigned char)(state >> 16);
+    }
+}
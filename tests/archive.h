@@ -0,0 +1,37 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * archive.h
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef archive_h
+#define archive_h
+
+/* Builds the small OLM files that the tests are run against. */
+
+/* Opaque type for an archive that is being written. */
+typedef struct test_archive test_archive;
+
+test_archive *test_archive_create(const char *path);
+int           test_archive_add(test_archive *archive, const char *entry_path, const void *data, uint32_t length, uint32_t stated_size);
+int           test_archive_add_message(test_archive *archive, unsigned int index, const void *attachment, uint32_t length, uint32_t stated_size);
+int           test_archive_add_email(test_archive *archive, unsigned int index, const char *elements);
+int           test_archive_close(test_archive *archive);
+void          test_attachment_data(unsigned int index, unsigned char *data, uint32_t length);
+
+#endif
@@ -0,0 +1,225 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * central_dir.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Opens archives whose end of central directory record (or ZIP64 one) gives a central directory that is larger than the
+   file, lies past the end of it or is too small for its entries, all of which must be turned away as corrupted before any
+   memory is allocated for it. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define SOURCE_PATH                              "central_dir.olm"
+#define ARCHIVE_PATH                             "central_dir.olm.bad"
+#define SIG_ZIP64_END_OF_CENTRAL_DIR             0x06064b50
+#define SIG_ZIP64_EOCDR_LOCATOR                  0x07064b50
+#define END_OF_CENTRAL_DIR_SIZE                  22
+#define ZIP64_END_OF_CENTRAL_DIR_SIZE            56
+#define ZIP64_EOCDR_LOCATOR_SIZE                 20
+
+/* The central directory that an end of central directory record is to give. */
+typedef struct _central_dir
+{
+    uint64_t total_entries;
+    uint64_t size;
+    uint64_t offset;
+} central_dir;
+
+static unsigned char *archive_body = NULL;                          /* Everything before the end of central directory record. */
+static size_t body_length = 0;
+static central_dir actual_dir;
+
+static void put16(unsigned char *dest, uint16_t value)
+{
+    dest[0] = (unsigned char)value;
+    dest[1] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned char *dest, uint32_t value)
+{
+    put16(dest, (uint16_t)value);
+    put16((dest + 2), (uint16_t)(value >> 16));
+}
+
+static void put64(unsigned char *dest, uint64_t value)
+{
+    put32(dest, (uint32_t)value);
+    put32((dest + 4), (uint32_t)(value >> 32));
+}
+
+static uint32_t get32(const unsigned char *source)
+{
+    return (uint32_t)source[0] | ((uint32_t)source[1] << 8) | ((uint32_t)source[2] << 16) | ((uint32_t)source[3] << 24);
+}
+
+/* Reads the archive written by test_archive_close() back in, keeping everything but its end of central directory record. */
+static int load_archive(void)
+{
+    FILE *stream = NULL;
+    long length = 0;
+    int result = false;
+    
+    stream = fopen(SOURCE_PATH, "rb");
+    if (stream == NULL) return false;
+    if ((fseek(stream, 0, SEEK_END) != 0) || ((length = ftell(stream)) < END_OF_CENTRAL_DIR_SIZE)) goto bail_and_die;
+    rewind(stream);
+    archive_body = (unsigned char *)malloc((size_t)length);
+    if ((archive_body == NULL) || (fread(archive_body, 1, (size_t)length, stream) != (size_t)length)) goto bail_and_die;
+    
+    body_length = (size_t)length - END_OF_CENTRAL_DIR_SIZE;
+    actual_dir.total_entries = archive_body[body_length + 10] | ((uint64_t)archive_body[body_length + 11] << 8);
+    actual_dir.size = get32(archive_body + body_length + 12);
+    actual_dir.offset = get32(archive_body + body_length + 16);
+    result = true;
+
+bail_and_die:
+    fclose(stream);
+    
+    return result;
+}
+
+/* Writes the archive out again, ending in records that give the given central directory. */
+static int write_archive(const central_dir *dir, int zip64)
+{
+    unsigned char tail[ZIP64_END_OF_CENTRAL_DIR_SIZE + ZIP64_EOCDR_LOCATOR_SIZE + END_OF_CENTRAL_DIR_SIZE];
+    unsigned char *record = tail;
+    FILE *stream = NULL;
+    int result = true;
+    
+    memset(tail, 0, sizeof(tail));
+    if (zip64 == true)
+    {
+        put32(record, SIG_ZIP64_END_OF_CENTRAL_DIR);
+        put64((record + 4), (ZIP64_END_OF_CENTRAL_DIR_SIZE - 12));
+        put16((record + 12), 45);
+        put16((record + 14), 45);
+        put64((record + 24), dir->total_entries);
+        put64((record + 32), dir->total_entries);
+        put64((record + 40), dir->size);
+        put64((record + 48), dir->offset);
+        record += ZIP64_END_OF_CENTRAL_DIR_SIZE;
+    
+        put32(record, SIG_ZIP64_EOCDR_LOCATOR);
+        put64((record + 8), (uint64_t)body_length);
+        put32((record + 16), 1);
+        record += ZIP64_EOCDR_LOCATOR_SIZE;
+    }
+    
+    put32(record, 0x06054b50);
+    put16((record + 8), (zip64 == true) ? 0xFFFF : (uint16_t)dir->total_entries);
+    put16((record + 10), (zip64 == true) ? 0xFFFF : (uint16_t)dir->total_entries);
+    put32((record + 12), (zip64 == true) ? 0xFFFFFFFF : (uint32_t)dir->size);
+    put32((record + 16), (zip64 == true) ? 0xFFFFFFFF : (uint32_t)dir->offset);
+    record += END_OF_CENTRAL_DIR_SIZE;
+    
+    stream = fopen(ARCHIVE_PATH, "wb");
+    if (stream == NULL) return false;
+    if ((fwrite(archive_body, 1, body_length, stream) != body_length) ||
+        (fwrite(tail, 1, (size_t)(record - tail), stream) != (size_t)(record - tail))) result = false;
+    if (fclose(stream) != 0) result = false;
+    
+    return result;
+}
+
+/* Opens the archive ending in the given central directory and checks that the open fails (or not) as it should. */
+static int check_open(const char *name, uint64_t total_entries, uint64_t size, uint64_t offset, int zip64, int expected_error)
+{
+    central_dir dir;
+    olm_file_t *file = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    dir.total_entries = total_entries;
+    dir.size = size;
+    dir.offset = offset;
+    if (write_archive(&dir, zip64) == false)
+    {
+        fprintf(stderr, "%s: the archive could not be written\n", name);
+        return false;
+    }
+    
+    file = olm_open_file(ARCHIVE_PATH, 0, &error_code);
+    if (file != NULL) olm_close_file(file);
+    if (error_code != expected_error)
+    {
+        fprintf(stderr, "%s: the open gave error %d rather than %d\n", name, error_code, expected_error);
+        return false;
+    }
+    
+    return true;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    unsigned char attachment[100];
+    uint64_t entries = 0;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    int passed = true;
+    
+    archive = test_archive_create(SOURCE_PATH);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        return EXIT_FAILURE;
+    }
+    test_attachment_data(0, attachment, sizeof(attachment));
+    if ((test_archive_add_message(archive, 0, attachment, sizeof(attachment), sizeof(attachment)) == false) ||
+        (test_archive_close(archive) == false) || (load_archive() == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        unlink(SOURCE_PATH);
+        return EXIT_FAILURE;
+    }
+    entries = actual_dir.total_entries;
+    size = actual_dir.size;
+    offset = actual_dir.offset;
+    
+    /* The archive must open as it is, with either kind of record. */
+    passed &= check_open("intact", entries, size, offset, false, OLM_ERROR_SUCCESS);
+    passed &= check_open("intact zip64", entries, size, offset, true, OLM_ERROR_SUCCESS);
+    
+    passed &= check_open("huge size", entries, 0xFFFFFFF0, offset, false, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("offset past the end", entries, size, 0x7FFFFFFF, false, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("overlapping the record", entries, (size + 1), offset, false, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("too many entries", 0xFFFF, size, offset, false, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("huge zip64 size", entries, (UINT64_MAX - 15), offset, true, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("zip64 offset past the end", entries, size, ((uint64_t)1 << 63), true, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("wrapping zip64 offset", entries, size, (UINT64_MAX - 15), true, OLM_ERROR_FILE_CORRUPTED);
+    passed &= check_open("too many zip64 entries", ((uint64_t)1 << 40), size, offset, true, OLM_ERROR_FILE_CORRUPTED);
+    
+    free(archive_body);
+    unlink(SOURCE_PATH);
+    unlink(ARCHIVE_PATH);
+    
+    return (passed == true) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
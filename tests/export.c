@@ -0,0 +1,339 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * export.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Exports a small archive as an mbox file and as a directory of EML files, and checks that a body line starting "From " is
+   quoted-printable encoded, that a subject that is not ASCII is RFC 2047 encoded, that the base64 attachment decodes to
+   the data it was made from, that a date which cannot be parsed is passed over and that the line endings are right. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define ARCHIVE_PATH                             "export.olm"
+#define MBOX_PATH                                "export.olm.mbox"
+#define EML_DIR                                  "export.olm.eml"
+#define ATTACHMENT_PATH                          "Local/com.microsoft.__Messages/Inbox/com.microsoft.__Attachments/attachment_0_1"
+#define ATTACHMENT_SIZE                          1000
+#define MESSAGE_COUNT                            2
+
+#define SUBJECT                                  "Caf\xC3\xA9 prices \xE2\x98\x95"
+#define STR(value)                               #value
+#define XSTR(value)                              STR(value)
+
+static const char *messages[MESSAGE_COUNT] =
+{
+    "<OPFMessageCopySubject>" SUBJECT "</OPFMessageCopySubject>"
+    "<OPFMessageCopySenderAddress><emailAddress OPFContactEmailAddressAddress=\"alice@example.com\"/></OPFMessageCopySenderAddress>"
+    "<OPFMessageCopySentTime>2012-06-11T09:27:23Z</OPFMessageCopySentTime>"
+    "<OPFMessageCopyBody>Hello\nFrom here on, prices rise.\nBye</OPFMessageCopyBody>"
+    "<OPFMessageCopyAttachmentList><messageAttachment OPFAttachmentName=\"prices.bin\" OPFAttachmentURL=\"" ATTACHMENT_PATH "\" "
+    "OPFAttachmentContentFileSize=\"" XSTR(ATTACHMENT_SIZE) "\"/></OPFMessageCopyAttachmentList>",
+    
+    "<OPFMessageCopySubject>Plain subject</OPFMessageCopySubject>"
+    "<OPFMessageCopySenderAddress><emailAddress OPFContactEmailAddressAddress=\"bob@example.com\"/></OPFMessageCopySenderAddress>"
+    "<OPFMessageCopySentTime>not a date</OPFMessageCopySentTime>"
+    "<OPFMessageCopyReceivedTime>2012-06-12T10:00:00Z</OPFMessageCopyReceivedTime>"
+    "<OPFMessageCopyBody>Second message</OPFMessageCopyBody>"
+};
+
+static unsigned char attachment[ATTACHMENT_SIZE];
+
+/* Reads the whole of the given file, with a terminating nul. */
+static char *read_file(const char *path, size_t *length)
+{
+    struct stat stat_buff;
+    char *data = NULL;
+    FILE *stream = NULL;
+    
+    if (stat(path, &stat_buff) == -1) return NULL;
+    *length = (size_t)stat_buff.st_size;
+    data = (char *)malloc(*length + 1);
+    stream = fopen(path, "rb");
+    if ((data == NULL) || (stream == NULL) || (fread(data, 1, *length, stream) != *length))
+    {
+        free(data);
+        data = NULL;
+    }
+    else
+    {
+        data[*length] = '\0';
+    }
+    if (stream != NULL) fclose(stream);
+    
+    return data;
+}
+
+/* Decodes base64 up to the given end, skipping line endings, and returns the number of bytes written to dest or -1 if the
+   text is not base64 or does not fit. */
+static long decode_base64(const char *text, const char *end, unsigned char *dest, size_t size)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const char *digit = NULL;
+    uint32_t group = 0;
+    size_t count = 0;
+    size_t length = 0;
+    
+    for (; (text < end) && (*text != '='); text++)
+    {
+        if ((*text == '\r') || (*text == '\n')) continue;
+        digit = strchr(digits, *text);
+        if ((digit == NULL) || (*text == '\0')) return -1;
+        group = (group << 6) | (uint32_t)(digit - digits);
+        if (++count < 4) continue;
+        if ((length + 3) > size) return -1;
+        dest[length++] = (unsigned char)(group >> 16);
+        dest[length++] = (unsigned char)(group >> 8);
+        dest[length++] = (unsigned char)group;
+        group = 0;
+        count = 0;
+    }
+    if (count == 1) return -1;
+    if (count > 1)
+    {
+        group <<= 6 * (4 - count);
+        if ((length + count - 1) > size) return -1;
+        dest[length++] = (unsigned char)(group >> 16);
+        if (count == 3) dest[length++] = (unsigned char)(group >> 8);
+    }
+    
+    return (long)length;
+}
+
+/* Checks that every line of the given text ends as it should, in CRLF or a bare LF. */
+static int check_line_endings(const char *name, const char *text, size_t length, int crlf)
+{
+    for (size_t idx = 0; idx < length; idx++)
+    {
+        if ((text[idx] == '\r') && ((crlf == false) || (text[idx + 1] != '\n')))
+        {
+            fprintf(stderr, "%s: a stray carriage return at offset %zu\n", name, idx);
+            return false;
+        }
+        if ((text[idx] == '\n') && (crlf == true) && ((idx == 0) || (text[idx - 1] != '\r')))
+        {
+            fprintf(stderr, "%s: a line ending in a bare LF at offset %zu\n", name, idx);
+            return false;
+        }
+    }
+    if ((length == 0) || (text[length - 1] != '\n'))
+    {
+        fprintf(stderr, "%s: the last line is not ended\n", name);
+        return false;
+    }
+    
+    return true;
+}
+
+/* Looks for the given line, which must be the whole of a line of the text. */
+static int has_line(const char *name, const char *text, const char *line, const char *eol)
+{
+    size_t length = strlen(line);
+    
+    for (const char *curr = strstr(text, line); curr != NULL; curr = strstr((curr + 1), line))
+    {
+        if (((curr == text) || (curr[-1] == '\n')) && (strncmp((curr + length), eol, strlen(eol)) == 0)) return true;
+    }
+    fprintf(stderr, "%s: there is no line \"%s\"\n", name, line);
+    
+    return false;
+}
+
+/* Checks what the first message was turned into, in the given text. */
+static int check_first_message(const char *name, const char *text, const char *eol)
+{
+    unsigned char decoded[ATTACHMENT_SIZE + 4];
+    const char *start = NULL;
+    const char *end = NULL;
+    long length = 0;
+    int result = true;
+    
+    /* The subject is short enough for a single encoded word. */
+    result &= has_line(name, text, "From: alice@example.com", eol);
+    result &= has_line(name, text, "Date: Mon, 11 Jun 2012 09:27:23 +0000", eol);
+    start = strstr(text, "Subject: =?UTF-8?B?");
+    end = (start == NULL) ? NULL : strstr(start, "?=");
+    if ((start == NULL) || (end == NULL) || (strncmp((end + 2), eol, strlen(eol)) != 0) ||
+        ((length = decode_base64((start + 19), end, decoded, sizeof(decoded))) != (long)strlen(SUBJECT)) || (memcmp(decoded, SUBJECT, (size_t)length) != 0))
+    {
+        fprintf(stderr, "%s: the subject is not a single encoded word holding the original\n", name);
+        result = false;
+    }
+    
+    /* The body is quoted-printable, with the F of "From " encoded and the other lines as they were. */
+    result &= has_line(name, text, "Content-Transfer-Encoding: quoted-printable", eol);
+    result &= has_line(name, text, "Hello", eol);
+    result &= has_line(name, text, "=46rom here on, prices rise.", eol);
+    result &= has_line(name, text, "Bye", eol);
+    
+    /* The attachment runs from the blank line after its headers to the closing boundary. */
+    result &= has_line(name, text, "Content-Disposition: attachment;", eol);
+    result &= has_line(name, text, " filename=\"prices.bin\"", eol);
+    start = strstr(text, "Content-Transfer-Encoding: base64");
+    if (start != NULL) start = strstr(start, eol);
+    if (start != NULL) start += 2 * strlen(eol);
+    end = (start == NULL) ? NULL : strstr(start, "--=_olm_part_0--");
+    if ((start == NULL) || (end == NULL) || (decode_base64(start, end, decoded, sizeof(decoded)) != ATTACHMENT_SIZE) ||
+        (memcmp(decoded, attachment, ATTACHMENT_SIZE) != 0))
+    {
+        fprintf(stderr, "%s: the attachment does not decode to the original data\n", name);
+        result = false;
+    }
+    
+    return result;
+}
+
+/* Checks the mbox file, which has LF line endings and a "From " line for each message and nowhere else. */
+static int check_mbox(void)
+{
+    char *text = NULL;
+    size_t length = 0;
+    int from_lines = 0;
+    int result = true;
+    
+    text = read_file(MBOX_PATH, &length);
+    if (text == NULL)
+    {
+        fprintf(stderr, "mbox: the file was not written\n");
+        return false;
+    }
+    
+    result &= check_line_endings("mbox", text, length, false);
+    for (const char *curr = text; curr != NULL; curr = strchr(curr, '\n'))
+    {
+        if (*curr == '\n') curr++;
+        if (strncmp(curr, "From ", 5) == 0) from_lines++;
+    }
+    if (from_lines != MESSAGE_COUNT)
+    {
+        fprintf(stderr, "mbox: %d lines start \"From \" rather than %d\n", from_lines, MESSAGE_COUNT);
+        result = false;
+    }
+    result &= has_line("mbox", text, "From alice@example.com Mon Jun 11 09:27:23 2012", "\n");
+    result &= check_first_message("mbox", text, "\n");
+    
+    /* The second message has a sent time that could not be parsed, so it is dated by when it was received. */
+    result &= has_line("mbox", text, "From bob@example.com Tue Jun 12 10:00:00 2012", "\n");
+    result &= has_line("mbox", text, "Date: Tue, 12 Jun 2012 10:00:00 +0000", "\n");
+    free(text);
+    
+    return result;
+}
+
+/* Checks the EML files, which have CRLF line endings and no "From " line. */
+static int check_eml_dir(void)
+{
+    char *text = NULL;
+    size_t length = 0;
+    int result = true;
+    
+    text = read_file(EML_DIR "/00000000.eml", &length);
+    if (text == NULL)
+    {
+        fprintf(stderr, "00000000.eml: the file was not written\n");
+        return false;
+    }
+    result &= check_line_endings("00000000.eml", text, length, true);
+    if (strncmp(text, "From: ", 6) != 0)
+    {
+        fprintf(stderr, "00000000.eml: the file does not start with the From header\n");
+        result = false;
+    }
+    result &= check_first_message("00000000.eml", text, "\r\n");
+    free(text);
+    
+    text = read_file(EML_DIR "/00000001.eml", &length);
+    if (text == NULL)
+    {
+        fprintf(stderr, "00000001.eml: the file was not written\n");
+        return false;
+    }
+    result &= check_line_endings("00000001.eml", text, length, true);
+    result &= has_line("00000001.eml", text, "Subject: Plain subject", "\r\n");
+    result &= has_line("00000001.eml", text, "Date: Tue, 12 Jun 2012 10:00:00 +0000", "\r\n");
+    free(text);
+    
+    return result;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    olm_file_t *file = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    int written = true;
+    int result = EXIT_FAILURE;
+    
+    archive = test_archive_create(ARCHIVE_PATH);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        return EXIT_FAILURE;
+    }
+    test_attachment_data(0, attachment, ATTACHMENT_SIZE);
+    for (unsigned int index = 0; (index < MESSAGE_COUNT) && (written == true); index++) written = test_archive_add_email(archive, index, messages[index]);
+    if (written == true) written = test_archive_add(archive, ATTACHMENT_PATH, attachment, ATTACHMENT_SIZE, ATTACHMENT_SIZE);
+    if ((test_archive_close(archive) == false) || (written == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        goto bail_and_die;
+    }
+    
+    file = olm_open_file(ARCHIVE_PATH, 0, &error_code);
+    if (file == NULL)
+    {
+        fprintf(stderr, "the archive could not be opened (error %d)\n", error_code);
+        goto bail_and_die;
+    }
+    if ((error_code = olm_export_mbox(file, MBOX_PATH, 1)) != OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "the mbox export failed (error %d)\n", error_code);
+        goto bail_and_die;
+    }
+    if ((error_code = olm_export_eml_dir(file, EML_DIR, 1)) != OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "the EML export failed (error %d)\n", error_code);
+        goto bail_and_die;
+    }
+    
+    if ((check_mbox() == true) & (check_eml_dir() == true)) result = EXIT_SUCCESS;
+
+bail_and_die:
+    if (file != NULL) olm_close_file(file);
+    unlink(EML_DIR "/00000000.eml");
+    unlink(EML_DIR "/00000001.eml");
+    rmdir(EML_DIR);
+    unlink(MBOX_PATH);
+    unlink(ARCHIVE_PATH);
+    
+    return result;
+}
@@ -0,0 +1,213 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * metadata.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Exports the metadata of a small archive as JSON Lines and as CSV and compares the output with what it should be, line by
+   line: quotes, backslashes and control characters escaped, quotes doubled in CSV, missing values (and a date that cannot
+   be parsed) as null or an empty field and the row of column names that starts a CSV file. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define ARCHIVE_PATH                             "metadata.olm"
+#define DEST_PATH                                "metadata.tmp"
+#define MESSAGE_COUNT                            3
+#define FIELDS                                   (OLM_FIELD_SENT_TIME | OLM_FIELD_RECEIVED_TIME | OLM_FIELD_FROM | OLM_FIELD_TO | OLM_FIELD_SUBJECT | \
+                                                  OLM_FIELD_MESSAGE_ID | OLM_FIELD_ATTACHMENTS)
+
+static const char *messages[MESSAGE_COUNT] =
+{
+    "<OPFMessageCopySubject>Say &quot;hi&quot;&#9;to C:\\temp&#13;\nnow</OPFMessageCopySubject>"
+    "<OPFMessageCopySenderAddress><emailAddress OPFContactEmailAddressAddress=\"alice@example.com\"/></OPFMessageCopySenderAddress>"
+    "<OPFMessageCopyToAddresses><emailAddress OPFContactEmailAddressAddress=\"bob@example.com\"/>"
+    "<emailAddress OPFContactEmailAddressAddress=\"carol@example.com\"/></OPFMessageCopyToAddresses>"
+    "<OPFMessageCopySentTime>2012-06-11T09:27:23Z</OPFMessageCopySentTime>"
+    "<OPFMessageCopyMessageID>&lt;abc@example.com&gt;</OPFMessageCopyMessageID>",
+    
+    "<OPFMessageCopySentTime>not a date</OPFMessageCopySentTime>"
+    "<OPFMessageCopyReceivedTime>2012-06-12T10:00:00Z</OPFMessageCopyReceivedTime>"
+    "<OPFMessageCopyAttachmentList><messageAttachment OPFAttachmentName=\"a.bin\" OPFAttachmentContentFileSize=\"100\"/>"
+    "<messageAttachment OPFAttachmentName=\"b.bin\" OPFAttachmentContentFileSize=\"2048\"/></OPFMessageCopyAttachmentList>",
+    
+    "<OPFMessageCopySubject></OPFMessageCopySubject>"
+    "<OPFMessageCopySenderAddress><emailAddress OPFContactEmailAddressAddress=\"dave@example.com\"/></OPFMessageCopySenderAddress>"
+};
+
+/* An empty subject is kept apart from a missing one, as "" rather than null (or, in CSV, a quoted empty field). */
+static const char expected_jsonl[] =
+    "{\"index\":0,\"sent_time\":\"2012-06-11T09:27:23Z\",\"received_time\":null,\"from\":[\"alice@example.com\"],"
+    "\"to\":[\"bob@example.com\",\"carol@example.com\"],\"subject\":\"Say \\\"hi\\\"\\tto C:\\\\temp\\r\\nnow\","
+    "\"message_id\":\"<abc@example.com>\",\"attachment_count\":0,\"attachment_sizes\":[]}\n"
+    "{\"index\":1,\"sent_time\":null,\"received_time\":\"2012-06-12T10:00:00Z\",\"from\":null,\"to\":null,\"subject\":null,"
+    "\"message_id\":null,\"attachment_count\":2,\"attachment_sizes\":[100,2048]}\n"
+    "{\"index\":2,\"sent_time\":null,\"received_time\":null,\"from\":[\"dave@example.com\"],\"to\":null,\"subject\":\"\","
+    "\"message_id\":null,\"attachment_count\":0,\"attachment_sizes\":[]}\n";
+
+/* Quoted fields keep their control characters, so the first record runs over two lines. */
+static const char expected_csv[] =
+    "index,sent_time,received_time,from,to,subject,message_id,attachment_count,attachment_sizes\r\n"
+    "0,2012-06-11T09:27:23Z,,\"alice@example.com\",\"bob@example.com;carol@example.com\",\"Say \"\"hi\"\"\tto C:\\temp\r\nnow\","
+    "\"<abc@example.com>\",0,\"\"\r\n"
+    "1,,2012-06-12T10:00:00Z,,,,,2,\"100;2048\"\r\n"
+    "2,,,\"dave@example.com\",,\"\",,0,\"\"\r\n";
+
+/* Reads the whole of the given file, with a terminating nul. */
+static char *read_file(const char *path)
+{
+    struct stat stat_buff;
+    char *data = NULL;
+    FILE *stream = NULL;
+    size_t length = 0;
+    
+    if (stat(path, &stat_buff) == -1) return NULL;
+    length = (size_t)stat_buff.st_size;
+    data = (char *)malloc(length + 1);
+    stream = fopen(path, "rb");
+    if ((data == NULL) || (stream == NULL) || (fread(data, 1, length, stream) != length))
+    {
+        free(data);
+        data = NULL;
+    }
+    else
+    {
+        data[length] = '\0';
+    }
+    if (stream != NULL) fclose(stream);
+    
+    return data;
+}
+
+/* Prints a line with its control characters made visible. */
+static void print_line(const char *label, const char *line, size_t length)
+{
+    fprintf(stderr, "  %s ", label);
+    for (size_t idx = 0; idx < length; idx++)
+    {
+        if ((unsigned char)line[idx] < 0x20) fprintf(stderr, "<%02X>", (unsigned char)line[idx]);
+        else fputc(line[idx], stderr);
+    }
+    fputc('\n', stderr);
+}
+
+/* Exports the metadata in the given format and compares it with what is expected, one line at a time. */
+static int check_export(olm_file_t *file, int format, const char *name, const char *expected)
+{
+    char *actual = NULL;
+    const char *actual_line = NULL;
+    const char *expected_line = NULL;
+    size_t actual_length = 0;
+    size_t expected_length = 0;
+    int line = 1;
+    int fd = -1;
+    int error_code = OLM_ERROR_SUCCESS;
+    int result = true;
+    
+    fd = open(DEST_PATH, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        fprintf(stderr, "%s: the output file could not be created\n", name);
+        return false;
+    }
+    error_code = olm_export_metadata(file, format, fd, FIELDS);
+    close(fd);
+    if (error_code != OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "%s: the export failed (error %d)\n", name, error_code);
+        return false;
+    }
+    actual = read_file(DEST_PATH);
+    if (actual == NULL)
+    {
+        fprintf(stderr, "%s: the output could not be read back\n", name);
+        return false;
+    }
+    
+    /* Each line is compared with its LF, so that a missing last line ending is caught too. */
+    for (actual_line = actual, expected_line = expected; (*actual_line != '\0') || (*expected_line != '\0'); line++)
+    {
+        actual_length = strcspn(actual_line, "\n");
+        if (actual_line[actual_length] == '\n') actual_length++;
+        expected_length = strcspn(expected_line, "\n");
+        if (expected_line[expected_length] == '\n') expected_length++;
+        if ((actual_length != expected_length) || (memcmp(actual_line, expected_line, actual_length) != 0))
+        {
+            fprintf(stderr, "%s: line %d differs\n", name, line);
+            print_line("expected", expected_line, expected_length);
+            print_line("actual  ", actual_line, actual_length);
+            result = false;
+        }
+        actual_line += actual_length;
+        expected_line += expected_length;
+    }
+    free(actual);
+    
+    return result;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    olm_file_t *file = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    int written = true;
+    int result = EXIT_FAILURE;
+    
+    archive = test_archive_create(ARCHIVE_PATH);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int index = 0; (index < MESSAGE_COUNT) && (written == true); index++) written = test_archive_add_email(archive, index, messages[index]);
+    if ((test_archive_close(archive) == false) || (written == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        goto bail_and_die;
+    }
+    
+    file = olm_open_file(ARCHIVE_PATH, 0, &error_code);
+    if (file == NULL)
+    {
+        fprintf(stderr, "the archive could not be opened (error %d)\n", error_code);
+        goto bail_and_die;
+    }
+    if ((check_export(file, OLM_EXPORT_JSONL, "jsonl", expected_jsonl) == true) & (check_export(file, OLM_EXPORT_CSV, "csv", expected_csv) == true)) result = EXIT_SUCCESS;
+
+bail_and_die:
+    if (file != NULL) olm_close_file(file);
+    unlink(DEST_PATH);
+    unlink(ARCHIVE_PATH);
+    
+    return result;
+}
@@ -0,0 +1,259 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * search.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Runs a set of queries against the full-text search index of a small archive, with the index built in memory, built and
+   written by olm_build_search_index(), mapped from the written file by a later open and built again from scratch, and checks
+   that each of them finds exactly the messages it should. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define ARCHIVE_PATH                             "search.olm"
+#define INDEX_PATH                               ARCHIVE_PATH ".fts"
+#define ADDRESS(list, address)                   "<" list "><emailAddress OPFContactEmailAddressAddress=\"" address "\"/></" list ">"
+#define FROM(address)                            ADDRESS("OPFMessageCopySenderAddress", address)
+
+static const char *messages[] =
+{
+    "<OPFMessageCopySubject>Apple pie recipe</OPFMessageCopySubject>" FROM("alice@example.com")
+    ADDRESS("OPFMessageCopyToAddresses", "bob@example.com")
+    "<OPFMessageCopyBody>Bake the apple pie at 180 degrees.</OPFMessageCopyBody>",
+    
+    "<OPFMessageCopySubject>Meeting notes</OPFMessageCopySubject>" FROM("bob@example.com")
+    "<OPFMessageCopyToAddresses><emailAddress OPFContactEmailAddressAddress=\"alice@example.com\"/>"
+    "<emailAddress OPFContactEmailAddressAddress=\"carol@example.org\"/></OPFMessageCopyToAddresses>"
+    "<OPFMessageCopyBody>Discussed the banana budget.</OPFMessageCopyBody>",
+    
+    "<OPFMessageCopySubject>Re: Meeting notes</OPFMessageCopySubject>" FROM("carol@example.org")
+    ADDRESS("OPFMessageCopyToAddresses", "bob@example.com")
+    "<OPFMessageCopyBody>Apple and banana both approved.</OPFMessageCopyBody>",
+    
+    "<OPFMessageCopySubject>Quarterly report</OPFMessageCopySubject>" FROM("dave@example.net")
+    ADDRESS("OPFMessageCopyToAddresses", "alice@example.com")
+    "<OPFMessageCopyBody>Numbers attached; see the Q3 figures.</OPFMessageCopyBody>",
+    
+    "<OPFMessageCopySubject>Caf\xC3\xA9 menu</OPFMessageCopySubject>" FROM("alice@example.com")
+    ADDRESS("OPFMessageCopyToAddresses", "dave@example.net")
+    "<OPFMessageCopyBody>Croissant and apple juice.</OPFMessageCopyBody>"
+};
+
+#define MESSAGE_COUNT                            (sizeof(messages) / sizeof(messages[0]))
+
+/* A query and the messages it must find, as a mask of their indexes. */
+static const struct
+{
+    const char *query;
+    uint32_t hits;
+} queries[] =
+{
+    { "apple",                                  0x15 },
+    { "APPLE",                                  0x15 },
+    { "subject:apple",                          0x01 },
+    { "body:apple",                             0x15 },
+    { "apple banana",                           0x04 },
+    { "  banana\tapple  ",                      0x04 },
+    { "from:alice",                             0x11 },
+    { "to:alice",                               0x0A },
+    { "alice",                                  0x1B },
+    { "from:alice apple",                       0x11 },
+    { "subject:meeting from:carol",             0x04 },
+    { "subject:notes to:alice",                 0x02 },
+    { "example",                                0x1F },
+    { "q3",                                     0x08 },
+    { "caf\xC3\xA9",                            0x10 },
+    { "zebra",                                  0x00 },
+    { "apple zebra",                            0x00 },
+    { "subject:banana",                         0x00 }
+};
+
+#define QUERY_COUNT                              (sizeof(queries) / sizeof(queries[0]))
+
+/* Adds the index of each message found to the mask. */
+static int note_hit(olm_file_t *file, uint64_t index, void *user_data)
+{
+    (void)file;
+    
+    if (index < 32) *(uint32_t *)user_data |= (uint32_t)1 << index;
+    
+    return 0;
+}
+
+/* Runs every query against the given file, and checks that a query without any terms is turned away. */
+static int run_queries(olm_file_t *file, const char *stage)
+{
+    uint32_t hits = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    int result = true;
+    
+    for (size_t idx = 0; idx < QUERY_COUNT; idx++)
+    {
+        hits = 0;
+        error_code = olm_search(file, queries[idx].query, note_hit, &hits);
+        if ((error_code != OLM_ERROR_SUCCESS) || (hits != queries[idx].hits))
+        {
+            fprintf(stderr, "%s: \"%s\" found 0x%02X (error %d) rather than 0x%02X\n", stage, queries[idx].query, hits, error_code, queries[idx].hits);
+            result = false;
+        }
+    }
+    
+    if ((olm_search(file, "", note_hit, &hits) != OLM_ERROR_INVALID_PARAMETER) ||
+        (olm_search(file, " :: !! ", note_hit, &hits) != OLM_ERROR_INVALID_PARAMETER))
+    {
+        fprintf(stderr, "%s: a query without terms was not turned away\n", stage);
+        result = false;
+    }
+    
+    return result;
+}
+
+/* Opens the archive with the given options and runs the queries against it. */
+static int search_archive(int opts, int build, const char *stage)
+{
+    olm_file_t *file = NULL;
+    int error_code = OLM_ERROR_SUCCESS;
+    int result = false;
+    
+    file = olm_open_file(ARCHIVE_PATH, opts, &error_code);
+    if (file == NULL)
+    {
+        fprintf(stderr, "%s: the archive could not be opened (error %d)\n", stage, error_code);
+        return false;
+    }
+    if ((build == true) && ((error_code = olm_build_search_index(file)) != OLM_ERROR_SUCCESS))
+    {
+        fprintf(stderr, "%s: the index could not be built (error %d)\n", stage, error_code);
+    }
+    else
+    {
+        result = run_queries(file, stage);
+    }
+    olm_close_file(file);
+    
+    return result;
+}
+
+/* Reads the whole of the given file. */
+static unsigned char *read_file(const char *path, size_t *length)
+{
+    struct stat stat_buff;
+    unsigned char *data = NULL;
+    FILE *stream = NULL;
+    
+    if (stat(path, &stat_buff) == -1) return NULL;
+    *length = (size_t)stat_buff.st_size;
+    data = (unsigned char *)malloc(*length + 1);
+    stream = fopen(path, "rb");
+    if ((data == NULL) || (stream == NULL) || (fread(data, 1, *length, stream) != *length))
+    {
+        free(data);
+        data = NULL;
+    }
+    if (stream != NULL) fclose(stream);
+    
+    return data;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    struct stat stat_buff;
+    unsigned char *built_index = NULL;
+    unsigned char *rebuilt_index = NULL;
+    size_t built_length = 0;
+    size_t rebuilt_length = 0;
+    ino_t built_inode = 0;
+    int written = true;
+    int result = EXIT_FAILURE;
+    
+    unlink(INDEX_PATH);
+    archive = test_archive_create(ARCHIVE_PATH);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        return EXIT_FAILURE;
+    }
+    for (unsigned int index = 0; (index < MESSAGE_COUNT) && (written == true); index++) written = test_archive_add_email(archive, index, messages[index]);
+    if ((test_archive_close(archive) == false) || (written == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        goto bail_and_die;
+    }
+    
+    /* Built in memory, and not written without OLM_OPT_INDEX. */
+    if (search_archive(0, false, "in memory") == false) goto bail_and_die;
+    if (access(INDEX_PATH, F_OK) == 0)
+    {
+        fprintf(stderr, "the index was written without being asked for\n");
+        goto bail_and_die;
+    }
+    
+    /* Built and written, then searched through the written file. */
+    if (search_archive(0, true, "built") == false) goto bail_and_die;
+    built_index = read_file(INDEX_PATH, &built_length);
+    if ((built_index == NULL) || (stat(INDEX_PATH, &stat_buff) == -1))
+    {
+        fprintf(stderr, "the index was not written\n");
+        goto bail_and_die;
+    }
+    built_inode = stat_buff.st_ino;
+    
+    /* A later open must map the written index rather than build and write another one. */
+    if (search_archive(OLM_OPT_INDEX, false, "reloaded") == false) goto bail_and_die;
+    if ((stat(INDEX_PATH, &stat_buff) == -1) || (stat_buff.st_ino != built_inode))
+    {
+        fprintf(stderr, "the written index was not reused\n");
+        goto bail_and_die;
+    }
+    
+    /* Built again from scratch, which must give the same file. */
+    unlink(INDEX_PATH);
+    if (search_archive(OLM_OPT_INDEX, false, "rebuilt") == false) goto bail_and_die;
+    rebuilt_index = read_file(INDEX_PATH, &rebuilt_length);
+    if ((rebuilt_index == NULL) || (rebuilt_length != built_length) || (memcmp(rebuilt_index, built_index, built_length) != 0))
+    {
+        fprintf(stderr, "the rebuilt index differs from the first one\n");
+        goto bail_and_die;
+    }
+    
+    result = EXIT_SUCCESS;
+
+bail_and_die:
+    free(built_index);
+    free(rebuilt_index);
+    unlink(INDEX_PATH);
+    unlink(ARCHIVE_PATH ".idx");
+    unlink(ARCHIVE_PATH);
+    
+    return result;
+}
@@ -0,0 +1,226 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * threads.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Reads messages and extracts attachments from many threads at once through one olm_file_t, which is what positional reads
+   are meant to allow, and checks that every thread gets back exactly what was put into the archive. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define ARCHIVE_PATH                             "threads.olm"
+#define THREAD_COUNT                             8
+#define MESSAGE_COUNT                            64
+#define ROUND_COUNT                              4
+#define LARGE_ATTACHMENT_SIZE                    (3 * 1024 * 1024 / 2)
+
+typedef struct _thread_data
+{
+    olm_file_t *file;
+    unsigned int thread_index;
+    int failed;
+} thread_data;
+
+/* The size of the attachment of each message, one is larger than the chunks that attachments are copied in. */
+static uint32_t attachment_size(unsigned int index)
+{
+    if (index == (MESSAGE_COUNT / 2)) return LARGE_ATTACHMENT_SIZE;
+    
+    return (4096 * ((index % 8) + 1)) + index;
+}
+
+/* Checks that the file at path holds the attachment of the given message. */
+static int check_extracted(const char *path, unsigned int index)
+{
+    uint32_t length = attachment_size(index);
+    unsigned char *expected = (unsigned char *)malloc(length);
+    unsigned char *actual = (unsigned char *)malloc(length + 1);
+    FILE *stream = NULL;
+    size_t read_length = 0;
+    int result = false;
+    
+    if ((expected == NULL) || (actual == NULL)) goto bail_and_die;
+    stream = fopen(path, "rb");
+    if (stream == NULL) goto bail_and_die;
+    read_length = fread(actual, 1, (length + 1), stream);
+    fclose(stream);
+    
+    test_attachment_data(index, expected, length);
+    result = ((read_length == length) && (memcmp(expected, actual, length) == 0));
+
+bail_and_die:
+    free(expected);
+    free(actual);
+    
+    return result;
+}
+
+/* Each thread goes through the messages from a different starting point, so that they are all at different places in
+   the archive at once. */
+static void *run_thread(void *arg)
+{
+    thread_data *data = (thread_data *)arg;
+    olm_mail_message_t *message = NULL;
+    char expected_subject[32];
+    char dest_path[64];
+    unsigned int index = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    
+    snprintf(dest_path, sizeof(dest_path), "threads-%u.tmp", data->thread_index);
+    
+    for (unsigned int round = 0; (round < ROUND_COUNT) && (data->failed == false); round++)
+    {
+        for (unsigned int step = 0; step < MESSAGE_COUNT; step++)
+        {
+            index = (step + (data->thread_index * (MESSAGE_COUNT / THREAD_COUNT)) + round) % MESSAGE_COUNT;
+            message = olm_get_message_at(data->file, index, &error_code);
+            if (message == NULL)
+            {
+                fprintf(stderr, "thread %u: message %u could not be read (error %d)\n", data->thread_index, index, error_code);
+                data->failed = true;
+                break;
+            }
+    
+            snprintf(expected_subject, sizeof(expected_subject), "Message %u", index);
+            if ((message->subject == NULL) || (strcmp(message->subject, expected_subject) != 0) || (message->attachment_count != 1))
+            {
+                fprintf(stderr, "thread %u: message %u came back wrong\n", data->thread_index, index);
+                data->failed = true;
+            }
+            else
+            {
+                error_code = olm_extract_and_save_attachment(data->file, message->attachment_list[0], dest_path);
+                if (error_code != OLM_ERROR_SUCCESS)
+                {
+                    fprintf(stderr, "thread %u: attachment %u could not be extracted (error %d)\n", data->thread_index, index, error_code);
+                    data->failed = true;
+                }
+                else if (check_extracted(dest_path, index) == false)
+                {
+                    fprintf(stderr, "thread %u: attachment %u came back wrong\n", data->thread_index, index);
+                    data->failed = true;
+                }
+            }
+            olm_message_free(message);
+            if (data->failed == true) break;
+        }
+    }
+    unlink(dest_path);
+    
+    return NULL;
+}
+
+/* Runs the threads against the archive opened with the given options. */
+static int run_threads(int opts)
+{
+    pthread_t threads[THREAD_COUNT];
+    thread_data data[THREAD_COUNT];
+    olm_file_t *file = NULL;
+    unsigned int started = 0;
+    int error_code = OLM_ERROR_SUCCESS;
+    int result = true;
+    
+    file = olm_open_file(ARCHIVE_PATH, opts, &error_code);
+    if (file == NULL)
+    {
+        fprintf(stderr, "the archive could not be opened (error %d)\n", error_code);
+        return false;
+    }
+    if (olm_mail_message_count(file) != MESSAGE_COUNT)
+    {
+        fprintf(stderr, "the archive has %llu messages\n", (unsigned long long)olm_mail_message_count(file));
+        olm_close_file(file);
+        return false;
+    }
+    
+    for (started = 0; started < THREAD_COUNT; started++)
+    {
+        data[started].file = file;
+        data[started].thread_index = started;
+        data[started].failed = false;
+        if (pthread_create(&threads[started], NULL, run_thread, &data[started]) != 0)
+        {
+            result = false;
+            break;
+        }
+    }
+    for (unsigned int idx = 0; idx < started; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+        if (data[idx].failed == true) result = false;
+    }
+    
+    olm_close_file(file);
+    
+    return result;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    unsigned char *attachment = NULL;
+    uint32_t length = 0;
+    int written = true;
+    int result = EXIT_FAILURE;
+    
+    attachment = (unsigned char *)malloc(LARGE_ATTACHMENT_SIZE);
+    archive = test_archive_create(ARCHIVE_PATH);
+    if ((attachment == NULL) || (archive == NULL))
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        goto bail_and_die;
+    }
+    for (unsigned int index = 0; index < MESSAGE_COUNT; index++)
+    {
+        length = attachment_size(index);
+        test_attachment_data(index, attachment, length);
+        if (test_archive_add_message(archive, index, attachment, length, length) == false)
+        {
+            written = false;
+            break;
+        }
+    }
+    if ((test_archive_close(archive) == false) || (written == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        goto bail_and_die;
+    }
+    
+    if ((run_threads(0) == true) && (run_threads(OLM_OPT_MMAP) == true)) result = EXIT_SUCCESS;
+
+bail_and_die:
+    free(attachment);
+    unlink(ARCHIVE_PATH);
+    
+    return result;
+}
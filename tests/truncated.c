@@ -0,0 +1,162 @@
+/* Copyright (C) 2012, Chris Morrison <chris-morrison@cyberservices.com>
+ *
+ * truncated.c
+ *
+ * This file is part of libolmec.
+ *
+ * libolmec is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libolmec is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libolmec.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Reads a message and an attachment that are stored entries whose central directory gives a size far larger than the data
+   they hold, which must be turned away as errors rather than read past the end of the file (or of its mapping). */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "libolmec.h"
+#include "archive.h"
+
+#define ARCHIVE_PATH                             "truncated.olm"
+#define DEST_PATH                                "truncated.tmp"
+#define ATTACHMENT_SIZE                          100
+#define STATED_SIZE                              (64 * 1024 * 1024)
+
+static const char truncated_message[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<emails><email>\n"
+    "<OPFMessageCopySubject>Truncated</OPFMessageCopySubject>\n"
+    "</email></emails>\n";
+
+/* Passes the attachment data on to nowhere. */
+static int discard_block(const void *data, size_t length, void *user_data)
+{
+    (void)data;
+    (void)length;
+    (void)user_data;
+    
+    return 0;
+}
+
+/* Tries each way of reading the damaged entries with the archive opened with the given options. */
+static int check_archive(int opts)
+{
+    olm_file_t *file = NULL;
+    olm_mail_message_t *message = NULL;
+    olm_attachment_reader_t *reader = NULL;
+    unsigned char buffer[ATTACHMENT_SIZE];
+    int error_code = OLM_ERROR_SUCCESS;
+    int result = false;
+    
+    file = olm_open_file(ARCHIVE_PATH, opts, &error_code);
+    if (file == NULL)
+    {
+        fprintf(stderr, "opts %d: the archive could not be opened (error %d)\n", opts, error_code);
+        return false;
+    }
+    
+    /* The message entry itself is short. */
+    message = olm_get_message_at(file, 0, &error_code);
+    if (message != NULL)
+    {
+        fprintf(stderr, "opts %d: the short message was read\n", opts);
+        olm_message_free(message);
+        goto bail_and_die;
+    }
+    if (olm_verify_message_at(file, 0) == OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "opts %d: the short message was verified\n", opts);
+        goto bail_and_die;
+    }
+    
+    /* The message is fine but its attachment is short. */
+    message = olm_get_message_at(file, 1, &error_code);
+    if ((message == NULL) || (message->attachment_count != 1))
+    {
+        fprintf(stderr, "opts %d: the message with the short attachment could not be read (error %d)\n", opts, error_code);
+        goto bail_and_die;
+    }
+    if (olm_extract_and_save_attachment(file, message->attachment_list[0], DEST_PATH) == OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "opts %d: the short attachment was extracted\n", opts);
+        goto bail_and_die;
+    }
+    if (olm_stream_attachment(file, message->attachment_list[0], discard_block, NULL) == OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "opts %d: the short attachment was streamed\n", opts);
+        goto bail_and_die;
+    }
+    if (olm_verify_attachment(file, message->attachment_list[0]) == OLM_ERROR_SUCCESS)
+    {
+        fprintf(stderr, "opts %d: the short attachment was verified\n", opts);
+        goto bail_and_die;
+    }
+    reader = olm_attachment_open(file, message->attachment_list[0], &error_code);
+    if ((reader != NULL) && (olm_attachment_read(reader, (STATED_SIZE - sizeof(buffer)), buffer, sizeof(buffer), &error_code) >= 0))
+    {
+        fprintf(stderr, "opts %d: the end of the short attachment was read\n", opts);
+        goto bail_and_die;
+    }
+    
+    result = true;
+
+bail_and_die:
+    if (reader != NULL) olm_attachment_close(reader);
+    if (message != NULL) olm_message_free(message);
+    olm_close_file(file);
+    unlink(DEST_PATH);
+    
+    return result;
+}
+
+int main(void)
+{
+    test_archive *archive = NULL;
+    unsigned char attachment[ATTACHMENT_SIZE];
+    int written = false;
+    int result = EXIT_FAILURE;
+    
+    archive = test_archive_create(ARCHIVE_PATH);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "the archive could not be created\n");
+        return EXIT_FAILURE;
+    }
+    test_attachment_data(1, attachment, sizeof(attachment));
+    written = test_archive_add(archive, "Local/com.microsoft.__Messages/Inbox/message_00000__message_attachment__.xml",
+                               truncated_message, (sizeof(truncated_message) - 1), STATED_SIZE);
+    if (written == true) written = test_archive_add_message(archive, 1, attachment, sizeof(attachment), STATED_SIZE);
+    if ((test_archive_close(archive) == false) || (written == false))
+    {
+        fprintf(stderr, "the archive could not be written\n");
+        goto bail_and_die;
+    }
+    
+    if ((check_archive(0) == true) &&
+        (check_archive(OLM_OPT_MMAP) == true) &&
+        (check_archive(OLM_OPT_MMAP | OLM_OPT_SKIP_CRC) == true)) result = EXIT_SUCCESS;
+
+bail_and_die:
+    unlink(ARCHIVE_PATH);
+    
+    return result;
+}